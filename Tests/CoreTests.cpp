@@ -0,0 +1,732 @@
+﻿#include "gtest/gtest.h"
+
+#include "../src/AsyncLog.h"
+#include "../src/MemoryFileSystem.h"
+#include "../src/NameCipher.h"
+#include "../src/Platform.h"
+#include "../src/SyncPlan.h"
+#include "../src/SyncProgress.h"
+#include "../src/SyncStats.h"
+#include "../src/SyncReport.h"
+#include "../src/SyncTrace.h"
+#include "SyncBench.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <thread>
+#include <vector>
+
+// the tests of the platform independent sync core, built by CMakeLists.txt on every platform
+
+TEST(NameCipher, encrypt_old_encryption)
+{
+    CNameCipher cipher(L"password");
+    EXPECT_EQ(cipher.EncryptPath(L"filename.txt", false), L"77fd5c174b90a159d0e7b9fa2e");
+    EXPECT_EQ(cipher.DecryptPath(L"77fd5c174b90a159d0e7b9fa2e.7z", false), L"filename.txt");
+}
+
+TEST(NameCipher, encrypt_new_encryption)
+{
+    CNameCipher cipher(L"password");
+    EXPECT_EQ(cipher.EncryptPath(L"filenam.txt", true), L"板浜慴殐樕榛毛时");
+    EXPECT_EQ(cipher.DecryptPath(L"板浜慴殐樕槐湻槺䀮.7z", true), L"filename.txt");
+}
+
+TEST(NameCipher, round_trip)
+{
+    CNameCipher  cipher(L"pässwörd");
+    std::wstring sep(1, PlatformPathSeparator);
+    std::wstring path = L"folder" + sep + L"sub folder" + sep + L"名前 \U0001F600.txt";
+    for (bool newEncryption : {false, true})
+    {
+        auto encrypted = cipher.EncryptPath(path, newEncryption);
+        EXPECT_EQ(encrypted.find('.'), std::wstring::npos);
+        EXPECT_EQ(cipher.DecryptPath(encrypted + L".7z", newEncryption), path);
+        // a wrong password leaves the names as they are
+        EXPECT_NE(CNameCipher(L"other").DecryptPath(encrypted + L".7z", newEncryption), path);
+    }
+    // names that aren't encrypted stay unchanged
+    EXPECT_EQ(cipher.DecryptPath(L"plain" + sep + L"file.txt.7z", false), L"plain" + sep + L"file.txt.7z");
+}
+
+TEST(Platform, utf_conversion)
+{
+    std::wstring str = L"aä中\U0001F600";
+    EXPECT_EQ(CPlatform::ToUtf8(str), "a\xc3\xa4\xe4\xb8\xad\xf0\x9f\x98\x80");
+    EXPECT_EQ(CPlatform::FromUtf8(CPlatform::ToUtf8(str)), str);
+    EXPECT_EQ(CPlatform::ToUtf16(str), u"aä中\U0001F600");
+    EXPECT_EQ(CPlatform::FromUtf16(CPlatform::ToUtf16(str)), str);
+    EXPECT_EQ(CPlatform::FromUtf8("a\xff"), L"a\xfffd");
+}
+
+TEST(Platform, file_system)
+{
+    auto&           fs   = CFileSystem::Native();
+    std::wstring    sep(1, PlatformPathSeparator);
+    std::wstring    root = (std::filesystem::temp_directory_path() / "CryptSyncCoreTest").wstring();
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+
+    ASSERT_TRUE(fs.MakeDirs(root + sep + L"a" + sep + L"b"));
+    ASSERT_TRUE(fs.WriteContent(root + sep + L"a" + sep + L"file.txt", "content"));
+    PlatformFileInfo info;
+    ASSERT_TRUE(fs.Stat(root + sep + L"a" + sep + L"file.txt", info));
+    EXPECT_EQ(info.size, 7);
+    EXPECT_FALSE(info.directory);
+
+    // 2020-01-01, in 100ns ticks since 1601
+    constexpr uint64_t writeTime = 132223104000000000ULL;
+    EXPECT_TRUE(fs.SetWriteTime(root + sep + L"a" + sep + L"file.txt", writeTime));
+    EXPECT_TRUE(fs.Copy(root + sep + L"a" + sep + L"file.txt", root + sep + L"a" + sep + L"b" + sep + L"copy.txt"));
+    ASSERT_TRUE(fs.Stat(root + sep + L"a" + sep + L"b" + sep + L"copy.txt", info));
+    EXPECT_EQ(info.writeTime, writeTime);
+    EXPECT_TRUE(fs.Rename(root + sep + L"a" + sep + L"b" + sep + L"copy.txt", root + sep + L"moved.txt"));
+    std::string content;
+    EXPECT_TRUE(fs.ReadContent(root + sep + L"moved.txt", content));
+    EXPECT_EQ(content, "content");
+
+    std::map<std::wstring, bool> entries;
+    EXPECT_TRUE(fs.Enumerate(root, [&](const std::wstring& relPath, const PlatformFileInfo& entry) {
+        entries[relPath] = entry.directory;
+        return true;
+    }));
+    std::map<std::wstring, bool> expected = {{L"a", true}, {L"a" + sep + L"b", true}, {L"a" + sep + L"file.txt", false}, {L"moved.txt", false}};
+    EXPECT_EQ(entries, expected);
+    // the content of a folder descend returns false for is skipped
+    entries.clear();
+    EXPECT_TRUE(fs.Enumerate(
+        root, [&](const std::wstring& relPath, const PlatformFileInfo& entry) {
+            entries[relPath] = entry.directory;
+            return true;
+        },
+        [](const std::wstring& relPath, const PlatformFileInfo&) { return relPath != L"a"; }));
+    expected = {{L"a", true}, {L"moved.txt", false}};
+    EXPECT_EQ(entries, expected);
+
+    EXPECT_FALSE(fs.Stat(root + sep + L"missing.txt", info));
+    EXPECT_EQ(fs.LastError(), PlatformError::NotFound);
+    EXPECT_TRUE(fs.Remove(root + sep + L"moved.txt"));
+    EXPECT_TRUE(fs.Remove(root + sep + L"a" + sep + L"file.txt"));
+    EXPECT_TRUE(fs.Remove(root + sep + L"a" + sep + L"b"));
+    EXPECT_TRUE(fs.Remove(root + sep + L"a"));
+    EXPECT_TRUE(fs.Remove(root));
+    EXPECT_FALSE(fs.Stat(root, info));
+}
+
+TEST(Platform, run_process)
+{
+#ifdef _WIN32
+    EXPECT_EQ(CPlatform::RunProcess(L"cmd.exe", {L"/c", L"exit 3"}, L""), 3);
+#else
+    EXPECT_EQ(CPlatform::RunProcess(L"sh", {L"-c", L"exit 3"}, L""), 3);
+#endif
+    EXPECT_EQ(CPlatform::RunProcess(L"CryptSyncNoSuchProgram", {}, L""), -1);
+
+    unsigned char random[32] = {};
+    unsigned char zero[32]   = {};
+    EXPECT_TRUE(CPlatform::RandomBytes(random, sizeof(random)));
+    EXPECT_NE(memcmp(random, zero, sizeof(random)), 0);
+}
+
+namespace
+{
+SyncPlanFile PlanFile(const std::wstring& path, uint64_t size, uint64_t writeTime)
+{
+    SyncPlanFile file;
+    file.fileRelPath = path;
+    file.size        = size;
+    file.writeTime   = writeTime;
+    return file;
+}
+
+SyncPlanSettings PlanSettings()
+{
+    SyncPlanSettings settings;
+    settings.encryptPath = [](const std::wstring& path) { return path + L".7z"; };
+    return settings;
+}
+} // namespace
+
+TEST(SyncPlan, both_ways)
+{
+    SyncPlanFileList orig;
+    SyncPlanFileList crypt;
+    orig[L"new.txt"]             = PlanFile(L"new.txt", 100, 1000);
+    orig[L"changed.txt"]         = PlanFile(L"changed.txt", 200, 3000);
+    crypt[L"changed.txt"]        = PlanFile(L"changed.txt.7z", 50, 2000);
+    orig[L"older.txt"]           = PlanFile(L"older.txt", 10, 1000);
+    crypt[L"older.txt"]          = PlanFile(L"older.txt.7z", 20, 2000);
+    orig[L"same.txt"]            = PlanFile(L"same.txt", 10, 1000);
+    crypt[L"same.txt"]           = PlanFile(L"same.txt.7z", 20, 1000);
+    crypt[L"restore.txt"]        = PlanFile(L"restore.txt.7z", 30, 1000);
+    orig[L"copy.bin"]            = PlanFile(L"copy.bin", 40, 1000);
+    orig[L"copy.bin"].copyOnly   = true;
+    orig[L"ignored.tmp"]         = PlanFile(L"ignored.tmp", 40, 1000);
+    orig[L"ignored.tmp"].ignored = true;
+
+    CSyncPlan plan(orig, crypt, PlanSettings());
+    std::map<std::wstring, SyncActionType> types;
+    for (const auto& action : plan.GetActions())
+        types[action.relPath] = action.type;
+    std::map<std::wstring, SyncActionType> expected = {
+        {L"new.txt", SyncActionType::Encrypt},
+        {L"changed.txt", SyncActionType::Encrypt},
+        {L"older.txt", SyncActionType::Decrypt},
+        {L"restore.txt", SyncActionType::Decrypt},
+        {L"copy.bin", SyncActionType::CopyToCrypt},
+    };
+    EXPECT_EQ(types, expected);
+    auto totals = plan.GetTotals();
+    EXPECT_EQ(totals.transfers, 5);
+    EXPECT_EQ(totals.bytes, 100 + 200 + 20 + 30 + 40);
+    for (const auto& action : plan.GetActions())
+    {
+        if (action.relPath == L"restore.txt")
+        {
+            EXPECT_EQ(action.cryptRelPath, L"restore.txt.7z");
+        }
+    }
+}
+
+TEST(SyncPlan, mirror_and_fat)
+{
+    SyncPlanFileList orig;
+    SyncPlanFileList crypt;
+    orig[L"a.txt"]        = PlanFile(L"a.txt", 1, 110000000);
+    // a second older: equal with the FAT tolerance
+    crypt[L"a.txt"]       = PlanFile(L"a.txt.7z", 1, 100000000);
+    crypt[L"deleted.txt"] = PlanFile(L"deleted.txt.7z", 1, 100000000);
+
+    auto settings   = PlanSettings();
+    settings.toOrig = false;
+    settings.fat    = true;
+    CSyncPlan plan(orig, crypt, settings);
+    ASSERT_EQ(plan.GetActions().size(), 1);
+    EXPECT_EQ(plan.GetActions()[0].type, SyncActionType::DeleteCrypt);
+    EXPECT_EQ(plan.GetActions()[0].cryptRelPath, L"deleted.txt.7z");
+
+    settings.syncDeleted = false;
+    settings.fat         = false;
+    CSyncPlan plan2(orig, crypt, settings);
+    ASSERT_EQ(plan2.GetActions().size(), 2);
+    EXPECT_EQ(plan2.GetActions()[0].type, SyncActionType::Encrypt);
+    EXPECT_EQ(plan2.GetActions()[1].type, SyncActionType::KeepDeleted);
+}
+
+TEST(SyncPlan, policy)
+{
+    std::wstring     sep(1, PlatformPathSeparator);
+    SyncPlanFileList orig;
+    orig[L"a" + sep + L"1"] = PlanFile(L"a" + sep + L"1", 300, 1);
+    orig[L"a" + sep + L"2"] = PlanFile(L"a" + sep + L"2", 100, 1);
+    orig[L"a" + sep + L"3"] = PlanFile(L"a" + sep + L"3", 200, 1);
+    orig[L"b" + sep + L"1"] = PlanFile(L"b" + sep + L"1", 400, 1);
+
+    CSyncPlan  plan(orig, SyncPlanFileList(), PlanSettings());
+    SyncPolicy policy = SyncPolicy::FromSettings(static_cast<uint32_t>(SyncOrder::SmallestFirst), 4, 2);
+    plan.Apply(policy);
+    std::vector<uint64_t> sizes;
+    for (const auto& action : plan.GetActions())
+        sizes.push_back(action.size);
+    EXPECT_EQ(sizes, std::vector<uint64_t>({100, 200, 300, 400}));
+
+    // two transfers per batch, and never across folders
+    auto batches = plan.GetBatches(policy);
+    ASSERT_EQ(batches.size(), 3);
+    EXPECT_EQ(batches[0].count, 2);
+    EXPECT_EQ(batches[1].count, 1);
+    EXPECT_EQ(batches[2].count, 1);
+    EXPECT_NE(plan.Format().find(L"4 actions, 4 transfers, 1000 bytes"), std::wstring::npos);
+}
+
+TEST(SyncBench, suite)
+{
+    auto&           fs   = CFileSystem::Native();
+    std::wstring    sep(1, PlatformPathSeparator);
+    std::wstring    root = (std::filesystem::temp_directory_path() / "CryptSyncBenchTest").wstring();
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+
+    BenchTreeSettings settings;
+    settings.Parse(L"files=50,maxsize=4096,depth=2,folders=2,unknown=1");
+    EXPECT_EQ(settings.fileCount, 50);
+    EXPECT_EQ(settings.foldersPerLevel, 2);
+
+    // the same settings give the same tree
+    CBenchTree tree1(fs, settings);
+    CBenchTree tree2(fs, settings);
+    ASSERT_TRUE(tree1.Generate(root + sep + L"tree1"));
+    ASSERT_TRUE(tree2.Generate(root + sep + L"tree2"));
+    ASSERT_EQ(tree1.GetFiles().size(), 50);
+    std::string content1;
+    std::string content2;
+    for (size_t i = 0; i < tree1.GetFiles().size(); ++i)
+    {
+        ASSERT_EQ(tree1.GetFiles()[i].relPath, tree2.GetFiles()[i].relPath);
+        ASSERT_TRUE(fs.ReadContent(root + sep + L"tree1" + sep + tree1.GetFiles()[i].relPath, content1));
+        ASSERT_TRUE(fs.ReadContent(root + sep + L"tree2" + sep + tree2.GetFiles()[i].relPath, content2));
+        EXPECT_EQ(content1.size(), tree1.GetFiles()[i].size);
+        EXPECT_EQ(content1, content2);
+    }
+    EXPECT_EQ(tree1.Mutate(root + sep + L"tree1"), 1);
+
+    CBenchReport report("fs", settings);
+    auto         sync = [&](const std::wstring& origRoot, const std::wstring& cryptRoot, bool decryptOnly, BenchResult& result) {
+        return BenchPlanAndCopy(fs, L"password", origRoot, cryptRoot, decryptOnly, result);
+    };
+    ASSERT_TRUE(RunBenchSuite(fs, root + sep + L"suite", settings, sync, report));
+    std::map<std::string, uint64_t> transfers;
+    for (const auto& result : report.GetResults())
+        transfers[result.scenario] = result.transfers;
+    std::map<std::string, uint64_t> expected = {{"generate", 50}, {"initial", 50}, {"rescan", 0}, {"mutation", 1}, {"restore", 50}};
+    EXPECT_EQ(transfers, expected);
+    EXPECT_NE(report.ToJson().find("\"scenario\": \"restore\", \"files\": 50, \"transfers\": 50"), std::string::npos);
+    std::filesystem::remove_all(root, ec);
+}
+
+TEST(SyncStats, counters)
+{
+    CSyncStats stats;
+    stats.Add(SyncCounter::OrigFiles, 10);
+    stats.Add(SyncCounter::Failures);
+    stats.AddAction(SyncActionType::Encrypt);
+    stats.AddAction(SyncActionType::Encrypt);
+    stats.AddAction(SyncActionType::DeleteCrypt);
+    stats.AddTime(SyncTimer::Plan, 1500);
+    EXPECT_EQ(stats.Time(SyncTimer::Encrypt, [] { return 42; }), 42);
+
+    auto snapshot = stats.Snapshot();
+    EXPECT_EQ(snapshot.Get(SyncCounter::OrigFiles), 10);
+    EXPECT_EQ(snapshot.Get(SyncCounter::Failures), 1);
+    EXPECT_EQ(snapshot.GetActions(SyncActionType::Encrypt), 2);
+    EXPECT_EQ(snapshot.GetActions(SyncActionType::DeleteCrypt), 1);
+    EXPECT_EQ(snapshot.GetMicroseconds(SyncTimer::Plan), 1500);
+
+    SyncStats total;
+    total += snapshot;
+    total += snapshot;
+    EXPECT_EQ(total.Get(SyncCounter::OrigFiles), 20);
+    EXPECT_EQ(total.GetActions(SyncActionType::Encrypt), 4);
+    auto lines = total.Format();
+    ASSERT_EQ(lines.size(), 4);
+    EXPECT_NE(lines[0].find(L"enumerated 20 orig files"), std::wstring::npos);
+    EXPECT_NE(lines[1].find(L"planned in 3.0 ms"), std::wstring::npos);
+    EXPECT_NE(lines[2].find(L"encrypt 4, decrypt 0"), std::wstring::npos);
+
+    stats.Reset();
+    EXPECT_EQ(stats.Snapshot().Get(SyncCounter::OrigFiles), 0);
+}
+
+TEST(SyncReport, json)
+{
+    CSyncStats stats;
+    stats.AddAction(SyncActionType::Encrypt);
+    stats.AddActionBytes(SyncActionType::Encrypt, 1000, 250);
+    stats.AddTime(SyncTimer::Encrypt, 2000);
+    stats.AddTime(SyncTimer::Total, 5000);
+
+    SyncReport report;
+    report.exitCode                     = 4;
+    report.microseconds                 = 7000;
+    report.pairs[L"C:\\plain \"docs\""] = stats.Snapshot();
+    report.failures.push_back({L"C:\\plain\\b\u00e4d.txt", false});
+    auto json = report.ToJson();
+    EXPECT_NE(json.find("\"exitCode\":4,\"cancelled\":false"), std::string::npos);
+    EXPECT_NE(json.find("\"durationMs\":7.000"), std::string::npos);
+    EXPECT_NE(json.find("\"orig\":\"C:\\\\plain \\\"docs\\\"\""), std::string::npos);
+    EXPECT_NE(json.find("\"encrypt\":{\"count\":1,\"bytesRead\":1000,\"bytesWritten\":250,\"ratio\":0.250,\"bytesPerSecond\":500000.000}"), std::string::npos);
+    EXPECT_NE(json.find("\"path\":\"C:\\\\plain\\\\b\xc3\xa4" "d.txt\",\"operation\":\"decrypt\""), std::string::npos);
+    // with a single pair, the totals have the same numbers as the pair
+    const auto encrypt = json.find("\"encrypt\":{\"count\":1,");
+    EXPECT_NE(encrypt, json.rfind("\"encrypt\":{\"count\":1,"));
+    EXPECT_NE(json.find("\"failures\":0"), std::string::npos);
+}
+
+TEST(SyncProgress, aggregate)
+{
+    CSyncProgress progress;
+    std::wstring  big   = L"big.iso";
+    std::wstring  small = L"small.txt";
+    progress.AddTotal(3, 10000000);
+    progress.StartTransfers(1000);
+    EXPECT_TRUE(progress.ShouldPublish(1000));
+    EXPECT_FALSE(progress.ShouldPublish(1000 + SYNCPROGRESS_INTERVAL_MS - 1));
+    EXPECT_TRUE(progress.ShouldPublish(1000 + SYNCPROGRESS_INTERVAL_MS));
+    {
+        CSyncProgress::CFile file(progress, small, 100000);
+    }
+    {
+        CSyncProgress::CFile file(progress, big, 9900000);
+        file.SetPosition(1900000);
+        file.SetPosition(900000); // not increasing: ignored
+        auto snapshot = progress.Snapshot(1000 + SYNCPROGRESS_RATE_MS);
+        EXPECT_EQ(snapshot.filesDone, 1);
+        EXPECT_EQ(snapshot.bytesDone, 2000000);
+        EXPECT_EQ(snapshot.path, big);
+        EXPECT_EQ(snapshot.bytesPerSecond, 1000000);
+        EXPECT_EQ(snapshot.secondsLeft, 8);
+        EXPECT_EQ(snapshot.Format(), L"1 of 3 files, 1.9 MB of 9.5 MB, about 8 seconds left");
+        file.SetPosition(20000000); // beyond the size of the file
+    }
+    {
+        CSyncProgress::CFile deleted(progress, small, 0);
+    }
+    progress.ClearPath();
+    auto snapshot = progress.Snapshot(1000 + SYNCPROGRESS_RATE_MS);
+    EXPECT_EQ(snapshot.filesDone, 3);
+    EXPECT_EQ(snapshot.GetDone(), 10000000);
+    EXPECT_EQ(snapshot.GetTotal(), 10000000);
+    EXPECT_EQ(snapshot.secondsLeft, 0);
+    EXPECT_TRUE(snapshot.path.empty());
+
+    progress.Reset();
+    snapshot = progress.Snapshot(5000);
+    EXPECT_EQ(snapshot.GetTotal(), 0);
+    EXPECT_EQ(snapshot.Format(), L"0 of 0 files");
+}
+
+TEST(SyncTrace, spans)
+{
+    std::wstring path = (std::filesystem::temp_directory_path() / "CryptSyncTrace.json").wstring();
+    {
+        CTraceSpan off("Off", "test");
+    }
+    auto& trace = CSyncTrace::Instance();
+    ASSERT_TRUE(trace.Start(path, 3));
+    EXPECT_FALSE(trace.Start(path));
+    EXPECT_TRUE(CSyncTrace::IsEnabled());
+    {
+        CTraceSpan span("GetFileList", "enum", L"c:\\folder \"quoted\"");
+        std::thread([] { CTraceSpan span("EncryptFile", "crypt"); }).join();
+    }
+    {
+        CTraceSpan second("Plan", "sync");
+        CTraceSpan dropped("Dropped", "sync");
+    }
+    EXPECT_EQ(trace.GetDropped(), 1);
+    ASSERT_TRUE(trace.Stop());
+    EXPECT_FALSE(CSyncTrace::IsEnabled());
+
+    std::string json;
+    ASSERT_TRUE(CFileSystem::Native().ReadContent(path, json));
+    EXPECT_EQ(json.find("\"Off\""), std::string::npos);
+    EXPECT_NE(json.find("{\"name\":\"GetFileList\",\"cat\":\"enum\",\"ph\":\"X\""), std::string::npos);
+    EXPECT_NE(json.find("\"args\":{\"detail\":\"c:\\\\folder \\\"quoted\\\"\"}"), std::string::npos);
+    EXPECT_NE(json.find("\"name\":\"EncryptFile\",\"cat\":\"crypt\""), std::string::npos);
+    EXPECT_NE(json.find("\"tid\":2"), std::string::npos);
+    EXPECT_NE(json.find("\"dropped\":1"), std::string::npos);
+    CFileSystem::Native().Remove(path);
+}
+
+namespace
+{
+void RunFsBenchmark(CFileSystem& fs, const std::string& name)
+{
+    std::wstring    root = (std::filesystem::temp_directory_path() / "CryptSyncBench").wstring();
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+
+    BenchTreeSettings settings;
+    settings.Parse(CPlatform::GetEnvironment(L"CRYPTSYNC_BENCH"));
+    CBenchReport report(name, settings);
+    auto         sync = [&](const std::wstring& origRoot, const std::wstring& cryptRoot, bool decryptOnly, BenchResult& result) {
+        return BenchPlanAndCopy(fs, L"password", origRoot, cryptRoot, decryptOnly, result);
+    };
+    EXPECT_TRUE(RunBenchSuite(fs, root, settings, sync, report));
+    std::filesystem::remove_all(root, ec);
+
+    auto reportPath = CPlatform::GetEnvironment(L"CRYPTSYNC_BENCH_REPORT");
+    EXPECT_TRUE(report.Save(CFileSystem::Native(), reportPath.empty() ? CPlatform::FromUtf8("SyncBench-" + name + ".json") : reportPath));
+    printf("%s", report.ToJson().c_str());
+}
+} // namespace
+
+// File system micro-benchmarks: the scans, the planner and plain copies under
+// encrypted names, not the sync engine. That one is measured by SyncBench.DISABLED_engine
+// of the Windows tests.
+// run with --gtest_also_run_disabled_tests --gtest_filter=FsBench.*
+// CRYPTSYNC_BENCH changes the tree, e.g. "files=100000,maxsize=65536", see BenchTreeSettings::Parse().
+// The JSON report is written to CRYPTSYNC_BENCH_REPORT, or SyncBench-<name>.json in the current folder.
+TEST(FsBench, DISABLED_native)
+{
+    RunFsBenchmark(CFileSystem::Native(), "fs-native");
+}
+
+// the same on a file system in memory: measures the algorithms without the device
+TEST(FsBench, DISABLED_memory)
+{
+    CMemoryFileSystem fs;
+    RunFsBenchmark(fs, "fs-memory");
+}
+
+TEST(MemoryFileSystem, operations)
+{
+    CMemoryFileSystem fs;
+    std::wstring      sep(1, PlatformPathSeparator);
+    std::wstring      root = sep + L"mem";
+
+    EXPECT_FALSE(fs.WriteContent(root + sep + L"file.txt", "x"));
+    ASSERT_TRUE(fs.MakeDirs(root + sep + L"a" + sep + L"b"));
+    ASSERT_TRUE(fs.MakeDirs(root + sep + L"a-2"));
+    ASSERT_TRUE(fs.WriteContent(root + sep + L"a" + sep + L"file.txt", "content"));
+    PlatformFileInfo info;
+    ASSERT_TRUE(fs.Stat(root + sep + L"a" + sep + L"file.txt", info));
+    EXPECT_EQ(info.size, 7);
+    EXPECT_FALSE(info.directory);
+
+    constexpr uint64_t writeTime = 132223104000000000ULL;
+    EXPECT_TRUE(fs.SetWriteTime(root + sep + L"a" + sep + L"file.txt", writeTime));
+    EXPECT_TRUE(fs.Copy(root + sep + L"a" + sep + L"file.txt", root + sep + L"a" + sep + L"b" + sep + L"copy.txt"));
+    ASSERT_TRUE(fs.Stat(root + sep + L"a" + sep + L"b" + sep + L"copy.txt", info));
+    EXPECT_EQ(info.writeTime, writeTime);
+    // "a-2" sorts between "a" and its content
+    EXPECT_FALSE(fs.Remove(root + sep + L"a"));
+
+    std::map<std::wstring, bool> entries;
+    EXPECT_TRUE(fs.Enumerate(root + sep + L"a", [&](const std::wstring& relPath, const PlatformFileInfo& entry) {
+        entries[relPath] = entry.directory;
+        return true;
+    }));
+    std::map<std::wstring, bool> expected = {{L"b", true}, {L"b" + sep + L"copy.txt", false}, {L"file.txt", false}};
+    EXPECT_EQ(entries, expected);
+    entries.clear();
+    EXPECT_TRUE(fs.Enumerate(
+        root, [&](const std::wstring& relPath, const PlatformFileInfo& entry) {
+            entries[relPath] = entry.directory;
+            return true;
+        },
+        [](const std::wstring& relPath, const PlatformFileInfo&) { return relPath != L"a"; }));
+    expected = {{L"a", true}, {L"a-2", true}};
+    EXPECT_EQ(entries, expected);
+    EXPECT_FALSE(fs.Stat(root + sep + L"missing", info));
+    EXPECT_EQ(fs.LastError(), PlatformError::NotFound);
+
+    // a folder moves with its content
+    EXPECT_TRUE(fs.Rename(root + sep + L"a" + sep + L"b", root + sep + L"a-2" + sep + L"c"));
+    std::string content;
+    EXPECT_TRUE(fs.ReadContent(root + sep + L"a-2" + sep + L"c" + sep + L"copy.txt", content));
+    EXPECT_EQ(content, "content");
+    EXPECT_FALSE(fs.Stat(root + sep + L"a" + sep + L"b", info));
+    EXPECT_TRUE(fs.Remove(root + sep + L"a" + sep + L"file.txt"));
+    EXPECT_TRUE(fs.Remove(root + sep + L"a"));
+
+    auto stats = fs.GetStats();
+    EXPECT_EQ(stats.bytesWritten, 14);
+    EXPECT_EQ(stats.bytesRead, 14);
+    EXPECT_EQ(stats.failures, 0);
+}
+
+TEST(MemoryFileSystem, injection)
+{
+    CMemoryFileSystem fs;
+    std::wstring      sep(1, PlatformPathSeparator);
+    std::wstring      root = sep + L"mem";
+    ASSERT_TRUE(fs.MakeDirs(root));
+
+    // FAT rounds the write times up to 2 seconds
+    fs.SetFatTimes(true);
+    ASSERT_TRUE(fs.WriteContent(root + sep + L"fat.txt", ""));
+    EXPECT_TRUE(fs.SetWriteTime(root + sep + L"fat.txt", 132223104010000000ULL));
+    PlatformFileInfo info;
+    ASSERT_TRUE(fs.Stat(root + sep + L"fat.txt", info));
+    EXPECT_EQ(info.writeTime, 132223104020000000ULL);
+    fs.SetFatTimes(false);
+
+    fs.SetFailingPath(root + sep + L"fat.txt", true);
+    EXPECT_FALSE(fs.Stat(root + sep + L"fat.txt", info));
+    EXPECT_FALSE(fs.Copy(root + sep + L"fat.txt", root + sep + L"copy.txt"));
+    fs.SetFailingPath(root + sep + L"fat.txt", false);
+    EXPECT_TRUE(fs.Stat(root + sep + L"fat.txt", info));
+
+    fs.SetFailureRate(1.0);
+    EXPECT_FALSE(fs.Stat(root, info));
+    fs.SetFailureRate(0.0);
+    EXPECT_EQ(fs.GetStats().failures, 3);
+
+    // the user changes files while the sync enumerates
+    std::vector<MemoryFsChange> changes;
+    fs.SetChangeCallback([&](const MemoryFsChange& change) { changes.push_back(change); });
+    MemoryFsChange added;
+    added.type        = MemoryFsChangeType::Added;
+    added.path        = root + sep + L"new" + sep + L"user.txt";
+    added.content     = "user";
+    added.atOperation = fs.GetStats().operations + 2;
+    fs.Script(added);
+    MemoryFsChange removed;
+    removed.type        = MemoryFsChangeType::Removed;
+    removed.path        = root + sep + L"fat.txt";
+    removed.atOperation = added.atOperation;
+    fs.Script(removed);
+
+    size_t count = 0;
+    EXPECT_TRUE(fs.Enumerate(root, [&](const std::wstring&, const PlatformFileInfo&) {
+        ++count;
+        return true;
+    }));
+    EXPECT_EQ(count, 1);
+    EXPECT_TRUE(changes.empty());
+    EXPECT_TRUE(fs.WriteContent(root + sep + L"own.txt", "own"));
+    count = 0;
+    EXPECT_TRUE(fs.Enumerate(root, [&](const std::wstring&, const PlatformFileInfo&) {
+        ++count;
+        return true;
+    }));
+    // new, new/user.txt and own.txt
+    EXPECT_EQ(count, 3);
+    ASSERT_EQ(changes.size(), 3);
+    EXPECT_TRUE(changes[0].scripted);
+    EXPECT_EQ(changes[1].type, MemoryFsChangeType::Removed);
+    EXPECT_EQ(changes[2].path, root + sep + L"own.txt");
+    EXPECT_FALSE(changes[2].scripted);
+}
+
+TEST(AsyncLog, format)
+{
+    CAsyncLog                 log;
+    std::vector<std::wstring> lines;
+    log.SetSink([&](LogLevel level, const std::wstring& line) {
+        if (level != LogLevel::Debug)
+            lines.push_back(line);
+    });
+    std::wstring path = L"c:\\folder\\file.txt";
+    log.Info(L"copy file %s to %s", path, L"d:\\crypt");
+    log.Error(L"%d files, %Iu bytes, %I64u ms, %5.1f%%, 0x%08x, %c, %-4s|", -3, size_t(42), 12345ULL, 99.25, 255u, L'x', L"ab");
+    log.Warning(L"missing %s and %d", L"one");
+    log.Info(L"%s", LogFileTime{0});
+    ASSERT_EQ(lines.size(), 4);
+    EXPECT_EQ(lines[0], L"INFO:    copy file c:\\folder\\file.txt to d:\\crypt");
+    EXPECT_EQ(lines[1], L"ERROR:   -3 files, 42 bytes, 12345 ms,  99.2%, 0x000000ff, x, ab  |");
+    EXPECT_EQ(lines[2], L"WARNING: missing one and %d");
+    EXPECT_EQ(lines[3], L"INFO:    " + CPlatform::FormatFileTime(0));
+}
+
+TEST(AsyncLog, long_strings)
+{
+    CAsyncLog                 log;
+    std::vector<std::wstring> lines;
+    log.SetSink([&](LogLevel, const std::wstring& line) { lines.push_back(line); });
+    ASSERT_TRUE(log.Start(4));
+    std::wstring longPath = L"c:\\" + std::wstring(1000, 'x') + L"\\file.txt";
+    log.Info(L"%s", longPath);
+    log.Info(L"%s > %s", L"short", longPath);
+    log.Info(L"%s > %s", longPath, longPath);
+    log.Stop();
+    ASSERT_EQ(lines.size(), 3);
+    // the strings share the buffer of the record, the start and the end of each are kept
+    const std::wstring prefix = L"INFO:    ";
+    EXPECT_EQ(lines[0].size(), prefix.size() + ASYNCLOG_STRING_CAPACITY);
+    EXPECT_EQ(lines[0].compare(prefix.size(), 4, L"c:\\x"), 0);
+    EXPECT_NE(lines[0].find(L"x...x"), std::wstring::npos);
+    EXPECT_EQ(lines[0].substr(lines[0].size() - 9), L"\\file.txt");
+    EXPECT_EQ(lines[1].size(), prefix.size() + ASYNCLOG_STRING_CAPACITY + 3);
+    EXPECT_EQ(lines[1].compare(prefix.size(), 8, L"short > "), 0);
+    EXPECT_EQ(lines[2].size(), prefix.size() + ASYNCLOG_STRING_CAPACITY + 3);
+    EXPECT_EQ(lines[2].find(L".txt"), lines[2].find(L" > ") - 4);
+}
+
+TEST(AsyncLog, threads)
+{
+    constexpr int                 threadCount = 4;
+    constexpr int                 records     = 5000;
+    CAsyncLog                     log;
+    std::vector<std::vector<int>> received(threadCount);
+    log.SetSink([&](LogLevel, const std::wstring& line) {
+        // "INFO:    thread <t> record <r>"
+        int thread = 0;
+        int record = 0;
+        if (swscanf(line.c_str(), L"INFO:    thread %d record %d", &thread, &record) == 2)
+            received[thread].push_back(record);
+    });
+    // a small ring buffer, so the threads have to wait for the writer
+    ASSERT_TRUE(log.Start(64));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&log, t] {
+            for (int r = 0; r < records; ++r)
+                log.Info(L"thread %d record %d", t, r);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    log.Flush();
+    EXPECT_EQ(log.GetWritten(), threadCount * records);
+    for (const auto& thread : received)
+    {
+        ASSERT_EQ(thread.size(), records);
+        for (int r = 0; r < records; ++r)
+            EXPECT_EQ(thread[r], r);
+    }
+    log.Stop();
+    log.Info(L"thread %d record %d", 0, records);
+    EXPECT_EQ(received[0].size(), records + 1);
+}
+
+TEST(AsyncLog, stop_while_logging)
+{
+    constexpr int    threadCount = 4;
+    constexpr int    records     = 20000;
+    CAsyncLog        log;
+    std::atomic<int> lines{0};
+    log.SetSink([&](LogLevel, const std::wstring&) { ++lines; });
+    ASSERT_TRUE(log.Start(64));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&log, t] {
+            for (int r = 0; r < records; ++r)
+                log.Info(L"thread %d record %d", t, r);
+        });
+    }
+    // stop while the threads take tickets: their records are written
+    // by the writer thread or right away, none of them gets lost
+    while (log.GetWritten() < 1000)
+        std::this_thread::yield();
+    log.Stop();
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(lines, threadCount * records);
+    EXPECT_EQ(log.GetWritten(), threadCount * records);
+}
+
+// run with --gtest_also_run_disabled_tests --gtest_filter=AsyncLog.DISABLED_overhead
+// the time the sync thread spends on the log lines of a file, written right away and through the writer thread.
+// The files are logged in bursts that fit into the ring buffer, like a sync which does I/O between the files.
+TEST(AsyncLog, DISABLED_overhead)
+{
+    constexpr int files = 200000;
+    constexpr int burst = 1000;
+    std::wstring  orig  = L"c:\\Users\\someone\\Documents\\projects\\CryptSync\\src\\FolderSync.cpp";
+    std::wstring  crypt = L"d:\\Cloud\\Encrypted\\projects\\CryptSync\\src\\FolderSync.cpp.7z";
+    uint64_t      chars = 0;
+    for (bool async : {false, true})
+    {
+        CAsyncLog log;
+        log.SetSink([&](LogLevel, const std::wstring& line) { chars += line.size(); });
+        if (async)
+            log.Start();
+        std::chrono::steady_clock::duration logging{};
+        auto                                start = std::chrono::steady_clock::now();
+        for (int i = 0; i < files; i += burst)
+        {
+            auto burstStart = std::chrono::steady_clock::now();
+            for (int j = i; j < i + burst; ++j)
+            {
+                log.Info(L"encrypted file is older: %s : %s, %s : %s", orig, LogFileTime{132223104000000000ULL + j}, crypt, LogFileTime{132223104000000000ULL});
+                log.Info(L"encrypt file %s to %s", orig, crypt);
+            }
+            logging += std::chrono::steady_clock::now() - burstStart;
+            log.Flush();
+        }
+        log.Stop();
+        auto total = std::chrono::steady_clock::now() - start;
+        printf("%s: %.0f ns per file on the sync thread, %.0f ns until written\n", async ? "async" : "sync",
+               std::chrono::duration<double, std::nano>(logging).count() / files,
+               std::chrono::duration<double, std::nano>(total).count() / files);
+    }
+    EXPECT_GT(chars, 0);
+}
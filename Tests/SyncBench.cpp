@@ -0,0 +1,386 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "SyncBench.h"
+#include "../src/NameCipher.h"
+#include "../src/SyncPlan.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <numeric>
+#include <set>
+
+namespace
+{
+constexpr uint64_t TicksPerSecond        = 10000000ULL;
+/// 2024-01-01, the write time of a generated tree
+constexpr uint64_t BenchBaseWriteTime    = 133485408000000000ULL;
+/// the content is random or pattern in segments of this size
+constexpr size_t   BenchSegmentSize      = 256;
+/// the extension of the files BenchPlanAndCopy() writes to the encrypted folder
+constexpr wchar_t  BenchCryptExtension[] = L".enc";
+
+const wchar_t* const BenchExtensions[] = {L".txt", L".doc", L".xml", L".cpp", L".pdf", L".jpg", L".dat", L".bin"};
+
+std::string FormatJson(const char* format, ...)
+{
+    char    buf[512] = {};
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    return buf;
+}
+} // namespace
+
+void BenchTreeSettings::Parse(const std::wstring& spec)
+{
+    size_t start = 0;
+    while (start < spec.size())
+    {
+        auto end = spec.find(',', start);
+        if (end == std::wstring::npos)
+            end = spec.size();
+        auto item  = spec.substr(start, end - start);
+        start      = end + 1;
+        auto eqPos = item.find('=');
+        if (eqPos == std::wstring::npos)
+            continue;
+        auto name  = item.substr(0, eqPos);
+        auto value = item.c_str() + eqPos + 1;
+        auto count = static_cast<uint64_t>(wcstoull(value, nullptr, 10));
+        if (name == L"seed")
+            seed = static_cast<uint32_t>(count);
+        else if (name == L"files")
+            fileCount = static_cast<size_t>(count);
+        else if (name == L"minsize")
+            minSize = count;
+        else if (name == L"maxsize")
+            maxSize = count;
+        else if (name == L"depth")
+            depth = static_cast<size_t>(count);
+        else if (name == L"folders")
+            foldersPerLevel = static_cast<size_t>(count);
+        else if (name == L"compress")
+            compressibility = std::clamp(wcstod(value, nullptr), 0.0, 1.0);
+        else if (name == L"minname")
+            minNameLength = static_cast<size_t>(count);
+        else if (name == L"maxname")
+            maxNameLength = static_cast<size_t>(count);
+        else if (name == L"mutate")
+            mutatePercent = std::clamp(wcstod(value, nullptr), 0.0, 100.0);
+    }
+    maxSize       = std::max(maxSize, minSize);
+    minNameLength = std::max<size_t>(minNameLength, 1);
+    maxNameLength = std::max(maxNameLength, minNameLength);
+}
+
+std::string BenchTreeSettings::ToJson() const
+{
+    return FormatJson("{\"seed\": %u, \"files\": %llu, \"minSize\": %llu, \"maxSize\": %llu, \"depth\": %llu, \"foldersPerLevel\": %llu, "
+                      "\"compressibility\": %.2f, \"minNameLength\": %llu, \"maxNameLength\": %llu, \"mutatePercent\": %.2f}",
+                      seed, static_cast<unsigned long long>(fileCount), static_cast<unsigned long long>(minSize), static_cast<unsigned long long>(maxSize),
+                      static_cast<unsigned long long>(depth), static_cast<unsigned long long>(foldersPerLevel), compressibility,
+                      static_cast<unsigned long long>(minNameLength), static_cast<unsigned long long>(maxNameLength), mutatePercent);
+}
+
+CBenchTree::CBenchTree(CFileSystem& fs, const BenchTreeSettings& settings)
+    : m_fs(fs)
+    , m_settings(settings)
+    , m_random(settings.seed)
+    , m_writeTime(BenchBaseWriteTime)
+{
+}
+
+uint64_t CBenchTree::Random(uint64_t range)
+{
+    // not std::uniform_int_distribution: its results differ between the standard libraries
+    return range ? m_random() % range : 0;
+}
+
+std::wstring CBenchTree::Name(const wchar_t* extension)
+{
+    static const wchar_t chars[] = L"abcdefghijklmnopqrstuvwxyz0123456789_-";
+    auto                 length  = m_settings.minNameLength + Random(m_settings.maxNameLength - m_settings.minNameLength + 1);
+    std::wstring         name;
+    for (uint64_t i = 0; i < length; ++i)
+        name += chars[Random(std::size(chars) - 1)];
+    if (extension)
+        name += extension;
+    return name;
+}
+
+std::string CBenchTree::Content(uint64_t size)
+{
+    static const char pattern[] = "CryptSync benchmark content, compresses well. ";
+    std::string       content(static_cast<size_t>(size), '\0');
+    const auto        threshold = static_cast<uint64_t>(m_settings.compressibility * 1000);
+    for (size_t pos = 0; pos < content.size(); pos += BenchSegmentSize)
+    {
+        auto length = std::min(BenchSegmentSize, content.size() - pos);
+        if (Random(1000) < threshold)
+        {
+            for (size_t i = 0; i < length; ++i)
+                content[pos + i] = pattern[(pos + i) % (std::size(pattern) - 1)];
+        }
+        else
+        {
+            for (size_t i = 0; i < length; i += sizeof(uint64_t))
+            {
+                uint64_t value = m_random();
+                memcpy(&content[pos + i], &value, std::min(sizeof(value), length - i));
+            }
+        }
+    }
+    return content;
+}
+
+bool CBenchTree::Generate(const std::wstring& root)
+{
+    const std::wstring sep(1, PlatformPathSeparator);
+    m_files.clear();
+
+    // every folder of a level gets foldersPerLevel sub folders, up to depth levels
+    std::vector<std::wstring> folders = {std::wstring()};
+    std::vector<std::wstring> level   = folders;
+    for (size_t d = 0; (d < m_settings.depth) && (folders.size() < m_settings.fileCount); ++d)
+    {
+        std::vector<std::wstring> next;
+        for (const auto& parent : level)
+        {
+            for (size_t i = 0; i < m_settings.foldersPerLevel; ++i)
+                next.push_back(parent.empty() ? Name(nullptr) : parent + sep + Name(nullptr));
+        }
+        folders.insert(folders.end(), next.begin(), next.end());
+        level = std::move(next);
+    }
+    for (const auto& folder : folders)
+    {
+        if (!m_fs.MakeDirs(folder.empty() ? root : root + sep + folder))
+            return false;
+    }
+
+    std::set<std::wstring> used;
+    const double           sizeRange = static_cast<double>(m_settings.maxSize) / static_cast<double>(std::max<uint64_t>(m_settings.minSize, 1));
+    while (m_files.size() < m_settings.fileCount)
+    {
+        const auto& folder  = folders[Random(folders.size())];
+        auto        relPath = Name(BenchExtensions[Random(std::size(BenchExtensions))]);
+        if (!folder.empty())
+            relPath = folder + sep + relPath;
+        if (!used.insert(relPath).second)
+            continue;
+        // log-uniform: every order of magnitude between min and max gets the same number of files
+        double    fraction = static_cast<double>(m_random() >> 11) / 9007199254740992.0;
+        BenchFile file;
+        file.relPath = relPath;
+        file.size    = std::max(m_settings.minSize, static_cast<uint64_t>(static_cast<double>(m_settings.minSize) * std::pow(sizeRange, fraction)));
+        auto path    = root + sep + relPath;
+        if (!m_fs.WriteContent(path, Content(file.size)) || !m_fs.SetWriteTime(path, m_writeTime))
+            return false;
+        m_files.push_back(std::move(file));
+    }
+    return true;
+}
+
+size_t CBenchTree::Mutate(const std::wstring& root)
+{
+    if (m_files.empty())
+        return 0;
+    const std::wstring sep(1, PlatformPathSeparator);
+    auto               count = static_cast<size_t>(static_cast<double>(m_files.size()) * m_settings.mutatePercent / 100.0 + 0.5);
+    count                    = std::clamp<size_t>(count, 1, m_files.size());
+
+    // an hour later, newer than the encrypted files even on FAT
+    m_writeTime += 3600 * TicksPerSecond;
+    std::vector<size_t> indexes(m_files.size());
+    std::iota(indexes.begin(), indexes.end(), 0);
+    size_t changed = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::swap(indexes[i], indexes[i + Random(indexes.size() - i)]);
+        const auto& file = m_files[indexes[i]];
+        auto        path = root + sep + file.relPath;
+        if (m_fs.WriteContent(path, Content(file.size)) && m_fs.SetWriteTime(path, m_writeTime))
+            ++changed;
+    }
+    return changed;
+}
+
+uint64_t CBenchTree::GetTotalSize() const
+{
+    uint64_t total = 0;
+    for (const auto& file : m_files)
+        total += file.size;
+    return total;
+}
+
+double CBenchTimer::Lap()
+{
+    auto now      = std::chrono::steady_clock::now();
+    auto duration = std::chrono::duration<double>(now - m_start).count();
+    m_start       = now;
+    return duration;
+}
+
+CBenchReport::CBenchReport(const std::string& name, const BenchTreeSettings& settings)
+    : m_name(name)
+    , m_settings(settings)
+{
+}
+
+void CBenchReport::Add(const BenchResult& result)
+{
+    m_results.push_back(result);
+    if (m_results.back().peakMemory == 0)
+        m_results.back().peakMemory = CPlatform::PeakMemory();
+}
+
+std::string CBenchReport::ToJson() const
+{
+#ifdef _WIN32
+    const char* platform = "windows";
+#else
+    const char* platform = "posix";
+#endif
+    std::string json = FormatJson("{\n  \"benchmark\": \"%s\",\n  \"platform\": \"%s\",\n  \"tree\": ", m_name.c_str(), platform);
+    json += m_settings.ToJson();
+    json += ",\n  \"results\": [";
+    for (size_t i = 0; i < m_results.size(); ++i)
+    {
+        const auto& result  = m_results[i];
+        const auto  seconds = std::max(result.seconds, 1e-9);
+        json += FormatJson("%s\n    {\"scenario\": \"%s\", \"files\": %llu, \"transfers\": %llu, \"bytes\": %llu, \"seconds\": %.3f, "
+                           "\"filesPerSecond\": %.1f, \"mbPerSecond\": %.2f, \"peakMemory\": %llu, \"phases\": {",
+                           i ? "," : "", result.scenario.c_str(), static_cast<unsigned long long>(result.files),
+                           static_cast<unsigned long long>(result.transfers), static_cast<unsigned long long>(result.bytes), result.seconds,
+                           static_cast<double>(result.files) / seconds, static_cast<double>(result.bytes) / (1024.0 * 1024.0) / seconds,
+                           static_cast<unsigned long long>(result.peakMemory));
+        for (size_t p = 0; p < result.phases.size(); ++p)
+            json += FormatJson("%s\"%s\": %.3f", p ? ", " : "", result.phases[p].name.c_str(), result.phases[p].seconds);
+        json += "}}";
+    }
+    json += "\n  ]\n}\n";
+    return json;
+}
+
+bool CBenchReport::Save(CFileSystem& fs, const std::wstring& path) const
+{
+    return fs.WriteContent(path, ToJson());
+}
+
+bool RunBenchSuite(CFileSystem& fs, const std::wstring& root, const BenchTreeSettings& settings, const BenchSyncFunction& sync, CBenchReport& report)
+{
+    const std::wstring sep(1, PlatformPathSeparator);
+    const auto         origRoot    = root + sep + L"orig";
+    const auto         cryptRoot   = root + sep + L"crypt";
+    const auto         restoreRoot = root + sep + L"restore";
+
+    CBenchTree  tree(fs, settings);
+    CBenchTimer timer;
+    if (!tree.Generate(origRoot) || !fs.MakeDirs(cryptRoot) || !fs.MakeDirs(restoreRoot))
+        return false;
+    BenchResult generated;
+    generated.scenario  = "generate";
+    generated.files     = tree.GetFiles().size();
+    generated.transfers = generated.files;
+    generated.bytes     = tree.GetTotalSize();
+    generated.seconds   = timer.Lap();
+    report.Add(generated);
+
+    auto run = [&](const char* scenario, const std::wstring& orig, bool decryptOnly) {
+        BenchResult result;
+        result.scenario = scenario;
+        result.files    = tree.GetFiles().size();
+        CBenchTimer scenarioTimer;
+        bool        ok  = sync(orig, cryptRoot, decryptOnly, result);
+        if (result.seconds == 0)
+            result.seconds = scenarioTimer.Lap();
+        report.Add(result);
+        return ok;
+    };
+    if (!run("initial", origRoot, false) || !run("rescan", origRoot, false))
+        return false;
+    if (tree.Mutate(origRoot) == 0)
+        return false;
+    return run("mutation", origRoot, false) && run("restore", restoreRoot, true);
+}
+
+bool BenchPlanAndCopy(CFileSystem& fs, const std::wstring& password, const std::wstring& origRoot, const std::wstring& cryptRoot, bool decryptOnly, BenchResult& result)
+{
+    const std::wstring sep(1, PlatformPathSeparator);
+    CNameCipher        cipher(password);
+    CBenchTimer        timer;
+
+    SyncPlanFileList origFiles;
+    SyncPlanFileList cryptFiles;
+    bool             ok = fs.Enumerate(origRoot, [&](const std::wstring& relPath, const PlatformFileInfo& info) {
+        if (!info.directory)
+        {
+            auto& file       = origFiles[relPath];
+            file.fileRelPath = relPath;
+            file.size        = info.size;
+            file.writeTime   = info.writeTime;
+        }
+        return true;
+    });
+    ok = fs.Enumerate(cryptRoot, [&](const std::wstring& relPath, const PlatformFileInfo& info) {
+        if (!info.directory)
+        {
+            auto  plainPath        = cipher.DecryptPath(relPath, true);
+            auto& file             = cryptFiles[plainPath];
+            file.fileRelPath       = relPath;
+            file.size              = info.size;
+            file.writeTime         = info.writeTime;
+            file.filenameEncrypted = plainPath != relPath;
+        }
+        return true;
+    }) && ok;
+    result.phases.push_back({"scan", timer.Lap()});
+
+    SyncPlanSettings settings;
+    settings.toCrypt     = !decryptOnly;
+    settings.encryptPath = [&](const std::wstring& relPath) { return cipher.EncryptPath(relPath, true) + BenchCryptExtension; };
+    CSyncPlan plan(origFiles, cryptFiles, settings);
+    plan.Apply(SyncPolicy());
+    result.phases.push_back({"plan", timer.Lap()});
+
+    std::set<std::wstring> folders;
+    for (const auto& action : plan.GetActions())
+    {
+        if (!action.IsTransfer())
+            continue;
+        const bool toCrypt = (action.type == SyncActionType::Encrypt) || (action.type == SyncActionType::CopyToCrypt);
+        auto       source  = toCrypt ? origRoot + sep + action.origRelPath : cryptRoot + sep + action.cryptRelPath;
+        auto       target  = toCrypt ? cryptRoot + sep + action.cryptRelPath : origRoot + sep + action.origRelPath;
+        auto       folder  = target.substr(0, target.find_last_of(PlatformPathSeparator));
+        if (folders.insert(folder).second)
+            ok = fs.MakeDirs(folder) && ok;
+        ok = fs.Copy(source, target) && ok;
+        ++result.transfers;
+        result.bytes += action.size;
+    }
+    result.phases.push_back({"execute", timer.Lap()});
+    return ok;
+}
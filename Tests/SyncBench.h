@@ -0,0 +1,149 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include "../src/Platform.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * The end to end sync benchmarks.
+ *
+ * CBenchTree generates a reproducible synthetic tree: the same settings
+ * always give the same names, sizes, contents and write times.
+ * RunBenchSuite() runs the scenarios on it (initial sync, no-op rescan,
+ * rescan after changing a few files and a decrypt only restore) through
+ * a sync function, and CBenchReport collects the results as JSON so the
+ * numbers can be compared across commits.
+ * The sync function is the CFolderSync engine in the Windows tests.
+ * BenchPlanAndCopy() is only a file system micro-benchmark for the other
+ * platforms: it scans with CFileSystem, plans with CSyncPlan and copies
+ * the files under encrypted names, without the encryption and the
+ * execution code of the engine.
+ */
+
+/// the shape of a synthetic tree
+struct BenchTreeSettings
+{
+    uint32_t seed            = 1;
+    size_t   fileCount       = 1000;
+    uint64_t minSize         = 512;
+    uint64_t maxSize         = 1024 * 1024; ///< the sizes are log-uniform between min and max: many small and few big files
+    size_t   depth           = 3;           ///< folder levels below the root
+    size_t   foldersPerLevel = 4;
+    double   compressibility = 0.5;         ///< the part of the content that is a repeated pattern, 0 is random data
+    size_t   minNameLength   = 8;
+    size_t   maxNameLength   = 24;
+    double   mutatePercent   = 1.0;         ///< the files changed for the mutation rescan
+
+    /// overrides the values named in a spec like "files=10000,depth=5,compress=0.2", unknown names are ignored
+    void        Parse(const std::wstring& spec);
+    std::string ToJson() const;
+};
+
+/// a file of a synthetic tree
+struct BenchFile
+{
+    std::wstring relPath;
+    uint64_t     size = 0;
+};
+
+class CBenchTree
+{
+public:
+    CBenchTree(CFileSystem& fs, const BenchTreeSettings& settings);
+
+    /// writes the tree below root
+    bool                          Generate(const std::wstring& root);
+    /// rewrites mutatePercent of the files below root with new content and a newer write time, returns the number of changed files
+    size_t                        Mutate(const std::wstring& root);
+    const std::vector<BenchFile>& GetFiles() const { return m_files; }
+    uint64_t                      GetTotalSize() const;
+
+private:
+    uint64_t                      Random(uint64_t range);
+    std::string                   Content(uint64_t size);
+    std::wstring                  Name(const wchar_t* extension);
+
+    CFileSystem&                  m_fs;
+    BenchTreeSettings             m_settings;
+    std::mt19937_64               m_random;
+    std::vector<BenchFile>        m_files;
+    uint64_t                      m_writeTime;
+};
+
+/// the time a part of a scenario took
+struct BenchPhase
+{
+    std::string name;
+    double      seconds = 0;
+};
+
+/// the numbers of one scenario
+struct BenchResult
+{
+    std::string             scenario;
+    uint64_t                files      = 0; ///< the files in the tree
+    uint64_t                transfers  = 0; ///< the files encrypted, decrypted or copied
+    uint64_t                bytes      = 0; ///< the bytes of the transferred files
+    double                  seconds    = 0;
+    uint64_t                peakMemory = 0; ///< the peak memory of the process after the scenario
+    std::vector<BenchPhase> phases;
+};
+
+/// measures the time since it was created or since the last Lap()
+class CBenchTimer
+{
+public:
+    double Lap();
+
+private:
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+};
+
+class CBenchReport
+{
+public:
+    CBenchReport(const std::string& name, const BenchTreeSettings& settings);
+
+    void                            Add(const BenchResult& result);
+    const std::vector<BenchResult>& GetResults() const { return m_results; }
+    std::string                     ToJson() const;
+    bool                            Save(CFileSystem& fs, const std::wstring& path) const;
+
+private:
+    std::string                     m_name;
+    BenchTreeSettings               m_settings;
+    std::vector<BenchResult>        m_results;
+};
+
+/// does one sync pass from origRoot to cryptRoot, or back to origRoot if decryptOnly, and fills in the transfers, bytes and phases.
+/// The time of the call is the time of the scenario, unless the function sets seconds itself.
+using BenchSyncFunction = std::function<bool(const std::wstring& origRoot, const std::wstring& cryptRoot, bool decryptOnly, BenchResult& result)>;
+
+/// generates the tree in root and runs all scenarios on it, root must not exist
+bool RunBenchSuite(CFileSystem& fs, const std::wstring& root, const BenchTreeSettings& settings, const BenchSyncFunction& sync, CBenchReport& report);
+/// a file system micro-benchmark: scans both folders, plans and copies the files with encrypted names
+bool BenchPlanAndCopy(CFileSystem& fs, const std::wstring& password, const std::wstring& origRoot, const std::wstring& cryptRoot, bool decryptOnly, BenchResult& result);
@@ -1,6 +1,23 @@
 ﻿#include "stdafx.h"
 
 #include "../src/FolderSync.h"
+#include "../src/CopyEngine.h"
+#include "../src/PathWatcher.h"
+#include "../src/WatchDaemon.h"
+#include "../src/MemoryFileSystem.h"
+#include "../lzma/Wrapper-CPP/C7Zip.h"
+#include "../lzma/Wrapper-CPP/Helper.h"
+#include "../lzma/Wrapper-CPP/MemoryGovernor.h"
+#include "../lzma/Wrapper-CPP/UnbufferedFile.h"
+#include "PathUtils.h"
+#include "SyncBench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+#include <thread>
+#include <Psapi.h>
 
 #pragma warning(disable: 4566) // character represented by ... cannot be represented in the current code page
 
@@ -39,3 +56,1209 @@ TEST(NameEncryption, encrypt_new_encryption2)
     auto encryptedFilename = CFolderSync::GetEncryptedFilename(L"filenam.txt", L"password", true, true, true, false);
     EXPECT_EQ(encryptedFilename, L"板浜慴殐樕榛毛时.7z");
 }
+
+TEST(SelfWriteTable, normalize_path)
+{
+    EXPECT_EQ(CSelfWriteTable::NormalizePath(L"\\\\?\\C:\\Folder\\File.TXT"), L"c:\\folder\\file.txt");
+    EXPECT_EQ(CSelfWriteTable::NormalizePath(L"\\\\?\\UNC\\Server\\Share\\file"), L"\\\\server\\share\\file");
+    EXPECT_EQ(CSelfWriteTable::NormalizePath(L"C:/Folder/"), L"c:\\folder");
+}
+
+TEST(SelfWriteTable, deleted_directory_suppresses_children)
+{
+    CSelfWriteTable table;
+    table.ExpectDelete(L"C:\\CryptSyncTestNotExisting\\folder");
+    EXPECT_TRUE(table.IsSelfEvent(L"\\\\?\\c:\\cryptsynctestnotexisting\\FOLDER\\sub\\file.txt"));
+    EXPECT_FALSE(table.IsSelfEvent(L"C:\\CryptSyncTestNotExisting\\other.txt"));
+    auto stats = table.GetStats();
+    EXPECT_EQ(stats.suppressed, 1);
+    EXPECT_EQ(stats.leaked, 0);
+}
+
+TEST(PathMatcher, wildcards)
+{
+    EXPECT_TRUE(CPathMatcher::WildcardMatch(L"*.tmp*", L"file.TMP1"));
+    EXPECT_TRUE(CPathMatcher::WildcardMatch(L"~*.*", L"~file.txt"));
+    EXPECT_TRUE(CPathMatcher::WildcardMatch(L"a?c*d", L"abcxyd"));
+    EXPECT_FALSE(CPathMatcher::WildcardMatch(L"a?c*d", L"acxyd"));
+    EXPECT_FALSE(CPathMatcher::WildcardMatch(L"thumbs.db", L"thumbs.dbx"));
+}
+
+TEST(PathMatcher, classify_path)
+{
+    CPathMatcher matcher;
+    matcher.AddPatterns({L"*.tmp*", L"thumbs.db"}, PathMatchIgnored, false);
+    matcher.AddPatterns({L"*.jpg", L"raw*"}, PathMatchCryptOnly, true);
+    matcher.AddPatterns({L"c:\\orig\\copy\\*"}, PathMatchCopyOnly, true);
+    EXPECT_EQ(matcher.Match(L"C:\\orig\\Thumbs.db"), PathMatchIgnored);
+    EXPECT_EQ(matcher.Match(L"C:\\orig\\folder.tmp\\file.txt"), PathMatchIgnored);
+    EXPECT_EQ(matcher.Match(L"C:\\orig\\RawFiles\\image.jpg"), PathMatchCryptOnly);
+    EXPECT_EQ(matcher.Match(L"C:\\orig\\copy\\image.jpg"), PathMatchCryptOnly | PathMatchCopyOnly);
+    EXPECT_EQ(matcher.Match(L"C:\\orig\\file.txt"), PathMatchNone);
+}
+
+/// the key the pair tests store their settings in instead of the real ones
+constexpr wchar_t TestPairsKey[] = L"Software\\CryptSyncTests";
+
+/// gives the tests access to the stored configuration of the pairs
+class CTestPairs : public CPairs
+{
+public:
+    explicit CTestPairs(bool readOnly = false)
+        : CPairs(TestPairsKey, readOnly)
+    {
+    }
+
+    using CPairs::CreateIndex;
+    using CPairs::CreateRecord;
+    using CPairs::Decrypt;
+    using CPairs::Encrypt;
+    using CPairs::GetRecordName;
+    using CPairs::ImportRegistryPairs;
+    using CPairs::ParseIndex;
+    using CPairs::ParseRecord;
+};
+
+/// the pair tests never touch the settings of the user, and leave nothing behind
+class Pairs : public ::testing::Test
+{
+protected:
+    void SetUp() override { RegDeleteTree(HKEY_CURRENT_USER, TestPairsKey); }
+    void TearDown() override { RegDeleteTree(HKEY_CURRENT_USER, TestPairsKey); }
+
+    static void AddTestPairs(CTestPairs& pairs)
+    {
+        pairs.AddPair(true, L"C:\\orig", L"D:\\crypt", L"secret", L"*.txt", L"*.jpg", L"*.tmp", 50, true, false, SrcToDst, true, false, true, false, true);
+        pairs.AddPair(false, L"C:\\orig2", L"D:\\crypt2", L"", L"", L"", L"", 100, false, true, DstToSrc, false, true, false, true, false);
+    }
+
+    static std::vector<BYTE> ReadValue(const wchar_t* name)
+    {
+        std::wstring      key  = std::wstring(TestPairsKey) + L"\\SyncPairs";
+        DWORD             size = 0;
+        std::vector<BYTE> data;
+        if (RegGetValue(HKEY_CURRENT_USER, key.c_str(), name, RRF_RT_REG_BINARY, nullptr, nullptr, &size) != ERROR_SUCCESS)
+            return data;
+        data.resize(size);
+        RegGetValue(HKEY_CURRENT_USER, key.c_str(), name, RRF_RT_REG_BINARY, nullptr, data.data(), &size);
+        return data;
+    }
+
+    static void WriteValue(const wchar_t* name, const std::vector<BYTE>& data)
+    {
+        std::wstring key = std::wstring(TestPairsKey) + L"\\SyncPairs";
+        RegSetKeyValue(HKEY_CURRENT_USER, key.c_str(), name, REG_BINARY, data.data(), static_cast<DWORD>(data.size()));
+    }
+
+    static std::vector<DWORD> ReadIds()
+    {
+        std::vector<DWORD> ids;
+        DWORD              version = 0;
+        CTestPairs::ParseIndex(ReadValue(L"Index"), ids, version);
+        return ids;
+    }
+};
+
+TEST_F(Pairs, password_round_trip)
+{
+    EXPECT_EQ(CTestPairs::Decrypt(CTestPairs::Encrypt(L"password")), L"password");
+    EXPECT_EQ(CTestPairs::Decrypt(CTestPairs::Encrypt(L"")), L"");
+}
+
+TEST_F(Pairs, record_round_trip)
+{
+    CTestPairs pairs;
+    AddTestPairs(pairs);
+    auto     record = CTestPairs::CreateRecord(pairs[0]);
+    PairData pd;
+    ASSERT_TRUE(CTestPairs::ParseRecord(record, pd));
+    EXPECT_TRUE(pd.m_enabled);
+    EXPECT_EQ(pd.m_origPath, L"C:\\orig");
+    EXPECT_EQ(pd.m_cryptPath, L"D:\\crypt");
+    EXPECT_EQ(pd.password(), L"secret");
+    EXPECT_EQ(pd.cryptOnly(), L"*.txt");
+    EXPECT_EQ(pd.copyOnly(), L"*.jpg");
+    EXPECT_EQ(pd.noSync(), L"*.tmp");
+    EXPECT_EQ(pd.m_compressSize, 50);
+    EXPECT_TRUE(pd.m_encNames);
+    EXPECT_FALSE(pd.m_encNamesNew);
+    EXPECT_EQ(pd.m_syncDir, SrcToDst);
+    EXPECT_TRUE(pd.m_use7Z);
+    EXPECT_FALSE(pd.m_useGpg);
+    EXPECT_TRUE(pd.m_fat);
+    EXPECT_FALSE(pd.m_syncDeleted);
+    EXPECT_TRUE(pd.m_ResetOriginalArchAttr);
+    // saving the loaded pair again doesn't change anything
+    EXPECT_EQ(CTestPairs::CreateRecord(pd), record);
+
+    ASSERT_TRUE(CTestPairs::ParseRecord(CTestPairs::CreateRecord(pairs[1]), pd));
+    EXPECT_FALSE(pd.m_enabled);
+    EXPECT_EQ(pd.password(), L"");
+    EXPECT_EQ(pd.m_syncDir, DstToSrc);
+    EXPECT_TRUE(pd.m_useGpg);
+    EXPECT_TRUE(pd.m_syncDeleted);
+}
+
+TEST_F(Pairs, truncated)
+{
+    CTestPairs pairs;
+    AddTestPairs(pairs);
+    auto     record = CTestPairs::CreateRecord(pairs[0]);
+    PairData pd;
+    for (size_t size = 0; size < record.size(); ++size)
+        EXPECT_FALSE(CTestPairs::ParseRecord(std::vector<BYTE>(record.begin(), record.begin() + size), pd)) << size;
+    auto               index = CTestPairs::CreateIndex({1, 2});
+    std::vector<DWORD> ids;
+    DWORD              version = 0;
+    for (size_t size = 0; size < index.size(); ++size)
+        EXPECT_FALSE(CTestPairs::ParseIndex(std::vector<BYTE>(index.begin(), index.begin() + size), ids, version)) << size;
+}
+
+TEST_F(Pairs, newer_version)
+{
+    // a newer version appends fields to the records and data after the ids of the index
+    const BYTE unknown[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    CTestPairs pairs;
+    AddTestPairs(pairs);
+    auto record = CTestPairs::CreateRecord(pairs[0]);
+    record.insert(record.end(), std::begin(unknown), std::end(unknown));
+    PairData pd;
+    ASSERT_TRUE(CTestPairs::ParseRecord(record, pd));
+    EXPECT_EQ(pd.m_origPath, L"C:\\orig");
+    EXPECT_EQ(pd.password(), L"secret");
+    EXPECT_EQ(pd.noSync(), L"*.tmp");
+
+    // magic, version, count, then the ids
+    auto  index        = CTestPairs::CreateIndex({3, 7});
+    DWORD newerVersion = PAIRS_BLOB_VERSION + 1;
+    memcpy(index.data() + sizeof(DWORD), &newerVersion, sizeof(DWORD));
+    index.insert(index.end(), std::begin(unknown), std::end(unknown));
+    std::vector<DWORD> ids;
+    DWORD              version = 0;
+    ASSERT_TRUE(CTestPairs::ParseIndex(index, ids, version));
+    EXPECT_EQ(version, PAIRS_BLOB_VERSION + 1);
+    EXPECT_EQ(ids, (std::vector<DWORD>{3, 7}));
+
+    // a different magic is not a pair configuration at all
+    index[0] = 0;
+    EXPECT_FALSE(CTestPairs::ParseIndex(index, ids, version));
+}
+
+TEST_F(Pairs, save_and_load)
+{
+    {
+        CTestPairs pairs;
+        EXPECT_TRUE(pairs.empty());
+        AddTestPairs(pairs);
+        ASSERT_TRUE(pairs.SavePairs());
+    }
+    CTestPairs pairs;
+    EXPECT_FALSE(pairs.IsReadOnly());
+    ASSERT_EQ(pairs.size(), 2);
+    EXPECT_EQ(pairs[0].m_origPath, L"C:\\orig");
+    EXPECT_EQ(pairs[0].password(), L"secret");
+    EXPECT_EQ(pairs[1].m_cryptPath, L"D:\\crypt2");
+    EXPECT_EQ(pairs[1].m_syncDir, DstToSrc);
+    // every pair is a value of its own
+    auto ids = ReadIds();
+    ASSERT_EQ(ids.size(), 2);
+    EXPECT_NE(ids[0], ids[1]);
+    EXPECT_EQ(ReadValue(CTestPairs::GetRecordName(ids[0]).c_str()), CTestPairs::CreateRecord(pairs[0]));
+    EXPECT_EQ(ReadValue(CTestPairs::GetRecordName(ids[1]).c_str()), CTestPairs::CreateRecord(pairs[1]));
+}
+
+TEST_F(Pairs, save_changed_pairs_only)
+{
+    CTestPairs pairs;
+    AddTestPairs(pairs);
+    ASSERT_TRUE(pairs.SavePairs());
+    auto ids = ReadIds();
+    ASSERT_EQ(ids.size(), 2);
+
+    // the first pair is changed in the registry, but not in pairs: saving the
+    // change of the second pair doesn't write the first one again
+    PairData changed       = pairs[0];
+    changed.m_compressSize = 77;
+    WriteValue(CTestPairs::GetRecordName(ids[0]).c_str(), CTestPairs::CreateRecord(changed));
+    pairs[1].m_compressSize = 10;
+    ASSERT_TRUE(pairs.SavePairs());
+    {
+        CTestPairs loaded;
+        ASSERT_EQ(loaded.size(), 2);
+        EXPECT_EQ(loaded[0].m_compressSize, 77);
+        EXPECT_EQ(loaded[1].m_compressSize, 10);
+    }
+
+    // a removed pair removes its value, a new one gets a new id
+    pairs.erase(pairs.begin());
+    pairs.AddPair(true, L"C:\\orig3", L"D:\\crypt3", L"third", L"", L"", L"", 100, false, false, BothWays, false, false, false, true, false);
+    ASSERT_TRUE(pairs.SavePairs());
+    EXPECT_TRUE(ReadValue(CTestPairs::GetRecordName(ids[0]).c_str()).empty());
+    auto newIds = ReadIds();
+    ASSERT_EQ(newIds.size(), 2);
+    EXPECT_EQ(newIds[0], ids[1]);
+    EXPECT_NE(newIds[1], ids[0]);
+    CTestPairs loaded;
+    ASSERT_EQ(loaded.size(), 2);
+    EXPECT_EQ(loaded[0].m_origPath, L"C:\\orig2");
+    EXPECT_EQ(loaded[1].m_origPath, L"C:\\orig3");
+    EXPECT_EQ(loaded[1].password(), L"third");
+}
+
+TEST_F(Pairs, read_only)
+{
+    {
+        CTestPairs pairs;
+        AddTestPairs(pairs);
+        ASSERT_TRUE(pairs.SavePairs());
+    }
+    // a read only instance loads the pairs, but never saves them
+    CTestPairs readOnly(true);
+    ASSERT_EQ(readOnly.size(), 2);
+    readOnly[0].m_compressSize = 10;
+    EXPECT_FALSE(readOnly.SavePairs());
+    CTestPairs loaded;
+    EXPECT_EQ(loaded[0].m_compressSize, 50);
+
+    // a configuration that can't be read is not overwritten
+    auto ids = ReadIds();
+    ASSERT_EQ(ids.size(), 2);
+    WriteValue(CTestPairs::GetRecordName(ids[1]).c_str(), {1, 2, 3});
+    CTestPairs damaged;
+    EXPECT_TRUE(damaged.IsReadOnly());
+    EXPECT_TRUE(damaged.empty());
+    AddTestPairs(damaged);
+    EXPECT_FALSE(damaged.SavePairs());
+    EXPECT_EQ(ReadValue(CTestPairs::GetRecordName(ids[1]).c_str()), (std::vector<BYTE>{1, 2, 3}));
+}
+
+TEST_F(Pairs, legacy_import)
+{
+    auto setString = [&](const wchar_t* name, const std::wstring& value) {
+        RegSetKeyValue(HKEY_CURRENT_USER, TestPairsKey, name, REG_SZ, value.c_str(), static_cast<DWORD>((value.size() + 1) * sizeof(wchar_t)));
+    };
+    auto setDWORD = [&](const wchar_t* name, DWORD value) {
+        RegSetKeyValue(HKEY_CURRENT_USER, TestPairsKey, name, REG_DWORD, &value, sizeof(value));
+    };
+    setString(L"SyncPairOrig0", L"C:\\legacy");
+    setString(L"SyncPairCrypt0", L"D:\\legacy");
+    setString(L"SyncPairPass0", CTestPairs::Encrypt(L"secret"));
+    setString(L"SyncPairNoSync0", L"*.bak");
+    setDWORD(L"SyncPairOneWay0", 1);
+    setDWORD(L"SyncPair7zExt0", 1);
+    setDWORD(L"SyncPairCompressSize0", 30);
+    setDWORD(L"SyncPairEnabled0", 0);
+    setString(L"SyncPairOrig1", L"C:\\legacy2");
+    setString(L"SyncPairCrypt1", L"D:\\legacy2");
+    setString(L"SyncPairPass1", CTestPairs::Encrypt(L"other"));
+    setDWORD(L"SyncPairDir1", DstToSrc);
+
+    // a read only instance imports the pairs, but doesn't store them
+    {
+        CTestPairs readOnly(true);
+        EXPECT_EQ(readOnly.size(), 2);
+        EXPECT_TRUE(ReadIds().empty());
+    }
+    // the first load stores the imported pairs
+    {
+        CTestPairs imported;
+        EXPECT_EQ(imported.size(), 2);
+        EXPECT_EQ(ReadIds().size(), 2);
+    }
+    CTestPairs pairs;
+    ASSERT_EQ(pairs.size(), 2);
+    EXPECT_EQ(pairs[0].m_origPath, L"C:\\legacy");
+    EXPECT_EQ(pairs[0].m_cryptPath, L"D:\\legacy");
+    EXPECT_EQ(pairs[0].password(), L"secret");
+    EXPECT_EQ(pairs[0].noSync(), L"*.bak");
+    EXPECT_EQ(pairs[0].m_syncDir, SrcToDst);
+    EXPECT_TRUE(pairs[0].m_use7Z);
+    EXPECT_EQ(pairs[0].m_compressSize, 30);
+    EXPECT_FALSE(pairs[0].m_enabled);
+    EXPECT_EQ(pairs[1].password(), L"other");
+    EXPECT_EQ(pairs[1].m_syncDir, DstToSrc);
+    // the defaults of values that were never written
+    EXPECT_TRUE(pairs[1].m_enabled);
+    EXPECT_TRUE(pairs[1].m_encNames);
+    EXPECT_TRUE(pairs[1].m_syncDeleted);
+    EXPECT_EQ(pairs[1].m_compressSize, 100);
+}
+
+/// polls condition until it's true or timeout ms have passed
+static bool WaitFor(const std::function<bool()>& condition, DWORD timeout)
+{
+    for (auto start = GetTickCount64(); !condition(); Sleep(50))
+    {
+        if (GetTickCount64() - start > timeout)
+            return false;
+    }
+    return true;
+}
+
+TEST(PathWatcher, retry_backoff)
+{
+    std::vector<ULONGLONG> delays;
+    ULONGLONG              delay = 0;
+    for (int i = 0; i < 10; ++i)
+    {
+        delay = CPathWatcher::GetNextRetryDelay(delay);
+        delays.push_back(delay);
+    }
+    EXPECT_EQ(delays, std::vector<ULONGLONG>({2000, 4000, 8000, 16000, 32000, 64000, 128000, 256000, 300000, 300000}));
+}
+
+TEST(PathWatcher, unavailable_path)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring missing = CPathUtils::Append(tempPath, L"CryptSyncTestWatchMissing");
+    RemoveDirectory(missing.c_str());
+
+    CPathWatcher watcher;
+    EXPECT_TRUE(watcher.AddPath(missing));
+    ASSERT_TRUE(WaitFor([&] { return watcher.GetWatchStatus()[0].health == WatchHealth::Unavailable; }, 5000));
+    auto status = watcher.GetWatchStatus();
+    ASSERT_EQ(status.size(), 1);
+    EXPECT_TRUE((status[0].lastError == ERROR_FILE_NOT_FOUND) || (status[0].lastError == ERROR_PATH_NOT_FOUND));
+    EXPECT_LE(status[0].retryDelay, static_cast<ULONGLONG>(WATCH_RETRY_MIN_DELAY));
+    EXPECT_EQ(watcher.GetNumberOfWatchedPaths(), 0);
+
+    // the retry after the first delay finds the folder
+    CreateDirectory(missing.c_str(), nullptr);
+    EXPECT_TRUE(WaitFor([&] { return watcher.GetNumberOfWatchedPaths() == 1; }, WATCH_RETRY_MIN_DELAY * 2 + 1000));
+    EXPECT_EQ(watcher.GetWatchStatus()[0].health, WatchHealth::Active);
+
+    watcher.Stop();
+    RemoveDirectory(missing.c_str());
+}
+
+TEST(PathWatcher, add_and_remove)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring kept    = CPathUtils::Append(tempPath, L"CryptSyncTestWatchKept");
+    std::wstring removed = CPathUtils::Append(tempPath, L"CryptSyncTestWatchRemoved");
+    CreateDirectory(kept.c_str(), nullptr);
+    CreateDirectory(removed.c_str(), nullptr);
+
+    CPathWatcher watcher;
+    EXPECT_TRUE(watcher.AddPath(kept));
+    EXPECT_TRUE(watcher.AddPath(removed));
+    EXPECT_FALSE(watcher.AddPath(kept));
+    ASSERT_TRUE(WaitFor([&] { return watcher.GetNumberOfWatchedPaths() == 2; }, 5000));
+
+    // removing one path cancels only its watch
+    EXPECT_TRUE(watcher.RemovePath(removed));
+    EXPECT_FALSE(watcher.RemovePath(removed));
+    auto status = watcher.GetWatchStatus();
+    ASSERT_EQ(status.size(), 1);
+    EXPECT_EQ(_wcsicmp(status[0].path.c_str(), kept.c_str()), 0);
+    EXPECT_EQ(status[0].health, WatchHealth::Active);
+
+    std::wstring keptFile    = CPathUtils::Append(kept, L"file.txt");
+    std::wstring removedFile = CPathUtils::Append(removed, L"file.txt");
+    CAutoFile(CreateFile(removedFile.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr));
+    CAutoFile(CreateFile(keptFile.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr));
+    std::set<std::wstring> changed;
+    auto                   contains = [&](const std::wstring& path) {
+        return std::ranges::any_of(changed, [&](const std::wstring& p) { return _wcsicmp(p.c_str(), path.c_str()) == 0; });
+    };
+    EXPECT_TRUE(WaitFor([&] {
+        auto paths = watcher.GetChangedPaths();
+        changed.insert(paths.begin(), paths.end());
+        return contains(keptFile);
+    }, 5000));
+    EXPECT_FALSE(contains(removedFile));
+
+    // and adding it again watches it again, the other path keeps its watch
+    EXPECT_TRUE(watcher.AddPath(removed));
+    EXPECT_TRUE(WaitFor([&] { return watcher.GetNumberOfWatchedPaths() == 2; }, 5000));
+
+    watcher.Stop();
+    DeleteFile(keptFile.c_str());
+    DeleteFile(removedFile.c_str());
+    RemoveDirectory(kept.c_str());
+    RemoveDirectory(removed.c_str());
+}
+
+// the changes of the file system go through the watcher and are synced like the watch mode does it
+TEST(PathWatcher, sync_memory_changes)
+{
+    CMemoryFileSystem  fs;
+    const std::wstring orig  = L"X:\\CryptSyncMemory\\orig";
+    const std::wstring crypt = L"X:\\CryptSyncMemory\\crypt";
+    ASSERT_TRUE(fs.MakeDirs(orig));
+    ASSERT_TRUE(fs.MakeDirs(crypt));
+
+    // the memory file system has no encryption: all files are copy-only
+    PairVector pairs;
+    pairs.push_back(PairData(true, orig, crypt, L"password", L"", L"*", L"", 100, false, false, BothWays, false, false, false, true, false));
+    CFolderSync folderSync(fs);
+    folderSync.SetPairs(pairs);
+
+    CPathWatcher watcher;
+    watcher.SetEventFilter([&](const std::wstring& path) { return folderSync.IsSelfWrite(path); });
+    fs.SetChangeCallback([&](const MemoryFsChange& change) {
+        if (change.type == MemoryFsChangeType::Renamed)
+            watcher.AddChangedPath(change.oldPath);
+        watcher.AddChangedPath(change.path);
+    });
+    auto syncChanges = [&] {
+        // applies the scripted changes
+        PlatformFileInfo info;
+        fs.Stat(orig, info);
+        auto changed = watcher.GetChangedPaths();
+        EXPECT_FALSE(changed.empty());
+        for (const auto& path : changed)
+            EXPECT_TRUE(folderSync.SyncFile(path));
+        folderSync.FlushDeletes();
+    };
+    auto script = [&](MemoryFsChangeType type, const std::wstring& path, const std::string& content, const std::wstring& oldPath = {}) {
+        MemoryFsChange change;
+        change.type        = type;
+        change.path        = path;
+        change.oldPath     = oldPath;
+        change.content     = content;
+        change.atOperation = fs.GetStats().operations + 1;
+        fs.Script(change);
+    };
+
+    script(MemoryFsChangeType::Added, orig + L"\\docs\\a.txt", "first");
+    script(MemoryFsChangeType::Added, orig + L"\\b.txt", "b");
+    syncChanges();
+    std::string      content;
+    PlatformFileInfo origInfo;
+    PlatformFileInfo cryptInfo;
+    EXPECT_TRUE(fs.ReadContent(crypt + L"\\docs\\a.txt", content));
+    EXPECT_EQ(content, "first");
+    ASSERT_TRUE(fs.Stat(orig + L"\\docs\\a.txt", origInfo));
+    ASSERT_TRUE(fs.Stat(crypt + L"\\docs\\a.txt", cryptInfo));
+    EXPECT_EQ(cryptInfo.writeTime, origInfo.writeTime);
+    EXPECT_TRUE(fs.Stat(crypt + L"\\b.txt", cryptInfo));
+    // the copies are our own writes, the watcher doesn't report them
+    for (const auto& path : watcher.GetChangedPaths())
+        EXPECT_EQ(path.find(L".txt"), std::wstring::npos) << path.c_str();
+
+    script(MemoryFsChangeType::Modified, orig + L"\\docs\\a.txt", "second");
+    script(MemoryFsChangeType::Renamed, orig + L"\\c.txt", "", orig + L"\\b.txt");
+    syncChanges();
+    EXPECT_TRUE(fs.ReadContent(crypt + L"\\docs\\a.txt", content));
+    EXPECT_EQ(content, "second");
+    EXPECT_FALSE(fs.Stat(crypt + L"\\b.txt", cryptInfo));
+    EXPECT_TRUE(fs.ReadContent(crypt + L"\\c.txt", content));
+    EXPECT_EQ(content, "b");
+
+    // a file deleted in the encrypted folder is deleted in the original one
+    script(MemoryFsChangeType::Removed, crypt + L"\\docs\\a.txt", "");
+    syncChanges();
+    EXPECT_FALSE(fs.Stat(orig + L"\\docs\\a.txt", origInfo));
+    EXPECT_TRUE(fs.Stat(orig + L"\\c.txt", origInfo));
+
+    watcher.Stop();
+}
+
+/// the daemon reads its pairs from the test key and syncs folders in the temp folder
+class WatchDaemon : public Pairs
+{
+protected:
+    void SetUp() override
+    {
+        Pairs::SetUp();
+        wchar_t tempPath[MAX_PATH] = {};
+        GetTempPath(_countof(tempPath), tempPath);
+        m_root = CPathUtils::Append(tempPath, L"CryptSyncTestDaemon");
+        std::error_code ec;
+        std::filesystem::remove_all(m_root, ec);
+        for (const auto* name : {L"orig1", L"crypt1", L"orig2", L"crypt2"})
+            std::filesystem::create_directories(GetPath(name), ec);
+    }
+    void TearDown() override
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(m_root, ec);
+        Pairs::TearDown();
+    }
+
+    std::wstring GetPath(const std::wstring& name) const { return CPathUtils::Append(m_root, name); }
+
+    /// a pair that copies the files, no encryption needed to check the results
+    void AddPair(CTestPairs& pairs, const std::wstring& orig, const std::wstring& crypt) const
+    {
+        pairs.AddPair(true, GetPath(orig), GetPath(crypt), L"password", L"", L"*", L"", 100, false, false, SrcToDst, false, false, false, true, false);
+    }
+
+    void CreateTestFile(const std::wstring& name) const
+    {
+        CAutoFile  hFile   = CreateFile(GetPath(name).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
+        const char data[]  = "watch";
+        DWORD      written = 0;
+        ASSERT_TRUE(hFile.IsValid());
+        ASSERT_TRUE(WriteFile(hFile, data, sizeof(data), &written, nullptr));
+    }
+
+    bool Exists(const std::wstring& name) const { return GetFileAttributes(GetPath(name).c_str()) != INVALID_FILE_ATTRIBUTES; }
+
+    /// starts the daemon with the first pair and waits until its first scan copied a file.
+    /// The thread is always started: the tests stop and join it whatever fails
+    void StartDaemon(CWatchDaemon& daemon, std::thread& runner, int& ret) const
+    {
+        {
+            CTestPairs pairs;
+            AddPair(pairs, L"orig1", L"crypt1");
+            EXPECT_TRUE(pairs.SavePairs());
+        }
+        CreateTestFile(L"orig1\\first.txt");
+        runner = std::thread([&] { ret = daemon.Run(); });
+        EXPECT_TRUE(WaitFor([&] { return Exists(L"crypt1\\first.txt"); }, 10000));
+    }
+
+    std::wstring m_root;
+};
+
+TEST_F(WatchDaemon, reload_config)
+{
+    CWatchDaemon daemon(TestPairsKey);
+    std::thread  runner;
+    int          ret = -1;
+    CreateTestFile(L"orig2\\second.txt");
+    StartDaemon(daemon, runner, ret);
+    EXPECT_FALSE(Exists(L"crypt2\\second.txt"));
+
+    // the saved pair is picked up without a reload request, and the scan after the reload syncs it
+    {
+        CTestPairs pairs;
+        AddPair(pairs, L"orig2", L"crypt2");
+        EXPECT_TRUE(pairs.SavePairs());
+    }
+    const auto index = ReadValue(L"Index");
+    EXPECT_TRUE(WaitFor([&] { return Exists(L"crypt2\\second.txt"); }, 10000));
+    // the daemon never writes the pairs back
+    EXPECT_EQ(ReadValue(L"Index"), index);
+
+    daemon.Stop();
+    EXPECT_TRUE(daemon.WaitForStopped(10000));
+    runner.join();
+    EXPECT_EQ(ret, ErrorNone);
+    CTestPairs pairs;
+    EXPECT_EQ(pairs.size(), 2);
+}
+
+TEST_F(WatchDaemon, drain_on_stop)
+{
+    CWatchDaemon daemon(TestPairsKey);
+    std::thread  runner;
+    int          ret = -1;
+    StartDaemon(daemon, runner, ret);
+
+    // changed long before the next interval sync: only the drain can sync them
+    CreateTestFile(L"orig1\\second.txt");
+    CreateTestFile(L"orig1\\third.txt");
+    // the watcher needs a moment to see the changes
+    Sleep(500);
+    daemon.Stop();
+    EXPECT_TRUE(daemon.WaitForStopped(10000));
+    runner.join();
+    EXPECT_EQ(ret, ErrorNone);
+    EXPECT_TRUE(Exists(L"crypt1\\second.txt"));
+    EXPECT_TRUE(Exists(L"crypt1\\third.txt"));
+}
+
+TEST_F(WatchDaemon, drain_on_shutdown)
+{
+    CWatchDaemon daemon(TestPairsKey);
+    std::thread  runner;
+    int          ret = -1;
+    StartDaemon(daemon, runner, ret);
+
+    CreateTestFile(L"orig1\\second.txt");
+    Sleep(500);
+    // the console control handler waits only that long, then the process is gone
+    daemon.Stop(true);
+    EXPECT_TRUE(daemon.WaitForStopped(WATCHDAEMON_SHUTDOWN_WAIT_MS));
+    runner.join();
+    EXPECT_EQ(ret, ErrorNone);
+    EXPECT_TRUE(Exists(L"crypt1\\second.txt"));
+}
+
+TEST(PairRouter, route_paths)
+{
+    PairVector pairs;
+    pairs.push_back(PairData(true, L"C:\\Orig", L"D:\\Crypt", L"password", L"", L"", L"", 100, false, false, BothWays, false, false, false, true, false));
+    pairs.push_back(PairData(true, L"C:\\Orig\\Sub", L"\\\\?\\UNC\\server\\share", L"password", L"", L"", L"", 100, false, false, BothWays, false, false, false, true, false));
+    CPairRouter router(pairs);
+
+    std::vector<size_t> found;
+    auto                collect = [&](const PairRoute& route) { found.push_back(route.pairIndex); };
+    router.ForEachRoute(L"c:\\orig\\SUB\\file.txt", collect);
+    EXPECT_EQ(found, std::vector<size_t>({0, 1}));
+    found.clear();
+    router.ForEachRoute(L"\\\\server\\share\\file.txt", collect);
+    EXPECT_EQ(found, std::vector<size_t>({1}));
+    found.clear();
+    router.ForEachRoute(L"C:\\Orig", collect);
+    router.ForEachRoute(L"C:\\Original\\file.txt", collect);
+    EXPECT_TRUE(found.empty());
+}
+
+class CRecordingDeleteBackend : public IDeleteBackend
+{
+public:
+    std::vector<std::wstring> Delete(const std::vector<DeleteItem>& items) override
+    {
+        for (const auto& item : items)
+            deleted.push_back(item.path);
+        return {};
+    }
+    std::vector<std::wstring> deleted;
+};
+
+TEST(DeleteQueue, trash_path)
+{
+    EXPECT_TRUE(CDeleteQueue::IsTrashPath(L"C:\\Crypt\\.cryptsync-trash"));
+    EXPECT_TRUE(CDeleteQueue::IsTrashPath(L"C:\\Crypt\\.CryptSync-Trash\\20240101-120000\\file.txt"));
+    EXPECT_FALSE(CDeleteQueue::IsTrashPath(L"C:\\Crypt\\.cryptsync-trash2\\file.txt"));
+}
+
+TEST(DeleteQueue, collapse_directories)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring root   = CPathUtils::Append(tempPath, L"CryptSyncTestDeleteQueue");
+    std::wstring source = CPathUtils::Append(tempPath, L"CryptSyncTestDeleteQueueSource");
+    auto         names  = {L"\\folder\\a.txt", L"\\folder\\b.txt", L"\\emptied\\a.txt", L"\\emptied\\b.txt", L"\\keep\\a.txt", L"\\keep\\b.txt"};
+    CreateDirectory(root.c_str(), nullptr);
+    CreateDirectory(source.c_str(), nullptr);
+    for (auto dir : {L"\\folder", L"\\emptied", L"\\keep"})
+        CreateDirectory((root + dir).c_str(), nullptr);
+    for (auto name : names)
+        CAutoFile(CreateFile((root + name).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr));
+    // on the source side, "folder" was deleted but "emptied" only lost its files
+    CreateDirectory((source + L"\\emptied").c_str(), nullptr);
+    CreateDirectory((source + L"\\keep").c_str(), nullptr);
+
+    auto         backend  = std::make_unique<CRecordingDeleteBackend>();
+    auto*        pBackend = backend.get();
+    CDeleteQueue queue;
+    queue.SetBackend(std::move(backend));
+    for (auto name : {L"\\folder\\a.txt", L"\\folder\\b.txt", L"\\emptied\\a.txt", L"\\emptied\\b.txt", L"\\keep\\a.txt"})
+        queue.Add(root + name, root, source + name);
+    EXPECT_EQ(queue.Flush(), 0);
+    std::sort(pBackend->deleted.begin(), pBackend->deleted.end());
+    EXPECT_EQ(pBackend->deleted, std::vector<std::wstring>({root + L"\\emptied\\a.txt", root + L"\\emptied\\b.txt", root + L"\\folder", root + L"\\keep\\a.txt"}));
+
+    // without a counterpart, the folder is never deleted as a whole
+    pBackend->deleted.clear();
+    queue.Add(root + L"\\folder\\a.txt", root);
+    queue.Add(root + L"\\folder\\b.txt", root);
+    EXPECT_EQ(queue.Flush(), 0);
+    std::sort(pBackend->deleted.begin(), pBackend->deleted.end());
+    EXPECT_EQ(pBackend->deleted, std::vector<std::wstring>({root + L"\\folder\\a.txt", root + L"\\folder\\b.txt"}));
+
+    for (auto name : names)
+        DeleteFile((root + name).c_str());
+    for (auto dir : {L"\\folder", L"\\emptied", L"\\keep"})
+    {
+        RemoveDirectory((root + dir).c_str());
+        RemoveDirectory((source + dir).c_str());
+    }
+    RemoveDirectory(root.c_str());
+    RemoveDirectory(source.c_str());
+}
+
+TEST(Throttle, volume_key)
+{
+    EXPECT_EQ(CThrottle::GetVolumeKey(L"C:\\Original\\file.txt"), L"c:");
+    EXPECT_EQ(CThrottle::GetVolumeKey(L"\\\\?\\D:\\Crypt\\file.txt"), L"d:");
+    EXPECT_EQ(CThrottle::GetVolumeKey(L"\\\\Server\\Share\\folder\\file.txt"), L"\\\\server\\share");
+    EXPECT_EQ(CThrottle::GetVolumeKey(L"\\\\?\\UNC\\Server\\Share\\file.txt"), L"\\\\server\\share");
+}
+
+TEST(Throttle, token_bucket)
+{
+    CTokenBucket bucket;
+    EXPECT_EQ(bucket.Take(1000000, 0), 0); // unlimited
+
+    bucket.SetRate(1000, 0);
+    EXPECT_EQ(bucket.Take(500, 0), 0);
+    EXPECT_EQ(bucket.Take(500, 0), 0);
+    // 100 tokens in debt at one token per ms
+    EXPECT_EQ(bucket.Take(100, 0), 101);
+    // refilled by 200 tokens in the meantime
+    EXPECT_EQ(bucket.Take(99, 200), 0);
+    // the bucket never holds more than one second worth of tokens
+    EXPECT_EQ(bucket.Take(1000, 100000), 0);
+    EXPECT_GT(bucket.Take(1, 100000), 0);
+}
+
+TEST(CopyEngine, copy_and_skip)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring src = CPathUtils::Append(tempPath, L"CryptSyncTestCopySrc.txt");
+    std::wstring dst = CPathUtils::Append(tempPath, L"CryptSyncTestCopyDst.txt");
+    {
+        CAutoFile hFile   = CreateFile(src.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
+        DWORD     written = 0;
+        WriteFile(hFile, "CryptSync", 9, &written, nullptr);
+    }
+
+    CCopyEngine engine;
+    EXPECT_TRUE(engine.Copy(src, dst));
+    EXPECT_NE(engine.GetLastMethod(), CopyMethod::Skipped);
+    EXPECT_TRUE(engine.HasSameContent(src, dst));
+
+    // same content with a different time: copied again unless the content is compared
+    FILETIME ft = {0x12345678, 0x01d00000};
+    {
+        CAutoFile hFile = CreateFile(dst.c_str(), FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        SetFileTime(hFile, nullptr, nullptr, &ft);
+    }
+    EXPECT_TRUE(engine.Copy(src, dst));
+    EXPECT_NE(engine.GetLastMethod(), CopyMethod::Skipped);
+    {
+        CAutoFile hFile = CreateFile(dst.c_str(), FILE_WRITE_ATTRIBUTES, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        SetFileTime(hFile, nullptr, nullptr, &ft);
+    }
+    // with the comparison, only the time is set
+    engine.SetCompareContent(true);
+    EXPECT_TRUE(engine.Copy(src, dst));
+    EXPECT_EQ(engine.GetLastMethod(), CopyMethod::Skipped);
+    WIN32_FILE_ATTRIBUTE_DATA srcData = {};
+    WIN32_FILE_ATTRIBUTE_DATA dstData = {};
+    GetFileAttributesEx(src.c_str(), GetFileExInfoStandard, &srcData);
+    GetFileAttributesEx(dst.c_str(), GetFileExInfoStandard, &dstData);
+    EXPECT_EQ(CompareFileTime(&srcData.ftLastWriteTime, &dstData.ftLastWriteTime), 0);
+
+    DeleteFile(src.c_str());
+    DeleteFile(dst.c_str());
+}
+
+TEST(Unbuffered, write_and_read)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring path = CPathUtils::Append(tempPath, L"CryptSyncTestUnbuffered.bin");
+
+    // the last block is only partly used and not aligned to the sector size
+    std::vector<BYTE> data(UnbufferedBlockSize * 2 + UnbufferedBlockSize / 2 + 123);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<BYTE>(i * 7 + i / 4099);
+    {
+        CAutoFile hFile = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | UnbufferedWriteFlags, nullptr);
+        ASSERT_TRUE(hFile.IsValid());
+        UnbufferedWriter writer(hFile);
+        UInt32           written = 0;
+        for (size_t pos = 0; pos < data.size(); pos += 1000)
+        {
+            UInt32 size = static_cast<UInt32>(std::min<size_t>(1000, data.size() - pos));
+            EXPECT_EQ(writer.Write(data.data() + pos, size, &written), S_OK);
+            EXPECT_EQ(written, size);
+        }
+        // like the 7z header, which is written last
+        memcpy(data.data(), "CryptSync", 9);
+        EXPECT_EQ(writer.Seek(0, FILE_BEGIN, nullptr), S_OK);
+        EXPECT_EQ(writer.Write("CryptSync", 9, &written), S_OK);
+        EXPECT_EQ(writer.Finish(), S_OK);
+    }
+
+    UnbufferedReader reader;
+    ASSERT_TRUE(reader.Open(path));
+    EXPECT_EQ(reader.GetSize(), data.size());
+    std::vector<BYTE> readData(data.size());
+    UInt32            read = 0;
+    for (size_t pos = 0; pos < readData.size(); pos += read)
+    {
+        EXPECT_EQ(reader.Read(readData.data() + pos, 3000, &read), S_OK);
+        ASSERT_GT(read, 0);
+    }
+    EXPECT_EQ(readData, data);
+    EXPECT_EQ(reader.Read(readData.data(), 3000, &read), S_OK);
+    EXPECT_EQ(read, 0);
+
+    BYTE buffer[200] = {};
+    EXPECT_EQ(reader.Seek(-100, FILE_END, nullptr), S_OK);
+    EXPECT_EQ(reader.Read(buffer, sizeof(buffer), &read), S_OK);
+    EXPECT_EQ(read, 100);
+    EXPECT_EQ(memcmp(buffer, data.data() + data.size() - 100, 100), 0);
+    EXPECT_EQ(reader.Seek(5, FILE_BEGIN, nullptr), S_OK);
+    EXPECT_EQ(reader.Read(buffer, 4, &read), S_OK);
+    EXPECT_EQ(memcmp(buffer, "Sync", 4), 0);
+
+    DeleteFile(path.c_str());
+}
+
+// run with --gtest_also_run_disabled_tests --gtest_filter=Unbuffered.DISABLED_benchmark
+TEST(Unbuffered, DISABLED_benchmark)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring src     = CPathUtils::Append(tempPath, L"CryptSyncBenchmark.bin");
+    std::wstring archive = CPathUtils::Append(tempPath, L"CryptSyncBenchmark.7z");
+    std::wstring target  = CPathUtils::Append(tempPath, L"CryptSyncBenchmark");
+
+    // random data, so the benchmark measures the I/O and not the compression
+    constexpr UInt64 fileSize = 2048ULL * 1024 * 1024;
+    {
+        CAutoFile         hFile  = CreateFile(src.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
+        std::vector<BYTE> buffer(COPYENGINE_BUFFER_SIZE);
+        UInt64            random = 88172645463325252ULL;
+        for (UInt64 written = 0; written < fileSize; written += buffer.size())
+        {
+            for (auto& b : buffer)
+            {
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                b = static_cast<BYTE>(random);
+            }
+            DWORD bytes = 0;
+            ASSERT_TRUE(WriteFile(hFile, buffer.data(), static_cast<DWORD>(buffer.size()), &bytes, nullptr));
+        }
+    }
+
+    auto cacheSize = []() -> LONGLONG {
+        PERFORMANCE_INFORMATION perfInfo = {sizeof(perfInfo)};
+        GetPerformanceInfo(&perfInfo, sizeof(perfInfo));
+        return static_cast<LONGLONG>(perfInfo.SystemCache * perfInfo.PageSize);
+    };
+    auto mbPerSec = [&](std::chrono::steady_clock::duration duration) {
+        return static_cast<double>(fileSize) / 1024.0 / 1024.0 / std::chrono::duration<double>(duration).count();
+    };
+
+    // the buffered run goes first: the source file is still in the cache from
+    // writing it, which favors the buffered path if anything
+    for (UInt64 threshold : {0ULL, 1ULL})
+    {
+        WIN32_FILE_ATTRIBUTE_DATA fileInfo = {};
+        GetFileAttributesEx(src.c_str(), GetFileExInfoStandard, &fileInfo);
+        FilePathInfo fpi;
+        fpi.FilePath       = src;
+        fpi.FileName       = L"CryptSyncBenchmark.bin";
+        fpi.Attributes     = fileInfo.dwFileAttributes;
+        fpi.CreationTime   = fileInfo.ftCreationTime;
+        fpi.IsDirectory    = false;
+        fpi.LastAccessTime = fileInfo.ftLastAccessTime;
+        fpi.LastWriteTime  = fileInfo.ftLastWriteTime;
+        fpi.Size           = fileSize;
+
+        auto  cacheStart = cacheSize();
+        auto  start      = std::chrono::steady_clock::now();
+        C7Zip compressor;
+        compressor.SetPassword(L"password");
+        compressor.SetArchivePath(archive);
+        compressor.SetCompressionFormat(CompressionFormat::SevenZip, 0);
+        compressor.SetUnbufferedThreshold(threshold);
+        ASSERT_TRUE(compressor.AddFile(fpi));
+        auto encryptTime  = std::chrono::steady_clock::now() - start;
+        auto encryptCache = cacheSize() - cacheStart;
+
+        cacheStart = cacheSize();
+        start      = std::chrono::steady_clock::now();
+        C7Zip extractor;
+        extractor.SetPassword(L"password");
+        extractor.SetArchivePath(archive);
+        extractor.SetCompressionFormat(CompressionFormat::SevenZip, 9);
+        extractor.SetUnbufferedThreshold(threshold);
+        ASSERT_TRUE(extractor.Extract(target));
+        auto decryptTime  = std::chrono::steady_clock::now() - start;
+        auto decryptCache = cacheSize() - cacheStart;
+
+        printf("%s: encrypt %.0f MB/s, cache %+lld MB; decrypt %.0f MB/s, cache %+lld MB\n", threshold ? "unbuffered" : "buffered  ",
+               mbPerSec(encryptTime), encryptCache / (1024 * 1024), mbPerSec(decryptTime), decryptCache / (1024 * 1024));
+
+        DeleteFile(archive.c_str());
+        DeleteFile(CPathUtils::Append(target, fpi.FileName).c_str());
+    }
+    RemoveDirectory(target.c_str());
+    DeleteFile(src.c_str());
+}
+
+TEST(DirectoryCache, create_and_invalidate)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring root  = CPathUtils::Append(tempPath, L"CryptSyncTestDirCache");
+    std::wstring inner = CPathUtils::Append(root, L"a\\b");
+
+    CDirectoryCache cache;
+    EXPECT_TRUE(cache.Create(inner));
+    EXPECT_TRUE(PathIsDirectory(inner.c_str()));
+    // the temp folder, root, a and a\b
+    auto size = cache.GetSize();
+    EXPECT_GE(size, 3);
+    // known folders are not created again
+    EXPECT_TRUE(cache.Create(inner + L"\\"));
+    EXPECT_EQ(cache.GetSize(), size);
+
+    RemoveDirectory(inner.c_str());
+    RemoveDirectory(CPathUtils::Append(root, L"a").c_str());
+    // invalidating a folder drops everything below it as well
+    cache.Invalidate(CPathUtils::Append(root, L"A"));
+    EXPECT_EQ(cache.GetSize(), size - 2);
+    EXPECT_TRUE(cache.Create(inner));
+    EXPECT_TRUE(PathIsDirectory(inner.c_str()));
+
+    RemoveDirectory(inner.c_str());
+    RemoveDirectory(CPathUtils::Append(root, L"a").c_str());
+    RemoveDirectory(root.c_str());
+}
+
+TEST(C7Zip, extract_temp_paths)
+{
+    std::wstring path  = L"C:\\data\\report.docx";
+    std::wstring temp1 = C7Zip::GetExtractTempPath(path);
+    std::wstring temp2 = C7Zip::GetExtractTempPath(path);
+    EXPECT_NE(temp1, temp2);
+    EXPECT_EQ(temp1.compare(0, path.size(), path), 0);
+    EXPECT_TRUE(C7Zip::IsExtractTempPath(temp1));
+    EXPECT_TRUE(C7Zip::IsExtractTempPath(temp2));
+    EXPECT_FALSE(C7Zip::IsExtractTempPath(path));
+    // files of the user that only look similar are synced
+    EXPECT_FALSE(C7Zip::IsExtractTempPath(L"C:\\data\\report.cstmp"));
+    EXPECT_FALSE(C7Zip::IsExtractTempPath(L"C:\\data\\report.docx.cstmp-backup"));
+    EXPECT_FALSE(C7Zip::IsExtractTempPath(L"C:\\data\\report.docx.cstmp-notanid!"));
+    // the suffix only adds a few characters to the path
+    EXPECT_EQ(temp1.size(), path.size() + wcslen(ExtractTempMarker) + ExtractTempIdLength);
+}
+
+TEST(Resumable, continue_from_checkpoint)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring src     = CPathUtils::Append(tempPath, L"CryptSyncTestResume.bin");
+    std::wstring archive = CPathUtils::Append(tempPath, L"CryptSyncTestResume.7z");
+    std::wstring target  = CPathUtils::Append(tempPath, L"CryptSyncTestResume");
+
+    // the last block is not a multiple of the AES block size
+    std::vector<BYTE> data(5 * 1024 * 1024 + 5);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<BYTE>(i * 13 + i / 1021);
+    {
+        CAutoFile hFile = CreateFile(src.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
+        ASSERT_TRUE(hFile.IsValid());
+        DWORD written = 0;
+        ASSERT_TRUE(WriteFile(hFile, data.data(), static_cast<DWORD>(data.size()), &written, nullptr));
+    }
+    WIN32_FILE_ATTRIBUTE_DATA fileInfo = {};
+    GetFileAttributesEx(src.c_str(), GetFileExInfoStandard, &fileInfo);
+    FilePathInfo fpi;
+    fpi.FilePath       = src;
+    fpi.FileName       = L"CryptSyncTestResume.bin";
+    fpi.Attributes     = fileInfo.dwFileAttributes;
+    fpi.CreationTime   = fileInfo.ftCreationTime;
+    fpi.IsDirectory    = false;
+    fpi.LastAccessTime = fileInfo.ftLastAccessTime;
+    fpi.LastWriteTime  = fileInfo.ftLastWriteTime;
+    fpi.Size           = data.size();
+
+    std::wstring partial    = C7Zip::GetResumePartialPath(archive);
+    std::wstring checkpoint = C7Zip::GetResumeCheckpointPath(archive);
+    EXPECT_TRUE(C7Zip::IsResumeTempPath(partial));
+    EXPECT_TRUE(C7Zip::IsResumeTempPath(checkpoint));
+    EXPECT_FALSE(C7Zip::IsResumeTempPath(archive));
+    EXPECT_FALSE(C7Zip::IsResumeTempPath(archive + L".cspart"));
+    EXPECT_FALSE(C7Zip::IsResumeTempPath(archive + L".cscheckpoint"));
+
+    // stop after 3 MB, like Stop() would
+    for (UInt64 stopAt : {3ULL * 1024 * 1024, 0ULL})
+    {
+        C7Zip compressor;
+        compressor.SetPassword(L"password");
+        compressor.SetArchivePath(partial);
+        compressor.SetCompressionFormat(CompressionFormat::SevenZip, 0);
+        compressor.SetCheckpointFile(checkpoint, 1024 * 1024);
+        compressor.SetCallback([&](UInt64 pos, UInt64, const std::wstring&) {
+            return (stopAt && pos >= stopAt) ? E_ABORT : S_OK;
+        });
+        if (stopAt)
+        {
+            EXPECT_FALSE(compressor.AddFile(fpi));
+            EXPECT_TRUE(PathFileExists(checkpoint.c_str()));
+        }
+        else
+        {
+            ASSERT_TRUE(compressor.AddFile(fpi));
+            EXPECT_EQ(compressor.GetResumedSize(), 3ULL * 1024 * 1024);
+            EXPECT_FALSE(PathFileExists(checkpoint.c_str()));
+        }
+    }
+
+    C7Zip extractor;
+    extractor.SetPassword(L"password");
+    extractor.SetArchivePath(partial);
+    extractor.SetCompressionFormat(CompressionFormat::SevenZip, 9);
+    ASSERT_TRUE(extractor.Extract(target));
+    std::wstring      extracted = CPathUtils::Append(target, fpi.FileName);
+    std::vector<BYTE> readData(data.size() + 1);
+    {
+        CAutoFile hFile = CreateFile(extracted.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+        ASSERT_TRUE(hFile.IsValid());
+        DWORD read = 0;
+        ASSERT_TRUE(ReadFile(hFile, readData.data(), static_cast<DWORD>(readData.size()), &read, nullptr));
+        readData.resize(read);
+    }
+    EXPECT_EQ(readData, data);
+
+    // a different password doesn't match the checkpoint: the encryption starts over
+    {
+        C7Zip compressor;
+        compressor.SetPassword(L"password");
+        compressor.SetArchivePath(partial);
+        compressor.SetCompressionFormat(CompressionFormat::SevenZip, 0);
+        compressor.SetCheckpointFile(checkpoint, 1024 * 1024);
+        compressor.SetCallback([](UInt64 pos, UInt64, const std::wstring&) {
+            return pos >= 2 * 1024 * 1024 ? E_ABORT : S_OK;
+        });
+        EXPECT_FALSE(compressor.AddFile(fpi));
+        compressor.SetPassword(L"other");
+        compressor.SetCallback(nullptr);
+        ASSERT_TRUE(compressor.AddFile(fpi));
+        EXPECT_EQ(compressor.GetResumedSize(), 0ULL);
+    }
+
+    DeleteFile(extracted.c_str());
+    RemoveDirectory(target.c_str());
+    DeleteFile(partial.c_str());
+    DeleteFile(src.c_str());
+}
+
+// the temp files of resumable encryptions that can't be continued anymore don't
+// stay forever, and don't keep their folder from being deleted
+TEST(Resumable, remove_stale_files)
+{
+    CMemoryFileSystem  fs;
+    const std::wstring orig  = L"X:\\CryptSyncResume\\orig";
+    const std::wstring crypt = L"X:\\CryptSyncResume\\crypt";
+    ASSERT_TRUE(fs.MakeDirs(orig));
+    ASSERT_TRUE(fs.MakeDirs(crypt + L"\\gone"));
+    auto addResumeFiles = [&](const std::wstring& archive) {
+        ASSERT_TRUE(fs.WriteContent(C7Zip::GetResumePartialPath(archive), "partial"));
+        ASSERT_TRUE(fs.WriteContent(C7Zip::GetResumeCheckpointPath(archive), "checkpoint"));
+    };
+    auto hasResumeFiles = [&](const std::wstring& archive) {
+        PlatformFileInfo info;
+        return fs.Stat(C7Zip::GetResumePartialPath(archive), info) || fs.Stat(C7Zip::GetResumeCheckpointPath(archive), info);
+    };
+    // a source file that's too small to be encrypted resumably, whatever the threshold is
+    ASSERT_TRUE(fs.WriteContent(orig + L"\\small.txt", "small"));
+    addResumeFiles(crypt + L"\\small.txt");
+    // and one whose source folder is gone
+    ASSERT_TRUE(fs.WriteContent(crypt + L"\\gone\\file.txt", "gone"));
+    addResumeFiles(crypt + L"\\gone\\file.txt");
+
+    // the memory file system has no encryption: all files are copy-only
+    PairVector pairs;
+    pairs.push_back(PairData(true, orig, crypt, L"password", L"", L"*", L"", 100, false, false, SrcToDst, false, false, false, true, false));
+    CFolderSync folderSync(fs);
+    folderSync.SetPairs(pairs);
+    EXPECT_EQ(folderSync.SyncFoldersWait(pairs), ErrorNone);
+    PlatformFileInfo info;
+    EXPECT_TRUE(fs.Stat(crypt + L"\\small.txt", info));
+    EXPECT_FALSE(hasResumeFiles(crypt + L"\\small.txt"));
+    EXPECT_FALSE(hasResumeFiles(crypt + L"\\gone\\file.txt"));
+    EXPECT_FALSE(fs.Stat(crypt + L"\\gone", info));
+
+    // a deleted source file takes the temp files of its encryption with it
+    ASSERT_TRUE(fs.WriteContent(orig + L"\\deleted.txt", "deleted"));
+    ASSERT_TRUE(fs.Copy(orig + L"\\deleted.txt", crypt + L"\\deleted.txt"));
+    addResumeFiles(crypt + L"\\deleted.txt");
+    ASSERT_TRUE(fs.Remove(orig + L"\\deleted.txt"));
+    EXPECT_TRUE(folderSync.SyncFile(orig + L"\\deleted.txt"));
+    folderSync.FlushDeletes();
+    EXPECT_FALSE(fs.Stat(crypt + L"\\deleted.txt", info));
+    EXPECT_FALSE(hasResumeFiles(crypt + L"\\deleted.txt"));
+}
+
+TEST(MemoryGovernor, reserve_and_release)
+{
+    auto& governor = MemoryGovernor::Instance();
+    governor.SetBudget(100);
+    governor.ResetPeak();
+    {
+        MemoryReservation first;
+        MemoryReservation second;
+        MemoryReservation third;
+        EXPECT_TRUE(first.TryReserve(60));
+        EXPECT_TRUE(second.TryReserve(40));
+        EXPECT_FALSE(third.TryReserve(1));
+        EXPECT_FALSE(third.Reserve(1, 10));
+        EXPECT_EQ(governor.GetReserved(), 100ULL);
+        second.Release();
+        EXPECT_TRUE(third.Reserve(30, 10));
+        EXPECT_EQ(governor.GetReserved(), 90ULL);
+    }
+    EXPECT_EQ(governor.GetReserved(), 0ULL);
+    EXPECT_EQ(governor.GetPeak(), 100ULL);
+    {
+        // a reservation bigger than the budget only gets through alone
+        MemoryReservation big;
+        EXPECT_TRUE(big.TryReserve(500));
+        MemoryReservation other;
+        EXPECT_FALSE(other.TryReserve(1));
+    }
+    governor.SetBudget(0);
+    EXPECT_GT(governor.GetBudget(), 0ULL);
+
+    EXPECT_EQ(ParseDictionarySize(L"LZMA2:24 7zAES:19"), 1U << 24);
+    EXPECT_EQ(ParseDictionarySize(L"LZMA:1536k"), 1536U * 1024);
+    EXPECT_EQ(ParseDictionarySize(L"PPMD:o6:mem24"), 1U << 24);
+    EXPECT_EQ(ParseDictionarySize(L"Copy 7zAES:19"), 0U);
+    EXPECT_EQ(GetDefaultDictionarySize(9), 64U * 1024 * 1024);
+    // level 9 with 64 MB needs several hundred MB per encoder, more with more threads
+    EXPECT_GT(EstimateEncoderMemory(9, 0, 1), 500ULL * 1024 * 1024);
+    EXPECT_GT(EstimateEncoderMemory(9, 0, 8), EstimateEncoderMemory(9, 0, 2));
+    EXPECT_LT(EstimateEncoderMemory(9, 4 * 1024 * 1024, 2), EstimateEncoderMemory(9, 0, 2));
+}
+
+// run with --gtest_also_run_disabled_tests --gtest_filter=SyncBench.DISABLED_engine
+// CRYPTSYNC_BENCH changes the tree, e.g. "files=100000,maxsize=65536", see BenchTreeSettings::Parse().
+// The JSON report is written to CRYPTSYNC_BENCH_REPORT, or SyncBench-engine.json in the current folder.
+TEST(SyncBench, DISABLED_engine)
+{
+    wchar_t tempPath[MAX_PATH] = {};
+    GetTempPath(_countof(tempPath), tempPath);
+    std::wstring    root = CPathUtils::Append(tempPath, L"CryptSyncBench");
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+
+    BenchTreeSettings settings;
+    settings.Parse(CPlatform::GetEnvironment(L"CRYPTSYNC_BENCH"));
+    CBenchReport report("engine", settings);
+    auto         sync = [&](const std::wstring& origRoot, const std::wstring& cryptRoot, bool decryptOnly, BenchResult& result) {
+        PairVector pairs;
+        pairs.push_back(PairData(true, origRoot, cryptRoot, L"password", L"", L"", L"", 100, true, true, BothWays, true, false, false, true, false));
+
+        // a dry run first: it scans and plans, and its plan has the transfers and bytes of the sync
+        CBenchTimer timer;
+        CFolderSync planner;
+        planner.DecryptOnly(decryptOnly);
+        planner.DryRun(true);
+        planner.SyncFoldersWait(pairs);
+        result.phases.push_back({"plan", timer.Lap()});
+        const auto& plan     = planner.GetPlanReport();
+        auto        totalPos = plan.rfind(L" actions, ");
+        if (totalPos != std::wstring::npos)
+        {
+            unsigned long long actions   = 0;
+            unsigned long long transfers = 0;
+            unsigned long long bytes     = 0;
+            totalPos                     = plan.find_last_of('\n', totalPos);
+            swscanf_s(plan.c_str() + (totalPos == std::wstring::npos ? 0 : totalPos + 1), L"%llu actions, %llu transfers, %llu bytes", &actions, &transfers, &bytes);
+            result.transfers = transfers;
+            result.bytes     = bytes;
+        }
+
+        CFolderSync foldersync;
+        foldersync.DecryptOnly(decryptOnly);
+        auto ret       = foldersync.SyncFoldersWait(pairs);
+        result.seconds = timer.Lap();
+        result.phases.push_back({"sync", result.seconds});
+        return ret == ErrorNone;
+    };
+    EXPECT_TRUE(RunBenchSuite(CFileSystem::Native(), root, settings, sync, report));
+    std::filesystem::remove_all(root, ec);
+
+    auto reportPath = CPlatform::GetEnvironment(L"CRYPTSYNC_BENCH_REPORT");
+    EXPECT_TRUE(report.Save(CFileSystem::Native(), reportPath.empty() ? L"SyncBench-engine.json" : reportPath));
+    printf("%s", report.ToJson().c_str());
+}
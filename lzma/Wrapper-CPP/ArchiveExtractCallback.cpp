@@ -21,7 +21,7 @@
 //   ./CPP/7zip/UI/Client7z/Client7z.cpp
 #include "StdAfx.h"
 #include "ArchiveExtractCallback.h"
-#include "OutStreamWrapper.h"
+#include "C7Zip.h"
 #include "Helper.h"
 #include <comdef.h>
 #include <Shlwapi.h>
@@ -31,17 +31,32 @@ namespace SevenZip
 {
 const std::wstring EmptyFileAlias = L"[Content]";
 
+// the attributes stored in an archive which can be set on a file
+constexpr DWORD SettableAttributes = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE |
+                                     FILE_ATTRIBUTE_TEMPORARY | FILE_ATTRIBUTE_OFFLINE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+
 ArchiveExtractCallback::ArchiveExtractCallback(const CMyComPtr<IInArchive>& archiveHandler, const std::wstring& directory, const std::wstring& password)
     : CallbackBase()
     , m_refCount(0)
     , m_archiveHandler(archiveHandler)
     , m_directory(directory)
+    , m_isDir(false)
+    , m_hasAttrib(false)
+    , m_attrib(0)
+    , m_hasModifiedTime(false)
+    , m_modifiedTime{}
+    , m_hasNewFileSize(false)
+    , m_newFileSize(0)
+    , m_hasForcedModifiedTime(false)
+    , m_forcedModifiedTime{}
 {
     SetPassword(password);
 }
 
 ArchiveExtractCallback::~ArchiveExtractCallback()
 {
+    // the extraction got aborted while a file was written
+    DiscardTempFile();
 }
 
 STDMETHODIMP ArchiveExtractCallback::QueryInterface(REFIID iid, void** ppvObject)
@@ -137,22 +152,48 @@ STDMETHODIMP ArchiveExtractCallback::GetStream(UInt32 index, ISequentialOutStrea
     if (m_isDir)
     {
         // Creating the directory here supports having empty directories.
-        CreateRecursiveDirectory(m_absPath);
+        CreateDirectoryCached(m_absPath);
         *outStream = NULL;
         return S_OK;
     }
 
-    std::wstring absDir = PathIsDirectory(m_absPath.c_str()) ? m_absPath : m_absPath.substr(0, m_absPath.find_last_of('\\'));
-    CreateRecursiveDirectory(absDir);
-
-    CMyComPtr<IStream> fileStream;
-    if (FAILED(SHCreateStreamOnFileEx(m_absPath.c_str(), STGM_CREATE | STGM_WRITE, FILE_ATTRIBUTE_NORMAL, TRUE, NULL, &fileStream)))
+    CreateDirectoryCached(m_absPath.substr(0, m_absPath.find_last_of('\\')));
+
+    // the file is written to a temp file first which replaces the
+    // destination file only once it is complete and its CRC matched:
+    // a failed or cancelled extraction leaves an existing file as it was.
+    DiscardTempFile();
+    m_tempPath        = C7Zip::GetExtractTempPath(m_absPath);
+    // big files would only push everything else out of the file system cache
+    bool   unbuffered = m_hasNewFileSize && (m_unbufferedThreshold > 0) && (m_newFileSize >= m_unbufferedThreshold);
+    HANDLE hFile      = CreateFile(m_tempPath.c_str(), unbuffered ? GENERIC_READ | GENERIC_WRITE : GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                                   unbuffered ? FILE_ATTRIBUTE_NORMAL | UnbufferedWriteFlags : FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        m_tempPath.clear();
+        return hr;
+    }
+    if (m_hasNewFileSize && (m_newFileSize > 0))
     {
-        return HRESULT_FROM_WIN32(GetLastError());
+        // reserve the space for the whole file up front so the file system
+        // can allocate it in one piece. This is only a hint: if it fails,
+        // the file just grows as it's written.
+        FILE_ALLOCATION_INFO allocInfo    = {};
+        allocInfo.AllocationSize.QuadPart = static_cast<LONGLONG>(m_newFileSize);
+        SetFileInformationByHandle(hFile, FileAllocationInfo, &allocInfo, sizeof(allocInfo));
     }
 
-    CMyComPtr<OutStreamWrapper> wrapperStream = new OutStreamWrapper(fileStream);
-    *outStream                                = wrapperStream.Detach();
+    // keep a reference to the stream: the file is closed in SetOperationResult()
+    m_outFileStream = new OutStreamWrapper(hFile, unbuffered);
+    if (m_ioCallback)
+    {
+        m_outFileStream->SetIoCallback([ioCallback = m_ioCallback, path = m_absPath](UInt64 size) {
+            ioCallback(path, size, true);
+        });
+    }
+    *outStream = m_outFileStream;
+    (*outStream)->AddRef();
 
     m_progressPath = m_absPath;
     if (m_callback)
@@ -166,7 +207,7 @@ STDMETHODIMP ArchiveExtractCallback::PrepareOperation(Int32 /*askExtractMode*/)
     return S_OK;
 }
 
-STDMETHODIMP ArchiveExtractCallback::SetOperationResult(Int32 /*operationResult*/)
+STDMETHODIMP ArchiveExtractCallback::SetOperationResult(Int32 operationResult)
 {
     if (m_absPath.empty())
     {
@@ -175,19 +216,43 @@ STDMETHODIMP ArchiveExtractCallback::SetOperationResult(Int32 /*operationResult*
         return S_OK;
     }
 
-    if (m_hasModifiedTime)
+    if ((m_outFileStream != nullptr) && (operationResult != NArchive::NExtract::NOperationResult::kOK))
     {
-        HANDLE fileHandle = CreateFile(m_absPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (fileHandle != INVALID_HANDLE_VALUE)
+        // CRC error, wrong password, ...: the destination file is left untouched
+        DiscardTempFile();
+        return E_FAIL;
+    }
+    if (m_outFileStream != nullptr)
+    {
+        // set the file times and attributes on the still open file
+        // instead of opening it again after it got closed
+        const FILETIME* modifiedTime = nullptr;
+        if (m_hasForcedModifiedTime)
+            modifiedTime = &m_forcedModifiedTime;
+        else if (m_hasModifiedTime)
+            modifiedTime = &m_modifiedTime;
+        DWORD attrib = 0;
+        if (m_hasAttrib)
         {
-            SetFileTime(fileHandle, NULL, NULL, &m_modifiedTime);
-            CloseHandle(fileHandle);
+            attrib = m_attrib & SettableAttributes;
+            if (attrib == 0)
+                attrib = FILE_ATTRIBUTE_NORMAL;
         }
+        m_outFileStream->SetFileInfo(nullptr, nullptr, modifiedTime, attrib);
+        HRESULT hr = m_outFileStream->Close();
+        m_outFileStream.Release();
+        if (SUCCEEDED(hr) && !MoveFileEx(m_tempPath.c_str(), m_absPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        if (FAILED(hr))
+        {
+            DiscardTempFile();
+            return hr;
+        }
+        m_tempPath.clear();
     }
-
-    if (m_hasAttrib)
+    else if (m_isDir && m_hasAttrib)
     {
-        SetFileAttributes(m_absPath.c_str(), m_attrib);
+        SetFileAttributes(m_absPath.c_str(), m_attrib & SettableAttributes);
     }
 
     m_progressPath = m_absPath;
@@ -336,4 +401,31 @@ void ArchiveExtractCallback::GetPropertySize(UInt32 index)
 
     m_hasNewFileSize = true;
 }
+
+bool ArchiveExtractCallback::CreateDirectoryCached(const std::wstring& dir)
+{
+    if (m_createDirectory)
+        return m_createDirectory(dir);
+    if (m_createdDirs.find(dir) != m_createdDirs.end())
+        return true;
+    // CreateRecursiveDirectory() fails if the directory already exists
+    if (!CreateRecursiveDirectory(dir) && !PathIsDirectory(dir.c_str()))
+        return false;
+    m_createdDirs.insert(dir);
+    return true;
+}
+
+void ArchiveExtractCallback::DiscardTempFile()
+{
+    if (m_outFileStream != nullptr)
+    {
+        m_outFileStream->Close();
+        m_outFileStream.Release();
+    }
+    if (!m_tempPath.empty())
+    {
+        DeleteFile(m_tempPath.c_str());
+        m_tempPath.clear();
+    }
+}
 }
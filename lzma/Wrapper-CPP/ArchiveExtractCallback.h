@@ -21,11 +21,13 @@
 //   ./CPP/7zip/UI/Client7z/Client7z.cpp
 #pragma once
 #include "CallbackBase.h"
+#include "OutStreamWrapper.h"
 #include "../CPP/7zip/Archive/IArchive.h"
 #include "../CPP/7zip/IPassword.h"
 #include "../CPP/Common/MyCom.h"
 
 #include <string>
+#include <set>
 
 namespace SevenZip
 {
@@ -40,6 +42,7 @@ private:
 
     std::wstring m_relPath;
     std::wstring m_absPath;
+    std::wstring m_tempPath;
     bool         m_isDir;
 
     bool   m_hasAttrib;
@@ -51,10 +54,29 @@ private:
     bool   m_hasNewFileSize;
     UInt64 m_newFileSize;
 
+    bool     m_hasForcedModifiedTime;
+    FILETIME m_forcedModifiedTime;
+
+    CMyComPtr<OutStreamWrapper> m_outFileStream;
+
+    std::set<std::wstring>                       m_createdDirs; ///< directories already created for previous entries
+    std::function<bool(const std::wstring& dir)> m_createDirectory;
+
 public:
     ArchiveExtractCallback(const CMyComPtr<IInArchive>& archiveHandler, const std::wstring& directory, const std::wstring& password);
     virtual ~ArchiveExtractCallback();
 
+    /// all extracted files get this modified time instead of the one stored in the archive
+    void SetModifiedTime(const FILETIME& modifiedTime)
+    {
+        m_forcedModifiedTime    = modifiedTime;
+        m_hasForcedModifiedTime = true;
+    }
+
+    /// directories are created with \c func instead of CreateRecursiveDirectory(),
+    /// e.g. to share a cache of existing directories between extractions
+    void SetCreateDirectoryCallback(const std::function<bool(const std::wstring& dir)>& func) { m_createDirectory = func; }
+
     STDMETHOD(QueryInterface)
     (REFIID iid, void** ppvObject);
     STDMETHOD_(ULONG, AddRef)
@@ -86,5 +108,7 @@ private:
     void GetPropertyIsDir(UInt32 index);
     void GetPropertyModifiedTime(UInt32 index);
     void GetPropertySize(UInt32 index);
+    bool CreateDirectoryCached(const std::wstring& dir);
+    void DiscardTempFile();
 };
 }
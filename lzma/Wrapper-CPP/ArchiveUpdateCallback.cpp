@@ -196,14 +196,30 @@ STDMETHODIMP ArchiveUpdateCallback::GetStream(UInt32 index, ISequentialInStream*
         return S_OK;
     }
 
-    CMyComPtr<IStream> fileStream;
-    if (FAILED(SHCreateStreamOnFileEx(fileInfo.FilePath.c_str(), STGM_READ | STGM_SHARE_DENY_NONE, FILE_ATTRIBUTE_NORMAL, FALSE, NULL, &fileStream)))
+    CMyComPtr<InStreamWrapper> wrapperStream;
+    if ((m_unbufferedThreshold > 0) && (fileInfo.Size >= m_unbufferedThreshold))
     {
-        return HRESULT_FROM_WIN32(GetLastError());
+        // big files would only push everything else out of the file system cache
+        auto reader = std::make_unique<UnbufferedReader>();
+        if (reader->Open(fileInfo.FilePath))
+            wrapperStream = new InStreamWrapper(std::move(reader));
     }
-
-    CMyComPtr<InStreamWrapper> wrapperStream = new InStreamWrapper(fileStream);
-    *inStream                                = wrapperStream.Detach();
+    if (wrapperStream == nullptr)
+    {
+        CMyComPtr<IStream> fileStream;
+        if (FAILED(SHCreateStreamOnFileEx(fileInfo.FilePath.c_str(), STGM_READ | STGM_SHARE_DENY_NONE, FILE_ATTRIBUTE_NORMAL, FALSE, NULL, &fileStream)))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        wrapperStream = new InStreamWrapper(fileStream);
+    }
+    if (m_ioCallback)
+    {
+        wrapperStream->SetIoCallback([ioCallback = m_ioCallback, path = fileInfo.FilePath](UInt64 size) {
+            ioCallback(path, size, false);
+        });
+    }
+    *inStream = wrapperStream.Detach();
 
     return S_OK;
 }
@@ -25,8 +25,13 @@
 #include "DirFileEnum.h"
 #include "ArchiveExtractCallback.h"
 #include "Helper.h"
+#include "MemoryGovernor.h"
+#include "ResumableEncoder.h"
 #include "../CPP/7zip/IDecl.h"
 #include "../CPP/Windows/PropVariant.h"
+#include "../CPP/Windows/System.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 
 
@@ -34,6 +39,16 @@ C7Zip::C7Zip()
     : m_compressionFormat(CompressionFormat::Unknown)
     , m_compressionLevel(5)
     , m_callback(nullptr)
+    , m_ioCallback(nullptr)
+    , m_unbufferedThreshold(0)
+    , m_createDirectory(nullptr)
+    , m_checkpointInterval(0)
+    , m_resumedSize(0)
+    , m_hasArchiveFileInfo(false)
+    , m_archiveWriteTime{}
+    , m_archiveAttributes(0)
+    , m_hasExtractedFileTime(false)
+    , m_extractedFileTime{}
 {
 }
 
@@ -198,6 +213,27 @@ bool C7Zip::AddPath(const std::wstring& path)
         }
     }
 
+    std::wstring dirPrefix = path;
+    if (*path.rbegin() != '\\')
+    {
+        dirPrefix = dirPrefix.substr(0, dirPrefix.find_last_of('\\') + 1);
+    }
+    return Compress(dirPrefix, filePaths);
+}
+
+bool C7Zip::AddFile(const FilePathInfo& fileInfo)
+{
+    m_resumedSize = 0;
+    if (!m_checkpointPath.empty() && (m_compressionFormat == CompressionFormat::SevenZip) && (m_compressionLevel == 0) &&
+        !m_password.empty() && (fileInfo.Size > 0))
+        return CompressResumable(fileInfo);
+    std::vector<FilePathInfo> filePaths;
+    filePaths.push_back(fileInfo);
+    return Compress(fileInfo.FilePath.substr(0, fileInfo.FilePath.find_last_of('\\') + 1), filePaths);
+}
+
+bool C7Zip::Compress(const std::wstring& dirPrefix, const std::vector<FilePathInfo>& filePaths)
+{
     CMyComPtr<IOutArchive> archive;
     HRESULT                hr   = S_FALSE;
     auto                   guid = GetGUIDFromFormat(m_compressionFormat);
@@ -208,9 +244,20 @@ bool C7Zip::AddPath(const std::wstring& path)
     if (FAILED(hr))
         return false;
 
+    // the memory for the encoder is reserved before it starts, which can
+    // mean fewer threads or a smaller dictionary than the level would use
+    MemoryReservation reservation;
+    UInt32            numThreads = 0;
+    UInt32            dictSize   = 0;
+    if (m_compressionFormat == CompressionFormat::SevenZip)
+    {
+        if (!ReserveEncoderMemory(reservation, numThreads, dictSize))
+            return false;
+    }
+
     // set the compression properties
     bool                         encryptHeaders = (m_compressionFormat == CompressionFormat::SevenZip && !m_password.empty());
-    const size_t                 numProps       = 5;
+    const size_t                 numProps       = 7;
     const wchar_t*               names[numProps];  // = { L"x" };
     int                          propIndex = 0;
     NWindows::NCOM::CPropVariant values[numProps]; // = { static_cast<UInt32>(m_compressionLevel) };
@@ -228,6 +275,20 @@ bool C7Zip::AddPath(const std::wstring& path)
         names[propIndex] = L"he";
         values[propIndex++] = true;
     }
+    if (numThreads)
+    {
+        names[propIndex]    = L"mt";
+        values[propIndex++] = numThreads;
+    }
+    if (dictSize && (m_compressionLevel > 0) && (dictSize < GetDefaultDictionarySize(m_compressionLevel)))
+    {
+        // the dictionary size is passed as log2, it's always a power of two here
+        UInt32 dictLog = 0;
+        while ((1U << (dictLog + 1)) <= dictSize)
+            ++dictLog;
+        names[propIndex]    = L"d";
+        values[propIndex++] = dictLog;
+    }
     assert(propIndex <= numProps);  // Ensure future additions to names/values array will respect declared array size
 
     CMyComPtr<ISetProperties> setter;
@@ -241,27 +302,56 @@ bool C7Zip::AddPath(const std::wstring& path)
         }
     }
 
-    CMyComPtr<IStream> fileStream;
-    const WCHAR*       filePathStr = m_archivePath.c_str();
-    if (FAILED(SHCreateStreamOnFileEx(filePathStr, STGM_CREATE | STGM_WRITE, FILE_ATTRIBUTE_NORMAL, TRUE, NULL, &fileStream)))
+    // the archive is about as big as the files: big archives are written without the cache.
+    // The writer has to read back blocks when the header is written, so it needs read access.
+    UInt64 totalSize = 0;
+    for (const auto& fileInfo : filePaths)
+        totalSize += fileInfo.Size;
+    bool   unbuffered = (m_unbufferedThreshold > 0) && (totalSize >= m_unbufferedThreshold);
+    DWORD  access     = unbuffered ? GENERIC_READ | GENERIC_WRITE : GENERIC_WRITE;
+    DWORD  flags      = unbuffered ? FILE_ATTRIBUTE_NORMAL | UnbufferedWriteFlags : FILE_ATTRIBUTE_NORMAL;
+    HANDLE hFile      = CreateFile(m_archivePath.c_str(), access, FILE_SHARE_READ, NULL, CREATE_ALWAYS, flags, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
     {
         CreateRecursiveDirectory(m_archivePath.substr(0, m_archivePath.find_last_of('\\')));
-        if (FAILED(SHCreateStreamOnFileEx(filePathStr, STGM_CREATE | STGM_WRITE, FILE_ATTRIBUTE_NORMAL, TRUE, NULL, &fileStream)))
+        hFile = CreateFile(m_archivePath.c_str(), access, FILE_SHARE_READ, NULL, CREATE_ALWAYS, flags, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
         {
             return false;
         }
     }
 
-    CMyComPtr<OutStreamWrapper> outFile   = new OutStreamWrapper(fileStream);
-    std::wstring                dirPrefix = path;
-    if (*path.rbegin() != '\\')
-    {
-        dirPrefix = dirPrefix.substr(0, dirPrefix.find_last_of('\\') + 1);
-    }
+    CMyComPtr<OutStreamWrapper>      outFile        = new OutStreamWrapper(hFile, unbuffered);
     CMyComPtr<ArchiveUpdateCallback> updateCallback = new ArchiveUpdateCallback(dirPrefix, filePaths, m_archivePath, m_password);
     updateCallback->SetProgressCallback(m_callback);
+    updateCallback->SetIoCallback(m_ioCallback);
+    updateCallback->SetUnbufferedThreshold(m_unbufferedThreshold);
+    if (m_ioCallback)
+    {
+        outFile->SetIoCallback([this](UInt64 size) {
+            m_ioCallback(m_archivePath, size, true);
+        });
+    }
 
-    return SUCCEEDED(archive->UpdateItems(outFile, (UInt32)filePaths.size(), updateCallback));
+    if (FAILED(archive->UpdateItems(outFile, (UInt32)filePaths.size(), updateCallback)))
+        return false;
+    if (m_hasArchiveFileInfo)
+        outFile->SetFileInfo(nullptr, nullptr, &m_archiveWriteTime, m_archiveAttributes);
+    return SUCCEEDED(outFile->Close());
+}
+
+bool C7Zip::CompressResumable(const FilePathInfo& fileInfo)
+{
+    ResumableEncoder encoder(m_archivePath, m_checkpointPath, m_password);
+    if (m_checkpointInterval > 0)
+        encoder.SetCheckpointInterval(m_checkpointInterval);
+    encoder.SetProgressCallback(m_callback);
+    encoder.SetIoCallback(m_ioCallback);
+    if (m_hasArchiveFileInfo)
+        encoder.SetArchiveFileInfo(m_archiveWriteTime, m_archiveAttributes);
+    HRESULT hr    = encoder.Encode(fileInfo);
+    m_resumedSize = encoder.GetResumedSize();
+    return SUCCEEDED(hr);
 }
 
 bool C7Zip::Extract(const std::wstring& destPath)
@@ -285,10 +375,24 @@ bool C7Zip::Extract(const std::wstring& destPath)
 
     hr = CreateObject(guid, &IID_IInArchive, reinterpret_cast<void**>(&archive));
 
-    CMyComPtr<InStreamWrapper>     inFile       = new InStreamWrapper(fileStream);
+    CMyComPtr<InStreamWrapper> inFile;
+    if (m_unbufferedThreshold > 0)
+    {
+        auto reader = std::make_unique<UnbufferedReader>();
+        if (reader->Open(m_archivePath) && (reader->GetSize() >= m_unbufferedThreshold))
+            inFile = new InStreamWrapper(std::move(reader));
+    }
+    if (!inFile)
+        inFile = new InStreamWrapper(fileStream);
     CMyComPtr<ArchiveOpenCallback> openCallback = new ArchiveOpenCallback();
     openCallback->SetPassword(m_password);
     openCallback->SetProgressCallback(m_callback);
+    if (m_ioCallback)
+    {
+        inFile->SetIoCallback([this](UInt64 size) {
+            m_ioCallback(m_archivePath, size, false);
+        });
+    }
 
     hr = archive->Open(inFile, 0, openCallback);
     if (hr != S_OK)
@@ -305,8 +409,17 @@ bool C7Zip::Extract(const std::wstring& destPath)
             return false;
     }
 
+    MemoryReservation reservation;
+    if (!ReserveDecoderMemory(reservation, archive))
+        return false;
+
     CMyComPtr<ArchiveExtractCallback> extractCallback = new ArchiveExtractCallback(archive, destPath, m_password);
     extractCallback->SetProgressCallback(m_callback);
+    extractCallback->SetIoCallback(m_ioCallback);
+    extractCallback->SetUnbufferedThreshold(m_unbufferedThreshold);
+    extractCallback->SetCreateDirectoryCallback(m_createDirectory);
+    if (m_hasExtractedFileTime)
+        extractCallback->SetModifiedTime(m_extractedFileTime);
 
     hr = archive->Extract(NULL, (UInt32)-1, false, extractCallback);
     if (hr != S_OK) // returning S_FALSE also indicates error
@@ -316,3 +429,102 @@ bool C7Zip::Extract(const std::wstring& destPath)
     archive->Close();
     return true;
 }
+
+bool C7Zip::ReserveEncoderMemory(MemoryReservation& reservation, UInt32& numThreads, UInt32& dictSize)
+{
+    // fewer threads hardly change the compression ratio, so they're tried
+    // first, then smaller dictionaries. If even that doesn't fit, wait.
+    numThreads = NWindows::NSystem::GetNumberOfProcessors();
+    dictSize   = GetDefaultDictionarySize(m_compressionLevel);
+    for (;;)
+    {
+        if (reservation.TryReserve(EstimateEncoderMemory(m_compressionLevel, dictSize, numThreads)))
+            return true;
+        if (numThreads > 1)
+            numThreads /= 2;
+        else if ((m_compressionLevel > 0) && (dictSize > (1U << GovernorMinDictionaryLog)))
+            dictSize /= 2;
+        else
+            break;
+    }
+    return WaitForMemory(reservation, EstimateEncoderMemory(m_compressionLevel, dictSize, numThreads));
+}
+
+bool C7Zip::ReserveDecoderMemory(MemoryReservation& reservation, IInArchive* archive)
+{
+    // the decoder needs the biggest dictionary of all the items
+    UInt32 dictSize = 0;
+    UInt32 numItems = 0;
+    archive->GetNumberOfItems(&numItems);
+    for (UInt32 i = 0; i < numItems; ++i)
+    {
+        NWindows::NCOM::CPropVariant prop;
+        if (SUCCEEDED(archive->GetProperty(i, kpidMethod, &prop)) && (prop.vt == VT_BSTR))
+            dictSize = std::max(dictSize, ParseDictionarySize(prop.bstrVal));
+    }
+    return WaitForMemory(reservation, EstimateDecoderMemory(dictSize));
+}
+
+bool C7Zip::WaitForMemory(MemoryReservation& reservation, UInt64 size)
+{
+    while (!reservation.Reserve(size, GovernorWaitInterval))
+    {
+        if (m_callback && (m_callback(0, 0, m_archivePath) == E_ABORT))
+            return false;
+    }
+    return true;
+}
+
+std::wstring C7Zip::GetExtractTempPath(const std::wstring& path)
+{
+    // the ids count up from a random start: unique within the process,
+    // and another process extracting the same file uses other names
+    static std::atomic<ULONG> nextId = [] {
+        GUID guid = {};
+        CoCreateGuid(&guid);
+        return guid.Data1;
+    }();
+    wchar_t id[ExtractTempIdLength + 1] = {};
+    swprintf_s(id, L"%08lX", nextId++);
+    return path + ExtractTempMarker + id;
+}
+
+bool C7Zip::IsExtractTempPath(const std::wstring& path)
+{
+    // only the marker followed by a hex id, a file that just happens to
+    // have a similar extension is synced like any other file
+    const size_t markerLen = wcslen(ExtractTempMarker);
+    const size_t suffixLen = markerLen + ExtractTempIdLength;
+    if (path.size() <= suffixLen)
+        return false;
+    const wchar_t* suffix = path.c_str() + path.size() - suffixLen;
+    if (_wcsnicmp(suffix, ExtractTempMarker, markerLen) != 0)
+        return false;
+    return std::all_of(suffix + markerLen, suffix + suffixLen, [](wchar_t c) { return iswxdigit(c) != 0; });
+}
+
+std::wstring C7Zip::GetResumePartialPath(const std::wstring& archivePath)
+{
+    return archivePath + ResumePartialExtension;
+}
+
+std::wstring C7Zip::GetResumeCheckpointPath(const std::wstring& archivePath)
+{
+    return archivePath + ResumeCheckpointExtension;
+}
+
+bool C7Zip::IsResumeTempPath(const std::wstring& path)
+{
+    return !GetResumeArchivePath(path).empty();
+}
+
+std::wstring C7Zip::GetResumeArchivePath(const std::wstring& path)
+{
+    for (const wchar_t* ext : {ResumePartialExtension, ResumeCheckpointExtension})
+    {
+        const size_t extLen = wcslen(ext);
+        if ((path.size() > extLen) && (_wcsicmp(path.c_str() + path.size() - extLen, ext) == 0))
+            return path.substr(0, path.size() - extLen);
+    }
+    return {};
+}
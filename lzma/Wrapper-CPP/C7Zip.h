@@ -20,6 +20,7 @@
 #pragma once
 #include "InStreamWrapper.h"
 #include "ArchiveOpenCallback.h"
+#include "MemoryGovernor.h"
 #include "../CPP/Common/MyCom.h"
 #include "../CPP/7zip/Archive/IArchive.h"
 #include "../CPP/Windows/PropVariant.h"
@@ -112,14 +113,82 @@ public:
     /// to continue, or E_ABORT to cancel.
     void SetCallback(const std::function<HRESULT(UInt64 pos, UInt64 total, const std::wstring& path)>& callback) { m_callback = callback; }
 
+    /// sets a callback function that is called after every read from and
+    /// every write to a file, with the path of the file and the number of bytes.
+    /// It can be used to account or to limit the I/O, e.g. by sleeping.
+    void SetIoCallback(const std::function<void(const std::wstring& path, UInt64 size, bool write)>& callback) { m_ioCallback = callback; }
+
+    /// Files and archives of at least \c threshold bytes are read and written
+    /// with unbuffered I/O, so that they don't push everything else out of the
+    /// file system cache. 0 (the default) always uses the cache.
+    void SetUnbufferedThreshold(UInt64 threshold) { m_unbufferedThreshold = threshold; }
+
+    /// Sets a function Extract() uses to create the directories, instead
+    /// of creating them on its own. It must return true if the directory exists.
+    void SetCreateDirectoryCallback(const std::function<bool(const std::wstring& dir)>& callback) { m_createDirectory = callback; }
+
+    /// Makes AddFile() resumable for stored archives: if a 7z archive is
+    /// written with a password and without compression (level 0), the state
+    /// is saved to \c checkpointPath every \c interval bytes. If AddFile()
+    /// was interrupted, the next call continues from the last checkpoint
+    /// instead of starting over. The archive file is kept in that case.
+    void SetCheckpointFile(const std::wstring& checkpointPath, UInt64 interval)
+    {
+        m_checkpointPath     = checkpointPath;
+        m_checkpointInterval = interval;
+    }
+
+    /// returns the number of bytes the last AddFile() did not have to
+    /// compress again because it continued from a checkpoint
+    UInt64 GetResumedSize() const { return m_resumedSize; }
+
+    /// Sets the last write time and attributes the archive file gets
+    /// when it's created by AddPath() or AddFile().
+    void SetArchiveFileInfo(const FILETIME& lastWriteTime, DWORD attributes)
+    {
+        m_archiveWriteTime   = lastWriteTime;
+        m_archiveAttributes  = attributes;
+        m_hasArchiveFileInfo = true;
+    }
+
+    /// Sets the last write time for the files extracted by Extract(),
+    /// instead of the time stored in the archive.
+    void SetExtractedFileTime(const FILETIME& lastWriteTime)
+    {
+        m_extractedFileTime    = lastWriteTime;
+        m_hasExtractedFileTime = true;
+    }
+
     /// Add paths to compress into the archive file.
     /// if the path ends with a backslash, the directory is not added itselb but only
     /// the contents.
     bool AddPath(const std::wstring& path);
 
+    /// Adds a single file to compress into the archive file.
+    /// Use this instead of AddPath() if the file info is already known,
+    /// e.g. from enumerating the directory, so it doesn't have to be read again.
+    bool AddFile(const FilePathInfo& fileInfo);
+
     /// Extracts the contents of the archive to the destPath.
+    /// Every file is written to a temp file next to it first, which replaces
+    /// the file only if it was extracted completely and without errors.
     bool Extract(const std::wstring& destPath);
 
+    /// returns a new temp path Extract() writes \c path to, unique for every call
+    static std::wstring GetExtractTempPath(const std::wstring& path);
+    /// returns true if path is one of the temp files Extract() writes to
+    static bool         IsExtractTempPath(const std::wstring& path);
+
+    /// returns the path a resumable AddFile() for \c archivePath should write to
+    static std::wstring GetResumePartialPath(const std::wstring& archivePath);
+    /// returns the path of the checkpoint file for \c archivePath
+    static std::wstring GetResumeCheckpointPath(const std::wstring& archivePath);
+    /// returns true if path is a partial archive or a checkpoint file
+    static bool         IsResumeTempPath(const std::wstring& path);
+    /// returns the archive path a partial archive or a checkpoint file belongs to,
+    /// or an empty string if \c path is neither
+    static std::wstring GetResumeArchivePath(const std::wstring& path);
+
     /// Lists all files inside an archive to the container. container can be std:vector, std::list, ...
     template <class Container>
     bool ListFiles(Container& container)
@@ -195,6 +264,12 @@ private:
     CompressionFormat GetCompressionFormatFromPath();
     const GUID*       GetGUIDFromFormat(CompressionFormat format);
     const GUID* GetGUIDByTrying(CompressionFormat& format, CMyComPtr<IStream>& fileStream);
+    bool        Compress(const std::wstring& dirPrefix, const std::vector<FilePathInfo>& filePaths);
+    bool        CompressResumable(const FilePathInfo& fileInfo);
+    bool        ReserveEncoderMemory(MemoryReservation& reservation, UInt32& numThreads, UInt32& dictSize);
+    bool        ReserveDecoderMemory(MemoryReservation& reservation, IInArchive* archive);
+    /// waits until the memory governor has \c size bytes, unless the operation is cancelled
+    bool        WaitForMemory(MemoryReservation& reservation, UInt64 size);
 
 private:
     std::wstring                                                               m_archivePath;
@@ -202,4 +277,15 @@ private:
     CompressionFormat                                                          m_compressionFormat;
     int                                                                        m_compressionLevel;
     std::function<HRESULT(UInt64 pos, UInt64 total, const std::wstring& path)> m_callback;
+    std::function<void(const std::wstring& path, UInt64 size, bool write)>     m_ioCallback;
+    UInt64                                                                     m_unbufferedThreshold;
+    std::function<bool(const std::wstring& dir)>                               m_createDirectory;
+    std::wstring                                                               m_checkpointPath;
+    UInt64                                                                     m_checkpointInterval;
+    UInt64                                                                     m_resumedSize;
+    bool                                                                       m_hasArchiveFileInfo;
+    FILETIME                                                                   m_archiveWriteTime;
+    DWORD                                                                      m_archiveAttributes;
+    bool                                                                       m_hasExtractedFileTime;
+    FILETIME                                                                   m_extractedFileTime;
 };
@@ -26,8 +26,10 @@ namespace SevenZip
 {
 CallbackBase::CallbackBase()
     : m_callback(nullptr)
+    , m_ioCallback(nullptr)
     , m_progress(0)
     , m_total(0)
+    , m_unbufferedThreshold(0)
 {
 }
 
@@ -33,13 +33,17 @@ class CallbackBase
 protected:
     std::wstring                                                               m_password;
     std::function<HRESULT(UInt64 pos, UInt64 total, const std::wstring& path)> m_callback;
+    std::function<void(const std::wstring& path, UInt64 size, bool write)>     m_ioCallback;
     UInt64                                                                     m_progress;
     UInt64                                                                     m_total;
     std::wstring                                                               m_progressPath;
+    UInt64                                                                     m_unbufferedThreshold; ///< 0: files are always buffered
 
 public:
     void SetPassword(const std::wstring& pw) { m_password = pw; }
     void SetProgressCallback(const std::function<HRESULT(UInt64 pos, UInt64 total, const std::wstring& path)>& func) { m_callback = func; }
+    void SetIoCallback(const std::function<void(const std::wstring& path, UInt64 size, bool write)>& func) { m_ioCallback = func; }
+    void SetUnbufferedThreshold(UInt64 threshold) { m_unbufferedThreshold = threshold; }
 
     CallbackBase();
     virtual ~CallbackBase();
@@ -21,3 +21,11 @@
 #include <string>
 
 bool CreateRecursiveDirectory(const std::wstring& path);
+
+/// extracted files are written to a temp file in the same directory first,
+/// named like the file with this marker and a new hex id appended. The suffix
+/// is kept short so that the temp path doesn't exceed MAX_PATH much sooner
+/// than the path of the file itself.
+constexpr wchar_t ExtractTempMarker[]  = L".cstmp-";
+/// number of hex digits of the id after the ExtractTempMarker
+constexpr size_t  ExtractTempIdLength = 8;
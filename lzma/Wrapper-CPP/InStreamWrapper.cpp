@@ -25,6 +25,14 @@ namespace SevenZip
 InStreamWrapper::InStreamWrapper(const CMyComPtr<IStream>& baseStream)
     : m_refCount(0)
     , m_baseStream(baseStream)
+    , m_ioCallback(nullptr)
+{
+}
+
+InStreamWrapper::InStreamWrapper(std::unique_ptr<UnbufferedReader> reader)
+    : m_refCount(0)
+    , m_reader(std::move(reader))
+    , m_ioCallback(nullptr)
 {
 }
 
@@ -83,17 +91,30 @@ ULONG STDMETHODCALLTYPE InStreamWrapper::Release()
 STDMETHODIMP InStreamWrapper::Read(void* data, UInt32 size, UInt32* processedSize)
 {
     ULONG   read = 0;
-    HRESULT hr   = m_baseStream->Read(data, size, &read);
+    HRESULT hr   = S_OK;
+    if (m_reader)
+    {
+        UInt32 readSize = 0;
+        hr              = m_reader->Read(data, size, &readSize);
+        read            = readSize;
+    }
+    else
+        hr = m_baseStream->Read(data, size, &read);
     if (processedSize != NULL)
     {
         *processedSize = read;
     }
+    if (m_ioCallback && (read > 0))
+        m_ioCallback(read);
     // Transform S_FALSE to S_OK
     return SUCCEEDED(hr) ? S_OK : hr;
 }
 
 STDMETHODIMP InStreamWrapper::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition)
 {
+    if (m_reader)
+        return m_reader->Seek(offset, seekOrigin, newPosition);
+
     LARGE_INTEGER  move;
     ULARGE_INTEGER newPos;
 
@@ -108,6 +129,12 @@ STDMETHODIMP InStreamWrapper::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newP
 
 STDMETHODIMP InStreamWrapper::GetSize(UInt64* size)
 {
+    if (m_reader)
+    {
+        *size = m_reader->GetSize();
+        return S_OK;
+    }
+
     STATSTG statInfo;
     HRESULT hr = m_baseStream->Stat(&statInfo, STATFLAG_NONAME);
     if (SUCCEEDED(hr))
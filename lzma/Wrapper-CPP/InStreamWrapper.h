@@ -20,6 +20,9 @@
 #pragma once
 #include "../CPP/7zip/IStream.h"
 #include "../CPP/Common/MyCom.h"
+#include "UnbufferedFile.h"
+#include <functional>
+#include <memory>
 
 namespace SevenZip
 {
@@ -27,13 +30,20 @@ class InStreamWrapper : public IInStream
     , public IStreamGetSize
 {
 private:
-    long               m_refCount;
-    CMyComPtr<IStream> m_baseStream;
+    long                              m_refCount;
+    CMyComPtr<IStream>                m_baseStream;
+    std::unique_ptr<UnbufferedReader> m_reader;
+    std::function<void(UInt64)>       m_ioCallback;
 
 public:
     InStreamWrapper(const CMyComPtr<IStream>& baseStream);
+    /// reads the file with \c reader, bypassing the file system cache
+    InStreamWrapper(std::unique_ptr<UnbufferedReader> reader);
     virtual ~InStreamWrapper();
 
+    /// Sets a function which is called with the number of bytes after every read.
+    void SetIoCallback(const std::function<void(UInt64 size)>& func) { m_ioCallback = func; }
+
     STDMETHOD(QueryInterface)
     (REFIID iid, void** ppvObject);
     STDMETHOD_(ULONG, AddRef)
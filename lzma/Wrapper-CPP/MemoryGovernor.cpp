@@ -0,0 +1,258 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "StdAfx.h"
+#include "MemoryGovernor.h"
+#include "../CPP/7zip/Common/MethodProps.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace SevenZip
+{
+namespace
+{
+/// the in- and output buffers of a coder, on top of the dictionary
+constexpr UInt64 CoderBufferMemory = 2 * 1024 * 1024;
+
+UInt64 GetDefaultBudget()
+{
+    MEMORYSTATUSEX memStatus = {sizeof(memStatus)};
+    if (!GlobalMemoryStatusEx(&memStatus))
+        return 1024ULL * 1024 * 1024;
+    return memStatus.ullTotalPhys / 2;
+}
+
+/// parses a size like "24" (log2), "1536k" or "3m" at \c pos
+UInt64 ParseSize(const std::wstring& s, size_t pos)
+{
+    UInt64 value  = 0;
+    bool   digits = false;
+    for (; pos < s.size() && iswdigit(s[pos]); ++pos)
+    {
+        value  = value * 10 + (s[pos] - '0');
+        digits = true;
+        if (value > 0xFFFFFFFF)
+            return 0;
+    }
+    if (!digits)
+        return 0;
+    switch (pos < s.size() ? towlower(s[pos]) : 0)
+    {
+        case 'b':
+            return value;
+        case 'k':
+            return value << 10;
+        case 'm':
+            return value << 20;
+        case 'g':
+            return value << 30;
+        default:
+            return value < 32 ? (1ULL << value) : 0;
+    }
+}
+} // namespace
+
+MemoryGovernor& MemoryGovernor::Instance()
+{
+    static MemoryGovernor instance;
+    return instance;
+}
+
+MemoryGovernor::MemoryGovernor()
+    : m_budget(GetDefaultBudget())
+    , m_reserved(0)
+    , m_peak(0)
+{
+}
+
+void MemoryGovernor::SetBudget(UInt64 budget)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_budget = budget ? budget : GetDefaultBudget();
+    }
+    // a bigger budget can make waiting reservations fit
+    m_released.notify_all();
+}
+
+UInt64 MemoryGovernor::GetBudget() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget;
+}
+
+bool MemoryGovernor::Fits(UInt64 size) const
+{
+    return (m_reserved == 0) || (m_reserved + size <= m_budget);
+}
+
+void MemoryGovernor::Add(UInt64 size)
+{
+    m_reserved += size;
+    m_peak      = std::max(m_peak, m_reserved);
+}
+
+bool MemoryGovernor::TryReserve(UInt64 size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!Fits(size))
+        return false;
+    Add(size);
+    return true;
+}
+
+bool MemoryGovernor::Reserve(UInt64 size, DWORD timeout)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_released.wait_for(lock, std::chrono::milliseconds(timeout), [&] { return Fits(size); }))
+        return false;
+    Add(size);
+    return true;
+}
+
+void MemoryGovernor::Release(UInt64 size)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_reserved -= std::min(size, m_reserved);
+    }
+    m_released.notify_all();
+}
+
+UInt64 MemoryGovernor::GetReserved() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_reserved;
+}
+
+UInt64 MemoryGovernor::GetPeak() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_peak;
+}
+
+void MemoryGovernor::ResetPeak()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_peak = m_reserved;
+}
+
+MemoryReservation::MemoryReservation()
+    : m_size(0)
+{
+}
+
+MemoryReservation::~MemoryReservation()
+{
+    Release();
+}
+
+bool MemoryReservation::TryReserve(UInt64 size)
+{
+    Release();
+    if (!MemoryGovernor::Instance().TryReserve(size))
+        return false;
+    m_size = size;
+    return true;
+}
+
+bool MemoryReservation::Reserve(UInt64 size, DWORD timeout)
+{
+    Release();
+    if (!MemoryGovernor::Instance().Reserve(size, timeout))
+        return false;
+    m_size = size;
+    return true;
+}
+
+void MemoryReservation::Release()
+{
+    if (m_size)
+        MemoryGovernor::Instance().Release(m_size);
+    m_size = 0;
+}
+
+UInt32 GetDefaultDictionarySize(int level)
+{
+    CMethodProps props;
+    props.AddProp_Level(static_cast<UInt32>(level));
+    return static_cast<UInt32>(props.Get_Lzma_DicSize());
+}
+
+UInt64 EstimateEncoderMemory(int level, UInt32 dictSize, UInt32 numThreads)
+{
+    // the copy coder only needs a small buffer
+    if (level == 0)
+        return CoderBufferMemory;
+
+    CMethodProps props;
+    props.AddProp_Level(static_cast<UInt32>(level));
+    if (dictSize)
+        props.AddProp32(NCoderPropID::kDictionarySize, dictSize);
+    props.AddProp_NumThreads(std::max(numThreads, 1U));
+
+    // LZMA2 runs one LZMA encoder per block thread, every encoder with one
+    // or two threads. The block threads also need the blocks they work on,
+    // the same calculation as in CHandler::SetMainMethod() of the 7z handler.
+    const UInt32 lzmaThreads  = props.Get_Lzma_NumThreads();
+    const UInt32 blockThreads = std::max(numThreads, 1U) / lzmaThreads;
+    if (blockThreads <= 1)
+        return props.Get_Lzma_MemUsage(true);
+    const UInt64 chunkSize     = props.Get_Xz_BlockSize();
+    UInt32       numPackChunks = blockThreads + (blockThreads / 8) + 1;
+    if (chunkSize < (1 << 26))
+        numPackChunks++;
+    if (chunkSize < (1 << 24))
+        numPackChunks++;
+    if (chunkSize < (1 << 22))
+        numPackChunks++;
+    return blockThreads * (props.Get_Lzma_MemUsage(false) + chunkSize) + numPackChunks * chunkSize;
+}
+
+UInt64 EstimateDecoderMemory(UInt32 dictSize)
+{
+    return static_cast<UInt64>(dictSize) + CoderBufferMemory;
+}
+
+UInt32 ParseDictionarySize(const std::wstring& method)
+{
+    // the methods are separated by spaces, their properties by colons:
+    // the first property of LZMA and LZMA2 is the dictionary, PPMd has "mem"
+    UInt64 dictSize = 0;
+    size_t start    = 0;
+    while (start < method.size())
+    {
+        size_t end = method.find(' ', start);
+        if (end == std::wstring::npos)
+            end = method.size();
+        std::wstring token = method.substr(start, end - start);
+        size_t       colon = token.find(':');
+        if ((colon != std::wstring::npos) && (_wcsnicmp(token.c_str(), L"LZMA", 4) == 0))
+            dictSize = std::max(dictSize, ParseSize(token, colon + 1));
+        for (; colon != std::wstring::npos; colon = token.find(':', colon + 1))
+        {
+            if (_wcsnicmp(token.c_str() + colon + 1, L"mem", 3) == 0)
+                dictSize = std::max(dictSize, ParseSize(token, colon + 4));
+        }
+        start = end + 1;
+    }
+    return static_cast<UInt32>(std::min<UInt64>(dictSize, 0xFFFFFFFF));
+}
+}
@@ -0,0 +1,108 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include "../CPP/Common/MyTypes.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+namespace SevenZip
+{
+/// the smallest dictionary (as log2) C7Zip shrinks the dictionary to if the memory budget is tight
+constexpr UInt32 GovernorMinDictionaryLog = 22;
+/// ms C7Zip waits for a reservation before it checks if the operation got cancelled
+constexpr DWORD  GovernorWaitInterval     = 500;
+
+/// Limits the memory all the encoders and decoders of the process use together.
+///
+/// C7Zip estimates the memory an encoder or decoder needs from the method,
+/// the level, the dictionary and the number of threads, and reserves it
+/// before it starts. A reservation that doesn't fit into the budget either
+/// fails right away (TryReserve()) or waits until enough memory got released
+/// (Reserve()). A single reservation bigger than the whole budget is granted
+/// if nothing else is reserved, otherwise it could never run.
+class MemoryGovernor
+{
+public:
+    static MemoryGovernor& Instance();
+
+    MemoryGovernor(const MemoryGovernor&)            = delete;
+    MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+    /// sets the budget in bytes, 0 means half of the physical memory
+    void   SetBudget(UInt64 budget);
+    UInt64 GetBudget() const;
+
+    bool   TryReserve(UInt64 size);
+    /// waits up to \c timeout ms for the reservation
+    bool   Reserve(UInt64 size, DWORD timeout);
+    void   Release(UInt64 size);
+
+    /// the bytes that are reserved right now
+    UInt64 GetReserved() const;
+    /// the most bytes that were reserved at the same time
+    UInt64 GetPeak() const;
+    void   ResetPeak();
+
+private:
+    MemoryGovernor();
+
+    bool                    Fits(UInt64 size) const;
+    void                    Add(UInt64 size);
+
+    mutable std::mutex      m_mutex;
+    std::condition_variable m_released;
+    UInt64                  m_budget;
+    UInt64                  m_reserved;
+    UInt64                  m_peak;
+};
+
+/// A reservation with the MemoryGovernor, released when the object is destroyed.
+class MemoryReservation
+{
+public:
+    MemoryReservation();
+    ~MemoryReservation();
+
+    MemoryReservation(const MemoryReservation&)            = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    bool   TryReserve(UInt64 size);
+    bool   Reserve(UInt64 size, DWORD timeout);
+    void   Release();
+    UInt64 GetSize() const { return m_size; }
+
+private:
+    UInt64 m_size;
+};
+
+/// returns the dictionary size the LZMA and LZMA2 encoders use for \c level
+UInt32 GetDefaultDictionarySize(int level);
+/// returns the memory the 7z LZMA2 encoder needs, estimated the way the 7z handler does it.
+/// \c dictSize 0 is the default for the level.
+UInt64 EstimateEncoderMemory(int level, UInt32 dictSize, UInt32 numThreads);
+/// returns the memory a decoder with a dictionary of \c dictSize needs
+UInt64 EstimateDecoderMemory(UInt32 dictSize);
+/// returns the dictionary size of a method string like "LZMA2:24 7zAES:19"
+/// as the archive handlers report it (kpidMethod), or 0 if it has none
+UInt32 ParseDictionarySize(const std::wstring& method);
+}
@@ -22,14 +22,60 @@
 
 namespace SevenZip
 {
-OutStreamWrapper::OutStreamWrapper(const CMyComPtr<IStream>& baseStream)
+OutStreamWrapper::OutStreamWrapper(HANDLE hFile, bool unbuffered)
     : m_refCount(0)
-    , m_baseStream(baseStream)
+    , m_hFile(hFile)
+    , m_hasFileInfo(false)
+    , m_creationTime{}
+    , m_lastAccessTime{}
+    , m_lastWriteTime{}
+    , m_attributes(0)
+    , m_writer(unbuffered ? std::make_unique<UnbufferedWriter>(hFile) : nullptr)
+    , m_ioCallback(nullptr)
 {
 }
 
 OutStreamWrapper::~OutStreamWrapper()
 {
+    Close();
+}
+
+void OutStreamWrapper::SetFileInfo(const FILETIME* creationTime, const FILETIME* lastAccessTime, const FILETIME* lastWriteTime, DWORD attributes)
+{
+    m_creationTime   = creationTime ? *creationTime : FILETIME{};
+    m_lastAccessTime = lastAccessTime ? *lastAccessTime : FILETIME{};
+    m_lastWriteTime  = lastWriteTime ? *lastWriteTime : FILETIME{};
+    m_attributes     = attributes;
+    m_hasFileInfo    = true;
+}
+
+HRESULT OutStreamWrapper::Close()
+{
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return S_OK;
+    HRESULT hr = S_OK;
+    if (m_writer)
+    {
+        hr = m_writer->Finish();
+        m_writer.reset();
+    }
+    if (m_hasFileInfo)
+    {
+        // zero times and attributes are left unchanged
+        FILE_BASIC_INFO basicInfo         = {};
+        basicInfo.CreationTime.LowPart    = m_creationTime.dwLowDateTime;
+        basicInfo.CreationTime.HighPart   = m_creationTime.dwHighDateTime;
+        basicInfo.LastAccessTime.LowPart  = m_lastAccessTime.dwLowDateTime;
+        basicInfo.LastAccessTime.HighPart = m_lastAccessTime.dwHighDateTime;
+        basicInfo.LastWriteTime.LowPart   = m_lastWriteTime.dwLowDateTime;
+        basicInfo.LastWriteTime.HighPart  = m_lastWriteTime.dwHighDateTime;
+        basicInfo.FileAttributes          = m_attributes;
+        if (!SetFileInformationByHandle(m_hFile, FileBasicInfo, &basicInfo, sizeof(basicInfo)) && SUCCEEDED(hr))
+            hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    return hr;
 }
 
 HRESULT STDMETHODCALLTYPE OutStreamWrapper::QueryInterface(REFIID iid, void** ppvObject)
@@ -75,33 +121,58 @@ ULONG STDMETHODCALLTYPE OutStreamWrapper::Release()
 
 STDMETHODIMP OutStreamWrapper::Write(const void* data, UInt32 size, UInt32* processedSize)
 {
-    ULONG   written = 0;
-    HRESULT hr      = m_baseStream->Write(data, size, &written);
+    DWORD   written = 0;
+    HRESULT hr      = S_OK;
+    if (m_writer)
+    {
+        UInt32 writtenSize = 0;
+        hr                 = m_writer->Write(data, size, &writtenSize);
+        written            = writtenSize;
+    }
+    else if (!WriteFile(m_hFile, data, size, &written, NULL))
+        hr = HRESULT_FROM_WIN32(GetLastError());
     if (processedSize != NULL)
     {
         *processedSize = written;
     }
+    if (m_ioCallback && (written > 0))
+        m_ioCallback(written);
     return hr;
 }
 
 STDMETHODIMP OutStreamWrapper::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition)
 {
-    LARGE_INTEGER  move;
-    ULARGE_INTEGER newPos;
+    if (m_writer)
+        return m_writer->Seek(offset, seekOrigin, newPosition);
+
+    // STREAM_SEEK_SET/CUR/END have the same values as FILE_BEGIN/CURRENT/END
+    LARGE_INTEGER move;
+    LARGE_INTEGER newPos;
 
     move.QuadPart = offset;
-    HRESULT hr    = m_baseStream->Seek(move, seekOrigin, &newPos);
+    if (!SetFilePointerEx(m_hFile, move, &newPos, seekOrigin))
+        return HRESULT_FROM_WIN32(GetLastError());
     if (newPosition != NULL)
     {
         *newPosition = newPos.QuadPart;
     }
-    return hr;
+    return S_OK;
 }
 
 STDMETHODIMP OutStreamWrapper::SetSize(UInt64 newSize)
 {
-    ULARGE_INTEGER size;
-    size.QuadPart = newSize;
-    return m_baseStream->SetSize(size);
+    if (m_writer)
+        return m_writer->SetSize(newSize);
+
+    LARGE_INTEGER zero    = {};
+    LARGE_INTEGER current = {};
+    LARGE_INTEGER size    = {};
+    size.QuadPart         = newSize;
+    if (!SetFilePointerEx(m_hFile, zero, &current, FILE_CURRENT) ||
+        !SetFilePointerEx(m_hFile, size, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(m_hFile) ||
+        !SetFilePointerEx(m_hFile, current, NULL, FILE_BEGIN))
+        return HRESULT_FROM_WIN32(GetLastError());
+    return S_OK;
 }
 }
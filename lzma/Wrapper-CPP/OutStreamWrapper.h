@@ -20,19 +20,47 @@
 #pragma once
 #include "../CPP/7zip/IStream.h"
 #include "../CPP/Common/MyCom.h"
+#include "UnbufferedFile.h"
+#include <functional>
+#include <memory>
 
 namespace SevenZip
 {
+/// Output stream writing to a file. The stream owns the file handle.
+///
+/// The file times and attributes set with SetFileInfo() are applied
+/// to the file handle right before it is closed, so the file does not
+/// have to be opened again after it was written.
+/// If \c unbuffered is set, the file must be opened with UnbufferedWriteFlags
+/// and is written with UnbufferedWriter.
 class OutStreamWrapper : public IOutStream
 {
 private:
-    long               m_refCount;
-    CMyComPtr<IStream> m_baseStream;
+    long                              m_refCount;
+    HANDLE                            m_hFile;
+    bool                              m_hasFileInfo;
+    FILETIME                          m_creationTime;
+    FILETIME                          m_lastAccessTime;
+    FILETIME                          m_lastWriteTime;
+    DWORD                             m_attributes;
+    std::unique_ptr<UnbufferedWriter> m_writer;
+    std::function<void(UInt64)>       m_ioCallback;
 
 public:
-    OutStreamWrapper(const CMyComPtr<IStream>& baseStream);
+    OutStreamWrapper(HANDLE hFile, bool unbuffered = false);
     virtual ~OutStreamWrapper();
 
+    /// Sets the times and attributes the file gets when it is closed.
+    /// times which are nullptr and attributes which are 0 are not changed.
+    void    SetFileInfo(const FILETIME* creationTime, const FILETIME* lastAccessTime, const FILETIME* lastWriteTime, DWORD attributes);
+
+    /// Applies the file info set with SetFileInfo() and closes the file.
+    /// Returns an error if the file info could not be set.
+    HRESULT Close();
+
+    /// Sets a function which is called with the number of bytes after every write.
+    void    SetIoCallback(const std::function<void(UInt64 size)>& func) { m_ioCallback = func; }
+
     STDMETHOD(QueryInterface)
     (REFIID iid, void** ppvObject);
     STDMETHOD_(ULONG, AddRef)
@@ -0,0 +1,359 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "StdAfx.h"
+#include "ResumableEncoder.h"
+#include "C7Zip.h"
+#include "Helper.h"
+#include "OutStreamWrapper.h"
+#include "../C/7zCrc.h"
+#include "../CPP/Common/ComTry.h"
+#include "../CPP/7zip/Archive/7z/7zOut.h"
+#include "../CPP/7zip/Crypto/7zAes.h"
+#include "../CPP/7zip/Crypto/MyAes.h"
+#include "../CPP/7zip/Crypto/RandGen.h"
+
+#include <cstddef>
+#include <memory>
+
+namespace SevenZip
+{
+namespace
+{
+constexpr UInt32 CheckpointMagic    = 0x50435343; // "CSCP"
+constexpr UInt32 CheckpointVersion  = 1;
+constexpr DWORD  ResumeBufferSize   = 1024 * 1024;
+constexpr UInt32 AesBlockSize       = 16;
+constexpr UInt32 AesKeySize         = 32;
+/// the same number of SHA-256 rounds (2^19) as 7-zip uses
+constexpr UInt32 AesNumCyclesPower  = 19;
+/// size of the start header of a 7z archive, the pack data follows it
+constexpr UInt64 ArchiveStartHeader = 32;
+
+struct HandleCloser
+{
+    void operator()(HANDLE h) const
+    {
+        if (h != INVALID_HANDLE_VALUE)
+            CloseHandle(h);
+    }
+};
+using HandlePtr = std::unique_ptr<void, HandleCloser>;
+
+struct BufferFree
+{
+    void operator()(Byte* p) const { VirtualFree(p, 0, MEM_RELEASE); }
+};
+
+UInt64 ToUInt64(const FILETIME& ft)
+{
+    return (static_cast<UInt64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+
+bool ReadAt(HANDLE hFile, UInt64 offset, void* data, DWORD size)
+{
+    OVERLAPPED overlapped = {};
+    overlapped.Offset     = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD read            = 0;
+    return ReadFile(hFile, data, size, &read, &overlapped) && (read == size);
+}
+
+/// encrypts the source block at \c offset with the cipher block \c prev before it,
+/// and compares the result with the archive
+bool VerifyBlock(HANDLE hSource, HANDLE hArchive, NCrypto::CAesCbcEncoder* aes, UInt64 offset, const Byte* prev)
+{
+    alignas(16) Byte plain[AesBlockSize];
+    Byte             cipher[AesBlockSize];
+    if (!ReadAt(hSource, offset, plain, AesBlockSize) || !ReadAt(hArchive, ArchiveStartHeader + offset, cipher, AesBlockSize))
+        return false;
+    aes->SetInitVector(prev, AesBlockSize);
+    aes->Filter(plain, AesBlockSize);
+    return memcmp(plain, cipher, AesBlockSize) == 0;
+}
+} // namespace
+
+ResumableEncoder::ResumableEncoder(const std::wstring& archivePath, const std::wstring& checkpointPath, const std::wstring& password)
+    : m_archivePath(archivePath)
+    , m_checkpointPath(checkpointPath)
+    , m_password(password)
+    , m_interval(ResumeCheckpointInterval)
+    , m_progressCallback(nullptr)
+    , m_ioCallback(nullptr)
+    , m_hasArchiveFileInfo(false)
+    , m_archiveWriteTime{}
+    , m_archiveAttributes(0)
+    , m_resumedSize(0)
+{
+}
+
+ResumableEncoder::~ResumableEncoder()
+{
+}
+
+void ResumableEncoder::SetArchiveFileInfo(const FILETIME& lastWriteTime, DWORD attributes)
+{
+    m_archiveWriteTime   = lastWriteTime;
+    m_archiveAttributes  = attributes;
+    m_hasArchiveFileInfo = true;
+}
+
+bool ResumableEncoder::LoadCheckpoint(Checkpoint& cp) const
+{
+    HandlePtr hFile(CreateFile(m_checkpointPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+    if (hFile.get() == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD read = 0;
+    if (!ReadFile(hFile.get(), &cp, sizeof(cp), &read, NULL) || (read != sizeof(cp)))
+        return false;
+    // a checkpoint that was only partly written doesn't match its checksum
+    return (cp.magic == CheckpointMagic) && (cp.version == CheckpointVersion) &&
+           (cp.checksum == CrcCalc(&cp, offsetof(Checkpoint, checksum))) &&
+           (cp.done > 0) && ((cp.done % AesBlockSize) == 0);
+}
+
+bool ResumableEncoder::SaveCheckpoint(Checkpoint& cp) const
+{
+    cp.magic    = CheckpointMagic;
+    cp.version  = CheckpointVersion;
+    cp.checksum = CrcCalc(&cp, offsetof(Checkpoint, checksum));
+    HandlePtr hFile(CreateFile(m_checkpointPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_HIDDEN, NULL));
+    if (hFile.get() == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD written = 0;
+    return WriteFile(hFile.get(), &cp, sizeof(cp), &written, NULL) && (written == sizeof(cp)) && FlushFileBuffers(hFile.get());
+}
+
+HRESULT ResumableEncoder::Encode(const FilePathInfo& fileInfo)
+{
+    m_resumedSize = 0;
+    HandlePtr hSource(CreateFile(fileInfo.FilePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL));
+    if (hSource.get() == INVALID_HANDLE_VALUE)
+        return HRESULT_FROM_WIN32(GetLastError());
+    BY_HANDLE_FILE_INFORMATION sourceInfo = {};
+    if (!GetFileInformationByHandle(hSource.get(), &sourceInfo))
+        return HRESULT_FROM_WIN32(GetLastError());
+    const UInt64 total = (static_cast<UInt64>(sourceInfo.nFileSizeHigh) << 32) | sourceInfo.nFileSizeLow;
+    if (total == 0)
+        return E_INVALIDARG;
+
+    // the key is derived the same way 7-zip does it, just without a salt
+    NCrypto::N7z::CKeyInfo key;
+    key.NumCyclesPower = AesNumCyclesPower;
+    key.Password.Alloc(m_password.size() * sizeof(wchar_t));
+    if (!m_password.empty())
+        memcpy(key.Password, m_password.c_str(), m_password.size() * sizeof(wchar_t));
+    key.CalcKey();
+    CMyComPtr<NCrypto::CAesCbcEncoder> aes = new NCrypto::CAesCbcEncoder(AesKeySize);
+    RINOK(aes->SetKey(key.Key, AesKeySize))
+
+    Checkpoint cp     = {};
+    bool       resume = LoadCheckpoint(cp) && (cp.sourceSize == total) && (cp.done < total) &&
+                        (CompareFileTime(&cp.sourceWriteTime, &sourceInfo.ftLastWriteTime) == 0);
+
+    HandlePtr hArchive(resume ? CreateFile(m_archivePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)
+                              : INVALID_HANDLE_VALUE);
+    if (resume)
+    {
+        // the archive must have all the data up to the checkpoint, and that data must
+        // come from the same source and password: encrypting the first and the last
+        // block again must give the same cipher blocks
+        LARGE_INTEGER archiveSize = {};
+        Byte          chain[AesBlockSize * 2];
+        resume = (hArchive.get() != INVALID_HANDLE_VALUE) && GetFileSizeEx(hArchive.get(), &archiveSize) &&
+                 (static_cast<UInt64>(archiveSize.QuadPart) >= ArchiveStartHeader + cp.done) &&
+                 VerifyBlock(hSource.get(), hArchive.get(), aes, 0, cp.iv);
+        if (resume)
+        {
+            const Byte* prev = cp.iv;
+            if (cp.done > AesBlockSize)
+            {
+                resume = ReadAt(hArchive.get(), ArchiveStartHeader + cp.done - 2 * AesBlockSize, chain, AesBlockSize);
+                prev   = chain;
+            }
+            resume = resume && VerifyBlock(hSource.get(), hArchive.get(), aes, cp.done - AesBlockSize, prev) &&
+                     ReadAt(hArchive.get(), ArchiveStartHeader + cp.done - AesBlockSize, chain + AesBlockSize, AesBlockSize) &&
+                     (memcmp(chain + AesBlockSize, cp.chain, AesBlockSize) == 0);
+        }
+        if (!resume)
+            hArchive.reset(INVALID_HANDLE_VALUE);
+    }
+    if (!resume)
+    {
+        DeleteFile(m_checkpointPath.c_str());
+        cp                 = {};
+        cp.sourceSize      = total;
+        cp.sourceWriteTime = sourceInfo.ftLastWriteTime;
+        cp.crc             = CRC_INIT_VAL;
+        MY_RAND_GEN(cp.iv, sizeof(cp.iv));
+        hArchive.reset(CreateFile(m_archivePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL));
+        if (hArchive.get() == INVALID_HANDLE_VALUE)
+        {
+            CreateRecursiveDirectory(m_archivePath.substr(0, m_archivePath.find_last_of('\\')));
+            hArchive.reset(CreateFile(m_archivePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL));
+            if (hArchive.get() == INVALID_HANDLE_VALUE)
+                return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    // the stream owns the archive handle from now on
+    HANDLE                      hArchiveFile = hArchive.release();
+    CMyComPtr<OutStreamWrapper> outFile      = new OutStreamWrapper(hArchiveFile);
+    if (m_ioCallback)
+    {
+        outFile->SetIoCallback([this](UInt64 size) {
+            m_ioCallback(m_archivePath, size, true);
+        });
+    }
+    NArchive::N7z::COutArchive out;
+    RINOK(out.Create_and_WriteStartPrefix(outFile))
+    if (resume)
+    {
+        RINOK(outFile->SetSize(ArchiveStartHeader + cp.done))
+        RINOK(outFile->Seek(static_cast<Int64>(ArchiveStartHeader + cp.done), STREAM_SEEK_SET, nullptr))
+        LARGE_INTEGER pos = {};
+        pos.QuadPart      = static_cast<LONGLONG>(cp.done);
+        if (!SetFilePointerEx(hSource.get(), pos, NULL, FILE_BEGIN))
+            return HRESULT_FROM_WIN32(GetLastError());
+        RINOK(aes->SetInitVector(cp.chain, AesBlockSize))
+        m_resumedSize = cp.done;
+    }
+    else
+    {
+        RINOK(aes->SetInitVector(cp.iv, AesBlockSize))
+    }
+
+    // VirtualAlloc() returns page aligned memory, AES needs 16 byte aligned data
+    std::unique_ptr<Byte, BufferFree> buffer(static_cast<Byte*>(VirtualAlloc(NULL, ResumeBufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)));
+    if (!buffer)
+        return E_OUTOFMEMORY;
+    UInt64 lastCheckpoint = cp.done;
+    UInt64 done           = cp.done;
+    UInt32 crc            = cp.crc;
+    for (;;)
+    {
+        DWORD size = 0;
+        while (size < ResumeBufferSize)
+        {
+            DWORD read = 0;
+            if (!ReadFile(hSource.get(), buffer.get() + size, ResumeBufferSize - size, &read, NULL))
+                return HRESULT_FROM_WIN32(GetLastError());
+            if (read == 0)
+                break;
+            if (m_ioCallback)
+                m_ioCallback(fileInfo.FilePath, read, false);
+            size += read;
+        }
+        if (size == 0)
+            break;
+        if (done + size > total)
+            break; // the file got bigger
+        crc = CrcUpdate(crc, buffer.get(), size);
+
+        // only the last block can be incomplete, it's padded with zeros
+        DWORD paddedSize = (size + AesBlockSize - 1) & ~(AesBlockSize - 1);
+        memset(buffer.get() + size, 0, paddedSize - size);
+        aes->Filter(buffer.get(), paddedSize);
+        RINOK(WriteStream(outFile, buffer.get(), paddedSize))
+        done += size;
+        if (size < ResumeBufferSize)
+            break;
+
+        cp.done = done;
+        cp.crc  = crc;
+        memcpy(cp.chain, buffer.get() + paddedSize - AesBlockSize, AesBlockSize);
+        bool cancel = m_progressCallback && (m_progressCallback(done, total, fileInfo.FilePath) == E_ABORT);
+        if (cancel || (done - lastCheckpoint >= m_interval))
+        {
+            // the data must be on disk before the checkpoint says it is
+            if (FlushFileBuffers(hArchiveFile) && SaveCheckpoint(cp))
+                lastCheckpoint = done;
+        }
+        if (cancel)
+            return E_ABORT;
+    }
+    if (done != total)
+    {
+        // the source file changed while it was encrypted: the checkpoint is of no use anymore
+        DeleteFile(m_checkpointPath.c_str());
+        return HRESULT_FROM_WIN32(ERROR_FILE_INVALID);
+    }
+
+    HRESULT hr = WriteHeader(out, fileInfo, total, CRC_GET_DIGEST(crc), cp.iv);
+    if (FAILED(hr))
+        return hr;
+    if (m_hasArchiveFileInfo)
+        outFile->SetFileInfo(nullptr, nullptr, &m_archiveWriteTime, m_archiveAttributes);
+    hr = outFile->Close();
+    if (SUCCEEDED(hr))
+        DeleteFile(m_checkpointPath.c_str());
+    return hr;
+}
+
+HRESULT ResumableEncoder::WriteHeader(NArchive::N7z::COutArchive& out, const FilePathInfo& fileInfo, UInt64 size, UInt32 crc, const Byte* iv) const
+{
+    COM_TRY_BEGIN
+    // a folder with just the 7zAES coder, which 7-zip writes too if there's
+    // no compression. The properties are the number of cycles with the flag
+    // for the IV, the IV size - 1 and the IV.
+    Byte props[2 + AesBlockSize];
+    props[0] = static_cast<Byte>(AesNumCyclesPower | (1 << 6));
+    props[1] = static_cast<Byte>(AesBlockSize - 1);
+    memcpy(props + 2, iv, AesBlockSize);
+
+    NArchive::N7z::CArchiveDatabaseOut db;
+    db.PackSizes.Add((size + AesBlockSize - 1) & ~static_cast<UInt64>(AesBlockSize - 1));
+    NArchive::N7z::CFolder& folder = db.Folders.AddNew();
+    folder.Coders.SetSize(1);
+    folder.Coders[0].MethodID   = NArchive::N7z::k_AES;
+    folder.Coders[0].NumStreams = 1;
+    folder.Coders[0].Props.CopyFrom(props, sizeof(props));
+    folder.PackStreams.SetSize(1);
+    folder.PackStreams[0] = 0;
+    db.NumUnpackStreamsVector.Add(1);
+    db.CoderUnpackSizes.Add(size);
+
+    NArchive::N7z::CFileItem file = {};
+    file.Size                     = size;
+    file.Crc                      = crc;
+    file.CrcDefined               = true;
+    file.HasStream                = true;
+
+    NArchive::N7z::CFileItem2 file2 = {};
+    file2.CTime                     = ToUInt64(fileInfo.CreationTime);
+    file2.ATime                     = ToUInt64(fileInfo.LastAccessTime);
+    file2.MTime                     = ToUInt64(fileInfo.LastWriteTime);
+    file2.Attrib                    = fileInfo.Attributes;
+    file2.CTimeDefined              = true;
+    file2.ATimeDefined              = true;
+    file2.MTimeDefined              = true;
+    file2.AttribDefined             = true;
+    db.AddFile(file, file2, UString(fileInfo.FileName.c_str()));
+
+    // the header is encrypted with the password, like with the "he" option
+    NArchive::N7z::CCompressionMethodMode options;
+    options.PasswordIsDefined = true;
+    options.Password          = m_password.c_str();
+
+    NArchive::N7z::CHeaderOptions headerOptions;
+    headerOptions.CompressMainHeader = false;
+    return out.WriteDatabase(db, &options, headerOptions);
+    COM_TRY_END
+}
+}
@@ -0,0 +1,109 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include "../CPP/Common/MyTypes.h"
+
+#include <functional>
+#include <string>
+
+struct FilePathInfo;
+
+namespace NArchive::N7z
+{
+class COutArchive;
+}
+
+namespace SevenZip
+{
+// The temp files of ResumableEncoder must be found again by the next run, so
+// instead of a random part their names end in a GUID reserved for them: files
+// of the user with a similar extension are still synced.
+/// appended to the archive path for the archive while ResumableEncoder writes it
+constexpr wchar_t ResumePartialExtension[]    = L".cspart-{5E0C2B7A-93D4-4F1E-A86B-2D7F94C3E1A5}";
+/// appended to the archive path for the checkpoint file of ResumableEncoder
+constexpr wchar_t ResumeCheckpointExtension[] = L".cscheckpoint-{5E0C2B7A-93D4-4F1E-A86B-2D7F94C3E1A5}";
+/// default number of bytes between two checkpoints
+constexpr UInt64  ResumeCheckpointInterval    = 256ULL * 1024 * 1024;
+
+/// Writes a 7z archive with a single stored (not compressed) file that is
+/// encrypted with 7zAES, so that the work can be resumed after it was
+/// interrupted.
+///
+/// The state of the LZMA encoder can't be saved, but AES-CBC only depends on
+/// the key and the last cipher block. So every checkpoint interval, the
+/// archive is flushed to disk and the number of bytes done, the CRC so far
+/// and the last cipher block are written to the checkpoint file. The
+/// checkpoint contains nothing secret, the key is derived from the password.
+///
+/// Encode() continues from the checkpoint if the source file still has the
+/// same size and last write time, and if encrypting the source again gives
+/// the same first and last cipher blocks as in the archive. Otherwise it
+/// starts from the beginning. When the archive is complete, the checkpoint
+/// file is deleted.
+class ResumableEncoder
+{
+public:
+    ResumableEncoder(const std::wstring& archivePath, const std::wstring& checkpointPath, const std::wstring& password);
+    ~ResumableEncoder();
+
+    void    SetCheckpointInterval(UInt64 interval) { m_interval = interval; }
+    void    SetProgressCallback(const std::function<HRESULT(UInt64 pos, UInt64 total, const std::wstring& path)>& func) { m_progressCallback = func; }
+    void    SetIoCallback(const std::function<void(const std::wstring& path, UInt64 size, bool write)>& func) { m_ioCallback = func; }
+    void    SetArchiveFileInfo(const FILETIME& lastWriteTime, DWORD attributes);
+
+    /// Encrypts the file into the archive. If the progress callback returns
+    /// E_ABORT, a checkpoint is written and E_ABORT is returned.
+    HRESULT Encode(const FilePathInfo& fileInfo);
+
+    /// returns the number of bytes the last Encode() call did not have to
+    /// encrypt again because of the checkpoint
+    UInt64  GetResumedSize() const { return m_resumedSize; }
+
+private:
+    struct Checkpoint
+    {
+        UInt32   magic;
+        UInt32   version;
+        UInt64   sourceSize;
+        FILETIME sourceWriteTime;
+        UInt64   done; ///< bytes of the source in the archive, a multiple of the AES block size
+        UInt32   crc;  ///< CRC state of the first \c done bytes
+        Byte     iv[16];
+        Byte     chain[16]; ///< the last cipher block
+        UInt32   checksum;  ///< of all the members above
+    };
+
+    bool    LoadCheckpoint(Checkpoint& cp) const;
+    bool    SaveCheckpoint(Checkpoint& cp) const;
+    HRESULT WriteHeader(NArchive::N7z::COutArchive& out, const FilePathInfo& fileInfo, UInt64 size, UInt32 crc, const Byte* iv) const;
+
+    std::wstring                                                               m_archivePath;
+    std::wstring                                                               m_checkpointPath;
+    std::wstring                                                               m_password;
+    UInt64                                                                     m_interval;
+    std::function<HRESULT(UInt64 pos, UInt64 total, const std::wstring& path)> m_progressCallback;
+    std::function<void(const std::wstring& path, UInt64 size, bool write)>     m_ioCallback;
+    bool                                                                       m_hasArchiveFileInfo;
+    FILETIME                                                                   m_archiveWriteTime;
+    DWORD                                                                      m_archiveAttributes;
+    UInt64                                                                     m_resumedSize;
+};
+}
@@ -0,0 +1,425 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "stdafx.h"
+#include "UnbufferedFile.h"
+
+#include <algorithm>
+
+namespace SevenZip
+{
+namespace
+{
+// STREAM_SEEK_SET/CUR/END have the same values as FILE_BEGIN/CURRENT/END
+HRESULT GetSeekPosition(Int64 offset, UInt32 seekOrigin, UInt64 position, UInt64 size, UInt64& newPosition)
+{
+    Int64 base = 0;
+    switch (seekOrigin)
+    {
+        case FILE_BEGIN:
+            base = 0;
+            break;
+        case FILE_CURRENT:
+            base = static_cast<Int64>(position);
+            break;
+        case FILE_END:
+            base = static_cast<Int64>(size);
+            break;
+        default:
+            return STG_E_INVALIDFUNCTION;
+    }
+    if (base + offset < 0)
+        return HRESULT_FROM_WIN32(ERROR_NEGATIVE_SEEK);
+    newPosition = static_cast<UInt64>(base + offset);
+    return S_OK;
+}
+
+void SetOffset(OVERLAPPED& overlapped, UInt64 offset)
+{
+    overlapped.Offset     = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+}
+} // namespace
+
+DWORD GetUnbufferedAlignment(HANDLE hFile)
+{
+    // 4k works for all disks with 512 byte and with 4k sectors
+    DWORD             alignment   = 4096;
+    FILE_STORAGE_INFO storageInfo = {};
+    if (GetFileInformationByHandleEx(hFile, FileStorageInfo, &storageInfo, sizeof(storageInfo)))
+        alignment = std::max({alignment, storageInfo.LogicalBytesPerSector, storageInfo.PhysicalBytesPerSectorForPerformance});
+    return alignment;
+}
+
+UnbufferedReader::UnbufferedReader()
+    : m_hFile(INVALID_HANDLE_VALUE)
+    , m_size(0)
+    , m_position(0)
+    , m_nextOffset(0)
+    , m_memory(nullptr)
+    , m_current(0)
+{
+}
+
+UnbufferedReader::~UnbufferedReader()
+{
+    CancelAll();
+    for (auto& slot : m_slots)
+    {
+        if (slot.overlapped.hEvent)
+            CloseHandle(slot.overlapped.hEvent);
+    }
+    if (m_memory)
+        VirtualFree(m_memory, 0, MEM_RELEASE);
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+}
+
+bool UnbufferedReader::Open(const std::wstring& path)
+{
+    m_hFile = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                         FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size = {};
+    if (!GetFileSizeEx(m_hFile, &size))
+        return false;
+    m_size = static_cast<UInt64>(size.QuadPart);
+
+    // VirtualAlloc() returns page aligned memory, which is aligned to the sector size
+    m_memory = static_cast<BYTE*>(VirtualAlloc(NULL, UnbufferedSlots * UnbufferedBlockSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (m_memory == nullptr)
+        return false;
+    m_slots.resize(UnbufferedSlots);
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        m_slots[i]                   = {};
+        m_slots[i].buffer            = m_memory + i * UnbufferedBlockSize;
+        m_slots[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (m_slots[i].overlapped.hEvent == NULL)
+            return false;
+    }
+    Restart(0);
+    return true;
+}
+
+HRESULT UnbufferedReader::Read(void* data, UInt32 size, UInt32* processedSize)
+{
+    UInt32 done = 0;
+    BYTE*  dest = static_cast<BYTE*>(data);
+    while ((size > 0) && (m_position < m_size))
+    {
+        Slot&   slot = m_slots[m_current];
+        HRESULT hr   = Complete(slot);
+        if (FAILED(hr))
+        {
+            if (processedSize != NULL)
+                *processedSize = done;
+            return hr;
+        }
+        if ((m_position >= slot.offset) && (m_position < slot.offset + UnbufferedBlockSize))
+        {
+            // a block is only shorter than UnbufferedBlockSize at the end
+            // of the file: if the position is behind it, the file got shorter
+            // since it was opened
+            if (m_position >= slot.offset + slot.bytes)
+                break;
+            DWORD inBlock = static_cast<DWORD>(m_position - slot.offset);
+            DWORD count   = std::min<DWORD>(size, slot.bytes - inBlock);
+            memcpy(dest, slot.buffer + inBlock, count);
+            dest += count;
+            done += count;
+            size -= count;
+            m_position += count;
+        }
+        else if ((m_position >= slot.offset + UnbufferedBlockSize) && (m_position < slot.offset + 2ULL * UnbufferedBlockSize))
+        {
+            // the block is used up: the slot reads ahead, and the next slot has the next block
+            Issue(slot, m_nextOffset);
+            m_nextOffset += UnbufferedBlockSize;
+            m_current = (m_current + 1) % m_slots.size();
+        }
+        else
+            Restart(m_position);
+    }
+    if (processedSize != NULL)
+        *processedSize = done;
+    return S_OK;
+}
+
+HRESULT UnbufferedReader::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition)
+{
+    // the blocks are only read again when the data is needed
+    UInt64  position = 0;
+    HRESULT hr       = GetSeekPosition(offset, seekOrigin, m_position, m_size, position);
+    if (FAILED(hr))
+        return hr;
+    m_position = position;
+    if (newPosition != NULL)
+        *newPosition = m_position;
+    return S_OK;
+}
+
+void UnbufferedReader::Issue(Slot& slot, UInt64 offset)
+{
+    slot.offset  = offset;
+    slot.bytes   = 0;
+    slot.pending = false;
+    slot.result  = S_OK;
+    if (offset >= m_size)
+        return;
+    SetOffset(slot.overlapped, offset);
+    // the whole block is requested even at the end of the file:
+    // unbuffered reads must have a size aligned to the sector size
+    if (ReadFile(m_hFile, slot.buffer, UnbufferedBlockSize, NULL, &slot.overlapped) || (GetLastError() == ERROR_IO_PENDING))
+        slot.pending = true;
+    else if (GetLastError() != ERROR_HANDLE_EOF)
+        slot.result = HRESULT_FROM_WIN32(GetLastError());
+}
+
+HRESULT UnbufferedReader::Complete(Slot& slot)
+{
+    if (slot.pending)
+    {
+        DWORD bytes = 0;
+        if (!GetOverlappedResult(m_hFile, &slot.overlapped, &bytes, TRUE) && (GetLastError() != ERROR_HANDLE_EOF))
+            slot.result = HRESULT_FROM_WIN32(GetLastError());
+        slot.bytes   = bytes;
+        slot.pending = false;
+    }
+    return slot.result;
+}
+
+void UnbufferedReader::Restart(UInt64 position)
+{
+    CancelAll();
+    m_current    = 0;
+    m_nextOffset = position - (position % UnbufferedBlockSize);
+    for (auto& slot : m_slots)
+    {
+        Issue(slot, m_nextOffset);
+        m_nextOffset += UnbufferedBlockSize;
+    }
+}
+
+void UnbufferedReader::CancelAll()
+{
+    for (auto& slot : m_slots)
+    {
+        if (!slot.pending)
+            continue;
+        DWORD bytes = 0;
+        CancelIoEx(m_hFile, &slot.overlapped);
+        GetOverlappedResult(m_hFile, &slot.overlapped, &bytes, TRUE);
+        slot.pending = false;
+    }
+}
+
+UnbufferedWriter::UnbufferedWriter(HANDLE hFile)
+    : m_hFile(hFile)
+    , m_sectorSize(GetUnbufferedAlignment(hFile))
+    , m_position(0)
+    , m_size(0)
+    , m_diskSize(0)
+    , m_memory(nullptr)
+    , m_current(0)
+    , m_blockOffset(0)
+    , m_hasBlock(false)
+    , m_dirty(false)
+    , m_result(S_OK)
+{
+    m_memory = static_cast<BYTE*>(VirtualAlloc(NULL, UnbufferedSlots * UnbufferedBlockSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (m_memory == nullptr)
+    {
+        m_result = E_OUTOFMEMORY;
+        return;
+    }
+    m_slots.resize(UnbufferedSlots);
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        m_slots[i]                   = {};
+        m_slots[i].buffer            = m_memory + i * UnbufferedBlockSize;
+        m_slots[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (m_slots[i].overlapped.hEvent == NULL)
+            m_result = HRESULT_FROM_WIN32(GetLastError());
+    }
+}
+
+UnbufferedWriter::~UnbufferedWriter()
+{
+    WaitAll();
+    for (auto& slot : m_slots)
+    {
+        if (slot.overlapped.hEvent)
+            CloseHandle(slot.overlapped.hEvent);
+    }
+    if (m_memory)
+        VirtualFree(m_memory, 0, MEM_RELEASE);
+}
+
+HRESULT UnbufferedWriter::Write(const void* data, UInt32 size, UInt32* processedSize)
+{
+    UInt32      done   = 0;
+    const BYTE* source = static_cast<const BYTE*>(data);
+    HRESULT     hr     = m_result;
+    while (SUCCEEDED(hr) && (size > 0))
+    {
+        UInt64 blockOffset = m_position - (m_position % UnbufferedBlockSize);
+        if (!m_hasBlock || (blockOffset != m_blockOffset))
+        {
+            hr = FlushBlock();
+            if (SUCCEEDED(hr))
+                hr = LoadBlock(blockOffset);
+            continue;
+        }
+        DWORD inBlock = static_cast<DWORD>(m_position - m_blockOffset);
+        DWORD count   = std::min<DWORD>(size, UnbufferedBlockSize - inBlock);
+        memcpy(m_slots[m_current].buffer + inBlock, source, count);
+        m_dirty = true;
+        source += count;
+        done += count;
+        size -= count;
+        m_position += count;
+        m_size = std::max(m_size, m_position);
+    }
+    if (processedSize != NULL)
+        *processedSize = done;
+    return hr;
+}
+
+HRESULT UnbufferedWriter::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition)
+{
+    // the current block is only written when data for another block comes in
+    UInt64  position = 0;
+    HRESULT hr       = GetSeekPosition(offset, seekOrigin, m_position, m_size, position);
+    if (FAILED(hr))
+        return hr;
+    m_position = position;
+    if (newPosition != NULL)
+        *newPosition = m_position;
+    return S_OK;
+}
+
+HRESULT UnbufferedWriter::SetSize(UInt64 newSize)
+{
+    HRESULT hr = FlushBlock();
+    if (SUCCEEDED(hr))
+        hr = WaitAll();
+    if (FAILED(hr))
+        return hr;
+    FILE_END_OF_FILE_INFO endOfFile = {};
+    endOfFile.EndOfFile.QuadPart    = static_cast<LONGLONG>(newSize);
+    if (!SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)))
+        return HRESULT_FROM_WIN32(GetLastError());
+    m_size     = newSize;
+    m_diskSize = newSize;
+    return S_OK;
+}
+
+HRESULT UnbufferedWriter::Finish()
+{
+    HRESULT hr = FlushBlock();
+    if (SUCCEEDED(hr))
+        hr = WaitAll();
+    if (FAILED(hr))
+        return hr;
+    // the last block was written padded to the sector size
+    if (m_diskSize != m_size)
+    {
+        FILE_END_OF_FILE_INFO endOfFile = {};
+        endOfFile.EndOfFile.QuadPart    = static_cast<LONGLONG>(m_size);
+        if (!SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)))
+            return HRESULT_FROM_WIN32(GetLastError());
+        m_diskSize = m_size;
+    }
+    return S_OK;
+}
+
+HRESULT UnbufferedWriter::LoadBlock(UInt64 offset)
+{
+    Slot&   slot = m_slots[m_current];
+    HRESULT hr   = WaitSlot(slot);
+    if (FAILED(hr))
+        return hr;
+    memset(slot.buffer, 0, UnbufferedBlockSize);
+    if (offset < m_diskSize)
+    {
+        // the block was written before: one of the pending writes might be for it
+        hr = WaitAll();
+        if (FAILED(hr))
+            return hr;
+        DWORD bytes = 0;
+        SetOffset(slot.overlapped, offset);
+        if (!ReadFile(m_hFile, slot.buffer, UnbufferedBlockSize, NULL, &slot.overlapped) && (GetLastError() != ERROR_IO_PENDING))
+        {
+            if (GetLastError() != ERROR_HANDLE_EOF)
+                return HRESULT_FROM_WIN32(GetLastError());
+        }
+        else if (!GetOverlappedResult(m_hFile, &slot.overlapped, &bytes, TRUE) && (GetLastError() != ERROR_HANDLE_EOF))
+            return HRESULT_FROM_WIN32(GetLastError());
+    }
+    m_blockOffset = offset;
+    m_hasBlock    = true;
+    m_dirty       = false;
+    return S_OK;
+}
+
+HRESULT UnbufferedWriter::FlushBlock()
+{
+    if (!m_hasBlock)
+        return S_OK;
+    if (m_dirty)
+    {
+        // the write of the last block is padded to the sector size,
+        // Finish() sets the file size afterwards
+        Slot&  slot  = m_slots[m_current];
+        UInt64 valid = std::min<UInt64>(UnbufferedBlockSize, m_size - m_blockOffset);
+        DWORD  bytes = static_cast<DWORD>((valid + m_sectorSize - 1) / m_sectorSize * m_sectorSize);
+        SetOffset(slot.overlapped, m_blockOffset);
+        if (WriteFile(m_hFile, slot.buffer, bytes, NULL, &slot.overlapped) || (GetLastError() == ERROR_IO_PENDING))
+            slot.pending = true;
+        else
+            return HRESULT_FROM_WIN32(GetLastError());
+        m_diskSize = std::max(m_diskSize, m_blockOffset + bytes);
+    }
+    m_current  = (m_current + 1) % m_slots.size();
+    m_hasBlock = false;
+    m_dirty    = false;
+    return S_OK;
+}
+
+HRESULT UnbufferedWriter::WaitSlot(Slot& slot)
+{
+    if (slot.pending)
+    {
+        DWORD bytes = 0;
+        if (!GetOverlappedResult(m_hFile, &slot.overlapped, &bytes, TRUE) && SUCCEEDED(m_result))
+            m_result = HRESULT_FROM_WIN32(GetLastError());
+        slot.pending = false;
+    }
+    return m_result;
+}
+
+HRESULT UnbufferedWriter::WaitAll()
+{
+    for (auto& slot : m_slots)
+        WaitSlot(slot);
+    return m_result;
+}
+}
@@ -0,0 +1,134 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+#include "../CPP/Common/MyTypes.h"
+
+#include <string>
+#include <vector>
+
+namespace SevenZip
+{
+/// size of the blocks read and written by UnbufferedReader and UnbufferedWriter
+constexpr DWORD  UnbufferedBlockSize  = 1024 * 1024;
+/// number of blocks that are read ahead or written behind at the same time
+constexpr size_t UnbufferedSlots      = 4;
+/// flags to pass to CreateFile() for a file written with UnbufferedWriter
+constexpr DWORD  UnbufferedWriteFlags = FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED;
+
+/// Reads a file without going through the file system cache.
+///
+/// Unbuffered reads have to be aligned to the sector size, so the file
+/// is read in blocks of UnbufferedBlockSize: several blocks are read
+/// ahead while the data of the current block is handed out. Any position
+/// can be read, but only sequential reads are fast.
+class UnbufferedReader
+{
+public:
+    UnbufferedReader();
+    ~UnbufferedReader();
+
+    UnbufferedReader(const UnbufferedReader&)            = delete;
+    UnbufferedReader& operator=(const UnbufferedReader&) = delete;
+
+    bool    Open(const std::wstring& path);
+
+    HRESULT Read(void* data, UInt32 size, UInt32* processedSize);
+    HRESULT Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition);
+    UInt64  GetSize() const { return m_size; }
+
+private:
+    struct Slot
+    {
+        OVERLAPPED overlapped;
+        BYTE*      buffer;
+        UInt64     offset;
+        DWORD      bytes;
+        bool       pending;
+        HRESULT    result;
+    };
+
+    void    Issue(Slot& slot, UInt64 offset);
+    HRESULT Complete(Slot& slot);
+    void    Restart(UInt64 position);
+    void    CancelAll();
+
+    HANDLE            m_hFile;
+    UInt64            m_size;
+    UInt64            m_position;
+    UInt64            m_nextOffset; ///< offset of the next block to read ahead
+    BYTE*             m_memory;
+    std::vector<Slot> m_slots;
+    size_t            m_current; ///< the slot with the block at m_position
+};
+
+/// Writes a file without going through the file system cache.
+///
+/// The data is collected in blocks of UnbufferedBlockSize which are written
+/// in the background while the next block is filled. Writes to positions
+/// that already went to disk read the block back first, so seeking works
+/// as usual, it's just slow. The last block is written padded to the
+/// sector size, Finish() then truncates the file to its real size.
+class UnbufferedWriter
+{
+public:
+    /// \c hFile must be opened with UnbufferedWriteFlags and with read access.
+    /// The writer doesn't close the handle.
+    UnbufferedWriter(HANDLE hFile);
+    ~UnbufferedWriter();
+
+    UnbufferedWriter(const UnbufferedWriter&)            = delete;
+    UnbufferedWriter& operator=(const UnbufferedWriter&) = delete;
+
+    HRESULT Write(const void* data, UInt32 size, UInt32* processedSize);
+    HRESULT Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition);
+    HRESULT SetSize(UInt64 newSize);
+    /// writes all data and sets the file size
+    HRESULT Finish();
+
+private:
+    struct Slot
+    {
+        OVERLAPPED overlapped;
+        BYTE*      buffer;
+        bool       pending;
+    };
+
+    HRESULT LoadBlock(UInt64 offset);
+    HRESULT FlushBlock();
+    HRESULT WaitSlot(Slot& slot);
+    HRESULT WaitAll();
+
+    HANDLE            m_hFile;
+    DWORD             m_sectorSize;
+    UInt64            m_position;
+    UInt64            m_size;
+    UInt64            m_diskSize; ///< end of the data that was written to disk, padded to the sector size
+    BYTE*             m_memory;
+    std::vector<Slot> m_slots;
+    size_t            m_current;     ///< the slot that holds the current block
+    UInt64            m_blockOffset; ///< offset of the current block
+    bool              m_hasBlock;
+    bool              m_dirty;
+    HRESULT           m_result; ///< the first error of a background write
+};
+
+/// returns the alignment unbuffered I/O needs for the file
+DWORD GetUnbufferedAlignment(HANDLE hFile);
+}
@@ -0,0 +1,427 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "AsyncLog.h"
+#include "Platform.h"
+
+#include <chrono>
+#include <cwchar>
+#include <iterator>
+
+namespace
+{
+/// how long the idle writer thread sleeps before it looks at the ring buffer again, in case a wake up got lost
+constexpr auto WriterIdleTimeout = std::chrono::seconds(1);
+/// replaces the middle of strings that don't fit into the string buffer of a record
+constexpr wchar_t Ellipsis[] = L"...";
+
+const wchar_t* GetLevelPrefix(LogLevel level)
+{
+    switch (level)
+    {
+        case LogLevel::Debug:
+            return L"DEBUG:   ";
+        case LogLevel::Info:
+            return L"INFO:    ";
+        case LogLevel::Warning:
+            return L"WARNING: ";
+        case LogLevel::Error:
+            return L"ERROR:   ";
+    }
+    return L"";
+}
+
+bool IsFlag(wchar_t c)
+{
+    return (c == '-') || (c == '+') || (c == ' ') || (c == '#') || (c == '0');
+}
+
+bool IsDigit(wchar_t c)
+{
+    return (c >= '0') && (c <= '9');
+}
+} // namespace
+
+CAsyncLog::CAsyncLog()
+    : m_mask(0)
+    , m_enqueuePos(0)
+    , m_dequeuePos(0)
+    , m_producers(0)
+    , m_running(false)
+    , m_writerSleeping(false)
+    , m_written(0)
+    , m_stop(false)
+{
+}
+
+CAsyncLog::~CAsyncLog()
+{
+    Stop();
+}
+
+CAsyncLog& CAsyncLog::Instance()
+{
+    static CAsyncLog instance;
+    return instance;
+}
+
+void CAsyncLog::SetSink(AsyncLogSink sink)
+{
+    std::lock_guard lock(m_sinkMutex);
+    m_sink = std::move(sink);
+}
+
+bool CAsyncLog::Start(size_t capacity)
+{
+    if (m_running || (capacity == 0))
+        return false;
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    m_slots.reset(new Record[size]);
+    for (size_t i = 0; i < size; ++i)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    m_mask       = size - 1;
+    m_enqueuePos = 0;
+    m_dequeuePos = 0;
+    m_stop       = false;
+    m_thread     = std::thread(&CAsyncLog::WriterThread, this);
+    m_running    = true;
+    return true;
+}
+
+void CAsyncLog::Stop()
+{
+    if (!m_running)
+        return;
+    // from now on the records are written right away. The threads that
+    // saw the log still running take their tickets and publish them: once
+    // they're done, no ticket is handed out anymore and the writer thread
+    // writes all the records in the ring buffer and exits
+    m_running = false;
+    while (m_producers.load() != 0)
+        std::this_thread::yield();
+    {
+        std::lock_guard lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_one();
+    m_thread.join();
+}
+
+void CAsyncLog::Flush()
+{
+    if (!m_running)
+        return;
+    size_t target = m_enqueuePos.load();
+    {
+        std::lock_guard lock(m_mutex);
+        m_writerSleeping = false;
+    }
+    m_wakeup.notify_one();
+    std::unique_lock lock(m_mutex);
+    m_flushed.wait(lock, [&] { return (m_dequeuePos.load() >= target) || m_stop; });
+}
+
+void CAsyncLog::SetArg(Record& record, const wchar_t* value)
+{
+    SetString(record, value ? value : L"(null)", value ? wcslen(value) : 6);
+}
+
+void CAsyncLog::SetArg(Record& record, const std::wstring& value)
+{
+    SetString(record, value.c_str(), value.size());
+}
+
+void CAsyncLog::SetArg(Record& record, const LogFileTime& value)
+{
+    Arg& arg = record.args[record.count++];
+    arg.type = ArgType::FileTime;
+    arg.u    = value.ticks;
+}
+
+void CAsyncLog::SetArg(Record& record, double value)
+{
+    Arg& arg = record.args[record.count++];
+    arg.type = ArgType::Double;
+    arg.d    = value;
+}
+
+void CAsyncLog::SetString(Record& record, const wchar_t* value, size_t size)
+{
+    Arg& arg   = record.args[record.count++];
+    arg.type   = ArgType::String;
+    arg.offset = record.stringsSize;
+    // the strings still to come get their share of the rest of the buffer
+    size_t limit = (ASYNCLOG_STRING_CAPACITY - record.stringsSize) / (record.stringsLeft ? record.stringsLeft : 1);
+    if (record.stringsLeft)
+        --record.stringsLeft;
+    wchar_t* dest = record.strings + record.stringsSize;
+    if (size <= limit)
+    {
+        wmemcpy(dest, value, size);
+        arg.size = size;
+    }
+    else if (limit > wcslen(Ellipsis))
+    {
+        // keep the start and the end, for paths that's the drive and the file name
+        const size_t ellipsisLen = wcslen(Ellipsis);
+        const size_t head        = (limit - ellipsisLen) / 2;
+        const size_t tail        = limit - ellipsisLen - head;
+        wmemcpy(dest, value, head);
+        wmemcpy(dest + head, Ellipsis, ellipsisLen);
+        wmemcpy(dest + head + ellipsisLen, value + size - tail, tail);
+        arg.size = limit;
+    }
+    else
+        arg.size = 0;
+    record.stringsSize += arg.size;
+}
+
+CAsyncLog::Record* CAsyncLog::Acquire(size_t& ticket)
+{
+    // the bounded queue of Dmitry Vyukov: a slot is free for a ticket
+    // when its sequence equals the ticket
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Record&   slot = m_slots[pos & m_mask];
+        size_t    seq  = slot.sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+        if (diff == 0)
+        {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                ticket = pos;
+                return &slot;
+            }
+        }
+        else if (diff < 0)
+        {
+            // full: wait for the writer
+            std::this_thread::yield();
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+        else
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+    }
+}
+
+void CAsyncLog::Publish(Record& record, size_t ticket)
+{
+    record.sequence.store(ticket + 1, std::memory_order_release);
+    // pairs with the fence of the writer thread before it goes to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_writerSleeping.load(std::memory_order_relaxed))
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_writerSleeping = false;
+        }
+        m_wakeup.notify_one();
+    }
+}
+
+void CAsyncLog::WriteNow(const Record& record)
+{
+    std::wstring    line;
+    std::lock_guard lock(m_sinkMutex);
+    Write(record, line);
+}
+
+void CAsyncLog::Write(const Record& record, std::wstring& line)
+{
+    line.clear();
+    Format(record, line);
+    if (m_sink)
+        m_sink(record.level, line);
+    ++m_written;
+}
+
+void CAsyncLog::Format(const Record& record, std::wstring& line)
+{
+    line += GetLevelPrefix(record.level);
+    size_t         argIndex = 0;
+    wchar_t        buffer[128];
+    std::wstring   spec;
+    const wchar_t* p = record.format;
+    while (*p)
+    {
+        if (*p != '%')
+        {
+            const wchar_t* start = p;
+            while (*p && (*p != '%'))
+                ++p;
+            line.append(start, p - start);
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            line += '%';
+            p += 2;
+            continue;
+        }
+        // %[flags][width][.precision][size]type
+        const wchar_t* start = p++;
+        spec.assign(1, '%');
+        while (IsFlag(*p))
+            spec += *p++;
+        while (IsDigit(*p))
+            spec += *p++;
+        if (*p == '.')
+        {
+            spec += *p++;
+            while (IsDigit(*p))
+                spec += *p++;
+        }
+        // the size prefixes are ignored: the arguments are stored with 64 bits
+        while ((*p == 'l') || (*p == 'h') || (*p == 'z') || (*p == 'j') || (*p == 't') || (*p == 'L') || (*p == 'w'))
+            ++p;
+        if (*p == 'I')
+        {
+            ++p;
+            if (((p[0] == '3') && (p[1] == '2')) || ((p[0] == '6') && (p[1] == '4')))
+                p += 2;
+        }
+        wchar_t type = *p;
+        if (type)
+            ++p;
+        if (!type || (argIndex >= record.count))
+        {
+            // no argument for it: keep the specifier as it is
+            line.append(start, p - start);
+            continue;
+        }
+        const Arg& arg = record.args[argIndex++];
+        switch (arg.type)
+        {
+            case ArgType::String:
+                if (spec.size() == 1)
+                    line.append(record.strings + arg.offset, arg.size);
+                else
+                {
+                    std::wstring str(record.strings + arg.offset, arg.size);
+                    std::wstring formatted(str.size() + 64, '\0');
+                    spec += L"ls";
+                    int len = swprintf(formatted.data(), formatted.size(), spec.c_str(), str.c_str());
+                    line.append(formatted.c_str(), len > 0 ? len : 0);
+                }
+                continue;
+            case ArgType::FileTime:
+                line += CPlatform::FormatFileTime(arg.u);
+                continue;
+            default:
+                break;
+        }
+        long long          signedValue   = arg.type == ArgType::Double ? static_cast<long long>(arg.d) : arg.i;
+        unsigned long long unsignedValue = arg.type == ArgType::Double ? static_cast<unsigned long long>(arg.d) : arg.u;
+        double             doubleValue   = arg.type == ArgType::Double ? arg.d : (arg.type == ArgType::Signed ? static_cast<double>(arg.i) : static_cast<double>(arg.u));
+        int                len           = 0;
+        switch (type)
+        {
+            case 'c':
+            case 'C':
+                line += static_cast<wchar_t>(unsignedValue);
+                continue;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                spec += type;
+                len = swprintf(buffer, std::size(buffer), spec.c_str(), doubleValue);
+                break;
+            case 'd':
+            case 'i':
+                spec += L"lld";
+                len = swprintf(buffer, std::size(buffer), spec.c_str(), signedValue);
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                spec += L"ll";
+                spec += type;
+                len = swprintf(buffer, std::size(buffer), spec.c_str(), unsignedValue);
+                break;
+            case 'p':
+                spec += L"llX";
+                len = swprintf(buffer, std::size(buffer), spec.c_str(), unsignedValue);
+                break;
+            default:
+                // a number for %s or an unknown type
+                if (arg.type == ArgType::Double)
+                    len = swprintf(buffer, std::size(buffer), L"%g", doubleValue);
+                else if (arg.type == ArgType::Signed)
+                    len = swprintf(buffer, std::size(buffer), L"%lld", signedValue);
+                else
+                    len = swprintf(buffer, std::size(buffer), L"%llu", unsignedValue);
+                break;
+        }
+        if (len > 0)
+            line.append(buffer, len);
+    }
+}
+
+void CAsyncLog::WriterThread()
+{
+    std::wstring line;
+    for (;;)
+    {
+        // write all records that are published
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Record& slot = m_slots[pos & m_mask];
+            if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+                break;
+            {
+                std::lock_guard lock(m_sinkMutex);
+                Write(slot, line);
+            }
+            slot.sequence.store(pos + m_mask + 1, std::memory_order_release);
+            m_dequeuePos.store(++pos, std::memory_order_release);
+        }
+
+        std::unique_lock lock(m_mutex);
+        m_flushed.notify_all();
+        if (pos != m_enqueuePos.load())
+        {
+            // a ticket is taken but its record is not published yet
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        if (m_stop)
+            break;
+        m_writerSleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_slots[pos & m_mask].sequence.load(std::memory_order_relaxed) == pos + 1)
+        {
+            m_writerSleeping = false;
+            continue;
+        }
+        m_wakeup.wait_for(lock, WriterIdleTimeout, [this] { return !m_writerSleeping || m_stop; });
+        m_writerSleeping = false;
+    }
+}
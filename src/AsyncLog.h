@@ -0,0 +1,231 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+enum class LogLevel
+{
+    Debug, ///< traces for developers, they go to the debugger instead of the log file
+    Info,
+    Warning,
+    Error
+};
+
+/// records below this level are not even compiled in, by default the debug traces are only in debug builds
+#ifndef ASYNCLOG_MIN_LEVEL
+#    ifdef _DEBUG
+#        define ASYNCLOG_MIN_LEVEL 0
+#    else
+#        define ASYNCLOG_MIN_LEVEL 1
+#    endif
+#endif
+
+/// the most arguments a log record can have
+constexpr size_t ASYNCLOG_MAX_ARGS         = 8;
+/// characters the string arguments of a record can have together, enough for two MAX_PATH paths
+constexpr size_t ASYNCLOG_STRING_CAPACITY  = 2 * 260;
+/// records the ring buffer holds by default, must be a power of two
+constexpr size_t ASYNCLOG_DEFAULT_CAPACITY = 4096;
+
+/// a file time argument, in 100ns ticks since 1601-01-01 UTC: it is formatted as local time by the writer thread
+struct LogFileTime
+{
+    uint64_t ticks = 0;
+};
+
+/// receives the formatted lines, with the level prefix ("INFO:    ") and without a line break
+using AsyncLogSink = std::function<void(LogLevel level, const std::wstring& line)>;
+
+/**
+ * Asynchronous log with deferred formatting.
+ *
+ * The threads that log only copy the format string pointer and the
+ * arguments into a slot of a lock free ring buffer, the strings into a
+ * fixed buffer of the slot: strings that don't fit are shortened in the
+ * middle, with "..." in place of the removed part. A writer thread
+ * formats the records and passes the lines to the sink, in the order
+ * they were logged. The format must be a string literal (it is used
+ * after the call returns) with printf style specifiers, which are
+ * formatted the same on every platform: %s takes wide strings and
+ * LogFileTime, the integer size prefixes (I, I64, l, ll, z) are ignored.
+ *
+ * When the ring buffer is full, the threads that log wait for the
+ * writer. Before Start() and after Stop() the records are formatted and
+ * written right away by the thread that logs.
+ */
+class CAsyncLog
+{
+public:
+    CAsyncLog();
+    ~CAsyncLog();
+
+    CAsyncLog(const CAsyncLog&)            = delete;
+    CAsyncLog& operator=(const CAsyncLog&) = delete;
+
+    static CAsyncLog& Instance();
+
+    /// sets where the lines go, call before Start()
+    void              SetSink(AsyncLogSink sink);
+    /// starts the writer thread, capacity is rounded up to a power of two
+    bool              Start(size_t capacity = ASYNCLOG_DEFAULT_CAPACITY);
+    /// writes the pending records, including the ones of threads that are
+    /// logging right now, and stops the writer thread
+    void              Stop();
+    /// returns once all records logged before the call are written to the sink
+    void              Flush();
+    bool              IsRunning() const { return m_running; }
+    /// the records written to the sink so far
+    uint64_t          GetWritten() const { return m_written; }
+
+    template <LogLevel level, typename... Args>
+    void Log([[maybe_unused]] const wchar_t* format, [[maybe_unused]] const Args&... args)
+    {
+        static_assert(sizeof...(Args) <= ASYNCLOG_MAX_ARGS, "too many log arguments");
+        if constexpr (static_cast<int>(level) >= ASYNCLOG_MIN_LEVEL)
+        {
+            Record local;
+            size_t ticket = 0;
+            // Stop() waits for the threads that saw the log running until they published their record
+            m_producers.fetch_add(1);
+            Record* record = m_running ? Acquire(ticket) : &local;
+            if (record == &local)
+                m_producers.fetch_sub(1);
+            record->level       = level;
+            record->format      = format;
+            record->count       = 0;
+            record->stringsSize = 0;
+            record->stringsLeft = (static_cast<size_t>(IsStringArg<Args>) + ... + 0);
+            (SetArg(*record, args), ...);
+            if (record == &local)
+                WriteNow(local);
+            else
+            {
+                Publish(*record, ticket);
+                m_producers.fetch_sub(1);
+            }
+        }
+    }
+
+    template <typename... Args>
+    void Debug(const wchar_t* format, const Args&... args) { Log<LogLevel::Debug>(format, args...); }
+    template <typename... Args>
+    void Info(const wchar_t* format, const Args&... args) { Log<LogLevel::Info>(format, args...); }
+    template <typename... Args>
+    void Warning(const wchar_t* format, const Args&... args) { Log<LogLevel::Warning>(format, args...); }
+    template <typename... Args>
+    void Error(const wchar_t* format, const Args&... args) { Log<LogLevel::Error>(format, args...); }
+
+private:
+    enum class ArgType : uint8_t
+    {
+        Signed,
+        Unsigned,
+        Double,
+        String, ///< offset and size in Record::strings
+        FileTime
+    };
+
+    struct Arg
+    {
+        ArgType type = ArgType::Signed;
+        union
+        {
+            int64_t  i;
+            uint64_t u = 0;
+            double   d;
+        };
+        size_t offset = 0;
+        size_t size   = 0;
+    };
+
+    /// a slot of the ring buffer. The strings of the arguments are copied
+    /// into one buffer of the slot, so logging doesn't allocate
+    struct Record
+    {
+        std::atomic<size_t> sequence{0};
+        LogLevel            level       = LogLevel::Info;
+        const wchar_t*      format      = nullptr;
+        size_t              count       = 0;
+        size_t              stringsSize = 0; ///< characters used in strings
+        size_t              stringsLeft = 0; ///< string arguments still to copy, they share the rest of the buffer
+        Arg                 args[ASYNCLOG_MAX_ARGS];
+        wchar_t             strings[ASYNCLOG_STRING_CAPACITY];
+    };
+
+    template <typename T>
+    static constexpr bool IsStringArg = std::is_convertible_v<const T&, const wchar_t*> || std::is_same_v<T, std::wstring>;
+
+    static void SetArg(Record& record, const wchar_t* value);
+    static void SetArg(Record& record, const std::wstring& value);
+    static void SetArg(Record& record, const LogFileTime& value);
+    static void SetArg(Record& record, double value);
+    template <typename T>
+        requires std::is_integral_v<T>
+    static void SetArg(Record& record, T value)
+    {
+        Arg& arg = record.args[record.count++];
+        if constexpr (std::is_signed_v<T>)
+        {
+            arg.type = ArgType::Signed;
+            arg.i    = value;
+        }
+        else
+        {
+            arg.type = ArgType::Unsigned;
+            arg.u    = value;
+        }
+    }
+    static void SetString(Record& record, const wchar_t* value, size_t size);
+
+    /// waits for a free slot and reserves it
+    Record*     Acquire(size_t& ticket);
+    /// hands a filled slot to the writer thread
+    void        Publish(Record& record, size_t ticket);
+    void        WriteNow(const Record& record);
+    void        Write(const Record& record, std::wstring& line);
+    /// appends the message of a record with the level prefix to line
+    static void Format(const Record& record, std::wstring& line);
+    void        WriterThread();
+
+    std::unique_ptr<Record[]>       m_slots;
+    size_t                          m_mask;
+    alignas(64) std::atomic<size_t> m_enqueuePos; ///< the next ticket, written by all threads that log
+    alignas(64) std::atomic<size_t> m_dequeuePos; ///< the next ticket the writer thread writes
+    alignas(64) std::atomic<size_t> m_producers;  ///< threads that might still take a ticket
+    std::atomic<bool>               m_running;
+    std::atomic<bool>               m_writerSleeping;
+    std::atomic<uint64_t>           m_written;
+    bool                            m_stop;
+    std::mutex                      m_mutex;     ///< for the condition variables
+    std::condition_variable         m_wakeup;    ///< wakes the writer thread
+    std::condition_variable         m_flushed;   ///< signaled when the writer wrote all records
+    std::mutex                      m_sinkMutex; ///< serializes the sink when the records are written right away
+    AsyncLogSink                    m_sink;
+    std::thread                     m_thread;
+};
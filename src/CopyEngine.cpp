@@ -0,0 +1,294 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+#include "stdafx.h"
+#include "CopyEngine.h"
+#include "SmartHandle.h"
+#include "DebugOutput.h"
+#include "OnOutOfScope.h"
+
+#include <winioctl.h>
+#include <algorithm>
+#include <memory>
+
+namespace
+{
+ULONGLONG GetSize(const WIN32_FILE_ATTRIBUTE_DATA& data)
+{
+    return (static_cast<ULONGLONG>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+}
+
+/// deletes the file when the handle is closed, without changing the last error
+void DiscardFile(HANDLE hFile)
+{
+    auto                  lastError       = GetLastError();
+    FILE_DISPOSITION_INFO dispositionInfo = {TRUE};
+    SetFileInformationByHandle(hFile, FileDispositionInfo, &dispositionInfo, sizeof(dispositionInfo));
+    SetLastError(lastError);
+}
+} // namespace
+
+CCopyEngine::CCopyEngine()
+    : m_ioCallback(nullptr)
+    , m_lastMethod(CopyMethod::None)
+    , m_compareContent(false)
+    , m_src(nullptr)
+    , m_dst(nullptr)
+    , m_transferred(0)
+{
+}
+
+CCopyEngine::~CCopyEngine()
+{
+}
+
+bool CCopyEngine::Copy(const std::wstring& src, const std::wstring& dst)
+{
+    m_lastMethod                      = CopyMethod::None;
+    WIN32_FILE_ATTRIBUTE_DATA srcData = {};
+    if (!GetFileAttributesEx(src.c_str(), GetFileExInfoStandard, &srcData))
+        return false;
+
+    WIN32_FILE_ATTRIBUTE_DATA dstData = {};
+    if (m_compareContent &&
+        GetFileAttributesEx(dst.c_str(), GetFileExInfoStandard, &dstData) &&
+        ((dstData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) &&
+        (GetSize(dstData) == GetSize(srcData)) &&
+        HasSameContent(src, dst))
+    {
+        // the file only has a different time, e.g. because it was
+        // copied by another tool or restored from a backup
+        CAutoFile hFile = CreateFile(dst.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (hFile.IsValid() && SetFileInfo(hFile, srcData, false))
+        {
+            m_lastMethod = CopyMethod::Skipped;
+            return true;
+        }
+    }
+
+    if (CloneFile(src, dst, srcData))
+        m_lastMethod = CopyMethod::BlockClone;
+    else if (CopySystem(src, dst))
+        m_lastMethod = CopyMethod::System;
+    else
+    {
+        // the caller has to create the folder first
+        if (GetLastError() == ERROR_PATH_NOT_FOUND)
+            return false;
+        if (!StreamFile(src, dst, srcData))
+            return false;
+        m_lastMethod = CopyMethod::Streamed;
+    }
+    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": copied %s to %s with method %s\n"), src.c_str(), dst.c_str(), GetMethodName(m_lastMethod));
+    return true;
+}
+
+bool CCopyEngine::HasSameContent(const std::wstring& path1, const std::wstring& path2)
+{
+    CAutoFile hFile1 = CreateFile(path1.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (!hFile1.IsValid())
+        return false;
+    CAutoFile hFile2 = CreateFile(path2.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (!hFile2.IsValid())
+        return false;
+
+    // the files are compared in chunks: a difference is usually found
+    // in the first chunk already, so most of the files don't have to be read
+    auto buffer1 = std::make_unique<BYTE[]>(COPYENGINE_BUFFER_SIZE);
+    auto buffer2 = std::make_unique<BYTE[]>(COPYENGINE_BUFFER_SIZE);
+    for (;;)
+    {
+        DWORD read1 = 0;
+        DWORD read2 = 0;
+        if (!ReadFile(hFile1, buffer1.get(), COPYENGINE_BUFFER_SIZE, &read1, nullptr) ||
+            !ReadFile(hFile2, buffer2.get(), COPYENGINE_BUFFER_SIZE, &read2, nullptr))
+            return false;
+        if (m_ioCallback)
+        {
+            m_ioCallback(path1, read1, false);
+            m_ioCallback(path2, read2, false);
+        }
+        if (read1 != read2)
+            return false;
+        if (read1 == 0)
+            return true;
+        if (memcmp(buffer1.get(), buffer2.get(), read1) != 0)
+            return false;
+    }
+}
+
+const wchar_t* CCopyEngine::GetMethodName(CopyMethod method)
+{
+    switch (method)
+    {
+        case CopyMethod::None:
+            return L"none";
+        case CopyMethod::Skipped:
+            return L"skipped";
+        case CopyMethod::BlockClone:
+            return L"block clone";
+        case CopyMethod::System:
+            return L"system";
+        case CopyMethod::Streamed:
+            return L"streamed";
+    }
+    return L"";
+}
+
+bool CCopyEngine::CloneFile(const std::wstring& src, const std::wstring& dst, const WIN32_FILE_ATTRIBUTE_DATA& srcData)
+{
+    // block cloning only works within one volume, and only if the file system supports it
+    wchar_t srcVolume[MAX_PATH] = {};
+    wchar_t dstVolume[MAX_PATH] = {};
+    if (!GetVolumePathName(src.c_str(), srcVolume, _countof(srcVolume)) ||
+        !GetVolumePathName(dst.c_str(), dstVolume, _countof(dstVolume)) ||
+        (_wcsicmp(srcVolume, dstVolume) != 0))
+        return false;
+    CAutoFile hSrc = CreateFile(src.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (!hSrc.IsValid())
+        return false;
+    DWORD fsFlags = 0;
+    if (!GetVolumeInformationByHandleW(hSrc, nullptr, 0, nullptr, nullptr, &fsFlags, nullptr, 0) || ((fsFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING) == 0))
+        return false;
+    // the clone regions have to be aligned to clusters
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity = {};
+    DWORD                                  bytes     = 0;
+    if (!DeviceIoControl(hSrc, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &integrity, sizeof(integrity), &bytes, nullptr) || (integrity.ClusterSizeInBytes == 0))
+        return false;
+
+    CAutoFile hDst = CreateFile(dst.c_str(), GENERIC_READ | GENERIC_WRITE | DELETE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (!hDst.IsValid())
+        return false;
+    bool bRet = false;
+    // remove the partial target, so the next method starts from scratch
+    OnOutOfScope(if (!bRet) DiscardFile(hDst));
+
+    if ((srcData.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0)
+    {
+        FILE_SET_SPARSE_BUFFER sparse = {TRUE};
+        if (!DeviceIoControl(hDst, FSCTL_SET_SPARSE, &sparse, sizeof(sparse), nullptr, 0, &bytes, nullptr))
+            return false;
+    }
+    // the target must have its final size before the blocks are cloned into it
+    ULONGLONG             size      = GetSize(srcData);
+    FILE_END_OF_FILE_INFO endOfFile = {};
+    endOfFile.EndOfFile.QuadPart    = static_cast<LONGLONG>(size);
+    if (!SetFileInformationByHandle(hDst, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)))
+        return false;
+
+    ULONGLONG clusterSize = integrity.ClusterSizeInBytes;
+    for (ULONGLONG offset = 0; offset < size; offset += COPYENGINE_CLONE_CHUNK)
+    {
+        // the last region is rounded up to a full cluster, which is allowed
+        // since it ends at the end of the file
+        ULONGLONG              count      = std::min(COPYENGINE_CLONE_CHUNK, size - offset);
+        count                             = (count + clusterSize - 1) / clusterSize * clusterSize;
+        DUPLICATE_EXTENTS_DATA extents    = {};
+        extents.FileHandle                = hSrc;
+        extents.SourceFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        extents.TargetFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        extents.ByteCount.QuadPart        = static_cast<LONGLONG>(count);
+        if (!DeviceIoControl(hDst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), nullptr, 0, &bytes, nullptr))
+            return false;
+    }
+    bRet = SetFileInfo(hDst, srcData, true);
+    return bRet;
+}
+
+bool CCopyEngine::CopySystem(const std::wstring& src, const std::wstring& dst)
+{
+    m_src         = &src;
+    m_dst         = &dst;
+    m_transferred = 0;
+    OnOutOfScope(m_src = nullptr; m_dst = nullptr;);
+    // CopyFileEx() lets SMB servers copy files on the server, and
+    // uses copy offloading where the storage supports it
+    return !!CopyFileEx(src.c_str(), dst.c_str(), CopyProgressRoutine, this, nullptr, 0);
+}
+
+DWORD CALLBACK CCopyEngine::CopyProgressRoutine(LARGE_INTEGER /*totalFileSize*/, LARGE_INTEGER totalBytesTransferred, LARGE_INTEGER /*streamSize*/, LARGE_INTEGER /*streamBytesTransferred*/,
+                                                DWORD /*dwStreamNumber*/, DWORD /*dwCallbackReason*/, HANDLE /*hSourceFile*/, HANDLE /*hDestinationFile*/, LPVOID lpData)
+{
+    // every chunk CopyFileEx() copies is read from the source and written to the target
+    auto* engine = static_cast<CCopyEngine*>(lpData);
+    auto  total  = static_cast<ULONGLONG>(totalBytesTransferred.QuadPart);
+    if ((total > engine->m_transferred) && engine->m_ioCallback)
+    {
+        engine->m_ioCallback(*engine->m_src, total - engine->m_transferred, false);
+        engine->m_ioCallback(*engine->m_dst, total - engine->m_transferred, true);
+    }
+    engine->m_transferred = std::max(engine->m_transferred, total);
+    return PROGRESS_CONTINUE;
+}
+
+bool CCopyEngine::StreamFile(const std::wstring& src, const std::wstring& dst, const WIN32_FILE_ATTRIBUTE_DATA& srcData)
+{
+    // the source is opened with all sharing flags: this copies files
+    // CopyFileEx() can't open because another process writes to them
+    CAutoFile hSrc = CreateFile(src.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (!hSrc.IsValid())
+        return false;
+    CAutoFile hDst = CreateFile(dst.c_str(), GENERIC_WRITE | DELETE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (!hDst.IsValid())
+        return false;
+    bool bRet = false;
+    OnOutOfScope(if (!bRet) DiscardFile(hDst));
+
+    // reserve the space up front so the file system can allocate it in one piece
+    FILE_ALLOCATION_INFO allocInfo    = {};
+    allocInfo.AllocationSize.QuadPart = static_cast<LONGLONG>(GetSize(srcData));
+    SetFileInformationByHandle(hDst, FileAllocationInfo, &allocInfo, sizeof(allocInfo));
+
+    auto buffer = std::make_unique<BYTE[]>(COPYENGINE_BUFFER_SIZE);
+    for (;;)
+    {
+        DWORD read = 0;
+        if (!ReadFile(hSrc, buffer.get(), COPYENGINE_BUFFER_SIZE, &read, nullptr))
+            return false;
+        if (read == 0)
+            break;
+        if (m_ioCallback)
+            m_ioCallback(src, read, false);
+        DWORD written = 0;
+        if (!WriteFile(hDst, buffer.get(), read, &written, nullptr) || (written != read))
+            return false;
+        if (m_ioCallback)
+            m_ioCallback(dst, written, true);
+    }
+    bRet = SetFileInfo(hDst, srcData, true);
+    return bRet;
+}
+
+bool CCopyEngine::SetFileInfo(HANDLE hFile, const WIN32_FILE_ATTRIBUTE_DATA& data, bool setAttributes)
+{
+    FILE_BASIC_INFO basicInfo         = {};
+    basicInfo.CreationTime.LowPart    = data.ftCreationTime.dwLowDateTime;
+    basicInfo.CreationTime.HighPart   = data.ftCreationTime.dwHighDateTime;
+    basicInfo.LastWriteTime.LowPart   = data.ftLastWriteTime.dwLowDateTime;
+    basicInfo.LastWriteTime.HighPart  = data.ftLastWriteTime.dwHighDateTime;
+    basicInfo.LastAccessTime.LowPart  = data.ftLastAccessTime.dwLowDateTime;
+    basicInfo.LastAccessTime.HighPart = data.ftLastAccessTime.dwHighDateTime;
+    if (setAttributes)
+    {
+        // attributes which are 0 are left unchanged, FILE_ATTRIBUTE_NORMAL clears them
+        basicInfo.FileAttributes = data.dwFileAttributes & COPYENGINE_ATTRIBUTES;
+        if (basicInfo.FileAttributes == 0)
+            basicInfo.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+    }
+    return !!SetFileInformationByHandle(hFile, FileBasicInfo, &basicInfo, sizeof(basicInfo));
+}
@@ -0,0 +1,95 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+/// size of the buffer used to stream and to compare files
+constexpr DWORD     COPYENGINE_BUFFER_SIZE = 4 * 1024 * 1024;
+/// max number of bytes cloned with one request
+constexpr ULONGLONG COPYENGINE_CLONE_CHUNK = 1024ULL * 1024 * 1024;
+/// attributes that are copied to the target when the file is cloned or streamed
+constexpr DWORD     COPYENGINE_ATTRIBUTES  = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE |
+                                             FILE_ATTRIBUTE_TEMPORARY | FILE_ATTRIBUTE_OFFLINE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+
+/// how CCopyEngine::Copy() copied the last file
+enum class CopyMethod
+{
+    None,       ///< the copy failed
+    Skipped,    ///< the target already had the same content, only the times were set
+    BlockClone, ///< the file system shares the blocks of the source with the target
+    System,     ///< CopyFileEx(), which uses server-side copies and offloading where possible
+    Streamed,   ///< read and written by CryptSync itself
+};
+
+/**
+ * Copies files with the cheapest method the file system supports.
+ *
+ * If comparing the content is turned on and the target already exists with
+ * the same size and the same content, only its times are set. That reads
+ * both files, so it only pays off if the targets are expensive to write,
+ * e.g. on a slow network share. Otherwise the file is cloned if source and
+ * target are on the same volume and the file system supports block
+ * cloning (ReFS), then \c CopyFileEx() is tried, which lets the SMB server
+ * copy the file for network shares. If that fails, e.g. because another
+ * process has the source open for writing, the file is streamed with a
+ * large buffer.
+ * The target gets the times and attributes of the source.
+ */
+class CCopyEngine
+{
+public:
+    CCopyEngine();
+    ~CCopyEngine();
+
+    /// sets a function which is called with the path and the number of bytes
+    /// of every read and write the engine does
+    void                  SetIoCallback(const std::function<void(const std::wstring& path, ULONGLONG size, bool write)>& func) { m_ioCallback = func; }
+
+    /// if set, a target with the same size is compared with the source first
+    /// and only gets the times of the source if the content is the same
+    void                  SetCompareContent(bool compare) { m_compareContent = compare; }
+
+    /// copies \c src to \c dst, replacing \c dst. On failure, GetLastError() has the error.
+    bool                  Copy(const std::wstring& src, const std::wstring& dst);
+
+    CopyMethod            GetLastMethod() const { return m_lastMethod; }
+
+    /// returns true if both files have the same content
+    bool                  HasSameContent(const std::wstring& path1, const std::wstring& path2);
+
+    static const wchar_t* GetMethodName(CopyMethod method);
+
+private:
+    bool                  CloneFile(const std::wstring& src, const std::wstring& dst, const WIN32_FILE_ATTRIBUTE_DATA& srcData);
+    bool                  CopySystem(const std::wstring& src, const std::wstring& dst);
+    bool                  StreamFile(const std::wstring& src, const std::wstring& dst, const WIN32_FILE_ATTRIBUTE_DATA& srcData);
+    static bool           SetFileInfo(HANDLE hFile, const WIN32_FILE_ATTRIBUTE_DATA& data, bool setAttributes);
+    static DWORD CALLBACK CopyProgressRoutine(LARGE_INTEGER totalFileSize, LARGE_INTEGER totalBytesTransferred, LARGE_INTEGER streamSize, LARGE_INTEGER streamBytesTransferred,
+                                              DWORD dwStreamNumber, DWORD dwCallbackReason, HANDLE hSourceFile, HANDLE hDestinationFile, LPVOID lpData);
+
+    std::function<void(const std::wstring& path, ULONGLONG size, bool write)> m_ioCallback;
+    CopyMethod                                                                m_lastMethod;
+    bool                                                                      m_compareContent;
+    const std::wstring*                                                       m_src;         ///< while CopySystem() runs
+    const std::wstring*                                                       m_dst;         ///< while CopySystem() runs
+    ULONGLONG                                                                 m_transferred; ///< by CopyFileEx()
+};
@@ -20,9 +20,18 @@
 #include "stdafx.h"
 #include "CmdLineParser.h"
 #include "TrayWindow.h"
+#include "WatchDaemon.h"
 #include "Ignores.h"
 #include "PathUtils.h"
 #include "CircularLog.h"
+#include "AsyncLog.h"
+#include "DebugOutput.h"
+#include "SyncTrace.h"
+#include "SyncReport.h"
+#include "Platform.h"
+#include "Registry.h"
+#include "UnicodeUtils.h"
+#include "SmartHandle.h"
 #include "resource.h"
 
 constexpr auto MAX_LOADSTRING = 100;
@@ -33,6 +42,8 @@ TCHAR     szTitle[MAX_LOADSTRING];       // The title bar text
 TCHAR     szWindowClass[MAX_LOADSTRING]; // the main window class name
 CPairs    g_pairs;
 
+CWatchDaemon* g_watchDaemon = nullptr; // the instance the console control handler stops
+
 // Forward declarations of functions included in this code module:
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 INT_PTR CALLBACK About(HWND, UINT, WPARAM, LPARAM);
@@ -59,6 +70,109 @@ std::wstring GetMutexID()
     return t;
 }
 
+/// writes the plan of a dry run to a file, or shows it in the console CryptSync was started from
+void OutputPlanReport(const std::wstring& report, const std::wstring& file)
+{
+    if (!file.empty())
+    {
+        CAutoFile hFile = CreateFile(file.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile)
+        {
+            auto  utf8    = CUnicodeUtils::StdGetUTF8(report);
+            DWORD written = 0;
+            WriteFile(hFile, utf8.c_str(), static_cast<DWORD>(utf8.size()), &written, nullptr);
+        }
+        else
+            CCircularLog::Instance()(L"ERROR:   could not write the plan to \"%s\"", file.c_str());
+        return;
+    }
+    if (AttachConsole(ATTACH_PARENT_PROCESS))
+    {
+        DWORD written = 0;
+        WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), report.c_str(), static_cast<DWORD>(report.size()), &written, nullptr);
+        FreeConsole();
+        return;
+    }
+    MessageBox(nullptr, report.c_str(), L"CryptSync dry run", MB_ICONINFORMATION);
+}
+
+/// writes the JSON report of a /src /dst or /syncall run to file
+void WriteSyncReport(CFolderSync& folderSync, int ret, ULONGLONG startTicks, bool dryRun, const std::wstring& file)
+{
+    SyncReport report;
+    report.exitCode     = ret;
+    report.dryRun       = dryRun;
+    report.microseconds = (GetTickCount64() - startTicks) * 1000;
+    report.pairs        = folderSync.GetSyncStats();
+    for (const auto& [path, op] : folderSync.GetFailures())
+        report.failures.push_back({path, op == Encrypt});
+    if (!CFileSystem::Native().WriteContent(file, report.ToJson()))
+        CAsyncLog::Instance().Error(L"could not write the report to \"%s\"", file.c_str());
+}
+
+/// starts tracing with /trace[:path], or if the TracePath registry value is set
+void StartTrace(const CCmdLineParser& parser, const std::wstring& logPath)
+{
+    std::wstring path = std::wstring(CRegStdString(L"Software\\CryptSync\\TracePath", L""));
+    if (parser.HasVal(L"trace"))
+        path = parser.GetVal(L"trace");
+    else if (parser.HasKey(L"trace") && path.empty())
+        path = logPath.substr(0, logPath.find_last_of('\\') + 1) + L"CryptSync-trace.json";
+    if (!path.empty() && CSyncTrace::Instance().Start(path))
+        CCircularLog::Instance()(L"INFO:    tracing to \"%s\"", path.c_str());
+}
+
+/// writes the trace and the pending log lines before CryptSync exits
+void StopLogging()
+{
+    if (CSyncTrace::IsEnabled() && !CSyncTrace::Instance().Stop())
+        CAsyncLog::Instance().Error(L"could not write the trace");
+    CAsyncLog::Instance().Stop();
+}
+
+/// stops the watch mode on ctrl+c or when the console goes away, ctrl+break reloads the settings
+BOOL WINAPI WatchCtrlHandler(DWORD ctrlType)
+{
+    if (!g_watchDaemon)
+        return FALSE;
+    switch (ctrlType)
+    {
+        case CTRL_BREAK_EVENT:
+            g_watchDaemon->Reload();
+            break;
+        case CTRL_CLOSE_EVENT:
+        case CTRL_LOGOFF_EVENT:
+        case CTRL_SHUTDOWN_EVENT:
+            // the process gets terminated as soon as this handler returns, and
+            // a few seconds after the event anyway: drain only what fits in there
+            g_watchDaemon->Stop(true);
+            g_watchDaemon->WaitForStopped(WATCHDAEMON_SHUTDOWN_WAIT_MS);
+            CAsyncLog::Instance().Flush();
+            break;
+        default:
+            g_watchDaemon->Stop();
+            break;
+    }
+    return TRUE;
+}
+
+/// signals an instance running in watch mode: /watch:stop or /watch:reload
+int SignalWatchDaemon(const std::wstring& command)
+{
+    std::wstring name;
+    if (_wcsicmp(command.c_str(), L"stop") == 0)
+        name = CWatchDaemon::GetStopEventName();
+    else if (_wcsicmp(command.c_str(), L"reload") == 0)
+        name = CWatchDaemon::GetReloadEventName();
+    else
+        return 1;
+    CAutoGeneralHandle hEvent = OpenEvent(EVENT_MODIFY_STATE, FALSE, name.c_str());
+    if (!hEvent)
+        return 1; // no instance is running in watch mode
+    SetEvent(hEvent);
+    return 0;
+}
+
 int APIENTRY _tWinMain(HINSTANCE hInstance,
                        HINSTANCE hPrevInstance,
                        LPTSTR    lpCmdLine,
@@ -98,7 +212,21 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
                              L"/progress     : shows a progress dialog while syncing\n"
                              L"/logpath      : path to a logfile\n"
                              L"/maxlog       : maximum number of lines the logfile can have\n"
-                             L"/tray         : start in background without showing a dialog first\n\n"
+                             L"/tray         : start in background without showing a dialog first\n"
+                             L"/watch        : syncs all set up pairs continuously without a window:\n"
+                             L"                watches the folders, scans them every FullScanInterval\n"
+                             L"                and reloads the settings when they change. Ctrl+C\n"
+                             L"                stops, Ctrl+Break reloads. /watch:stop and\n"
+                             L"                /watch:reload signal a running instance\n"
+                             L"/dryrun       : with /src and /dst or /syncall: only shows what would be\n"
+                             L"                synced, with the estimated bytes and cpu time.\n"
+                             L"                /dryrun:path writes it to a file instead\n"
+                             L"/report:path  : with /src and /dst or /syncall: writes a JSON report with\n"
+                             L"                the durations, the counts, bytes and compression ratios\n"
+                             L"                of the operations and the failed files to path\n"
+                             L"/trace        : records where the time goes to CryptSync-trace.json next\n"
+                             L"                to the log, for chrome://tracing or the Perfetto UI.\n"
+                             L"                /trace:path writes it to path instead\n\n"
                              L"the %ERRORLEVEL% is set to a bitmask on return, or zero on success:\n"
                              L"1: Cancelled\n"
                              L"2: Access denied\n"
@@ -108,6 +236,9 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
         return 1;
     }
 
+    if (parser.HasVal(L"watch"))
+        return SignalWatchDaemon(parser.GetVal(L"watch"));
+
     std::wstring lp     = parser.HasVal(L"logpath") ? parser.GetVal(L"logpath") : L"";
     int          maxlog = parser.HasVal(L"maxlog") ? parser.GetLongVal(L"maxlog") : 10000;
 
@@ -152,6 +283,15 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
     }
 
     CCircularLog::Instance().Init(lp, maxlog);
+    // the sync engine logs through the asynchronous log, which formats the lines on its own thread
+    CAsyncLog::Instance().SetSink([](LogLevel level, const std::wstring& line) {
+        if (level == LogLevel::Debug)
+            CTraceToOutputDebugString::Instance()(L"%s\n", line.c_str());
+        else
+            CCircularLog::Instance()(L"%s", line.c_str());
+    });
+    CAsyncLog::Instance().Start();
+    StartTrace(parser, lp);
     CCircularLog::Instance()(L"INFO:    Starting CryptSync");
 
     if (parser.HasVal(L"src") && parser.HasVal(L"dst"))
@@ -180,7 +320,8 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
         if (!ign.empty())
             CIgnores::Instance().Reload(ign);
 
-        CPairs pair;
+        // only syncs the pair of the command line, the stored pairs stay as they are
+        CPairs pair(CRYPTSYNC_REGKEY, true);
         pair.clear();
         SyncDir syncDir = BothWays;
         if (mirror && !mirrorback)
@@ -191,7 +332,15 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
         CFolderSync foldersync;
         if (decryptonly)
             foldersync.DecryptOnly(true);
-        const auto ret = foldersync.SyncFoldersWait(pair, parser.HasKey(L"progress") ? GetDesktopWindow() : nullptr);
+        foldersync.DryRun(!!parser.HasKey(L"dryrun"));
+        foldersync.MeasureWrittenBytes(!!parser.HasVal(L"report"));
+        const auto startTicks = GetTickCount64();
+        const auto ret        = foldersync.SyncFoldersWait(pair, parser.HasKey(L"progress") ? GetDesktopWindow() : nullptr);
+        if (parser.HasVal(L"report"))
+            WriteSyncReport(foldersync, ret, startTicks, !!parser.HasKey(L"dryrun"), parser.GetVal(L"report"));
+        if (parser.HasKey(L"dryrun"))
+            OutputPlanReport(foldersync.GetPlanReport(), parser.HasVal(L"dryrun") ? parser.GetVal(L"dryrun") : L"");
+        StopLogging();
         CCircularLog::Instance()(L"INFO:    exiting CryptSync");
         CCircularLog::Instance().Save();
         return ret;
@@ -200,9 +349,17 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
     {
         CIgnores::Instance().Reload();
 
-        CPairs      pair;
+        CPairs      pair(CRYPTSYNC_REGKEY, true);
         CFolderSync foldersync;
-        const auto  ret = foldersync.SyncFoldersWait(pair, parser.HasKey(L"progress") ? GetDesktopWindow() : nullptr);
+        foldersync.DryRun(!!parser.HasKey(L"dryrun"));
+        foldersync.MeasureWrittenBytes(!!parser.HasVal(L"report"));
+        const auto  startTicks = GetTickCount64();
+        const auto  ret        = foldersync.SyncFoldersWait(pair, parser.HasKey(L"progress") ? GetDesktopWindow() : nullptr);
+        if (parser.HasVal(L"report"))
+            WriteSyncReport(foldersync, ret, startTicks, !!parser.HasKey(L"dryrun"), parser.GetVal(L"report"));
+        if (parser.HasKey(L"dryrun"))
+            OutputPlanReport(foldersync.GetPlanReport(), parser.HasVal(L"dryrun") ? parser.GetVal(L"dryrun") : L"");
+        StopLogging();
         CCircularLog::Instance()(L"INFO:    exiting CryptSync");
         CCircularLog::Instance().Save();
         return ret;
@@ -218,11 +375,39 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
         OleUninitialize();
         if (hReloadProtection)
             CloseHandle(hReloadProtection);
+        StopLogging();
         CCircularLog::Instance()(L"INFO:    An instance of CryptSync is already running - exiting");
         CCircularLog::Instance().Save();
         return 0;
     }
 
+    if (parser.HasKey(L"watch"))
+    {
+        CWatchDaemon daemon;
+        g_watchDaemon = &daemon;
+        // started from a console: show the stats there and stop on ctrl+c
+        const bool console = !!AttachConsole(ATTACH_PARENT_PROCESS);
+        if (console)
+        {
+            daemon.SetConsoleOutput(true);
+            SetConsoleCtrlHandler(WatchCtrlHandler, TRUE);
+        }
+        const auto ret = daemon.Run();
+        if (console)
+        {
+            SetConsoleCtrlHandler(WatchCtrlHandler, FALSE);
+            FreeConsole();
+        }
+        g_watchDaemon = nullptr;
+        CoUninitialize();
+        OleUninitialize();
+        CloseHandle(hReloadProtection);
+        StopLogging();
+        CCircularLog::Instance()(L"INFO:    exiting CryptSync");
+        CCircularLog::Instance().Save();
+        return ret;
+    }
+
     CTrayWindow trayWindow(hInstance);
     trayWindow.ShowDialogImmediately(!parser.HasKey(L"tray"));
 
@@ -238,12 +423,14 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
                 DispatchMessage(&msg);
             }
         }
+        StopLogging();
         return static_cast<int>(msg.wParam);
     }
 
     CoUninitialize();
     OleUninitialize();
     CloseHandle(hReloadProtection);
+    StopLogging();
     CCircularLog::Instance()(L"INFO:    exiting CryptSync");
     CCircularLog::Instance().Save();
     return 1;
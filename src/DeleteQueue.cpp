@@ -0,0 +1,506 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+#include "stdafx.h"
+#include "DeleteQueue.h"
+#include "PathUtils.h"
+#include "DirFileEnum.h"
+#include "Registry.h"
+#include "StringUtils.h"
+#include "AsyncLog.h"
+#include "COMPtrs.h"
+#include "SmartHandle.h"
+
+#include <set>
+#include <map>
+#include <algorithm>
+
+namespace
+{
+std::wstring ShellPath(const std::wstring& path)
+{
+    // the shell does not handle the \\?\ prefix
+    if (path.starts_with(L"\\\\?\\UNC\\"))
+        return L"\\" + path.substr(7);
+    if (path.starts_with(L"\\\\?\\"))
+        return path.substr(4);
+    return path;
+}
+
+bool PathExists(const std::wstring& path)
+{
+    return GetFileAttributes(CPathUtils::AdjustForMaxPath(path).c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+bool DeletePathDirect(const std::wstring& path)
+{
+    auto  longPath = CPathUtils::AdjustForMaxPath(path);
+    DWORD attribs  = GetFileAttributes(longPath.c_str());
+    if (attribs == INVALID_FILE_ATTRIBUTES)
+        return true;
+    if (attribs & FILE_ATTRIBUTE_READONLY)
+        SetFileAttributes(longPath.c_str(), attribs & ~FILE_ATTRIBUTE_READONLY);
+    if ((attribs & FILE_ATTRIBUTE_DIRECTORY) == 0)
+        return DeleteFile(longPath.c_str()) != FALSE;
+
+    // delete all files first, then the folders from the bottom up
+    std::vector<std::wstring> dirs;
+    CDirFileEnum              enumerator(path);
+    std::wstring              filePath;
+    bool                      isDir = false;
+    while (enumerator.NextFile(filePath, &isDir, true))
+    {
+        auto longFilePath = CPathUtils::AdjustForMaxPath(filePath);
+        if (isDir)
+        {
+            dirs.push_back(longFilePath);
+            continue;
+        }
+        if (!DeleteFile(longFilePath.c_str()))
+        {
+            SetFileAttributes(longFilePath.c_str(), FILE_ATTRIBUTE_NORMAL);
+            DeleteFile(longFilePath.c_str());
+        }
+    }
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it)
+        RemoveDirectory(it->c_str());
+    return RemoveDirectory(longPath.c_str()) != FALSE;
+}
+
+class CDirectDeleteBackend : public IDeleteBackend
+{
+public:
+    std::vector<std::wstring> Delete(const std::vector<DeleteItem>& items) override
+    {
+        std::vector<std::wstring> failed;
+        for (const auto& item : items)
+        {
+            if (!DeletePathDirect(item.path))
+                failed.push_back(item.path);
+        }
+        return failed;
+    }
+};
+
+class CRecycleBinBackend : public IDeleteBackend
+{
+public:
+    std::vector<std::wstring> Delete(const std::vector<DeleteItem>& items) override
+    {
+        // one shell operation for all items
+        std::vector<std::wstring> remaining;
+        IFileOperationPtr         pfo = nullptr;
+        auto                      hr  = pfo.CreateInstance(CLSID_FileOperation, nullptr, CLSCTX_ALL);
+        if (SUCCEEDED(hr))
+        {
+            DWORD flags = FOF_ALLOWUNDO | FOF_FILESONLY | FOF_NOCONFIRMATION | FOF_NO_CONNECTED_ELEMENTS | FOF_NOERRORUI | FOF_SILENT | FOFX_RECYCLEONDELETE;
+            hr          = pfo->SetOperationFlags(flags);
+        }
+        bool anyQueued = false;
+        for (const auto& item : items)
+        {
+            IShellItemPtr psiFrom = nullptr;
+            if (SUCCEEDED(hr))
+            {
+                auto hrItem = SHCreateItemFromParsingName(ShellPath(item.path).c_str(), nullptr, IID_PPV_ARGS(&psiFrom));
+                if ((hrItem == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) || (hrItem == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND)))
+                    continue;
+                if (SUCCEEDED(hrItem) && SUCCEEDED(pfo->DeleteItem(psiFrom, nullptr)))
+                {
+                    anyQueued = true;
+                    continue;
+                }
+            }
+            remaining.push_back(item.path);
+        }
+        if (anyQueued)
+        {
+            pfo->PerformOperations();
+            // whatever is still there failed, no matter what the operation reported
+            for (const auto& item : items)
+            {
+                if (PathExists(item.path) && (std::ranges::find(remaining, item.path) == remaining.end()))
+                    remaining.push_back(item.path);
+            }
+        }
+        if (remaining.empty())
+            return remaining;
+
+        // try the SHFileOperation with all remaining paths at once
+        std::wstring fromBuf;
+        for (const auto& path : remaining)
+        {
+            fromBuf += ShellPath(path);
+            fromBuf += L'\0';
+        }
+        fromBuf += L'\0';
+        SHFILEOPSTRUCT fop = {nullptr};
+        fop.wFunc          = FO_DELETE;
+        fop.fFlags         = FOF_ALLOWUNDO | FOF_FILESONLY | FOF_NOCONFIRMATION | FOF_NO_CONNECTED_ELEMENTS | FOF_NOERRORUI | FOF_SILENT;
+        fop.pFrom          = fromBuf.c_str();
+        SHFileOperation(&fop);
+
+        // and delete what's left directly
+        std::vector<std::wstring> failed;
+        for (const auto& path : remaining)
+        {
+            if (!DeletePathDirect(path))
+                failed.push_back(path);
+        }
+        return failed;
+    }
+};
+
+class CTrashFolderBackend : public IDeleteBackend
+{
+public:
+    explicit CTrashFolderBackend(DWORD retentionDays)
+        : m_retentionDays(retentionDays)
+    {
+    }
+
+    std::vector<std::wstring> Delete(const std::vector<DeleteItem>& items) override
+    {
+        std::vector<std::wstring>                      failed;
+        std::map<std::wstring, std::wstring, ci_lessW> batchFolders; // root -> trash folder of this batch
+        for (const auto& item : items)
+        {
+            if (!PathExists(item.path))
+                continue;
+            if (item.root.empty() || (item.path.size() <= item.root.size() + 1) ||
+                (_wcsnicmp(item.path.c_str(), item.root.c_str(), item.root.size()) != 0))
+            {
+                // the path is not in a pair folder, there's no trash folder for it
+                if (!DeletePathDirect(item.path))
+                    failed.push_back(item.path);
+                continue;
+            }
+            auto batchIt = batchFolders.find(item.root);
+            if (batchIt == batchFolders.end())
+                batchIt = batchFolders.emplace(item.root, CreateBatchFolder(item.root)).first;
+            bool moved = false;
+            if (!batchIt->second.empty())
+            {
+                auto relPath = item.path.substr(item.root.size() + 1);
+                auto target  = CPathUtils::Append(batchIt->second, relPath);
+                CPathUtils::CreateRecursiveDirectory(target.substr(0, target.find_last_of('\\')));
+                moved = MoveFileEx(CPathUtils::AdjustForMaxPath(item.path).c_str(), CPathUtils::AdjustForMaxPath(target).c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+            }
+            if (!moved && !DeletePathDirect(item.path))
+                failed.push_back(item.path);
+        }
+        for (const auto& [root, batchFolder] : batchFolders)
+            RemoveExpired(CPathUtils::Append(root, DELETEQUEUE_TRASH_FOLDER));
+        return failed;
+    }
+
+private:
+    /// creates a new folder for the paths deleted now, named after the current time
+    std::wstring CreateBatchFolder(const std::wstring& root) const
+    {
+        auto trashFolder = CPathUtils::Append(root, DELETEQUEUE_TRASH_FOLDER);
+        if (CreateDirectory(CPathUtils::AdjustForMaxPath(trashFolder).c_str(), nullptr))
+            SetFileAttributes(CPathUtils::AdjustForMaxPath(trashFolder).c_str(), FILE_ATTRIBUTE_HIDDEN);
+        SYSTEMTIME st = {};
+        GetLocalTime(&st);
+        wchar_t name[64] = {};
+        swprintf_s(name, L"%04d%02d%02d-%02d%02d%02d", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+        for (int i = 0; i < 100; ++i)
+        {
+            std::wstring batchFolder = CPathUtils::Append(trashFolder, name);
+            if (i > 0)
+                batchFolder += L"-" + std::to_wstring(i);
+            if (CreateDirectory(CPathUtils::AdjustForMaxPath(batchFolder).c_str(), nullptr))
+                return batchFolder;
+            if (GetLastError() != ERROR_ALREADY_EXISTS)
+                break;
+        }
+        CAsyncLog::Instance().Error(L"could not create a folder in the trash folder \"%s\"", trashFolder.c_str());
+        return {};
+    }
+
+    /// removes the batch folders older than the retention time
+    void RemoveExpired(const std::wstring& trashFolder) const
+    {
+        FILETIME now = {};
+        GetSystemTimeAsFileTime(&now);
+        ULARGE_INTEGER limit = {};
+        limit.LowPart        = now.dwLowDateTime;
+        limit.HighPart       = now.dwHighDateTime;
+        limit.QuadPart -= m_retentionDays * 24ULL * 60 * 60 * 10000000;
+
+        WIN32_FIND_DATA findData = {};
+        CAutoFindFile   hFind    = FindFirstFileEx(CPathUtils::AdjustForMaxPath(trashFolder + L"\\*").c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch, nullptr, 0);
+        if (!hFind.IsValid())
+            return;
+        do
+        {
+            if (((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) ||
+                (wcscmp(findData.cFileName, L".") == 0) || (wcscmp(findData.cFileName, L"..") == 0))
+                continue;
+            ULARGE_INTEGER created = {};
+            created.LowPart        = findData.ftCreationTime.dwLowDateTime;
+            created.HighPart       = findData.ftCreationTime.dwHighDateTime;
+            if (created.QuadPart < limit.QuadPart)
+            {
+                auto expired = CPathUtils::Append(trashFolder, findData.cFileName);
+                CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": remove expired trash folder %s", expired.c_str());
+                DeletePathDirect(expired);
+            }
+        } while (FindNextFile(hFind, &findData));
+    }
+
+    DWORD m_retentionDays;
+};
+
+/// deletes the paths directly on a file system other than the native one
+class CFileSystemDeleteBackend : public IDeleteBackend
+{
+public:
+    explicit CFileSystemDeleteBackend(CFileSystem& fs)
+        : m_fs(fs)
+    {
+    }
+
+    std::vector<std::wstring> Delete(const std::vector<DeleteItem>& items) override
+    {
+        std::vector<std::wstring> failed;
+        for (const auto& item : items)
+        {
+            if (!DeletePath(item.path))
+                failed.push_back(item.path);
+        }
+        return failed;
+    }
+
+private:
+    bool DeletePath(const std::wstring& path)
+    {
+        PlatformFileInfo info;
+        if (!m_fs.Stat(path, info))
+        {
+            auto error = m_fs.LastError();
+            return (error == PlatformError::NotFound) || (error == PlatformError::PathNotFound);
+        }
+        if (!info.directory)
+            return m_fs.Remove(path);
+
+        // delete all files first, then the folders from the bottom up
+        std::vector<std::wstring> dirs;
+        m_fs.Enumerate(path, [&](const std::wstring& relPath, const PlatformFileInfo& entry) {
+            auto entryPath = path + L"\\" + relPath;
+            if (entry.directory)
+                dirs.push_back(entryPath);
+            else
+                m_fs.Remove(entryPath);
+            return true;
+        });
+        for (auto it = dirs.rbegin(); it != dirs.rend(); ++it)
+            m_fs.Remove(*it);
+        return m_fs.Remove(path);
+    }
+
+    CFileSystem& m_fs;
+};
+
+/// returns true if all entries of the folder \c dir are in \c queued
+bool AllEntriesQueued(const CFileSystem& fs, const std::wstring& dir, const std::set<std::wstring, ci_lessW>& queued)
+{
+    bool anyEntry  = false;
+    bool allQueued = true;
+    bool ok        = fs.Enumerate(
+        dir, [&](const std::wstring& relPath, const PlatformFileInfo&) {
+            allQueued = queued.find(dir + L"\\" + relPath) != queued.end();
+            anyEntry  = true;
+            return allQueued;
+        },
+        // only the entries of the folder itself
+        [](const std::wstring&, const PlatformFileInfo&) { return false; });
+    return ok && anyEntry && allQueued;
+}
+
+/// returns true if \c path doesn't exist, false if it does or that is unknown
+bool PathMissing(const CFileSystem& fs, const std::wstring& path)
+{
+    PlatformFileInfo info;
+    if (fs.Stat(path, info))
+        return false;
+    auto error = fs.LastError();
+    return (error == PlatformError::NotFound) || (error == PlatformError::PathNotFound);
+}
+} // namespace
+
+CDeleteQueue::CDeleteQueue(std::function<void(const std::wstring&)> beforeDelete, CFileSystem& fs)
+    : m_fs(fs)
+    , m_beforeDelete(std::move(beforeDelete))
+{
+}
+
+CDeleteQueue::~CDeleteQueue()
+{
+    Flush();
+}
+
+void CDeleteQueue::SetBackend(std::unique_ptr<IDeleteBackend> backend)
+{
+    CAutoWriteLock locker(m_guard);
+    m_backend = std::move(backend);
+}
+
+void CDeleteQueue::Add(const std::wstring& path, const std::wstring& root, const std::wstring& counterpart)
+{
+    size_t queued = 0;
+    {
+        CAutoWriteLock locker(m_guard);
+        m_items.push_back({path, root, counterpart});
+        queued = m_items.size();
+    }
+    if (queued >= DELETEQUEUE_BATCH_SIZE)
+        Flush();
+}
+
+size_t CDeleteQueue::Flush()
+{
+    std::vector<DeleteItem> items;
+    {
+        CAutoWriteLock locker(m_guard);
+        items.swap(m_items);
+        if (!items.empty() && !m_backend)
+        {
+            if (&m_fs == &CFileSystem::Native())
+                m_backend = CreateBackend(GetConfiguredMode());
+            else
+                m_backend = std::make_unique<CFileSystemDeleteBackend>(m_fs);
+        }
+    }
+    if (items.empty())
+        return 0;
+
+    CollapseDirectories(items, m_fs);
+    if (m_beforeDelete)
+    {
+        for (const auto& item : items)
+            m_beforeDelete(item.path);
+    }
+    CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": deleting %d paths", static_cast<int>(items.size()));
+    auto failed = m_backend->Delete(items);
+    for (const auto& path : failed)
+        CAsyncLog::Instance().Error(L"could not delete \"%s\"", path.c_str());
+    return failed.size();
+}
+
+DeleteMode CDeleteQueue::GetConfiguredMode()
+{
+    DWORD mode = CRegStdDWORD(L"Software\\CryptSync\\DeleteMode", static_cast<DWORD>(DeleteMode::RecycleBin));
+    if (mode > static_cast<DWORD>(DeleteMode::TrashFolder))
+        return DeleteMode::RecycleBin;
+    return static_cast<DeleteMode>(mode);
+}
+
+std::unique_ptr<IDeleteBackend> CDeleteQueue::CreateBackend(DeleteMode mode)
+{
+    switch (mode)
+    {
+        case DeleteMode::Direct:
+            return std::make_unique<CDirectDeleteBackend>();
+        case DeleteMode::TrashFolder:
+            return std::make_unique<CTrashFolderBackend>(CRegStdDWORD(L"Software\\CryptSync\\TrashRetentionDays", DELETEQUEUE_DEFAULT_RETENTION));
+        case DeleteMode::RecycleBin:
+        default:
+            return std::make_unique<CRecycleBinBackend>();
+    }
+}
+
+bool CDeleteQueue::IsTrashPath(const std::wstring& path)
+{
+    const size_t nameLen = wcslen(DELETEQUEUE_TRASH_FOLDER);
+    for (size_t pos = path.find_first_of(L"\\/"); pos != std::wstring::npos; pos = path.find_first_of(L"\\/", pos + 1))
+    {
+        if ((_wcsnicmp(path.c_str() + pos + 1, DELETEQUEUE_TRASH_FOLDER, nameLen) == 0) &&
+            ((path.size() == pos + 1 + nameLen) || (path[pos + 1 + nameLen] == '\\') || (path[pos + 1 + nameLen] == '/')))
+            return true;
+    }
+    return false;
+}
+
+void CDeleteQueue::CollapseDirectories(std::vector<DeleteItem>& items, const CFileSystem& fs)
+{
+    if (items.size() < 2)
+        return;
+    std::set<std::wstring, ci_lessW>             queued;
+    std::map<std::wstring, DeleteItem, ci_lessW> queuedItems; // queued path -> item
+    for (const auto& item : items)
+    {
+        queued.insert(item.path);
+        queuedItems.emplace(item.path, item);
+    }
+
+    // the parent folders of the queued paths, the deepest first
+    auto deeperFirst = [](const std::wstring& a, const std::wstring& b) {
+        if (a.size() != b.size())
+            return a.size() > b.size();
+        return _wcsicmp(a.c_str(), b.c_str()) < 0;
+    };
+    std::set<std::wstring, decltype(deeperFirst)> dirs(deeperFirst);
+    std::map<std::wstring, DeleteItem, ci_lessW>  dirItems; // folder -> item that replaces its entries
+    auto                                          addParent = [&](const DeleteItem& item) {
+        auto pos = item.path.find_last_of('\\');
+        // only folders below the root of the pair
+        if ((pos == std::wstring::npos) || (pos <= item.root.size()) || (_wcsnicmp(item.path.c_str(), item.root.c_str(), item.root.size()) != 0))
+            return;
+        auto dir            = item.path.substr(0, pos);
+        auto counterpartPos = item.counterpart.find_last_of('\\');
+        auto counterpartDir = counterpartPos == std::wstring::npos ? std::wstring() : item.counterpart.substr(0, counterpartPos);
+        dirs.insert(dir);
+        auto [it, inserted] = dirItems.emplace(dir, DeleteItem{dir, item.root, counterpartDir});
+        // entries that don't agree on the other side of the folder keep it
+        if (!inserted && (_wcsicmp(it->second.counterpart.c_str(), counterpartDir.c_str()) != 0))
+            it->second.counterpart.clear();
+    };
+    for (const auto& item : items)
+        addParent(item);
+
+    bool collapsed = false;
+    while (!dirs.empty())
+    {
+        auto dir = *dirs.begin();
+        dirs.erase(dirs.begin());
+        const auto& dirItem = dirItems[dir];
+        // a folder that still exists on the other side was only emptied there:
+        // its entries are deleted but the folder stays
+        if (dirItem.counterpart.empty() || (queued.find(dir) != queued.end()) || !AllEntriesQueued(fs, dir, queued) || !PathMissing(fs, dirItem.counterpart))
+            continue;
+        // replace the entries with the folder itself
+        auto prefix = dir + L"\\";
+        for (auto it = queued.lower_bound(prefix); (it != queued.end()) && (_wcsnicmp(it->c_str(), prefix.c_str(), prefix.size()) == 0);)
+        {
+            queuedItems.erase(*it);
+            it = queued.erase(it);
+        }
+        queued.insert(dir);
+        queuedItems.emplace(dir, dirItem);
+        addParent(dirItem);
+        collapsed = true;
+    }
+    if (!collapsed)
+        return;
+
+    items.clear();
+    for (const auto& path : queued)
+        items.push_back(queuedItems[path]);
+}
@@ -0,0 +1,112 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+
+#include "ReaderWriterLock.h"
+#include "Platform.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// how deleted files and folders are removed
+enum class DeleteMode : DWORD
+{
+    RecycleBin  = 0, ///< moved to the recycle bin
+    Direct      = 1, ///< deleted right away
+    TrashFolder = 2, ///< moved to a DELETEQUEUE_TRASH_FOLDER folder in the root of the pair folder
+};
+
+/// number of queued paths after which the queue is flushed on its own
+constexpr size_t  DELETEQUEUE_BATCH_SIZE        = 5000;
+/// days after which deleted paths are removed from the trash folder
+constexpr DWORD   DELETEQUEUE_DEFAULT_RETENTION = 30;
+/// name of the trash folder for DeleteMode::TrashFolder
+constexpr wchar_t DELETEQUEUE_TRASH_FOLDER[]    = L".cryptsync-trash";
+
+struct DeleteItem
+{
+    std::wstring path;
+    std::wstring root;        ///< the pair folder the path is in
+    std::wstring counterpart; ///< the path on the other side of the pair that is gone, or empty
+};
+
+/// removes the paths passed to it in one go
+class IDeleteBackend
+{
+public:
+    virtual ~IDeleteBackend() = default;
+
+    /// deletes the paths of all items, paths that don't exist count as deleted.
+    /// Returns the paths that could not be deleted.
+    virtual std::vector<std::wstring> Delete(const std::vector<DeleteItem>& items) = 0;
+};
+
+/**
+ * Collects paths to delete and removes them in batches.
+ *
+ * Deleting files one by one through the shell is slow: every delete is a
+ * separate shell operation. The queue collects the deletes of a sync pass
+ * and hands them to the delete backend all at once when it's flushed.
+ * If all entries of a folder are queued and the folder is gone on the other
+ * side of the pair as well, the folder is deleted instead of its entries.
+ * On a file system other than the native one, the paths are deleted
+ * directly: there's neither a recycle bin nor a trash folder.
+ */
+class CDeleteQueue
+{
+public:
+    /// \c beforeDelete is called for every path right before it gets deleted from \c fs
+    explicit CDeleteQueue(std::function<void(const std::wstring&)> beforeDelete = nullptr, CFileSystem& fs = CFileSystem::Native());
+    ~CDeleteQueue();
+
+    CDeleteQueue(const CDeleteQueue&)            = delete;
+    CDeleteQueue& operator=(const CDeleteQueue&) = delete;
+
+    /// uses \c backend instead of the one configured in the registry
+    void                                   SetBackend(std::unique_ptr<IDeleteBackend> backend);
+
+    /// queues \c path for deletion. \c root is the pair folder the path is in,
+    /// folders are only deleted as a whole below that. \c counterpart is the
+    /// path on the other side of the pair whose deletion is synced, its folder
+    /// must be gone too for the folder of \c path to be deleted as a whole.
+    void                                   Add(const std::wstring& path, const std::wstring& root, const std::wstring& counterpart = std::wstring());
+
+    /// deletes all queued paths. Returns the number of paths that could not be deleted.
+    size_t                                 Flush();
+
+    static DeleteMode                      GetConfiguredMode();
+    static std::unique_ptr<IDeleteBackend> CreateBackend(DeleteMode mode);
+
+    /// returns true if \c path is a trash folder or inside one
+    static bool                            IsTrashPath(const std::wstring& path);
+
+    /// replaces queued paths with their folder if all entries of the folder are
+    /// queued and the folder of their counterparts doesn't exist anymore
+    static void                            CollapseDirectories(std::vector<DeleteItem>& items, const CFileSystem& fs = CFileSystem::Native());
+
+private:
+    CFileSystem&                             m_fs;
+    CReaderWriterLock                        m_guard;
+    std::vector<DeleteItem>                  m_items;
+    std::unique_ptr<IDeleteBackend>          m_backend;
+    std::function<void(const std::wstring&)> m_beforeDelete;
+};
@@ -0,0 +1,131 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+#include "stdafx.h"
+#include "DirectoryCache.h"
+
+#include <algorithm>
+
+namespace
+{
+std::wstring NormalizeDir(const std::wstring& dir)
+{
+    std::wstring path = dir;
+    std::ranges::replace(path, '/', '\\');
+    while ((path.size() > 1) && (path.back() == '\\'))
+        path.pop_back();
+    return path;
+}
+
+/// returns true for paths without a parent that can be created: "C:", "\\server\share" and their long path forms
+bool IsVolumeRoot(const std::wstring& path)
+{
+    std::wstring_view view = path;
+    if (view.starts_with(L"\\\\?\\UNC\\"))
+        return std::ranges::count(view.substr(8), '\\') <= 1;
+    if (view.starts_with(L"\\\\?\\"))
+        view.remove_prefix(4);
+    else if (view.starts_with(L"\\\\"))
+        return std::ranges::count(view.substr(2), '\\') <= 1;
+    return view.find('\\') == std::wstring_view::npos;
+}
+} // namespace
+
+CDirectoryCache::CDirectoryCache()
+{
+}
+
+CDirectoryCache::~CDirectoryCache()
+{
+}
+
+bool CDirectoryCache::Create(const std::wstring& dir)
+{
+    auto path = NormalizeDir(dir);
+    if (path.empty())
+        return false;
+    if (IsKnown(path))
+        return true;
+    DWORD attributes = GetFileAttributes(path.c_str());
+    if (attributes != INVALID_FILE_ATTRIBUTES)
+    {
+        if ((attributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+        {
+            SetLastError(ERROR_ALREADY_EXISTS);
+            return false;
+        }
+        Insert(path);
+        return true;
+    }
+    if (IsVolumeRoot(path))
+        return false;
+
+    // the walk up stops at the first parent that's known or exists
+    auto parent = path.substr(0, path.find_last_of('\\'));
+    if (!IsVolumeRoot(parent) && !Create(parent))
+        return false;
+    // some file systems (e.g. webdav mounted drives) take time until
+    // a directory can be used after it got created
+    for (int retry = 0;; ++retry)
+    {
+        if (CreateDirectory(path.c_str(), nullptr) || (GetLastError() == ERROR_ALREADY_EXISTS))
+        {
+            Insert(path);
+            return true;
+        }
+        DWORD lastError = GetLastError();
+        if ((retry >= DIRCACHE_CREATE_RETRIES) || ((lastError != ERROR_PATH_NOT_FOUND) && (lastError != ERROR_FILE_NOT_FOUND)))
+            return false;
+        Sleep(DIRCACHE_RETRY_DELAY);
+    }
+}
+
+void CDirectoryCache::Invalidate(const std::wstring& path)
+{
+    auto           dir    = NormalizeDir(path);
+    auto           prefix = dir + L"\\";
+    CAutoWriteLock locker(m_guard);
+    m_dirs.erase(dir);
+    // the directories below the path follow it in the sorted set
+    for (auto it = m_dirs.lower_bound(prefix); (it != m_dirs.end()) && (_wcsnicmp(it->c_str(), prefix.c_str(), prefix.size()) == 0);)
+        it = m_dirs.erase(it);
+}
+
+void CDirectoryCache::Clear()
+{
+    CAutoWriteLock locker(m_guard);
+    m_dirs.clear();
+}
+
+size_t CDirectoryCache::GetSize() const
+{
+    CAutoReadLock locker(m_guard);
+    return m_dirs.size();
+}
+
+bool CDirectoryCache::IsKnown(const std::wstring& dir) const
+{
+    CAutoReadLock locker(m_guard);
+    return m_dirs.contains(dir);
+}
+
+void CDirectoryCache::Insert(const std::wstring& dir)
+{
+    CAutoWriteLock locker(m_guard);
+    m_dirs.insert(dir);
+}
@@ -0,0 +1,65 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+#include "ReaderWriterLock.h"
+#include "StringUtils.h"
+
+#include <set>
+#include <string>
+
+/// number of times a directory is created again if that fails right after its parent got created
+constexpr int   DIRCACHE_CREATE_RETRIES = 5;
+/// ms to wait before a directory is created again
+constexpr DWORD DIRCACHE_RETRY_DELAY    = 50;
+
+/**
+ * Remembers which directories are known to exist.
+ *
+ * Creating a directory with all its parents probes every parent on
+ * disk. The cache remembers the directories it has seen or created, so
+ * that creating the target folder of a file in a folder that's already
+ * known costs no file system calls at all.
+ * Directories that get deleted must be removed with Invalidate(). If a
+ * file operation fails with ERROR_PATH_NOT_FOUND even though the cache
+ * has the folder, the folder should be invalidated and created again.
+ */
+class CDirectoryCache
+{
+public:
+    CDirectoryCache();
+    ~CDirectoryCache();
+
+    /// creates \c dir and all its missing parents.
+    /// Returns true if the directory exists afterwards.
+    bool   Create(const std::wstring& dir);
+    /// forgets \c path and all directories below it
+    void   Invalidate(const std::wstring& path);
+    /// forgets all directories
+    void   Clear();
+    /// returns the number of known directories
+    size_t GetSize() const;
+
+private:
+    bool   IsKnown(const std::wstring& dir) const;
+    void   Insert(const std::wstring& dir);
+
+    mutable CReaderWriterLock        m_guard;
+    std::set<std::wstring, ci_lessW> m_dirs;
+};
@@ -18,35 +18,150 @@
 //
 #include "stdafx.h"
 #include "FolderSync.h"
-#include "DirFileEnum.h"
 #include "StringUtils.h"
 #include "UnicodeUtils.h"
 #include "PathUtils.h"
 #include "Ignores.h"
 #include "CreateProcessHelper.h"
 #include "SmartHandle.h"
-#include "DebugOutput.h"
 #include "CircularLog.h"
 #include "OnOutOfScope.h"
-#include "COMPtrs.h"
+#include "CopyEngine.h"
+#include "Registry.h"
 
 #include <process.h>
 #include <shlobj.h>
 #include <cctype>
 #include <algorithm>
 #include <comdef.h>
+#include <thread>
 
-#include "../base4k/base4k.h"
+#include "AsyncLog.h"
+#include "NameCipher.h"
+#include "SyncPlan.h"
+#include "SyncTrace.h"
 #include "../lzma/Wrapper-CPP/C7Zip.h"
 
-CFolderSync::CFolderSync()
-    : m_parentWnd(nullptr)
+namespace
+{
+/// a file time for the log, the writer thread of the log converts it to local time
+LogFileTime ToLogTime(const FILETIME& ft)
+{
+    return {(static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime};
+}
+
+FILETIME ToFileTime(uint64_t fileTime)
+{
+    return {static_cast<DWORD>(fileTime), static_cast<DWORD>(fileTime >> 32)};
+}
+
+/// the file info of a CFileSystem in the form GetFileAttributesEx() returns it
+WIN32_FILE_ATTRIBUTE_DATA ToAttributeData(const PlatformFileInfo& info)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data = {};
+    data.dwFileAttributes          = info.attributes;
+    if (data.dwFileAttributes == 0)
+    {
+        // only the native file system has the attributes, the others just the flags
+        if (info.directory)
+            data.dwFileAttributes |= FILE_ATTRIBUTE_DIRECTORY;
+        if (info.readOnly)
+            data.dwFileAttributes |= FILE_ATTRIBUTE_READONLY;
+        if (info.hidden)
+            data.dwFileAttributes |= FILE_ATTRIBUTE_HIDDEN;
+        if (data.dwFileAttributes == 0)
+            data.dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+    }
+    data.ftCreationTime   = ToFileTime(info.createTime);
+    data.ftLastAccessTime = ToFileTime(info.accessTime);
+    data.ftLastWriteTime  = ToFileTime(info.writeTime);
+    data.nFileSizeHigh    = static_cast<DWORD>(info.size >> 32);
+    data.nFileSizeLow     = static_cast<DWORD>(info.size);
+    return data;
+}
+
+/// files of this size (in MB) and bigger are encrypted and decrypted without the file system cache
+constexpr DWORD DEFAULT_UNBUFFERED_THRESHOLD_MB = 512;
+
+UInt64 GetUnbufferedThreshold()
+{
+    // 0 turns unbuffered I/O off
+    return static_cast<UInt64>(static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\UnbufferedThresholdMB", DEFAULT_UNBUFFERED_THRESHOLD_MB))) * 1024 * 1024;
+}
+
+/// files of this size (in MB) and bigger are encrypted so that an interrupted
+/// encryption can continue where it stopped. 0 (the default) turns it off.
+UInt64 GetResumableThreshold()
+{
+    return static_cast<UInt64>(static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\ResumableThresholdMB", 0))) * 1024 * 1024;
+}
+
+/// the memory (in MB) all encoders and decoders may use together. 0 (the default) is half of the physical memory
+UInt64 GetMemoryBudget()
+{
+    return static_cast<UInt64>(static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\MemoryBudgetMB", 0))) * 1024 * 1024;
+}
+
+/// number of MB encrypted between two checkpoints of a resumable encryption
+UInt64 GetResumeCheckpointInterval()
+{
+    return static_cast<UInt64>(static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\ResumeCheckpointMB", 256))) * 1024 * 1024;
+}
+
+/// if set, files that are copied are compared with an existing target of the same
+/// size first, and only get their times set if the content is the same. Off by
+/// default: the comparison reads both files completely.
+bool GetCompareBeforeCopy()
+{
+    return static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\CompareBeforeCopy", FALSE)) != 0;
+}
+
+/// the order, the number of threads and the batch size the actions of a sync are executed with
+SyncPolicy GetSyncPolicy()
+{
+    return SyncPolicy::FromSettings(CRegStdDWORD(L"Software\\CryptSync\\SyncOrder", 0),
+                                    CRegStdDWORD(L"Software\\CryptSync\\SyncThreads", 1),
+                                    CRegStdDWORD(L"Software\\CryptSync\\SyncBatchSize", 1));
+}
+
+/// converts a file list to the input of the planner, with the classification of every file
+SyncPlanFileList ToPlanList(const std::map<std::wstring, FileData, ci_lessW>& fileList, const std::wstring& origPath, const CPathMatcher& matcher, CSyncStats& stats)
+{
+    SyncPlanFileList planList;
+    for (const auto& [relPath, fd] : fileList)
+    {
+        SyncPlanFile file;
+        file.fileRelPath       = fd.fileRelPath;
+        file.size              = fd.GetFileSize();
+        file.writeTime         = (static_cast<uint64_t>(fd.ft.dwHighDateTime) << 32) | fd.ft.dwLowDateTime;
+        file.filenameEncrypted = fd.filenameEncrypted;
+
+        const auto pathClass   = matcher.Match(CPathUtils::Append(origPath, relPath));
+        file.ignored           = (pathClass & PathMatchIgnored) != 0;
+        file.cryptOnly         = (pathClass & PathMatchCryptOnly) != 0;
+        file.copyOnly          = (pathClass & PathMatchCopyOnly) != 0;
+        if (file.ignored)
+            stats.Add(SyncCounter::Ignored);
+        planList.emplace_hint(planList.end(), relPath, std::move(file));
+    }
+    return planList;
+}
+} // namespace
+
+CFolderSync::CFolderSync(CFileSystem& fs)
+    : m_fs(fs)
+    , m_router(std::make_shared<const CPairRouter>(PairVector()))
+    , m_parentWnd(nullptr)
     , m_trayWnd(nullptr)
     , m_pProgDlg(nullptr)
-    , m_progress(0)
-    , m_progressTotal(1)
     , m_bRunning(FALSE)
+    , m_selfWrites(fs)
     , m_decryptOnly(false)
+    , m_deleteQueue([this](const std::wstring& path) { BeforeDelete(path); }, fs)
+    , m_dryRun(false)
+    , m_measureWritten(false)
+    , m_syncThreadId(0)
+    , m_cancelled(false)
 {
     static const wchar_t *gnuPgInstallPaths[] = {
         L"%ProgramFiles%\\GNU\\GnuPG\\Pub\\gpg.exe",
@@ -103,20 +218,24 @@ void CFolderSync::Stop()
     InterlockedExchange(&m_bRunning, FALSE);
     if (m_hThread)
     {
+        // don't let the thread wait for the throttle while it's stopped
+        m_throttle.Cancel();
         WaitForSingleObject(m_hThread, INFINITE);
         m_hThread.CloseHandle();
+        m_throttle.Resume();
     }
 }
 
 void CFolderSync::SetPairs(const PairVector& pv)
 {
-    CAutoWriteLock locker(m_guard);
-    m_pairs = pv;
-    for (auto it = m_pairs.begin(); it != m_pairs.end(); ++it)
+    PairVector pairs = pv;
+    for (auto it = pairs.begin(); it != pairs.end(); ++it)
     {
         it->m_cryptPath = CPathUtils::AdjustForMaxPath(it->m_cryptPath);
         it->m_origPath  = CPathUtils::AdjustForMaxPath(it->m_origPath);
     }
+    // the router is replaced as a whole: SyncFile() never has to wait for this
+    m_router.store(std::make_shared<const CPairRouter>(pairs));
 }
 
 void CFolderSync::SyncFolders(const PairVector& pv, HWND hWnd)
@@ -168,38 +287,42 @@ unsigned int CFolderSync::SyncFolderThreadEntry(void* pContext)
 
 int CFolderSync::SyncFolderThread()
 {
-    int        ret = ErrorNone;
-    PairVector pv;
-    {
-        CAutoReadLock locker(m_guard);
-        pv = m_pairs;
-    }
-    m_progress      = 0;
-    m_progressTotal = 1;
+    int         ret    = ErrorNone;
+    auto        router = m_router.load();
+    const auto& pv     = router->GetPairs();
+    m_progress.Reset();
+    m_syncThreadId = GetCurrentThreadId();
+    m_cancelled    = false;
+    m_planReport.clear();
+    m_throttle.ReadSettings();
+    m_throttle.SetInteractive(m_parentWnd != nullptr);
+    MemoryGovernor::Instance().SetBudget(GetMemoryBudget());
+    MemoryGovernor::Instance().ResetPeak();
+    // folders might have been deleted since the last pass without a notification
+    m_dirCache.Clear();
     if (m_parentWnd)
     {
         CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
         m_pProgDlg = new CProgressDlg();
         m_pProgDlg->SetTitle(L"Syncing folders");
         m_pProgDlg->SetLine(0, L"scanning...");
-        m_pProgDlg->SetProgress(m_progress, m_progressTotal);
+        m_pProgDlg->SetProgress(0, 1);
         m_pProgDlg->ShowModal(m_parentWnd);
     }
     {
         CAutoWriteLock locker(m_failureGuard);
         m_failures.clear();
     }
-    for (auto it = pv.cbegin(); (it != pv.cend()) && m_bRunning; ++it)
     {
-        {
-            CAutoWriteLock locker(m_guard);
-            m_currentPath = *it;
-        }
-        ret |= SyncFolder(*it);
-        {
-            CAutoWriteLock locker(m_guard);
-            m_currentPath = PairData();
-        }
+        CAutoWriteLock locker(m_statsGuard);
+        m_passStats.clear();
+    }
+    for (size_t i = 0; (i < pv.size()) && m_bRunning; ++i)
+    {
+        // shares the ownership of the router, SetPairs() may replace it meanwhile
+        m_syncPair = std::shared_ptr<const PairData>(router, &pv[i]);
+        ret |= SyncFolder(pv[i]);
+        m_syncPair = nullptr;
     }
     if (m_pProgDlg)
     {
@@ -208,85 +331,76 @@ int CFolderSync::SyncFolderThread()
         m_pProgDlg = nullptr;
         CoUninitialize();
     }
+    // SyncFile() must not see the cancel of this sync
+    m_cancelled = false;
     PostMessage(m_parentWnd, WM_THREADENDED, 0, 0);
     m_parentWnd = nullptr;
+    m_throttle.SetInteractive(false);
     InterlockedExchange(&m_bRunning, FALSE);
     return ret;
 }
 
 bool CFolderSync::SyncFile(const std::wstring& path)
 {
+    // the temp files written while decrypting or resumably encrypting are renamed
+    // when they're done, and the trash folder only has files that got deleted
+    if (C7Zip::IsExtractTempPath(path) || C7Zip::IsResumeTempPath(path) || CDeleteQueue::IsTrashPath(path))
+        return true;
+
+    auto        router = m_router.load();
+    const auto& pairs  = router->GetPairs();
+
     // check if the path notification comes from a folder that's
     // currently synced in the sync thread. If so, we "requeue" the
     // SyncFile since it is possible the sync thread may have already passed the
-    // syncing of this file.
+    // syncing of this file. The pairs are compared by their folders: the sync
+    // thread might still work on the pairs from before the last SetPairs().
+    if (auto syncPair = m_syncPair.load())
     {
-        std::wstring s = m_currentPath.m_origPath;
-        if (!s.empty())
-        {
-            if ((path.size() > s.size()) &&
-                (_wcsicmp(s.c_str(), path.substr(0, s.size()).c_str()) == 0))
-                return false;
-        }
-        s = m_currentPath.m_cryptPath;
-        if (!s.empty())
-        {
-            if ((path.size() > s.size()) &&
-                (_wcsicmp(s.c_str(), path.substr(0, s.size()).c_str()) == 0))
-                return false;
-        }
+        bool bSyncing = false;
+        router->ForEachRoute(path, [&](const PairRoute& route) { bSyncing = bSyncing || (pairs[route.pairIndex] == *syncPair); });
+        if (bSyncing)
+            return false;
     }
 
-    PairData      pt;
-    CAutoReadLock locker(m_guard);
-    for (auto it = m_pairs.cbegin(); it != m_pairs.cend(); ++it)
-    {
-        if (!it->m_enabled)
-            continue;
-        std::wstring s = it->m_origPath;
-        if (path.size() > s.size())
-        {
-            if ((_wcsicmp(path.substr(0, s.size()).c_str(), s.c_str()) == 0) && (path[s.size()] == '\\'))
-            {
-                pt = *it;
-                SyncFile(path, pt);
-                continue;
-            }
-        }
-        s = it->m_cryptPath;
-        if (path.size() > s.size())
-        {
-            if ((_wcsicmp(path.substr(0, s.size()).c_str(), s.c_str()) == 0) && (path[s.size()] == '\\'))
-            {
-                pt = *it;
-                SyncFile(path, pt);
-                continue;
-            }
-        }
-    }
+    std::set<size_t> syncedPairs;
+    router->ForEachRoute(path, [&](const PairRoute& route) {
+        // a path inside both folders of a pair is synced only once, the routes
+        // of a pair are not necessarily next to each other
+        if (!syncedPairs.insert(route.pairIndex).second)
+            return;
+        SyncFile(path, pairs[route.pairIndex]);
+    });
     return true;
 }
 
 void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
 {
+    CTraceSpan   span("SyncFile", "watcher", plainPath);
     std::wstring orig  = pt.m_origPath;
     std::wstring crypt = pt.m_cryptPath;
     if (orig.empty() || crypt.empty())
         return;
     auto path = plainPath;
-    if (pt.IsIgnored(path))
+    const auto pathClass = pt.Classify(path);
+    if (pathClass & PathMatchIgnored)
         return;
     if (!pt.m_enabled)
         return;
 
-    const bool bCryptOnly = pt.IsCryptOnly(path);
-    bool       bCopyOnly  = pt.IsCopyOnly(path);
+    // files synced on their own are not throttled: they're synced
+    // from the UI thread. They still count for the limits of the sync thread.
+    CThrottle::CScope throttleScope(m_throttle, pt.m_origPath, false);
+
+    const bool       bCryptOnly = (pathClass & PathMatchCryptOnly) != 0;
+    bool             bCopyOnly  = (pathClass & PathMatchCopyOnly) != 0;
+    PlatformFileInfo info;
     if ((orig.size() < path.size()) && (_wcsicmp(path.substr(0, orig.size()).c_str(), orig.c_str()) == 0) && ((path[orig.size()] == '\\') || (path[orig.size()] == '/')))
     {
-        crypt = CPathUtils::Append(crypt, GetEncryptedFilename(path.substr(orig.size()), pt.m_password, pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg));
+        crypt = CPathUtils::Append(crypt, GetEncryptedFilename(path.substr(orig.size()), pt.password(), pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg));
         if (bCopyOnly)
         {
-            if (!PathFileExists(crypt.c_str()))
+            if (!m_fs.Stat(crypt, info))
                 crypt = CPathUtils::Append(pt.m_cryptPath, path.substr(orig.size()));
             else
                 bCopyOnly = false;
@@ -295,13 +409,13 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
     }
     else
     {
-        orig = CPathUtils::Append(orig, GetDecryptedFilename(path.substr(crypt.size()), pt.m_password, pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg));
+        orig = CPathUtils::Append(orig, GetDecryptedFilename(path.substr(crypt.size()), pt.password(), pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg));
         if (bCopyOnly)
         {
-            if (!PathFileExists(orig.c_str()))
+            if (!m_fs.Stat(orig, info))
             {
                 auto origCopy = CPathUtils::Append(pt.m_origPath, path.substr(crypt.size()));
-                if (PathFileExists(origCopy.c_str()))
+                if (m_fs.Stat(origCopy, info))
                     orig = origCopy;
                 else
                     bCopyOnly = false;
@@ -315,19 +429,32 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
     WIN32_FILE_ATTRIBUTE_DATA fDdataCrypt   = {};
     bool                      bOrigMissing  = false;
     bool                      bCryptMissing = false;
-    if (!GetFileAttributesEx(orig.c_str(), GetFileExInfoStandard, &fDataOrig))
+    if (m_fs.Stat(orig, info))
+        fDataOrig = ToAttributeData(info);
+    else
     {
-        DWORD lastError = GetLastError();
-        if (lastError == ERROR_ACCESS_DENIED)
+        auto lastError = m_fs.LastError();
+        if (lastError == PlatformError::AccessDenied)
             return;
-        bOrigMissing = (lastError == ERROR_FILE_NOT_FOUND);
+        bOrigMissing = (lastError == PlatformError::NotFound);
     }
-    if (!GetFileAttributesEx(crypt.c_str(), GetFileExInfoStandard, &fDdataCrypt))
+    if (m_fs.Stat(crypt, info))
+        fDdataCrypt = ToAttributeData(info);
+    else
     {
-        DWORD lastError = GetLastError();
-        if (lastError == ERROR_ACCESS_DENIED)
+        auto lastError = m_fs.LastError();
+        if (lastError == PlatformError::AccessDenied)
             return;
-        bCryptMissing = (lastError == ERROR_FILE_NOT_FOUND);
+        bCryptMissing = (lastError == PlatformError::NotFound);
+    }
+    // the notification might be for a folder that got deleted. For the
+    // encrypted folder, GetEncryptedFilename() added an extension to the name.
+    if (bOrigMissing)
+        m_dirCache.Invalidate(orig);
+    if (bCryptMissing)
+    {
+        m_dirCache.Invalidate(crypt);
+        m_dirCache.Invalidate(crypt.substr(0, crypt.find_last_of('.')));
     }
 
     if ((fDataOrig.ftLastWriteTime.dwLowDateTime == 0) && (fDataOrig.ftLastWriteTime.dwHighDateTime == 0) &&
@@ -337,32 +464,26 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
         {
             // original file got deleted.
             // delete the encrypted file
-            {
-                CAutoWriteLock nLocker(m_notingGuard);
-                m_notifyIgnores.insert(crypt);
-            }
-            CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": file %s does not exist, delete file %s\n"), orig.c_str(), crypt.c_str());
-            CCircularLog::Instance()(_T("INFO:    file %s does not exist, delete file %s"), orig.c_str(), crypt.c_str());
+            CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": file %s does not exist, delete file %s", orig.c_str(), crypt.c_str());
+            CAsyncLog::Instance().Info(L"file %s does not exist, delete file %s", orig.c_str(), crypt.c_str());
 
-            if (!DeletePathToTrash(crypt) || bCryptMissing)
+            // an interrupted encryption of the file can't be continued anymore
+            RemoveResumeFiles(crypt);
+            if (bCryptMissing)
             {
                 // in case the notification was for a folder that got removed,
                 // the GetDecryptedFilename() call above added the .cryptsync extension which
-                // folders don't have. Remove that extension and try deleting again.
-                auto crypt2 = crypt.substr(0, crypt.find_last_of('.'));
-                if (!DeletePathToTrash(crypt2))
-                {
-                    // could not delete file to the trashbin, so delete it directly
-                    DeleteFile(crypt.c_str());
-                    DeleteFile(crypt2.c_str());
-                }
+                // folders don't have. Remove that extension and delete the folder.
+                m_deleteQueue.Add(crypt.substr(0, crypt.find_last_of('.')), pt.m_cryptPath, orig);
             }
+            else
+                m_deleteQueue.Add(crypt, pt.m_cryptPath, orig);
             return;
         }
         else
         {
-            CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": file %s does not exist and sync deleted not set, skipping delete file %s\n"), orig.c_str(), crypt.c_str());
-            CCircularLog::Instance()(_T("INFO:    file %s does not exist and sync deleted not set, skipping delete file %s"), orig.c_str(), crypt.c_str());
+            CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": file %s does not exist and sync deleted not set, skipping delete file %s", orig.c_str(), crypt.c_str());
+            CAsyncLog::Instance().Info(L"file %s does not exist and sync deleted not set, skipping delete file %s", orig.c_str(), crypt.c_str());
         }
     }
 
@@ -373,42 +494,37 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
         {
             // encrypted file got deleted.
             // delete the original file as well
-            {
-                CAutoWriteLock nLocker(m_notingGuard);
-                m_notifyIgnores.insert(orig);
-            }
             // check if there's an unencrypted file instead of an encrypted one in the encrypted folder
             if (!bCopyOnly)
             {
                 std::wstring cryptnot = crypt.substr(0, crypt.find_last_of('.'));
-                if (!GetFileAttributesEx(cryptnot.c_str(), GetFileExInfoStandard, &fDdataCrypt))
+                if (!m_fs.Stat(cryptnot, info))
                 {
-                    DWORD lastError = GetLastError();
-                    if (lastError == ERROR_ACCESS_DENIED)
+                    auto lastError = m_fs.LastError();
+                    if (lastError == PlatformError::AccessDenied)
                         return;
-                    bCryptMissing = (lastError == ERROR_FILE_NOT_FOUND);
+                    bCryptMissing = (lastError == PlatformError::NotFound);
                 }
                 else
+                {
+                    fDdataCrypt   = ToAttributeData(info);
                     bCryptMissing = false;
+                }
             }
 
             if (bCryptMissing)
             {
-                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": file %s does not exist, delete file %s\n"), crypt.c_str(), orig.c_str());
-                CCircularLog::Instance()(_T("INFO:    file %s does not exist, delete file %s"), crypt.c_str(), orig.c_str());
+                CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": file %s does not exist, delete file %s", crypt.c_str(), orig.c_str());
+                CAsyncLog::Instance().Info(L"file %s does not exist, delete file %s", crypt.c_str(), orig.c_str());
 
-                if (!DeletePathToTrash(orig))
-                {
-                    // could not delete file to the trashbin, so delete it directly
-                    DeleteFile(orig.c_str());
-                }
+                m_deleteQueue.Add(orig, pt.m_origPath, crypt);
                 return;
             }
 
             else
             {
-                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": file %s does not exist and sync deleted not set, skipping delete file %s\n"), crypt.c_str(), orig.c_str());
-                CCircularLog::Instance()(_T("INFO:    file %s does not exist and sync deleted not set, skipping delete file %s"), crypt.c_str(), orig.c_str());
+                CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": file %s does not exist and sync deleted not set, skipping delete file %s", crypt.c_str(), orig.c_str());
+                CAsyncLog::Instance().Info(L"file %s does not exist and sync deleted not set, skipping delete file %s", crypt.c_str(), orig.c_str());
             }
         }
     }
@@ -417,7 +533,11 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
         return;
     if (fDdataCrypt.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
         return;
-    LONG cmp = CompareFileTime(&fDataOrig.ftLastWriteTime, &fDdataCrypt.ftLastWriteTime);
+    // EncryptFile() gets the file info as it was read, not rounded for FAT.
+    // Existing files always have at least one attribute set (FILE_ATTRIBUTE_NORMAL),
+    // so no attributes means the file info could not be read.
+    const WIN32_FILE_ATTRIBUTE_DATA fileInfoOrig = fDataOrig;
+    LONG                            cmp          = CompareFileTime(&fDataOrig.ftLastWriteTime, &fDdataCrypt.ftLastWriteTime);
     if (pt.m_fat)
     {
         // round up to two seconds accuracy
@@ -458,9 +578,9 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
     }
     if (cmp < 0)
     {
-        CCircularLog::Instance()(L"INFO:    original file is older: %s : %s, %s : %s",
-                                 crypt.c_str(), GetFileTimeStringForLog(fDdataCrypt.ftLastWriteTime).c_str(),
-                                 orig.c_str(), GetFileTimeStringForLog(fDataOrig.ftLastWriteTime).c_str());
+        CAsyncLog::Instance().Info(L"original file is older: %s : %s, %s : %s",
+                                   crypt.c_str(), ToLogTime(fDdataCrypt.ftLastWriteTime),
+                                   orig.c_str(), ToLogTime(fDataOrig.ftLastWriteTime));
         // original file is older than the encrypted file
         if ((pt.m_syncDir == BothWays) || (pt.m_syncDir == DstToSrc))
         {
@@ -469,39 +589,30 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
             fd.ft = fDdataCrypt.ftLastWriteTime;
             if (bCopyOnly)
             {
-                CCircularLog::Instance()(_T("INFO:    copy file %s to %s"), crypt.c_str(), orig.c_str());
-                if (!CopyFile(crypt.c_str(), orig.c_str(), FALSE))
-                {
-                    std::wstring targetFolder = orig.substr(0, orig.find_last_of('\\'));
-                    CPathUtils::CreateRecursiveDirectory(targetFolder);
-                    CopyFile(crypt.c_str(), orig.c_str(), FALSE);
-                }
+                CAsyncLog::Instance().Info(L"copy file %s to %s", crypt.c_str(), orig.c_str());
+                CopyFileToTarget(crypt, orig);
             }
             else
-                DecryptFile(orig, crypt, pt.m_password, fd, pt.m_useGpg);
+                DecryptFile(orig, crypt, pt.password(), fd, pt.m_useGpg);
         }
     }
     else if (cmp > 0)
     {
-        CCircularLog::Instance()(L"INFO:    encrypted file is older: %s : %s, %s : %s",
-                                 orig.c_str(), GetFileTimeStringForLog(fDataOrig.ftLastWriteTime).c_str(),
-                                 crypt.c_str(), GetFileTimeStringForLog(fDdataCrypt.ftLastWriteTime).c_str());
+        CAsyncLog::Instance().Info(L"encrypted file is older: %s : %s, %s : %s",
+                                   orig.c_str(), ToLogTime(fDataOrig.ftLastWriteTime),
+                                   crypt.c_str(), ToLogTime(fDdataCrypt.ftLastWriteTime));
         // encrypted file is older than the original file
         if ((pt.m_syncDir == BothWays) || (pt.m_syncDir == SrcToDst))
         {
             // encrypt the file
             FileData fd;
             fd.ft = fDataOrig.ftLastWriteTime;
+            if (fileInfoOrig.dwFileAttributes != 0)
+                fd.fileInfo = fileInfoOrig;
             if (bCopyOnly)
             {
-                CCircularLog::Instance()(_T("INFO:    copy file %s to %s"), orig.c_str(), crypt.c_str());
-                bool bCopyFileResult = CopyFile(orig.c_str(), crypt.c_str(), FALSE);
-                if (!bCopyFileResult)
-                {
-                    std::wstring targetFolder = crypt.substr(0, crypt.find_last_of('\\'));
-                    CPathUtils::CreateRecursiveDirectory(targetFolder);
-                    bCopyFileResult = CopyFile(orig.c_str(), crypt.c_str(), FALSE);
-                }
+                CAsyncLog::Instance().Info(L"copy file %s to %s", orig.c_str(), crypt.c_str());
+                bool bCopyFileResult = CopyFileToTarget(orig, crypt);
                 if (bCopyFileResult && pt.m_ResetOriginalArchAttr)
                 {
                     // Reset archive attribute on original file
@@ -509,7 +620,7 @@ void CFolderSync::SyncFile(const std::wstring& plainPath, const PairData& pt)
                 }
             }
             else
-                EncryptFile(orig, crypt, pt.m_password, fd, pt.m_useGpg, bCryptOnly, pt.m_compressSize, pt.m_ResetOriginalArchAttr);
+                EncryptFile(orig, crypt, pt.password(), fd, pt.m_useGpg, bCryptOnly, pt.m_compressSize, pt.m_ResetOriginalArchAttr);
         }
     }
     else if (cmp == 0)
@@ -532,42 +643,49 @@ int CFolderSync::SyncFolder(const PairData& pt)
     if (!pt.m_enabled)
         return ErrorNone;
 
-    CCircularLog::Instance()(L"INFO:    syncing folder orig \"%s\" with crypt \"%s\"", pt.m_origPath.c_str(), pt.m_cryptPath.c_str());
-    CCircularLog::Instance()(L"INFO:    settings: encrypt names: %s, use 7z: %s, use GPG: %s, use FAT workaround: %s, sync deleted: %s, reset archive attr: %s",
-                             pt.m_encNames ? L"yes" : L"no",
-                             pt.m_use7Z ? L"yes" : L"no",
-                             pt.m_useGpg ? L"yes" : L"no",
-                             pt.m_fat ? L"yes" : L"no",
-                             pt.m_syncDeleted ? L"yes" : L"no",
-                             pt.m_ResetOriginalArchAttr ? L"yes" : L"no");
+    CTraceSpan        span("SyncFolder", "sync", pt.m_origPath);
+    CThrottle::CScope throttleScope(m_throttle, pt.m_origPath, true);
+    {
+        CAutoWriteLock locker(m_statsGuard);
+        m_stats.Reset();
+        m_statsPair = pt.m_origPath;
+    }
+    OnOutOfScope(FinishStats(pt));
+    CSyncStats::CTimer totalTimer(m_stats, SyncTimer::Total);
+
+    CAsyncLog::Instance().Info(L"syncing folder orig \"%s\" with crypt \"%s\"", pt.m_origPath.c_str(), pt.m_cryptPath.c_str());
+    CAsyncLog::Instance().Info(L"settings: encrypt names: %s, use 7z: %s, use GPG: %s, use FAT workaround: %s, sync deleted: %s, reset archive attr: %s",
+                               pt.m_encNames ? L"yes" : L"no",
+                               pt.m_use7Z ? L"yes" : L"no",
+                               pt.m_useGpg ? L"yes" : L"no",
+                               pt.m_fat ? L"yes" : L"no",
+                               pt.m_syncDeleted ? L"yes" : L"no",
+                               pt.m_ResetOriginalArchAttr ? L"yes" : L"no");
     if (m_pProgDlg)
     {
+        auto progress = m_progress.Snapshot(GetTickCount64());
         m_pProgDlg->SetLine(0, L"scanning...");
         m_pProgDlg->SetLine(2, L"");
-        m_pProgDlg->SetProgress(m_progress, m_progressTotal);
+        m_pProgDlg->SetProgress64(progress.GetDone(), std::max<uint64_t>(progress.GetTotal(), 1));
     }
+    // folders that can't be read are found by the enumeration
+    PlatformFileInfo rootInfo;
+    if (!m_fs.Stat(pt.m_origPath, rootInfo))
     {
-        CAutoFile hTest = CreateFile(pt.m_origPath.c_str(), GENERIC_READ, FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-        if (!hTest)
-        {
-            CCircularLog::Instance()(L"ERROR:   error accessing path \"%s\", skipped", pt.m_origPath.c_str());
-            return ErrorAccess;
-        }
+        CAsyncLog::Instance().Error(L"error accessing path \"%s\", skipped", pt.m_origPath.c_str());
+        return ErrorAccess;
     }
+    if (!m_fs.Stat(pt.m_cryptPath, rootInfo))
     {
-        CAutoFile hTest = CreateFile(pt.m_cryptPath.c_str(), GENERIC_READ, FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-        if (!hTest)
-        {
-            CCircularLog::Instance()(L"ERROR:   error accessing path \"%s\", skipped", pt.m_cryptPath.c_str());
-            return ErrorAccess;
-        }
+        CAsyncLog::Instance().Error(L"error accessing path \"%s\", skipped", pt.m_cryptPath.c_str());
+        return ErrorAccess;
     }
-    DWORD dwErr        = 0;
-    auto  origFileList = GetFileList(true, pt.m_origPath, pt.m_password, pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg, dwErr);
+    PlatformError enumError    = PlatformError::None;
+    auto          origFileList = GetFileList(true, pt.m_origPath, pt.password(), pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg, enumError);
 
-    if (dwErr)
+    if (enumError != PlatformError::None)
     {
-        CCircularLog::Instance()(L"ERROR:   error enumerating path \"%s\", skipped", pt.m_origPath.c_str());
+        CAsyncLog::Instance().Error(L"error enumerating path \"%s\", skipped", pt.m_origPath.c_str());
         return ErrorAccess;
     }
     if (m_decryptOnly)
@@ -579,425 +697,402 @@ int CFolderSync::SyncFolder(const PairData& pt)
         origFileList.clear();
     }
 
-    auto cryptFileList = GetFileList(false, pt.m_cryptPath, pt.m_password, pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg, dwErr);
-    if (dwErr)
+    std::vector<std::wstring> resumeFiles;
+    auto                      cryptFileList = GetFileList(false, pt.m_cryptPath, pt.password(), pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg, enumError, &resumeFiles);
+    if (enumError != PlatformError::None)
     {
-        CCircularLog::Instance()(L"ERROR:   error enumerating path \"%s\", skipped", pt.m_cryptPath.c_str());
+        CAsyncLog::Instance().Error(L"error enumerating path \"%s\", skipped", pt.m_cryptPath.c_str());
         return ErrorAccess;
     }
 
     int retVal = ErrorNone;
 
+    // the global ignores and the patterns of the pair are matched
+    // in one go for every file
+    CPathMatcher matcher;
+    matcher.AddPatterns(CIgnores::Instance().GetPatterns(), PathMatchIgnored, false);
+    pt.AddPatterns(matcher);
+
+    SyncPlanSettings settings;
+    settings.toCrypt               = (pt.m_syncDir == BothWays) || (pt.m_syncDir == SrcToDst);
+    settings.toOrig                = (pt.m_syncDir == BothWays) || (pt.m_syncDir == DstToSrc);
+    settings.syncDeleted           = pt.m_syncDeleted;
+    settings.fat                   = pt.m_fat;
+    settings.resetArchiveAttribute = pt.m_ResetOriginalArchAttr;
+    settings.useGpg                = pt.m_useGpg;
+    settings.compressSize          = pt.m_compressSize;
+    settings.encryptPath           = [&](const std::wstring& relPath) {
+        CTraceSpan span("NameEncrypt", "names");
+        m_stats.Add(SyncCounter::NameEncrypts);
+        return m_stats.Time(SyncTimer::NameEncrypt, [&] { return GetEncryptedFilename(relPath, pt.password(), pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg); });
+    };
+
+    SyncPolicy policy = GetSyncPolicy();
+    CSyncPlan  plan   = m_stats.Time(SyncTimer::Plan, [&] {
+        CTraceSpan span("Plan", "sync");
+        CSyncPlan  newPlan(ToPlanList(origFileList, pt.m_origPath, matcher, m_stats), ToPlanList(cryptFileList, pt.m_origPath, matcher, m_stats), settings);
+        newPlan.Apply(policy);
+        return newPlan;
+    });
+    auto totals = plan.GetTotals();
+    CAsyncLog::Instance().Info(L"planned %Iu actions, %Iu transfers, %llu bytes, estimated cpu time %llu ms",
+                               totals.actions, totals.transfers, totals.bytes, totals.cpuCost);
+    if (m_dryRun)
+    {
+        m_planReport += L"orig \"" + pt.m_origPath + L"\", crypt \"" + pt.m_cryptPath + L"\"\n" + plan.Format() + L"\n";
+        CAsyncLog::Instance().Info(L"dry run, nothing synced in \"%s\"", pt.m_origPath.c_str());
+        return retVal;
+    }
+
+    // the decrypt only mode has no source files to check the temp files against
+    if (!m_decryptOnly)
+        RemoveStaleResumeFiles(pt, resumeFiles, origFileList);
+
+    retVal |= ExecutePlan(pt, plan, policy, origFileList, cryptFileList);
+
     if (m_trayWnd)
-        PostMessage(m_trayWnd, WM_PROGRESS, m_progress, m_progressTotal);
-    m_progressTotal += static_cast<DWORD>(origFileList.size() + cryptFileList.size());
+        PostMessage(m_trayWnd, WM_PROGRESS, 0, 0);
+    auto selfWriteStats = m_selfWrites.GetStats();
+    CAsyncLog::Instance().Info(L"own change notifications suppressed: %llu, leaked: %llu", selfWriteStats.suppressed, selfWriteStats.leaked);
+    CAsyncLog::Instance().Info(L"encoder and decoder memory reserved: %llu MB, peak: %llu MB, budget: %llu MB", MemoryGovernor::Instance().GetReserved() / (1024 * 1024),
+                               MemoryGovernor::Instance().GetPeak() / (1024 * 1024), MemoryGovernor::Instance().GetBudget() / (1024 * 1024));
+    CAsyncLog::Instance().Info(L"finished syncing folder orig \"%s\" with crypt \"%s\"", pt.m_origPath.c_str(), pt.m_cryptPath.c_str());
+    CAsyncLog::Instance().Flush();
+    CCircularLog::Instance().Save();
+    return retVal;
+}
 
-    auto lastSaveTicks = GetTickCount64();
+bool CFolderSync::IsCancelled() const
+{
+    // the progress dialog belongs to the sync thread, the threads that
+    // execute transfers in parallel only see the flag it sets
+    if (m_pProgDlg && (GetCurrentThreadId() == m_syncThreadId) && m_pProgDlg->HasUserCancelled())
+        m_cancelled = true;
+    return m_cancelled;
+}
 
-    for (auto it = origFileList.cbegin(); (it != origFileList.cend()) && m_bRunning; ++it)
+bool CFolderSync::UpdateProgress(bool force)
+{
+    // the tray window gets a message and the progress dialog several
+    // cross thread calls per update: they are rate limited instead of
+    // sent for every file
+    auto now = GetTickCount64();
+    if ((GetCurrentThreadId() == m_syncThreadId) && (m_progress.ShouldPublish(now) || force))
     {
-        if (GetTickCount64() - lastSaveTicks > 60000)
-        {
-            CCircularLog::Instance().Save();
-            lastSaveTicks = GetTickCount64();
-        }
+        auto progress = m_progress.Snapshot(now);
         if (m_trayWnd)
-            PostMessage(m_trayWnd, WM_PROGRESS, m_progress, m_progressTotal);
+            PostMessage(m_trayWnd, WM_PROGRESS, static_cast<WPARAM>(progress.filesDone), static_cast<LPARAM>(progress.filesTotal));
         if (m_pProgDlg)
         {
             m_pProgDlg->SetLine(0, L"syncing files");
-            m_pProgDlg->SetLine(2, it->first.c_str(), true);
-            m_pProgDlg->SetProgress(m_progress, m_progressTotal);
-            if (m_pProgDlg->HasUserCancelled())
-            {
-                if (m_trayWnd)
-                    PostMessage(m_trayWnd, WM_PROGRESS, 0, 0);
-                retVal |= ErrorCancelled;
-                break;
-            }
+            m_pProgDlg->SetLine(1, progress.Format().c_str());
+            if (!progress.path.empty())
+                m_pProgDlg->SetLine(2, progress.path.c_str(), true);
+            m_pProgDlg->SetProgress64(progress.GetDone(), std::max<uint64_t>(progress.GetTotal(), 1));
         }
-        ++m_progress;
+    }
+    if (IsCancelled())
+    {
+        if (m_trayWnd)
+            PostMessage(m_trayWnd, WM_PROGRESS, 0, 0);
+        return false;
+    }
+    return true;
+}
 
-        if (CIgnores::Instance().IsIgnored(CPathUtils::Append(pt.m_origPath, it->first)))
-            continue;
-        if (pt.IsIgnored(CPathUtils::Append(pt.m_origPath, it->first)))
+int CFolderSync::ExecutePlan(const PairData& pt, const CSyncPlan& plan, const SyncPolicy& policy, const std::map<std::wstring, FileData, ci_lessW>& origFileList, const std::map<std::wstring, FileData, ci_lessW>& cryptFileList)
+{
+    int         retVal  = ErrorNone;
+    const auto& actions = plan.GetActions();
+
+    // files deleted during the sync are removed in batches
+    CDeleteQueue deleteQueue([this](const std::wstring& path) { BeforeDelete(path); }, m_fs);
+
+    m_progress.AddTotal(actions.size(), plan.GetTotals().bytes);
+    m_progress.StartTransfers(GetTickCount64());
+    UpdateProgress(true);
+
+    // the transfers are executed by several threads if the policy allows it,
+    // all other actions only queue deletes or change attributes: they run here
+    std::vector<SyncBatch> parallelBatches;
+    auto                   lastSaveTicks = GetTickCount64();
+    for (const auto& batch : plan.GetBatches(policy))
+    {
+        if ((policy.threads > 1) && actions[batch.first].IsTransfer())
+        {
+            parallelBatches.push_back(batch);
             continue;
-        bool bCryptOnly = pt.IsCryptOnly(CPathUtils::Append(pt.m_origPath, it->first));
-        bool bCopyOnly  = pt.IsCopyOnly(CPathUtils::Append(pt.m_origPath, it->first));
-        auto cryptIt    = cryptFileList.find(it->first);
-        if (cryptIt == cryptFileList.end())
+        }
+        for (size_t i = batch.first; (i < batch.first + batch.count) && m_bRunning && !(retVal & ErrorCancelled); ++i)
         {
-            // file does not exist in the encrypted folder:
-            if ((pt.m_syncDir == BothWays) || (pt.m_syncDir == SrcToDst))
+            if (GetTickCount64() - lastSaveTicks > 60000)
             {
-                // encrypt the file
-                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": file %s does not exist in encrypted folder\n"), it->first.c_str());
-                if (bCopyOnly)
-                {
-                    std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, it->first);
-                    std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                    CCircularLog::Instance()(_T("INFO:    copy file %s to %s"), origPath.c_str(), cryptPath.c_str());
-                    bool bCopyFileResult = CopyFile(origPath.c_str(), cryptPath.c_str(), FALSE);
-                    if (!bCopyFileResult)
-                    {
-                        std::wstring targetFolder = cryptPath;
-                        targetFolder              = targetFolder.substr(0, targetFolder.find_last_of('\\'));
-                        CPathUtils::CreateRecursiveDirectory(targetFolder);
-                        bCopyFileResult = CopyFile(origPath.c_str(), cryptPath.c_str(), FALSE);
-                        if (!bCopyFileResult) // Original file did not use !, need to confirm with author
-                            retVal |= ErrorCopy;
-                    }
-                    if (bCopyFileResult && pt.m_ResetOriginalArchAttr)
-                    {
-                        // Reset archive attribute on original file
-                        AdjustFileAttributes(origPath.c_str(), FILE_ATTRIBUTE_ARCHIVE, 0);
-                    }
-                }
-                else
-                {
-                    std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, GetEncryptedFilename(it->first, pt.m_password, pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg));
-                    std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                    if (!EncryptFile(origPath, cryptPath, pt.m_password, it->second, pt.m_useGpg, bCryptOnly, pt.m_compressSize, pt.m_ResetOriginalArchAttr))
-                        retVal |= ErrorCrypt;
-                }
+                CAsyncLog::Instance().Flush();
+                CCircularLog::Instance().Save();
+                lastSaveTicks = GetTickCount64();
             }
-            else if (pt.m_syncDir == DstToSrc)
+            if (!UpdateProgress())
             {
-                if (pt.m_syncDeleted)
-                {
-                    // remove the original file
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": counterpart of file %s does not exist in crypted folder, delete file\n"), it->first.c_str());
-                    CCircularLog::Instance()(_T("INFO:    counterpart of file %s does not exist in crypted folder, delete file"), it->first.c_str());
-                    std::wstring orig = CPathUtils::Append(pt.m_origPath, it->second.fileRelPath);
-                    {
-                        CAutoWriteLock nLocker(m_notingGuard);
-                        m_notifyIgnores.insert(orig);
-                    }
-                    if (!DeletePathToTrash(orig))
-                    {
-                        // could not delete file to the trashbin, so delete it directly
-                        DeleteFile(orig.c_str());
-                    }
-                }
-                else
-                {
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": counterpart of file %s does not exist in crypted folder and sync deleted not set, skipping delete file\n"), it->first.c_str());
-                    CCircularLog::Instance()(_T("INFO:    counterpart of file %s does not exist in crypted folder and sync deleted not set, skipping delete file"), it->first.c_str());
-                }
+                retVal |= ErrorCancelled;
+                break;
             }
+            retVal |= ExecuteAction(pt, actions[i], origFileList, cryptFileList, deleteQueue);
         }
-        else
-        {
-            LONG cmp = 0;
-            if (pt.m_fat)
+    }
+    if (!parallelBatches.empty() && m_bRunning && !(retVal & ErrorCancelled))
+        retVal |= ExecuteParallel(pt, plan, parallelBatches, policy.threads, origFileList, cryptFileList, deleteQueue);
+
+    deleteQueue.Flush();
+    // the paths of the actions go away with the plan
+    m_progress.ClearPath();
+    UpdateProgress(true);
+    return retVal;
+}
+
+int CFolderSync::ExecuteParallel(const PairData& pt, const CSyncPlan& plan, const std::vector<SyncBatch>& batches, unsigned threadCount, const std::map<std::wstring, FileData, ci_lessW>& origFileList, const std::map<std::wstring, FileData, ci_lessW>& cryptFileList, CDeleteQueue& deleteQueue)
+{
+    const auto&              actions = plan.GetActions();
+    std::atomic<size_t>      nextBatch{0};
+    std::atomic<int>         errors{ErrorNone};
+    std::atomic<unsigned>    running{0};
+    std::vector<std::thread> threads;
+    threadCount = std::min(threadCount, static_cast<unsigned>(batches.size()));
+    CAsyncLog::Instance().Info(L"executing %Iu batches of transfers with %u threads", batches.size(), threadCount);
+    for (unsigned t = 0; t < threadCount; ++t)
+    {
+        ++running;
+        threads.emplace_back([&]() {
+            OnOutOfScope(--running);
+            CThrottle::CScope throttleScope(m_throttle, pt.m_origPath, true);
+            for (size_t b = nextBatch++; (b < batches.size()) && m_bRunning && !IsCancelled(); b = nextBatch++)
             {
-                // round up to two seconds accuracy
-                FILETIME ft1{};
-                ft1.dwLowDateTime  = it->second.ft.dwLowDateTime;
-                ft1.dwHighDateTime = it->second.ft.dwHighDateTime;
-                FILETIME ft2{};
-                ft2.dwLowDateTime  = cryptIt->second.ft.dwLowDateTime;
-                ft2.dwHighDateTime = cryptIt->second.ft.dwHighDateTime;
-
-                ULONGLONG qwResult;
-                qwResult = (static_cast<ULONGLONG>(ft1.dwHighDateTime) << 32) + ft1.dwLowDateTime;
-                if (qwResult % 20000000UL)
+                for (size_t i = batches[b].first; (i < batches[b].first + batches[b].count) && m_bRunning && !IsCancelled(); ++i)
                 {
-                    qwResult += 20000000UL;
-                    qwResult /= 20000000UL;
-                    qwResult *= 20000000UL;
+                    errors |= ExecuteAction(pt, actions[i], origFileList, cryptFileList, deleteQueue);
                 }
-                ft1.dwLowDateTime   = static_cast<DWORD>(qwResult & 0xFFFFFFFF);
-                ft1.dwHighDateTime  = static_cast<DWORD>(qwResult >> 32);
+            }
+        });
+    }
 
-                ULONGLONG qwResult2 = (static_cast<ULONGLONG>(ft2.dwHighDateTime) << 32) + ft2.dwLowDateTime;
-                if (qwResult2 % 20000000UL)
-                {
-                    qwResult2 += 20000000UL;
-                    qwResult2 /= 20000000UL;
-                    qwResult2 *= 20000000UL;
-                }
-                ft2.dwLowDateTime  = static_cast<DWORD>(qwResult2 & 0xFFFFFFFF);
-                ft2.dwHighDateTime = static_cast<DWORD>(qwResult2 >> 32);
+    // the progress dialog can only be updated from this thread
+    while (running)
+    {
+        Sleep(static_cast<DWORD>(SYNCPROGRESS_INTERVAL_MS));
+        if (!UpdateProgress())
+            errors |= ErrorCancelled;
+    }
+    for (auto& thread : threads)
+        thread.join();
+    return errors;
+}
 
-                cmp                = CompareFileTime(&ft1, &ft2);
-                // if the difference is smaller than 4 seconds (twice the FAT limit),
-                // then assume the times are equal.
-                if (qwResult > qwResult2)
-                {
-                    if ((qwResult - qwResult2) < 40000000UL)
-                        cmp = 0;
-                }
-                else
-                {
-                    if ((qwResult2 - qwResult) < 40000000UL)
-                        cmp = 0;
-                }
+int CFolderSync::ExecuteAction(const PairData& pt, const SyncAction& action, const std::map<std::wstring, FileData, ci_lessW>& origFileList, const std::map<std::wstring, FileData, ci_lessW>& cryptFileList, CDeleteQueue& deleteQueue)
+{
+    std::wstring origPath  = CPathUtils::Append(pt.m_origPath, action.origRelPath);
+    std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, action.cryptRelPath);
+    m_stats.AddAction(action.type);
+    CSyncProgress::CFile progress(m_progress, action.relPath, action.size);
+    // the size of the target is what the action wrote, for the compression ratios of the report.
+    // Only measured if a report was requested, that's an extra stat per transfer.
+    auto addBytes = [&](const std::wstring& target) {
+        PlatformFileInfo info;
+        ULONGLONG        written = 0;
+        if (m_measureWritten && m_fs.Stat(target, info))
+            written = info.size;
+        m_stats.AddActionBytes(action.type, action.size, written);
+    };
+    switch (action.type)
+    {
+        case SyncActionType::Encrypt:
+        case SyncActionType::CopyToCrypt:
+        {
+            const auto& fd = origFileList.at(action.relPath);
+            if (action.targetExists)
+            {
+                CAsyncLog::Instance().Info(L"encrypted file is older: %s : %s, %s : %s",
+                                           (pt.m_origPath + L"\\" + action.relPath).c_str(), ToLogTime(fd.ft),
+                                           (pt.m_cryptPath + L"\\" + action.relPath).c_str(), ToLogTime(cryptFileList.at(action.relPath).ft));
+                CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": file %s is newer than its encrypted partner", action.relPath.c_str());
             }
             else
-                cmp = CompareFileTime(&it->second.ft, &cryptIt->second.ft);
-            if (cmp < 0)
+                CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": file %s does not exist in encrypted folder", action.relPath.c_str());
+            if (action.type == SyncActionType::CopyToCrypt)
             {
-                CCircularLog::Instance()(L"INFO:    original file is older: %s : %s, %s : %s",
-                                         (pt.m_cryptPath + L"\\" + it->first).c_str(), GetFileTimeStringForLog(cryptIt->second.ft).c_str(),
-                                         (pt.m_origPath + L"\\" + it->first).c_str(), GetFileTimeStringForLog(it->second.ft).c_str());
-                // original file is older than the encrypted file
-                if ((pt.m_syncDir == BothWays) || (pt.m_syncDir == DstToSrc))
+                CAsyncLog::Instance().Info(L"copy file %s to %s", origPath.c_str(), cryptPath.c_str());
+                if (!m_stats.Time(SyncTimer::Copy, [&] { return CopyFileToTarget(origPath, cryptPath); }))
                 {
-                    // decrypt the file
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": file %s is older than its encrypted partner\n"), it->first.c_str());
-                    if (bCopyOnly)
-                    {
-                        std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, it->first);
-                        std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                        CCircularLog::Instance()(_T("INFO:    copy file %s to %s"), cryptPath.c_str(), origPath.c_str());
-                        if (!CopyFile(cryptPath.c_str(), origPath.c_str(), FALSE))
-                        {
-                            std::wstring targetFolder = pt.m_origPath + L"\\" + it->first;
-                            targetFolder              = targetFolder.substr(0, targetFolder.find_last_of('\\'));
-                            CPathUtils::CreateRecursiveDirectory(targetFolder);
-                            if (!CopyFile(cryptPath.c_str(), origPath.c_str(), FALSE))
-                                retVal |= ErrorCopy;
-                        }
-                    }
-                    else
-                    {
-                        std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, GetEncryptedFilename(it->first, pt.m_password, pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg));
-                        std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                        if (!DecryptFile(origPath, cryptPath, pt.m_password, cryptIt->second, pt.m_useGpg))
-                            retVal |= ErrorCrypt;
-                    }
+                    m_stats.Add(SyncCounter::Failures);
+                    return ErrorCopy;
                 }
-            }
-            else if (cmp > 0)
-            {
-                CCircularLog::Instance()(L"INFO:    encrypted file is older: %s : %s, %s : %s",
-                                         (pt.m_origPath + L"\\" + it->first).c_str(), GetFileTimeStringForLog(it->second.ft).c_str(),
-                                         (pt.m_cryptPath + L"\\" + it->first).c_str(), GetFileTimeStringForLog(cryptIt->second.ft).c_str());
-                // encrypted file is older than the original file
-                if ((pt.m_syncDir == BothWays) || (pt.m_syncDir == SrcToDst))
+                addBytes(cryptPath);
+                if (pt.m_ResetOriginalArchAttr)
                 {
-                    // encrypt the file
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": file %s is newer than its encrypted partner\n"), it->first.c_str());
-                    if (bCopyOnly)
-                    {
-                        std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, it->first);
-                        std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                        CCircularLog::Instance()(_T("INFO:    copy file %s to %s"), origPath.c_str(), cryptPath.c_str());
-                        bool bCopyFileResult = CopyFile(origPath.c_str(), cryptPath.c_str(), FALSE);
-                        if (!bCopyFileResult)
-                        {
-                            std::wstring targetFolder = pt.m_cryptPath + L"\\" + it->first;
-                            targetFolder              = targetFolder.substr(0, targetFolder.find_last_of('\\'));
-                            CPathUtils::CreateRecursiveDirectory(targetFolder);
-                            bCopyFileResult = CopyFile(origPath.c_str(), cryptPath.c_str(), FALSE);
-                            if (!bCopyFileResult)
-                                retVal |= ErrorCopy;
-                        }
-                        if (bCopyFileResult && pt.m_ResetOriginalArchAttr)
-                        {
-                            // Clear archive attibute
-                            AdjustFileAttributes(origPath.c_str(), FILE_ATTRIBUTE_ARCHIVE, 0);
-                        }
-                    }
-                    else
-                    {
-                        std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, GetEncryptedFilename(it->first, pt.m_password, pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg));
-                        std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                        if (!EncryptFile(origPath, cryptPath, pt.m_password, it->second, pt.m_useGpg, bCryptOnly, pt.m_compressSize, pt.m_ResetOriginalArchAttr))
-                            retVal |= ErrorCrypt;
-                    }
+                    // Reset archive attribute on original file
+                    AdjustFileAttributes(origPath.c_str(), FILE_ATTRIBUTE_ARCHIVE, 0);
                 }
+                return ErrorNone;
             }
-            else if (cmp == 0)
+            if (!m_stats.Time(SyncTimer::Encrypt, [&] { return EncryptFile(origPath, cryptPath, pt.password(), fd, pt.m_useGpg, action.noCompress, pt.m_compressSize, pt.m_ResetOriginalArchAttr, &progress); }))
             {
-                // files are identical (have the same last-write-time):
-                // nothing to copy. Check if we need to reset Archive attribute on source file
-                if ((pt.m_syncDir == BothWays) || (pt.m_syncDir == SrcToDst))
-                {
-                    if (pt.m_ResetOriginalArchAttr)
-                    {
-                        std::wstring origPath = CPathUtils::Append(pt.m_origPath, it->first);
-
-                        // Clear archive attibute
-                        AdjustFileAttributes(origPath.c_str(), FILE_ATTRIBUTE_ARCHIVE, 0);
-                    }
-                }
+                m_stats.Add(SyncCounter::Failures);
+                return ErrorCrypt;
             }
+            addBytes(cryptPath);
+            return ErrorNone;
         }
-    }
-    // now go through the encrypted file list and if there's a file that's not in the original file list,
-    // decrypt it
-    for (auto it = cryptFileList.cbegin(); (it != cryptFileList.cend()) && m_bRunning; ++it)
-    {
-        if (m_trayWnd)
-            PostMessage(m_trayWnd, WM_PROGRESS, m_progress, m_progressTotal);
-        if (m_pProgDlg)
+        case SyncActionType::Decrypt:
+        case SyncActionType::CopyToOrig:
         {
-            m_pProgDlg->SetLine(0, L"syncing files");
-            m_pProgDlg->SetLine(2, it->first.c_str(), true);
-            m_pProgDlg->SetProgress(m_progress, m_progressTotal);
-            if (m_pProgDlg->HasUserCancelled())
+            const auto& fd = cryptFileList.at(action.relPath);
+            if (action.targetExists)
             {
-                if (m_trayWnd)
-                    PostMessage(m_trayWnd, WM_PROGRESS, 0, 0);
-                retVal |= ErrorCancelled;
-                break;
+                CAsyncLog::Instance().Info(L"original file is older: %s : %s, %s : %s",
+                                           (pt.m_cryptPath + L"\\" + action.relPath).c_str(), ToLogTime(fd.ft),
+                                           (pt.m_origPath + L"\\" + action.relPath).c_str(), ToLogTime(origFileList.at(action.relPath).ft));
+                CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": file %s is older than its encrypted partner", action.relPath.c_str());
             }
-        }
-        ++m_progress;
-
-        if (CIgnores::Instance().IsIgnored(CPathUtils::Append(pt.m_origPath, it->first)))
-            continue;
-        if (pt.IsIgnored(CPathUtils::Append(pt.m_origPath, it->first)))
-            continue;
-        bool bCopyOnly = pt.IsCopyOnly(CPathUtils::Append(pt.m_origPath, it->first));
-        auto origit    = origFileList.find(it->first);
-        if (origit == origFileList.end())
-        {
-            // file does not exist in the original folder:
-            if ((pt.m_syncDir == SrcToDst) && !origFileList.empty())
+            else
+                CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": decrypt file %s to %s", action.relPath.c_str(), pt.m_origPath.c_str());
+            if (action.type == SyncActionType::CopyToOrig)
             {
-                if (pt.m_syncDeleted)
-                {
-                    // remove the encrypted file
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": counterpart of file %s does not exist in src folder, delete file\n"), it->first.c_str());
-                    CCircularLog::Instance()(_T("INFO:    counterpart of file %s does not exist in src folder, delete file"), it->first.c_str());
-                    std::wstring crypt = CPathUtils::Append(pt.m_cryptPath, it->second.fileRelPath);
-                    {
-                        CAutoWriteLock nlocker(m_notingGuard);
-                        m_notifyIgnores.insert(crypt);
-                    }
-                    if (!DeletePathToTrash(crypt))
-                    {
-                        // could not delete file to the trashbin, so delete it directly
-                        DeleteFile(crypt.c_str());
-                    }
-                }
-                else
+                CAsyncLog::Instance().Info(L"copy file %s to %s", cryptPath.c_str(), origPath.c_str());
+                if (m_stats.Time(SyncTimer::Copy, [&] { return CopyFileToTarget(cryptPath, origPath); }))
                 {
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": counterpart of file %s does not exist in src folder and sync deleted not set, skipping delete file\n"), it->first.c_str());
-                    CCircularLog::Instance()(_T("INFO:    counterpart of file %s does not exist in src folder and sync deleted not set, skipping delete file"), it->first.c_str());
+                    addBytes(origPath);
+                    return ErrorNone;
                 }
+                m_stats.Add(SyncCounter::Failures);
+                return ErrorCopy;
             }
-            else if (bCopyOnly && (origFileList.empty() || (pt.m_syncDir == BothWays) || (pt.m_syncDir == DstToSrc)))
+            if (m_stats.Time(SyncTimer::Decrypt, [&] { return DecryptFile(origPath, cryptPath, pt.password(), fd, pt.m_useGpg, &progress); }))
             {
-                std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, it->first);
-                std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                CCircularLog::Instance()(_T("INFO:    copy file %s to %s"), cryptPath.c_str(), origPath.c_str());
-                // copy the file
-                if (!CopyFile(cryptPath.c_str(), origPath.c_str(), FALSE))
-                {
-                    std::wstring targetFolder = pt.m_origPath + L"\\" + it->first;
-                    targetFolder              = targetFolder.substr(0, targetFolder.find_last_of('\\'));
-                    CPathUtils::CreateRecursiveDirectory(targetFolder);
-                    {
-                        CAutoWriteLock nLocker(m_notingGuard);
-                        m_notifyIgnores.insert(CPathUtils::Append(pt.m_origPath, it->first));
-                    }
-                    if (!CopyFile(cryptPath.c_str(), origPath.c_str(), FALSE))
-                        retVal |= ErrorCopy;
-                }
+                addBytes(origPath);
+                return ErrorNone;
             }
-
-            else if ((pt.m_syncDir == BothWays) || (pt.m_syncDir == DstToSrc)
-                     /** Only restore files in original folder
-                      * if syncing is both ways or encrypted to original direction.
-                      * Otherwise assume the intention is file should not be restored
-                      **/
-                     || (origFileList.empty() && (pt.m_syncDir == BothWays || pt.m_syncDir == DstToSrc)))
+            m_stats.Add(SyncCounter::Failures);
+            if (action.moveOnFailure)
             {
-                // decrypt the file
-                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": decrypt file %s to %s\n"), it->first.c_str(), pt.m_origPath.c_str());
-                std::wstring cryptPath = CPathUtils::Append(pt.m_cryptPath, it->second.fileRelPath);
-                std::wstring origPath  = CPathUtils::Append(pt.m_origPath, it->first);
-                if (!DecryptFile(origPath, cryptPath, pt.m_password, it->second, pt.m_useGpg))
-                {
-                    retVal |= ErrorCrypt;
-                    if (!it->second.filenameEncrypted)
-                    {
-                        {
-                            CAutoWriteLock nlocker(m_notingGuard);
-                            m_notifyIgnores.insert(cryptPath);
-                        }
-                        MoveFileEx(cryptPath.c_str(), origPath.c_str(), MOVEFILE_COPY_ALLOWED);
-                    }
-                }
+                m_selfWrites.ExpectDelete(cryptPath);
+                auto generation = m_selfWrites.BeginWrite(origPath);
+                // Rename() replaces the target, but an existing file must stay
+                PlatformFileInfo info;
+                if (!m_fs.Stat(origPath, info) && m_fs.Rename(cryptPath, origPath))
+                    m_selfWrites.CommitWrite(origPath, generation);
+                else
+                    m_selfWrites.CancelWrite(origPath, generation);
             }
+            return ErrorCrypt;
         }
+        case SyncActionType::DeleteOrig:
+            CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": counterpart of file %s does not exist in crypted folder, delete file", action.relPath.c_str());
+            CAsyncLog::Instance().Info(L"counterpart of file %s does not exist in crypted folder, delete file", action.relPath.c_str());
+            deleteQueue.Add(origPath, pt.m_origPath, cryptPath);
+            break;
+        case SyncActionType::DeleteCrypt:
+            CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": counterpart of file %s does not exist in src folder, delete file", action.relPath.c_str());
+            CAsyncLog::Instance().Info(L"counterpart of file %s does not exist in src folder, delete file", action.relPath.c_str());
+            deleteQueue.Add(cryptPath, pt.m_cryptPath, origPath);
+            break;
+        case SyncActionType::ResetArchiveAttribute:
+            // files are identical (have the same last-write-time):
+            // nothing to copy, but the archive attribute is still set
+            AdjustFileAttributes(origPath.c_str(), FILE_ATTRIBUTE_ARCHIVE, 0);
+            break;
+        case SyncActionType::KeepDeleted:
+            CAsyncLog::Instance().Info(L"counterpart of file %s does not exist in %s folder and sync deleted not set, skipping delete file",
+                                       action.relPath.c_str(), action.origRelPath.empty() ? L"src" : L"crypted");
+            break;
     }
-    if (m_trayWnd)
-        PostMessage(m_trayWnd, WM_PROGRESS, 0, 0);
-    CCircularLog::Instance()(L"INFO:    finished syncing folder orig \"%s\" with crypt \"%s\"", pt.m_origPath.c_str(), pt.m_cryptPath.c_str());
-    CCircularLog::Instance().Save();
-    return retVal;
+    return ErrorNone;
 }
 
-std::map<std::wstring, FileData, ci_lessW> CFolderSync::GetFileList(bool orig, const std::wstring& path, const std::wstring& password, bool encnames, bool encnamesnew, bool use7Z, bool useGpg, DWORD& error) const
+std::map<std::wstring, FileData, ci_lessW> CFolderSync::GetFileList(bool orig, const std::wstring& path, const std::wstring& password, bool encnames, bool encnamesnew, bool use7Z, bool useGpg, PlatformError& error, std::vector<std::wstring>* resumeFiles) const
 {
-    error                 = 0;
+    CSyncStats::CTimer enumTimer(m_stats, orig ? SyncTimer::EnumOrig : SyncTimer::EnumCrypt);
+    CTraceSpan         span("GetFileList", "enum", path);
+
+    error                 = PlatformError::None;
     std::wstring enumpath = path;
     if ((enumpath.size() == 2) && (enumpath[1] == ':'))
         enumpath += L"\\";
-    CDirFileEnum                               enumerator(enumpath);
+    // the enumeration returns the paths relative to enumpath
+    const std::wstring                         prefix = (*enumpath.rbegin() == '\\') ? enumpath : enumpath + L"\\";
 
     std::map<std::wstring, FileData, ci_lessW> fileList;
-    std::wstring                               filePath;
-    bool                                       isDir    = false;
-    bool                                       bRecurse = true;
-    while (enumerator.NextFile(filePath, &isDir, bRecurse))
-    {
-        if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
-            break;
-        if (!m_bRunning)
-            break;
-
-        bRecurse = true;
-        if (isDir)
+    auto                                       descend = [&](const std::wstring& relPath, const PlatformFileInfo&) {
+        std::wstring filePath = prefix + relPath;
+        if (CIgnores::Instance().IsIgnored(filePath))
         {
-            if (CIgnores::Instance().IsIgnored(filePath))
-                bRecurse = false; // don't recurse into ignored folders
-            continue;
+            m_stats.Add(SyncCounter::Ignored);
+            return false; // don't recurse into ignored folders
         }
+        if (CDeleteQueue::IsTrashPath(filePath))
+            return false; // nor into the trash folder
+        m_throttle.Operation(filePath);
+        return true;
+    };
+    bool ok = m_fs.Enumerate(
+        enumpath, [&](const std::wstring& foundPath, const PlatformFileInfo& info) {
+            if (IsCancelled())
+                return false;
+            if (!m_bRunning)
+                return false;
+            if (info.directory)
+                return true;
+
+            std::wstring filePath = prefix + foundPath;
+            // a temp file from a decryption or encryption that's in progress or got interrupted
+            if (C7Zip::IsExtractTempPath(filePath))
+                return true;
+            if (C7Zip::IsResumeTempPath(filePath))
+            {
+                if (resumeFiles)
+                    resumeFiles->push_back(foundPath);
+                return true;
+            }
 
-        FileData fd;
+            FileData fd;
 
-        fd.ft = enumerator.GetLastWriteTime();
-        if ((fd.ft.dwLowDateTime == 0) && (fd.ft.dwHighDateTime == 0))
-            fd.ft = enumerator.GetCreateTime();
+            // keep what the enumeration already found, so the file
+            // doesn't have to be queried again when it's encrypted
+            fd.fileInfo = ToAttributeData(info);
 
-        std::wstring relPath = filePath;
-        if (enumpath.size() < filePath.size())
-        {
-            if (*enumpath.rbegin() == '\\')
-                relPath = filePath.substr(enumpath.size());
-            else
-                relPath = filePath.substr(enumpath.size() + 1);
-        }
-        fd.fileRelPath                = relPath;
+            fd.ft       = fd.fileInfo.ftLastWriteTime;
+            if ((fd.ft.dwLowDateTime == 0) && (fd.ft.dwHighDateTime == 0))
+                fd.ft = fd.fileInfo.ftCreationTime;
 
-        std::wstring decryptedRelPath = relPath;
-        if (!orig)
-            decryptedRelPath = GetDecryptedFilename(relPath, password, encnames, encnamesnew, use7Z, useGpg);
-        fd.filenameEncrypted = (_wcsicmp(decryptedRelPath.c_str(), fd.fileRelPath.c_str()) != 0);
-        if (fd.filenameEncrypted)
-        {
-            if (use7Z && !orig)
+            std::wstring relPath          = foundPath;
+            fd.fileRelPath                = relPath;
+
+            std::wstring decryptedRelPath = relPath;
+            if (!orig)
             {
-                // if we use .7z as the file extension and the user tries to sync her/his own .7z files,
-                // we have to detect that here
-                auto lastDotPos = filePath.rfind('.');
-                if (lastDotPos != std::wstring::npos)
+                CTraceSpan span("NameDecrypt", "names");
+                m_stats.Add(SyncCounter::NameDecrypts);
+                decryptedRelPath = m_stats.Time(SyncTimer::NameDecrypt, [&] { return GetDecryptedFilename(relPath, password, encnames, encnamesnew, use7Z, useGpg); });
+            }
+            fd.filenameEncrypted = (_wcsicmp(decryptedRelPath.c_str(), fd.fileRelPath.c_str()) != 0);
+            if (fd.filenameEncrypted)
+            {
+                if (use7Z && !orig)
                 {
-                    if (_wcsicmp(filePath.substr(lastDotPos + 1).c_str(), L"7z") == 0)
+                    // if we use .7z as the file extension and the user tries to sync her/his own .7z files,
+                    // we have to detect that here
+                    auto lastDotPos = filePath.rfind('.');
+                    if (lastDotPos != std::wstring::npos)
                     {
-                        auto preLastDotPos = filePath.rfind('.', lastDotPos - 1);
-                        if (preLastDotPos != std::wstring::npos)
-                            relPath = decryptedRelPath;
-                        else if (encnames && decryptedRelPath != relPath)
+                        if (_wcsicmp(filePath.substr(lastDotPos + 1).c_str(), L"7z") == 0)
+                        {
+                            auto preLastDotPos = filePath.rfind('.', lastDotPos - 1);
+                            if (preLastDotPos != std::wstring::npos)
+                                relPath = decryptedRelPath;
+                            else if (encnames && decryptedRelPath != relPath)
+                                relPath = decryptedRelPath;
+                            else if (!orig)
+                                relPath = decryptedRelPath; // orig file with no extension
+                        }
+                        else
                             relPath = decryptedRelPath;
-                        else if (!orig)
-                            relPath = decryptedRelPath; // orig file with no extension
                     }
                     else
                         relPath = decryptedRelPath;
@@ -1005,21 +1100,26 @@ std::map<std::wstring, FileData, ci_lessW> CFolderSync::GetFileList(bool orig, c
                 else
                     relPath = decryptedRelPath;
             }
-            else
-                relPath = decryptedRelPath;
-        }
 
-        fileList[relPath] = fd;
-        if (error == 0)
-            error = enumerator.GetError();
+            fileList[relPath] = fd;
+            m_stats.Add(orig ? SyncCounter::OrigFiles : SyncCounter::CryptFiles);
+            return true;
+        },
+        descend);
+    if (!ok)
+    {
+        error = m_fs.LastError();
+        if (error == PlatformError::None)
+            error = PlatformError::Other;
     }
     return fileList;
 }
 
-bool CFolderSync::EncryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg, bool noCompress, int compresssize, bool resetArchAttr)
+bool CFolderSync::EncryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg, bool noCompress, int compresssize, bool resetArchAttr, CSyncProgress::CFile* progress)
 {
-    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": encrypt file %s to %s\n"), orig.c_str(), crypt.c_str());
-    CCircularLog::Instance()(_T("INFO:    encrypt file %s to %s"), orig.c_str(), crypt.c_str());
+    CTraceSpan span("EncryptFile", "crypt", orig);
+    CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": encrypt file %s to %s", orig.c_str(), crypt.c_str());
+    CAsyncLog::Instance().Info(L"encrypt file %s to %s", orig.c_str(), crypt.c_str());
 
     size_t slashpos = crypt.find_last_of('\\');
     if (slashpos == std::string::npos)
@@ -1027,101 +1127,115 @@ bool CFolderSync::EncryptFile(const std::wstring& orig, const std::wstring& cryp
     std::wstring targetFolder = crypt.substr(0, slashpos);
     std::wstring cryptName    = crypt.substr(slashpos + 1);
 
-    int          compression  = noCompress ? 0 : 9;
-    if (!noCompress)
+    if (!useGpg || password.empty())
     {
-        // try to open the source file in read mode:
-        // if we can't open the file, then it is locked and 7-zip would fail.
-        // But when 7-zip fails, it destroys a possible already existing encrypted file instead of
-        // just leaving it as it is. So by first checking if the source file
-        // can be read, we reduce the chances of 7-zip destroying the target file.
-        CAutoFile hFile = CreateFile(orig.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
-        if (!hFile.IsValid())
+        if (password.empty())
+            CAsyncLog::Instance().Error(L"password is blank - NOT secure - force 7z not GPG", crypt.c_str());
+
+        // the file info usually comes from the enumeration of the folder,
+        // the file only has to be queried if the caller didn't have it.
+        // 7-zip compresses into a temp file, so if the source file
+        // can't be read, an existing encrypted file is left as it is.
+        WIN32_FILE_ATTRIBUTE_DATA fileInfo = fd.fileInfo;
+        if (!fd.HasFileInfo() && !GetFileAttributesEx(orig.c_str(), GetFileExInfoStandard, &fileInfo))
         {
             _com_error comError(::GetLastError());
             LPCTSTR    comErrorText = comError.ErrorMessage();
 
-            CCircularLog::Instance()(L"ERROR:   \"%s\" error determining \"%s\"'s file size, encryption aborted.", comErrorText, orig.c_str());
+            CAsyncLog::Instance().Error(L"\"%s\" error determining \"%s\"'s file size, encryption aborted.", comErrorText, orig.c_str());
             return false;
         }
-        LARGE_INTEGER fileSize = {};
-        GetFileSizeEx(hFile, &fileSize);
-        hFile.CloseHandle();
-
-        if (fileSize.QuadPart > (compresssize * 1024LL * 1024LL))
+        FilePathInfo fpi;
+        fpi.FilePath       = orig;
+        fpi.FileName       = orig.substr(orig.find_last_of('\\') + 1);
+        fpi.Attributes     = fileInfo.dwFileAttributes;
+        fpi.CreationTime   = fileInfo.ftCreationTime;
+        fpi.IsDirectory    = false;
+        fpi.LastAccessTime = fileInfo.ftLastAccessTime;
+        fpi.LastWriteTime  = fileInfo.ftLastWriteTime;
+        fpi.Size           = (static_cast<ULONGLONG>(fileInfo.nFileSizeHigh) << 32) | fileInfo.nFileSizeLow;
+
+        int compression    = noCompress ? 0 : 9;
+        if (fpi.Size > (compresssize * 1024ULL * 1024ULL))
             compression = 0; // turn off compression for files bigger than compresssize MB
-    }
 
-    if (!useGpg || password.empty())
-    {
-        if (password.empty())
-            CCircularLog::Instance()(_T("ERROR:   password is blank - NOT secure - force 7z not GPG"), crypt.c_str());
-        auto progressFunc = [&](UInt64, UInt64, const std::wstring&) {
-            if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
+        // big files are encrypted in the target folder next to the encrypted
+        // file, where the partial archive and its checkpoint survive a Stop()
+        // or a reboot, so the next sync can continue from the checkpoint
+        UInt64 resumableThreshold = GetResumableThreshold();
+        bool   resumable          = (resumableThreshold > 0) && (compression == 0) && !password.empty() && (fpi.Size >= resumableThreshold);
+
+        auto progressFunc = [&](UInt64 pos, UInt64, const std::wstring&) {
+            CTraceSpan span("Progress", "7zip");
+            if (progress)
+                progress->SetPosition(pos);
+            if (!UpdateProgress())
+                return E_ABORT;
+            if (resumable && !m_bRunning)
                 return E_ABORT;
             return S_OK;
         };
+        auto ioFunc = [this](const std::wstring& path, UInt64 size, bool write) { AccountIo(path, size, write); };
 
-        std::wstring encryptTmpFile = CPathUtils::GetTempFilePath();
+        std::wstring encryptTmpFile = resumable ? C7Zip::GetResumePartialPath(crypt) : CPathUtils::GetTempFilePath();
+        std::wstring checkpointFile = C7Zip::GetResumeCheckpointPath(crypt);
         C7Zip        compressor;
         compressor.SetPassword(password);
         compressor.SetArchivePath(encryptTmpFile);
         compressor.SetCompressionFormat(CompressionFormat::SevenZip, compression);
         compressor.SetCallback(progressFunc);
-        if (compressor.AddPath(orig))
+        compressor.SetIoCallback(ioFunc);
+        compressor.SetUnbufferedThreshold(GetUnbufferedThreshold());
+        if (resumable)
         {
-            CPathUtils::CreateRecursiveDirectory(targetFolder);
+            m_dirCache.Create(targetFolder);
+            compressor.SetCheckpointFile(checkpointFile, GetResumeCheckpointInterval());
+        }
+        // Do equivalent of 7-zip's -stl option and set archive time based on archive's file timestamp.
+        // This is required to ensure future sync operations work (based on source / encrypted file's last-modified date).
+        // The time and the attributes are set on the archive file before it's closed, and are kept when it's moved.
+        compressor.SetArchiveFileInfo(fd.ft, FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED);
+        CAutoFile hOrigAttributes;
+        if (resetArchAttr)
+            hOrigAttributes = OpenForAttributes(orig);
+        if (compressor.AddFile(fpi))
+        {
+            if (compressor.GetResumedSize() > 0)
+                CAsyncLog::Instance().Info(L"continued encrypting \"%s\" at %I64u bytes", orig.c_str(), compressor.GetResumedSize());
+            m_dirCache.Create(targetFolder);
+            auto generation = m_selfWrites.BeginWrite(crypt);
             if (MoveFileEx(encryptTmpFile.c_str(), (targetFolder + L"\\" + cryptName).c_str(), MOVEFILE_COPY_ALLOWED | MOVEFILE_REPLACE_EXISTING))
             {
                 DeleteFile(encryptTmpFile.c_str());
 
-                // set content not indexed and the file timestamp
-                AdjustFileAttributes(targetFolder + L"\\" + cryptName.c_str(), 0, FILE_ATTRIBUTE_NOT_CONTENT_INDEXED);
-
                 if (resetArchAttr)
                 {
                     // Reset archive attribute on original file
-                    AdjustFileAttributes(orig.c_str(), FILE_ATTRIBUTE_ARCHIVE, 0);
+                    AdjustFileAttributes(hOrigAttributes, orig, FILE_ATTRIBUTE_ARCHIVE, 0, &fileInfo.ftLastWriteTime);
                 }
 
-                // Do equivalent of Z-zip's -stl option and set archive time based on archive's file timestamp
-                // This is required to ensure future sync operations work (based on source / encrypted file's last-modified date)
-                int  retry = 5;
-                bool bRet  = true;
-                do
-                {
-                    if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
-                        break;
-                    CAutoFile hFileCrypt = CreateFile(crypt.c_str(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-                    if (hFileCrypt.IsValid())
-                    {
-                        bRet = !!SetFileTime(hFileCrypt, nullptr, nullptr, &fd.ft);
-                    }
-                    else
-                        bRet = false;
-                    if (!bRet)
-                        Sleep(200);
-                } while (!bRet && (retry-- > 0));
-                if (!bRet) // Should archive file be erased in this case (future sync will be unreliable due to incorrect date)?
-                    CCircularLog::Instance()(_T("INFO:    failed to set file time on %s"), crypt.c_str());
+                m_selfWrites.CommitWrite(crypt, generation);
                 CAutoWriteLock locker(m_failureGuard);
                 m_failures.erase(orig);
                 return true;
             }
+            m_selfWrites.CancelWrite(crypt, generation);
             _com_error comError(::GetLastError());
             LPCTSTR    comErrorText = comError.ErrorMessage();
 
-            CCircularLog::Instance()(L"ERROR:   error moving temporary encrypted file \"%s\" to \"%s\" (%s)", encryptTmpFile.c_str(), crypt.c_str(), comErrorText);
+            CAsyncLog::Instance().Error(L"error moving temporary encrypted file \"%s\" to \"%s\" (%s)", encryptTmpFile.c_str(), crypt.c_str(), comErrorText);
             DeleteFile(encryptTmpFile.c_str());
             return false;
         }
         else
         {
-            // If encrypting failed, remove the leftover file
-            DeleteFile(encryptTmpFile.c_str());
+            // If encrypting failed, remove the leftover file, unless the
+            // encryption can continue from a checkpoint the next time
+            if (!resumable || !PathFileExists(checkpointFile.c_str()))
+                DeleteFile(encryptTmpFile.c_str());
             CAutoWriteLock locker(m_failureGuard);
             m_failures[orig] = Encrypt;
-            CCircularLog::Instance()(L"ERROR:   Failed to encrypt file \"%s\" to \"%s\"", orig.c_str(), crypt.c_str());
+            CAsyncLog::Instance().Error(L"Failed to encrypt file \"%s\" to \"%s\"", orig.c_str(), crypt.c_str());
             return false;
         }
     }
@@ -1131,55 +1245,45 @@ bool CFolderSync::EncryptFile(const std::wstring& orig, const std::wstring& cryp
 
     swprintf_s(cmdlineBuf.get(), bufLen, L"\"%s\" --batch --yes -c -a --passphrase \"%s\" -o \"%s\" \"%s\" ", m_gnuPg.c_str(), password.c_str(), crypt.c_str(), orig.c_str());
 
-    {
-        CAutoWriteLock nLocker(m_notingGuard);
-        m_notifyIgnores.insert(crypt);
-    }
-    bool bRet = RunGPG(cmdlineBuf.get(), targetFolder);
+    CAutoFile hOrigAttributes;
+    if (resetArchAttr)
+        hOrigAttributes = OpenForAttributes(orig);
+    auto generation = m_selfWrites.BeginWrite(crypt);
+    bool bRet       = RunGPG(cmdlineBuf.get(), targetFolder);
     if (bRet)
     {
         if (resetArchAttr)
         {
             // Reset archive attribute on original file
-            AdjustFileAttributes(orig.c_str(), FILE_ATTRIBUTE_ARCHIVE, 0);
+            AdjustFileAttributes(hOrigAttributes, orig, FILE_ATTRIBUTE_ARCHIVE, 0, fd.HasFileInfo() ? &fd.fileInfo.ftLastWriteTime : nullptr);
         }
 
-        // set the file timestamp
-        int retry = 5;
-        do
-        {
-            if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
-                break;
-            CAutoFile hFileCrypt = CreateFile(crypt.c_str(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-            if (hFileCrypt.IsValid())
-            {
-                bRet = !!SetFileTime(hFileCrypt, nullptr, nullptr, &fd.ft);
-            }
-            else
-                bRet = false;
-            if (!bRet)
-                Sleep(200);
-        } while (!bRet && (retry-- > 0));
+        // set the file timestamp: gpg has exited, so it doesn't hold the file anymore
+        CAutoFile hFileCrypt = OpenForAttributes(crypt);
+        bRet                 = hFileCrypt.IsValid() && SetFileTime(hFileCrypt, nullptr, nullptr, &fd.ft);
         if (!bRet) // Should archive file be erased in this case (future sync will be unreliable due to incorrect date)?
-            CCircularLog::Instance()(_T("INFO:    failed to set file time on %s"), crypt.c_str());
+            CAsyncLog::Instance().Info(L"failed to set file time on %s", crypt.c_str());
+        m_selfWrites.CommitWrite(crypt, generation);
         CAutoWriteLock locker(m_failureGuard);
         m_failures.erase(orig);
     }
     else
     {
         // If encrypting failed, remove the leftover file
+        m_selfWrites.ExpectDelete(crypt);
         DeleteFile(crypt.c_str());
         CAutoWriteLock locker(m_failureGuard);
         m_failures[orig] = Encrypt;
-        CCircularLog::Instance()(L"ERROR:   Failed to encrypt file \"%s\" to \"%s\"", orig.c_str(), crypt.c_str());
+        CAsyncLog::Instance().Error(L"Failed to encrypt file \"%s\" to \"%s\"", orig.c_str(), crypt.c_str());
     }
     return bRet;
 }
 
-bool CFolderSync::DecryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg)
+bool CFolderSync::DecryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg, CSyncProgress::CFile* progress)
 {
-    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": decrypt file %s to %s\n"), crypt.c_str(), orig.c_str());
-    CCircularLog::Instance()(_T("INFO:    decrypt file %s to %s"), crypt.c_str(), orig.c_str());
+    CTraceSpan span("DecryptFile", "crypt", crypt);
+    CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": decrypt file %s to %s", crypt.c_str(), orig.c_str());
+    CAsyncLog::Instance().Info(L"decrypt file %s to %s", crypt.c_str(), orig.c_str());
     size_t slashPos = orig.find_last_of('\\');
     if (slashPos == std::string::npos)
         return false;
@@ -1190,120 +1294,79 @@ bool CFolderSync::DecryptFile(const std::wstring& orig, const std::wstring& cryp
     if (!useGpg || password.empty())
     {
         if (password.empty())
-            CCircularLog::Instance()(_T("WARNING: password is blank - NOT secure - force 7z not GPG"), crypt.c_str());
+            CAsyncLog::Instance().Warning(L"password is blank - NOT secure - force 7z not GPG", crypt.c_str());
 
-        auto progressFunc = [&](UInt64, UInt64, const std::wstring&) {
-            if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
+        auto progressFunc = [&](UInt64 pos, UInt64, const std::wstring&) {
+            CTraceSpan span("Progress", "7zip");
+            if (progress)
+                progress->SetPosition(pos);
+            if (!UpdateProgress())
                 return E_ABORT;
             return S_OK;
         };
+        auto ioFunc = [this](const std::wstring& path, UInt64 size, bool write) { AccountIo(path, size, write); };
 
         C7Zip extractor;
         extractor.SetPassword(password);
         extractor.SetArchivePath(crypt);
         extractor.SetCompressionFormat(CompressionFormat::SevenZip, 9);
         extractor.SetCallback(progressFunc);
-        CPathUtils::CreateRecursiveDirectory(targetFolder);
+        extractor.SetIoCallback(ioFunc);
+        extractor.SetUnbufferedThreshold(GetUnbufferedThreshold());
+        extractor.SetCreateDirectoryCallback([this](const std::wstring& dir) { return m_dirCache.Create(dir); });
+        // the time stored in the archive is usually the same, but it's possible
+        // that the last write time of the encrypted file got changed: the
+        // decrypted file must get the same time as the encrypted file.
+        if ((fd.ft.dwLowDateTime != 0) || (fd.ft.dwHighDateTime != 0))
+            extractor.SetExtractedFileTime(fd.ft);
+        m_dirCache.Create(targetFolder);
+        auto generation = m_selfWrites.BeginWrite(orig);
         if (extractor.Extract(targetFolder))
         {
-            // Setting the file last write time is usually not required: 7zip will have set it based on archive content, even
-            // for files with read-only attributes (code below logs error msg for those files).
-            //
-            // but it is possible that the encrypted file has the last-write-time changed (i.e. different from the source file).
-            // so we check here if the file time is correct and if not, try to adjust it.
-            int  retry = 5;
-            bool bRet  = true;
-            do
-            {
-                if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
-                    break;
-
-                CAutoFile hFile = CreateFile(orig.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-                if (hFile.IsValid())
-                {
-                    FILETIME ftCreate{};
-                    bRet = !!GetFileTime(hFile, nullptr, nullptr, &ftCreate);
-                    if (bRet)
-                    {
-                        bRet = CompareFileTime(&fd.ft, &ftCreate) == 0;
-                    }
-                    if (!bRet)
-                    {
-                        hFile.CloseHandle();
-                        hFile = CreateFile(orig.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-                        bRet  = !!SetFileTime(hFile, nullptr, nullptr, &fd.ft);
-                    }
-                }
-                else
-                    bRet = false;
-                if (!bRet)
-                    Sleep(200);
-            } while (!bRet && (retry-- > 0));
-            if (!bRet)
-                CCircularLog::Instance()(_T("ERROR:   failed to set file time on %s"), orig.c_str());
+            m_selfWrites.CommitWrite(orig, generation);
             CAutoWriteLock locker(m_failureGuard);
             m_failures.erase(orig);
             return true;
         }
         else
         {
-            DeleteFile(orig.c_str());
+            // the extraction only replaces the file once it's complete,
+            // so there's no partially written file to remove
+            m_selfWrites.CancelWrite(orig, generation);
             CAutoWriteLock locker(m_failureGuard);
             m_failures[orig] = Decrypt;
-            CCircularLog::Instance()(L"ERROR:   Failed to decrypt file \"%s\" to \"%s\"", crypt.c_str(), orig.c_str());
+            CAsyncLog::Instance().Error(L"Failed to decrypt file \"%s\" to \"%s\"", crypt.c_str(), orig.c_str());
             return false;
         }
     }
 
     swprintf_s(cmdlineBuf.get(), bufLen, L"\"%s\" --yes --batch --passphrase \"%s\" -o \"%s\" \"%s\" ", m_gnuPg.c_str(), password.c_str(), orig.c_str(), crypt.c_str());
-    {
-        CAutoWriteLock nLocker(m_notingGuard);
-        m_notifyIgnores.insert(orig);
-    }
-    bool bRet = RunGPG(cmdlineBuf.get(), targetFolder);
+    auto generation = m_selfWrites.BeginWrite(orig);
+    bool bRet       = RunGPG(cmdlineBuf.get(), targetFolder);
     if (bRet)
     {
-        // set the file timestamp
-        int retry = 5;
-        do
-        {
-            if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
-                break;
-            CAutoFile hFile = CreateFile(orig.c_str(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
-            if (hFile.IsValid())
-            {
-                bRet = !!SetFileTime(hFile, nullptr, nullptr, &fd.ft);
-            }
-            else
-                bRet = false;
-            if (!bRet)
-                Sleep(200);
-        } while (!bRet && (retry-- > 0));
+        // set the file timestamp: gpg has exited, so it doesn't hold the file anymore
+        CAutoFile hFile = OpenForAttributes(orig);
+        bRet            = hFile.IsValid() && SetFileTime(hFile, nullptr, nullptr, &fd.ft);
         if (!bRet)
-            CCircularLog::Instance()(_T("ERROR:   failed to set file time on %s"), orig.c_str());
+            CAsyncLog::Instance().Error(L"failed to set file time on %s", orig.c_str());
+        m_selfWrites.CommitWrite(orig, generation);
         CAutoWriteLock locker(m_failureGuard);
         m_failures.erase(orig);
     }
     else
     {
+        m_selfWrites.ExpectDelete(orig);
         DeleteFile(orig.c_str());
         CAutoWriteLock locker(m_failureGuard);
         m_failures[orig] = Decrypt;
-        CCircularLog::Instance()(L"ERROR:   Failed to decrypt file \"%s\" to \"%s\"", crypt.c_str(), orig.c_str());
+        CAsyncLog::Instance().Error(L"Failed to decrypt file \"%s\" to \"%s\"", crypt.c_str(), orig.c_str());
     }
     return bRet;
 }
 
 std::wstring CFolderSync::GetDecryptedFilename(const std::wstring& filename, const std::wstring& password, bool encryptName, bool newEncryption, bool use7Z, bool useGpg)
 {
-    std::wstring decryptName = filename;
-    size_t       dotPos      = filename.find_last_of('.');
-    std::wstring fName;
-    if (dotPos != std::string::npos)
-        fName = filename.substr(0, dotPos);
-    else
-        fName = filename;
-
     if (!encryptName)
     {
         std::wstring f = filename;
@@ -1339,93 +1402,7 @@ std::wstring CFolderSync::GetDecryptedFilename(const std::wstring& filename, con
         return filename;
     }
 
-    HCRYPTPROV hProv = NULL;
-    // Get handle to user default provider.
-    if (CryptAcquireContext(&hProv, nullptr, nullptr, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
-    {
-        HCRYPTHASH hHash = NULL;
-        // Create hash object.
-        if (CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash))
-        {
-            // Hash password string.
-            DWORD dwLength = static_cast<DWORD>(sizeof(WCHAR) * password.size());
-            if (CryptHashData(hHash, reinterpret_cast<BYTE*>(const_cast<wchar_t*>(password.c_str())), dwLength, 0))
-            {
-                HCRYPTKEY hKey = NULL;
-                // Create block cipher session key based on hash of the password.
-                if (CryptDeriveKey(hProv, CALG_RC4, hHash, CRYPT_EXPORTABLE, &hKey))
-                {
-                    std::vector<std::wstring> names;
-                    std::vector<std::wstring> decryptNames;
-                    stringtok(names, fName, true, L"\\/");
-                    for (auto it = names.cbegin(); it != names.cend(); ++it)
-                    {
-                        std::string name = CUnicodeUtils::StdGetUTF8(*it);
-                        dwLength         = static_cast<DWORD>(name.size() + 1024); // 1024 bytes should be enough for padding
-                        auto buffer      = std::make_unique<BYTE[]>(dwLength);
-
-                        auto strIn       = std::make_unique<BYTE[]>(name.size() * sizeof(WCHAR) + 1);
-                        if (newEncryption)
-                        {
-                            base4k::B4K_ENCODING_SETTINGS encodingSettings;
-                            base4k::initialize(&encodingSettings, 2);
-                            uint32_t ccData   = B4K_AUTO;
-                            uint8_t* cDecoded = nullptr;
-                            if (base4k::base4KDecode(reinterpret_cast<const uint16_t*>(it->data()), &ccData, &cDecoded) == base4k::B4K_SUCCESS)
-                            {
-                                memcpy(buffer.get(), cDecoded, ccData + 1LL);
-                                CryptDecrypt(hKey, 0, true, 0, static_cast<BYTE*>(buffer.get()), &dwLength);
-                                decryptName = CUnicodeUtils::StdGetUnicode(std::string(reinterpret_cast<char*>(buffer.get()), ccData));
-                            }
-                            else
-                                decryptName = *it;
-                            free(cDecoded);
-                        }
-                        else
-                        {
-                            if (CStringUtils::FromHexString(name, strIn.get()))
-                            {
-                                // copy encrypted password to temporary buffer
-                                memcpy(buffer.get(), strIn.get(), name.size());
-                                CryptDecrypt(hKey, 0, true, 0, static_cast<BYTE*>(buffer.get()), &dwLength);
-                                decryptName = CUnicodeUtils::StdGetUnicode(std::string(reinterpret_cast<char*>(buffer.get()), name.size() / 2));
-                            }
-                        }
-                        if (decryptName.empty() || (decryptName[0] != '*'))
-                        {
-                            if ((dotPos != std::string::npos) && ((it + 1) == names.cend()))
-                            {
-                                std::wstring s = *it;
-                                s += filename.substr(dotPos);
-                                decryptNames.push_back(s);
-                            }
-                            else
-                                decryptNames.push_back(*it);
-                        }
-                        else
-                            decryptNames.push_back(decryptName.substr(1)); // cut off the starting '*'
-                    }
-                    CryptDestroyKey(hKey); // Release provider handle.
-                    decryptName.clear();
-                    for (auto it = decryptNames.cbegin(); it != decryptNames.cend(); ++it)
-                    {
-                        if (!decryptName.empty())
-                            decryptName += L"\\";
-                        decryptName += *it;
-                    }
-                }
-            }
-            CryptDestroyHash(hHash); // Destroy session key.
-        }
-        CryptReleaseContext(hProv, 0);
-    }
-    else
-        DebugBreak();
-
-    if (decryptName.empty())
-        decryptName = filename;
-
-    return decryptName;
+    return CNameCipher(password).DecryptPath(filename, newEncryption);
 }
 
 std::wstring CFolderSync::GetEncryptedFilename(const std::wstring& filename, const std::wstring& password, bool encryptName, bool newEncryption, bool use7Z, bool useGpg)
@@ -1456,115 +1433,25 @@ std::wstring CFolderSync::GetEncryptedFilename(const std::wstring& filename, con
         }
     }
 
-    bool       bResult = true;
-
-    HCRYPTPROV hProv   = NULL;
-    // Get handle to user default provider.
-    if (CryptAcquireContext(&hProv, nullptr, nullptr, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
-    {
-        HCRYPTHASH hHash = NULL;
-        // Create hash object.
-        if (CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash))
-        {
-            // Hash password string.
-            DWORD dwLength = static_cast<DWORD>(sizeof(WCHAR) * password.size());
-            if (CryptHashData(hHash, reinterpret_cast<BYTE*>(const_cast<wchar_t*>(password.c_str())), dwLength, 0))
-            {
-                // Create block cipher session key based on hash of the password.
-                HCRYPTKEY hKey = NULL;
-                if (CryptDeriveKey(hProv, CALG_RC4, hHash, CRYPT_EXPORTABLE, &hKey))
-                {
-                    std::vector<std::wstring> names;
-                    std::vector<std::wstring> encryptNames;
-                    stringtok(names, filename, true, L"\\/");
-                    for (auto it = names.cbegin(); it != names.cend(); ++it)
-                    {
-                        // Determine number of bytes to encrypt at a time.
-                        std::string starName = "*";
-                        starName += CUnicodeUtils::StdGetUTF8(*it);
-
-                        dwLength    = static_cast<DWORD>(starName.size());
-                        auto buffer = std::make_unique<BYTE[]>(dwLength + 1024LL);
-                        memcpy(buffer.get(), starName.c_str(), dwLength);
-                        // Encrypt data
-                        if (CryptEncrypt(hKey, 0, true, 0, buffer.get(), &dwLength, dwLength + 1024))
-                        {
-                            if (newEncryption)
-                            {
-                                base4k::B4K_ENCODING_SETTINGS encodingSettings;
-                                base4k::initialize(&encodingSettings, 2);
-                                uint32_t  ccData   = dwLength;
-                                uint16_t* cEncoded = nullptr;
-                                if (base4k::base4kEncode(&encodingSettings, reinterpret_cast<const uint8_t*>(buffer.get()), &ccData, &cEncoded) == base4k::B4K_SUCCESS)
-                                {
-                                    OnOutOfScope(free(cEncoded));
-                                    encryptFilename = reinterpret_cast<wchar_t*>(cEncoded);
-                                    encryptNames.push_back(encryptFilename);
-                                }
-                            }
-                            else
-                            {
-                                encryptFilename = CStringUtils::ToHexWString(buffer.get(), dwLength);
-                                encryptNames.push_back(encryptFilename);
-                            }
-                        }
-                        else
-                        {
-                            encryptNames.push_back(*it);
-                            bResult = false;
-                        }
-                    }
-                    encryptFilename.clear();
-                    for (auto it = encryptNames.cbegin(); it != encryptNames.cend(); ++it)
-                    {
-                        if (!encryptFilename.empty())
-                            encryptFilename += L"\\";
-                        encryptFilename += *it;
-                    }
-                    if (useGpg)
-                    {
-                        encryptFilename += L".gpg";
-                    }
-                    else
-                    {
-                        if (use7Z)
-                            encryptFilename += L".7z";
-                        else
-                            encryptFilename += L".cryptsync";
-                    }
-                    CryptDestroyKey(hKey); // Release provider handle.
-                }
-                else
-                {
-                    bResult = false;
-                }
-            }
-            else
-            {
-                bResult = false;
-            }
-            CryptDestroyHash(hHash);
-        }
-        else
-        {
-            bResult = false;
-        }
-        CryptReleaseContext(hProv, 0);
-    }
+    encryptFilename = CNameCipher(password).EncryptPath(filename, newEncryption);
+    if (useGpg)
+        encryptFilename += L".gpg";
+    else if (use7Z)
+        encryptFilename += L".7z";
     else
-        DebugBreak();
-    if (bResult)
-        return encryptFilename;
-    return filename;
+        encryptFilename += L".cryptsync";
+    return encryptFilename;
 }
 
 bool CFolderSync::RunGPG(LPWSTR cmdline, const std::wstring& cwd) const
 {
-    if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
+    // not the command line: it has the passphrase
+    CTraceSpan span("RunGPG", "crypt", cwd);
+    if (IsCancelled())
         return false;
     PROCESS_INFORMATION pi = {nullptr};
 
-    CPathUtils::CreateRecursiveDirectory(cwd);
+    m_dirCache.Create(cwd);
     if (CCreateProcessHelper::CreateProcess(m_gnuPg.c_str(), cmdline, nullptr, &pi, true, BELOW_NORMAL_PRIORITY_CLASS | CREATE_UNICODE_ENVIRONMENT))
     {
         // wait until the process terminates
@@ -1572,9 +1459,11 @@ bool CFolderSync::RunGPG(LPWSTR cmdline, const std::wstring& cwd) const
         do
         {
             waitRet = WaitForSingleObject(pi.hProcess, 2000);
-            if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
+            if (IsCancelled())
             {
+                // the output file is only closed once the process is gone
                 TerminateProcess(pi.hProcess, 1);
+                WaitForSingleObject(pi.hProcess, INFINITE);
                 break;
             }
         } while (waitRet == WAIT_TIMEOUT);
@@ -1590,152 +1479,196 @@ bool CFolderSync::RunGPG(LPWSTR cmdline, const std::wstring& cwd) const
     return false;
 }
 
+HANDLE CFolderSync::OpenForAttributes(const std::wstring& path)
+{
+    // accessing only the attributes and times isn't affected by the share mode
+    // of other handles to the file, e.g. of a virus scanner: no need to retry
+    return CreateFile(path.c_str(), FILE_READ_ATTRIBUTES | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+}
+
 void CFolderSync::AdjustFileAttributes(const std::wstring& fName, DWORD dwFileAttributesToClear, DWORD dwFileAttributesToSet) const
 {
-    // Adjust file attributes on file without impacting file times
-    WIN32_FILE_ATTRIBUTE_DATA fData = {};
-    DWORD                     error = 0;
+    CAutoFile hFile = OpenForAttributes(fName);
+    AdjustFileAttributes(hFile, fName, dwFileAttributesToClear, dwFileAttributesToSet);
+}
 
-    int                       retry = 5;
-    bool                      bRet  = true;
-    do
+void CFolderSync::AdjustFileAttributes(HANDLE hFile, const std::wstring& fName, DWORD dwFileAttributesToClear, DWORD dwFileAttributesToSet, const FILETIME* writeTime) const
+{
+    // Adjust file attributes on file without impacting file times
+    FILE_BASIC_INFO basicInfo = {};
+    bool            bRet      = (hFile != nullptr) && (hFile != INVALID_HANDLE_VALUE) && GetFileInformationByHandleEx(hFile, FileBasicInfo, &basicInfo, sizeof(basicInfo));
+    if (bRet)
     {
-        if (m_pProgDlg && m_pProgDlg->HasUserCancelled())
-            break;
-        if ((bRet = GetFileAttributesEx(fName.c_str(), GetFileExInfoStandard, &fData)) != 0)
+        if (((basicInfo.FileAttributes & dwFileAttributesToSet) == dwFileAttributesToSet) && ((basicInfo.FileAttributes & dwFileAttributesToClear) == 0))
         {
-            if (((fData.dwFileAttributes & dwFileAttributesToSet) == dwFileAttributesToSet) && ((fData.dwFileAttributes & dwFileAttributesToClear) == 0))
-            {
-                // Attribute already set / cleared as requested
-                // Commented out (noisy log enty) CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": Attribute %d already set correctly on file %s \n"), dwFileAttributesToSet, fName.c_str());
-                return;
-            }
-
-            if ((dwFileAttributesToClear & dwFileAttributesToSet) != 0)
-            {
-                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": Unexpected usage: clearing and setting same attribute on %s, dwFileAttributesToClear=%d, dwFileAttributesToSet (will be set)=%d \n"), fName.c_str(), dwFileAttributesToClear, dwFileAttributesToSet);
-            }
+            // Attribute already set / cleared as requested
+            return;
+        }
+        if (writeTime && (((static_cast<ULONGLONG>(writeTime->dwHighDateTime) << 32) | writeTime->dwLowDateTime) != static_cast<ULONGLONG>(basicInfo.LastWriteTime.QuadPart)))
+        {
+            // the file changed after it was synced, it still needs the next backup
+            CAsyncLog::Instance().Info(L"%s changed while it was synced, attributes not adjusted", fName.c_str());
+            return;
+        }
 
-            fData.dwFileAttributes &= (~dwFileAttributesToClear);
-            bRet = SetFileAttributes(fName.c_str(), fData.dwFileAttributes | dwFileAttributesToSet);
+        if ((dwFileAttributesToClear & dwFileAttributesToSet) != 0)
+        {
+            CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": Unexpected usage: clearing and setting same attribute on %s, dwFileAttributesToClear=%d, dwFileAttributesToSet (will be set)=%d", fName.c_str(), dwFileAttributesToClear, dwFileAttributesToSet);
         }
-        error = ::GetLastError();
-        if (!bRet)
-            Sleep(200);
-    } while (!bRet && (retry-- > 0));
+
+        DWORD attributes = (basicInfo.FileAttributes & ~dwFileAttributesToClear) | dwFileAttributesToSet;
+        if (attributes != FILE_ATTRIBUTE_NORMAL)
+            attributes &= ~FILE_ATTRIBUTE_NORMAL;
+        // zero leaves the attributes and the times as they are
+        basicInfo                = {};
+        basicInfo.FileAttributes = attributes ? attributes : FILE_ATTRIBUTE_NORMAL;
+        bRet                     = SetFileInformationByHandle(hFile, FileBasicInfo, &basicInfo, sizeof(basicInfo));
+    }
 
     if (!bRet)
     {
-        _com_error comError(error);
+        _com_error comError(::GetLastError());
         LPCTSTR    comErrorText = comError.ErrorMessage();
 
-        CCircularLog::Instance()(_T("INFO:    failed to adjust attributes on %s (%s)"), fName.c_str(), comErrorText);
-        CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": Unable to adjust file attributes on %s, dwFileAttributesToClear=%d, dwFileAttributesToSet=%d \n"), fName.c_str(), dwFileAttributesToClear, dwFileAttributesToSet);
+        CAsyncLog::Instance().Info(L"failed to adjust attributes on %s (%s)", fName.c_str(), comErrorText);
+        CAsyncLog::Instance().Debug(_T(__FUNCTION__) L": Unable to adjust file attributes on %s, dwFileAttributesToClear=%d, dwFileAttributesToSet=%d", fName.c_str(), dwFileAttributesToClear, dwFileAttributesToSet);
     }
     else
     {
-        CCircularLog::Instance()(_T("INFO:    successfully adjusted attribute on %s"), fName.c_str());
+        CAsyncLog::Instance().Info(L"successfully adjusted attribute on %s", fName.c_str());
     }
 }
 
-bool CFolderSync::DeletePathToTrash(const std::wstring& path)
+bool CFolderSync::CopyFileToTarget(const std::wstring& src, const std::wstring& dst)
 {
-    if (path.starts_with(L"\\\\?\\UNC"))
-    {
-        std::wstring newPath = L"\\" + path.substr(7);
-        return DeletePathToTrash(newPath);
-    }
-    if (path.starts_with(L"\\\\?\\"))
-    {
-        std::wstring newPath = path.substr(4);
-        return DeletePathToTrash(newPath);
-    }
-    IFileOperationPtr pfo = nullptr;
-    auto              hr  = pfo.CreateInstance(CLSID_FileOperation, nullptr, CLSCTX_ALL);
-    if (SUCCEEDED(hr))
+    CTraceSpan  span("CopyFile", "io", src);
+    CCopyEngine copyEngine;
+    copyEngine.SetCompareContent(GetCompareBeforeCopy());
+    copyEngine.SetIoCallback([this](const std::wstring& path, ULONGLONG size, bool write) { AccountIo(path, size, write); });
+    // the copy engine clones and offloads the copies on the native file system
+    const bool native     = IsNativeFileSystem();
+    auto       copy       = [&] { return native ? copyEngine.Copy(src, dst) : m_fs.Copy(src, dst); };
+    auto       generation = m_selfWrites.BeginWrite(dst);
+    bool       bRet       = copy();
+    if (!bRet)
     {
-        DWORD flags = FOF_ALLOWUNDO | FOF_FILESONLY | FOF_NOCONFIRMATION | FOF_NO_CONNECTED_ELEMENTS | FOF_NOERRORUI | FOF_SILENT | FOFX_RECYCLEONDELETE;
-        pfo->SetOperationFlags(flags);
-        IShellItemPtr psiFrom = nullptr;
-        hr                    = SHCreateItemFromParsingName(path.c_str(), nullptr, IID_PPV_ARGS(&psiFrom));
-        if ((hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) || (hr == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND)))
-            return true;
-
-        if (SUCCEEDED(hr))
-            hr = pfo->DeleteItem(psiFrom, nullptr);
-
-        if (SUCCEEDED(hr))
+        // not all file systems tell a missing folder from a missing file
+        std::wstring     targetFolder = dst.substr(0, dst.find_last_of('\\'));
+        auto             lastError    = m_fs.LastError();
+        PlatformFileInfo info;
+        if ((lastError == PlatformError::PathNotFound) || ((lastError == PlatformError::NotFound) && !m_fs.Stat(targetFolder, info)))
         {
-            hr = pfo->PerformOperations();
-            if (SUCCEEDED(hr))
+            // the folder might be in the cache even though it got deleted
+            if (native)
             {
-                BOOL fAnyOperationsAborted = false;
-                pfo->GetAnyOperationsAborted(&fAnyOperationsAborted);
-                if (!fAnyOperationsAborted)
-                    return true;
+                m_dirCache.Invalidate(targetFolder);
+                m_dirCache.Create(targetFolder);
             }
+            else
+                m_fs.MakeDirs(targetFolder);
+            m_stats.Add(SyncCounter::Retries);
+            bRet = copy();
         }
     }
-    // try the SHFileOperation
-    FILEOP_FLAGS   flags = FOF_ALLOWUNDO | FOF_FILESONLY | FOF_NOCONFIRMATION | FOF_NO_CONNECTED_ELEMENTS | FOF_NOERRORUI | FOF_SILENT;
-    SHFILEOPSTRUCT fop   = {nullptr};
-    fop.wFunc            = FO_DELETE;
-    fop.fFlags           = flags;
-    auto delBuf          = std::make_unique<wchar_t[]>(path.size() + 2);
-    wcscpy_s(delBuf.get(), path.size() + 2, path.c_str());
-    delBuf[path.size()]     = 0;
-    delBuf[path.size() + 1] = 0;
-    fop.pFrom               = delBuf.get();
-    auto ret = ((SHFileOperation(&fop) == 0) && (fop.fAnyOperationsAborted == FALSE));
-    if (!ret)
+    if (bRet)
+    {
+        if (native && (copyEngine.GetLastMethod() == CopyMethod::Skipped))
+            CAsyncLog::Instance().Info(L"file %s already has the content of %s", dst.c_str(), src.c_str());
+        m_selfWrites.CommitWrite(dst, generation);
+    }
+    else
+        m_selfWrites.CancelWrite(dst, generation);
+    return bRet;
+}
+
+void CFolderSync::RemoveStaleResumeFiles(const PairData& pt, const std::vector<std::wstring>& resumeFiles, const std::map<std::wstring, FileData, ci_lessW>& origFileList)
+{
+    const UInt64 threshold = GetResumableThreshold();
+    const bool   toCrypt   = (pt.m_syncDir == BothWays) || (pt.m_syncDir == SrcToDst);
+    for (const auto& relPath : resumeFiles)
     {
-        // delete the file directly
-        ret = DeleteFile(path.c_str());
-        if (!ret)
+        // EncryptFile() continues the encryption only for a source file it encrypts
+        // resumably: with 7-zip, without compression and at least as big as the threshold
+        const std::wstring origRelPath = GetDecryptedFilename(C7Zip::GetResumeArchivePath(relPath), pt.password(), pt.m_encNames, pt.m_encNamesNew, pt.m_use7Z, pt.m_useGpg);
+        const auto         origIt      = origFileList.find(origRelPath);
+        if (toCrypt && (threshold > 0) && !pt.m_useGpg && !pt.password().empty() && (origIt != origFileList.end()))
         {
-            // in case the path is a directory, delete all files and subdirectories
-            CDirFileEnum enumerator(path);
-            std::wstring filePath;
-            bool         isDir = false;
-            while (enumerator.NextFile(filePath, &isDir, true))
-            {
-                if (isDir)
-                    RemoveDirectory(filePath.c_str());
-                else
-                    DeleteFile(filePath.c_str());
-            }
+            const ULONGLONG size       = origIt->second.GetFileSize();
+            const bool      noCompress = (pt.Classify(CPathUtils::Append(pt.m_origPath, origRelPath)) & PathMatchCryptOnly) != 0;
+            if ((size >= threshold) && (noCompress || (size > pt.m_compressSize * 1024ULL * 1024ULL)))
+                continue;
         }
+        const std::wstring path = CPathUtils::Append(pt.m_cryptPath, relPath);
+        CAsyncLog::Instance().Info(L"removing %s, its encryption can't be continued anymore", path.c_str());
+        BeforeDelete(path);
+        if (!m_fs.Remove(path))
+            CAsyncLog::Instance().Warning(L"could not remove %s", path.c_str());
     }
-    return PathFileExists(path.c_str()) == FALSE;
 }
 
-std::map<std::wstring, SyncOp> CFolderSync::GetFailures()
+void CFolderSync::RemoveResumeFiles(const std::wstring& crypt)
 {
-    CAutoReadLock locker(m_failureGuard);
-    return m_failures;
+    PlatformFileInfo info;
+    for (const auto& path : {C7Zip::GetResumePartialPath(crypt), C7Zip::GetResumeCheckpointPath(crypt)})
+    {
+        if (!m_fs.Stat(path, info))
+            continue;
+        CAsyncLog::Instance().Info(L"removing %s, its encryption can't be continued anymore", path.c_str());
+        BeforeDelete(path);
+        if (!m_fs.Remove(path))
+            CAsyncLog::Instance().Warning(L"could not remove %s", path.c_str());
+    }
 }
 
-size_t CFolderSync::GetFailureCount()
+void CFolderSync::BeforeDelete(const std::wstring& path)
 {
-    CAutoReadLock locker(m_failureGuard);
-    return m_failures.size();
+    m_selfWrites.ExpectDelete(path);
+    m_dirCache.Invalidate(path);
+}
+
+void CFolderSync::AccountIo(const std::wstring& path, ULONGLONG size, bool write)
+{
+    // the I/O callbacks of the encoders and the copy engine: the span shows the time the throttle waits
+    CTraceSpan span(write ? "Write" : "Read", "io");
+    if (write)
+    {
+        m_throttle.Write(path, size);
+        m_stats.Add(SyncCounter::BytesWritten, size);
+    }
+    else
+    {
+        m_throttle.Read(path, size);
+        m_stats.Add(SyncCounter::BytesRead, size);
+    }
 }
 
-std::set<std::wstring> CFolderSync::GetNotifyIgnores()
+void CFolderSync::FinishStats(const PairData& pt)
 {
-    CAutoWriteLock locker(m_notingGuard);
-    auto           ignCopy = m_notifyIgnores;
-    m_notifyIgnores.clear();
-    return ignCopy;
+    auto stats = m_stats.Snapshot();
+    for (const auto& line : stats.Format())
+        CAsyncLog::Instance().Info(L"stats: %s", line.c_str());
+    CAutoWriteLock locker(m_statsGuard);
+    m_passStats[pt.m_origPath] += stats;
+    m_statsPair.clear();
 }
 
-std::wstring CFolderSync::GetFileTimeStringForLog(const FILETIME& ft)
+SyncStatsMap CFolderSync::GetSyncStats()
+{
+    CAutoReadLock locker(m_statsGuard);
+    auto          stats = m_passStats;
+    if (!m_statsPair.empty())
+        stats[m_statsPair] += m_stats.Snapshot();
+    return stats;
+}
+
+std::map<std::wstring, SyncOp> CFolderSync::GetFailures()
 {
-    SYSTEMTIME stUtc, stLocal = {0, 0, 0, 0, 0, 0, 0, 0};
-    FileTimeToSystemTime(&ft, &stUtc);
-    SystemTimeToTzSpecificLocalTime(nullptr, &stUtc, &stLocal);
+    CAutoReadLock locker(m_failureGuard);
+    return m_failures;
+}
 
-    return CStringUtils::Format(L"%02d.%02d.%02d - %02d:%02d:%02d:%03d",
-                                stLocal.wDay, stLocal.wMonth, stLocal.wYear,
-                                stLocal.wHour, stLocal.wMinute, stLocal.wSecond, stLocal.wMilliseconds);
+size_t CFolderSync::GetFailureCount()
+{
+    CAutoReadLock locker(m_failureGuard);
+    return m_failures.size();
 }
@@ -20,6 +20,15 @@
 #pragma once
 
 #include "Pairs.h"
+#include "PairRouter.h"
+#include "SelfWriteTable.h"
+#include "DeleteQueue.h"
+#include "Throttle.h"
+#include "DirectoryCache.h"
+#include "SyncPlan.h"
+#include "SyncStats.h"
+#include "SyncProgress.h"
+#include "Platform.h"
 #include "ReaderWriterLock.h"
 #include "ProgressDlg.h"
 #include "SmartHandle.h"
@@ -28,23 +37,32 @@
 #include <string>
 #include <set>
 #include <map>
+#include <memory>
+#include <atomic>
 
 class FileData
 {
 public:
     FileData()
-        : filenameEncrypted(false)
+        : fileInfo{}
+        , filenameEncrypted(false)
     {
-        ft.dwHighDateTime = 0;
-        ft.dwLowDateTime  = 0;
+        ft.dwHighDateTime         = 0;
+        ft.dwLowDateTime          = 0;
+        fileInfo.dwFileAttributes = INVALID_FILE_ATTRIBUTES;
     }
     ~FileData()
     {
     }
 
-    std::wstring fileRelPath; ///< real filename, possibly encrypted
-    FILETIME     ft;
-    bool         filenameEncrypted; ///< if the filename is encrypted
+    /// true if fileInfo holds the file metadata
+    bool                      HasFileInfo() const { return fileInfo.dwFileAttributes != INVALID_FILE_ATTRIBUTES; }
+    ULONGLONG                 GetFileSize() const { return (static_cast<ULONGLONG>(fileInfo.nFileSizeHigh) << 32) | fileInfo.nFileSizeLow; }
+
+    std::wstring              fileRelPath; ///< real filename, possibly encrypted
+    FILETIME                  ft;
+    WIN32_FILE_ATTRIBUTE_DATA fileInfo;          ///< size, attributes and times as found when the file was enumerated
+    bool                      filenameEncrypted; ///< if the filename is encrypted
 };
 
 enum SyncOp
@@ -63,7 +81,9 @@ constexpr int ErrorCopy      = 8;
 class CFolderSync
 {
 public:
-    CFolderSync();
+    /// syncs the pairs on \c fs. The encryption and decryption always work on the
+    /// native file system, other file systems only work for copy-only paths.
+    explicit CFolderSync(CFileSystem& fs = CFileSystem::Native());
     ~CFolderSync();
 
     void                           SyncFolders(const PairVector& pv, HWND hWnd = nullptr);
@@ -72,10 +92,24 @@ public:
     void                           SetPairs(const PairVector& pv);
     void                           Stop();
     std::map<std::wstring, SyncOp> GetFailures();
-    std::set<std::wstring>         GetNotifyIgnores();
+    bool                           IsSelfWrite(const std::wstring& path) { return m_selfWrites.IsSelfEvent(path); }
+    SelfWriteStats                 GetSelfWriteStats() { return m_selfWrites.GetStats(); }
+    /// the I/O of every pair, the key is the orig path of the pair
+    ThrottleStatsMap               GetThrottleStats() { return m_throttle.GetStats(); }
+    /// deletes the paths queued by SyncFile() calls
+    void                           FlushDeletes() { m_deleteQueue.Flush(); }
     size_t                         GetFailureCount();
     void                           SetTrayWnd(HWND hTray) { m_trayWnd = hTray; }
     void                           DecryptOnly(bool b) { m_decryptOnly = b; }
+    /// only plans the sync: the actions are collected in the plan report instead of executed
+    void                           DryRun(bool b) { m_dryRun = b; }
+    /// measures the size of every target an action wrote, for the compression
+    /// ratios of the sync report. Off by default: it costs a stat per transfer.
+    void                           MeasureWrittenBytes(bool b) { m_measureWritten = b; }
+    /// the actions and the estimates of all pairs of a dry run
+    const std::wstring&            GetPlanReport() const { return m_planReport; }
+    /// the counters and timers of the pairs of the current or the last sync pass
+    SyncStatsMap                   GetSyncStats();
     bool                           IsRunning() const { return m_bRunning != 0; }
 
     // puclic only for tests
@@ -87,29 +121,69 @@ private:
     void                                       SyncFile(const std::wstring& plainPath, const PairData& pt);
     int                                        SyncFolderThread();
     int                                        SyncFolder(const PairData& pt);
-    std::map<std::wstring, FileData, ci_lessW> GetFileList(bool orig, const std::wstring& path, const std::wstring& password, bool encnames, bool encnamesnew, bool use7Z, bool useGpg, DWORD& error) const;
-    bool                                       EncryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg, bool noCompress, int compresssize, bool resetArchAttr);
-    bool                                       DecryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg);
-    static std::wstring                        GetFileTimeStringForLog(const FILETIME& ft);
+    /// the partial archives and checkpoints of resumable encryptions are not in the list,
+    /// their paths relative to \c path are added to \c resumeFiles if it's given
+    std::map<std::wstring, FileData, ci_lessW> GetFileList(bool orig, const std::wstring& path, const std::wstring& password, bool encnames, bool encnamesnew, bool use7Z, bool useGpg, PlatformError& error, std::vector<std::wstring>* resumeFiles = nullptr) const;
+    /// removes the partial archives and checkpoints found in the crypt folder whose
+    /// encryption can't be continued anymore: the source file is gone or too small
+    /// now, or resumable encryption got turned off
+    void                                       RemoveStaleResumeFiles(const PairData& pt, const std::vector<std::wstring>& resumeFiles, const std::map<std::wstring, FileData, ci_lessW>& origFileList);
+    /// removes the partial archive and the checkpoint of \c crypt, if there are any
+    void                                       RemoveResumeFiles(const std::wstring& crypt);
+    int                                        ExecutePlan(const PairData& pt, const CSyncPlan& plan, const SyncPolicy& policy, const std::map<std::wstring, FileData, ci_lessW>& origFileList, const std::map<std::wstring, FileData, ci_lessW>& cryptFileList);
+    /// executes the batches of transfers with several threads while this thread shows the progress
+    int                                        ExecuteParallel(const PairData& pt, const CSyncPlan& plan, const std::vector<SyncBatch>& batches, unsigned threadCount, const std::map<std::wstring, FileData, ci_lessW>& origFileList, const std::map<std::wstring, FileData, ci_lessW>& cryptFileList, CDeleteQueue& deleteQueue);
+    int                                        ExecuteAction(const PairData& pt, const SyncAction& action, const std::map<std::wstring, FileData, ci_lessW>& origFileList, const std::map<std::wstring, FileData, ci_lessW>& cryptFileList, CDeleteQueue& deleteQueue);
+    /// updates the progress dialog and the tray icon at most every SYNCPROGRESS_INTERVAL_MS or if force is set,
+    /// only on the sync thread. Returns false if the user cancelled
+    bool                                       UpdateProgress(bool force = false);
+    /// true if the user cancelled the sync, can be called from any thread
+    bool                                       IsCancelled() const;
+    bool                                       EncryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg, bool noCompress, int compresssize, bool resetArchAttr, CSyncProgress::CFile* progress = nullptr);
+    bool                                       DecryptFile(const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const FileData& fd, bool useGpg, CSyncProgress::CFile* progress = nullptr);
     bool                                       RunGPG(LPWSTR cmdline, const std::wstring& cwd) const;
+    /// opens \c path to read and write its attributes and times only
+    static HANDLE                              OpenForAttributes(const std::wstring& path);
     // Would AdjustFileAttributes be a candidate for sktools?
     void                                       AdjustFileAttributes(const std::wstring& orig, DWORD dwFileAttributesToClear, DWORD dwFileAttributesToSet) const;
-    static bool                                DeletePathToTrash(const std::wstring& path);
-
-    CReaderWriterLock                          m_guard;
-    CReaderWriterLock                          m_failureGuard;
-    CReaderWriterLock                          m_notingGuard;
-    PairVector                                 m_pairs;
-    std::wstring                               m_gnuPg;
-    HWND                                       m_parentWnd;
-    HWND                                       m_trayWnd;
-    CProgressDlg*                              m_pProgDlg;
-    DWORD                                      m_progress;
-    DWORD                                      m_progressTotal;
-    volatile LONG                              m_bRunning;
-    CAutoGeneralHandle                         m_hThread;
-    PairData                                   m_currentPath;
-    std::map<std::wstring, SyncOp>             m_failures;
-    std::set<std::wstring>                     m_notifyIgnores;
-    bool                                       m_decryptOnly;
+    /// adjusts the attributes of the file \c hFile was opened for with OpenForAttributes(), \c fName is for the log.
+    /// If \c writeTime is given, they're only adjusted if the file still has that last write time
+    void                                       AdjustFileAttributes(HANDLE hFile, const std::wstring& fName, DWORD dwFileAttributesToClear, DWORD dwFileAttributesToSet, const FILETIME* writeTime = nullptr) const;
+    bool                                       CopyFileToTarget(const std::wstring& src, const std::wstring& dst);
+    /// true unless the pairs are synced on a file system other than the one of the OS
+    bool                                       IsNativeFileSystem() const { return &m_fs == &CFileSystem::Native(); }
+    /// called for every path right before the delete queues delete it
+    void                                       BeforeDelete(const std::wstring& path);
+    /// accounts the bytes read or written by the encoders and the copy engine to the throttle and the stats
+    void                                       AccountIo(const std::wstring& path, ULONGLONG size, bool write);
+    /// logs the stats of the pair and adds them to the stats of the pass
+    void                                       FinishStats(const PairData& pt);
+
+    CFileSystem&                                    m_fs; ///< the file system the files are enumerated, copied, moved and deleted on
+    CReaderWriterLock                               m_guard;
+    CReaderWriterLock                               m_failureGuard;
+    std::atomic<std::shared_ptr<const CPairRouter>> m_router;
+    std::wstring                                    m_gnuPg;
+    HWND                                            m_parentWnd;
+    HWND                                            m_trayWnd;
+    CProgressDlg*                                   m_pProgDlg;
+    CSyncProgress                                   m_progress; ///< the progress of the sync pass
+    volatile LONG                                   m_bRunning;
+    CAutoGeneralHandle                              m_hThread;
+    std::atomic<std::shared_ptr<const PairData>>    m_syncPair; ///< the pair the sync thread currently syncs, null if none
+    std::map<std::wstring, SyncOp>                  m_failures;
+    CSelfWriteTable                                 m_selfWrites;
+    bool                                            m_decryptOnly;
+    CDeleteQueue                                    m_deleteQueue; ///< deletes from SyncFile(), flushed by FlushDeletes()
+    mutable CThrottle                               m_throttle;
+    mutable CDirectoryCache                         m_dirCache; ///< target folders known to exist, cleared for every sync pass
+    bool                                            m_dryRun;
+    bool                                            m_measureWritten; ///< set if the report needs the sizes of the targets
+    std::wstring                                    m_planReport;
+    DWORD                                           m_syncThreadId; ///< the thread that owns the progress dialog
+    mutable std::atomic<bool>                       m_cancelled;    ///< set once the user cancelled in the progress dialog
+    mutable CSyncStats                              m_stats;        ///< the counters of the pair that currently syncs
+    CReaderWriterLock                               m_statsGuard;
+    SyncStatsMap                                    m_passStats; ///< the counters of the pairs the current pass has finished
+    std::wstring                                    m_statsPair; ///< the orig path of the pair m_stats counts for
 };
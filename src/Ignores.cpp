@@ -39,26 +39,13 @@ CIgnores::~CIgnores()
 bool CIgnores::IsIgnored(const std::wstring& s)
 {
     CAutoReadLock locker(m_guard);
-    bool          bIgnored = false;
+    return (m_matcher->Match(s) & PathMatchIgnored) != 0;
+}
 
-    std::wstring sCmp = s;
-    std::transform(sCmp.begin(), sCmp.end(), sCmp.begin(), ::towlower);
-    std::vector<std::wstring> pathelems;
-    stringtok(pathelems, sCmp, true, L"\\");
-    for (auto pe : pathelems)
-    {
-        for (auto it = ignores.cbegin(); it != ignores.cend(); ++it)
-        {
-            if (wcswildcmp(it->c_str(), pe.c_str()))
-            {
-                bIgnored = true;
-                break;
-            }
-        }
-        if (bIgnored)
-            break;
-    }
-    return bIgnored;
+std::vector<std::wstring> CIgnores::GetPatterns()
+{
+    CAutoReadLock locker(m_guard);
+    return ignores;
 }
 
 void CIgnores::Reload(const std::wstring& s /* = std::wstring() */)
@@ -75,6 +62,8 @@ void CIgnores::Reload(const std::wstring& s /* = std::wstring() */)
     {
         std::transform(it->begin(), it->end(), it->begin(), ::towlower);
     }
+    m_matcher = std::make_unique<CPathMatcher>();
+    m_matcher->AddPatterns(ignores, PathMatchIgnored, false);
 }
 
 CIgnores& CIgnores::Instance()
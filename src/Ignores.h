@@ -20,6 +20,9 @@
 #pragma once
 
 #include "ReaderWriterLock.h"
+#include "PathMatcher.h"
+
+#include <memory>
 
 #define DEFAULT_IGNORES L"*.tmp*|~*.*|thumbs.db|desktop.ini"
 
@@ -27,16 +30,19 @@ class CIgnores
 {
 public:
     static CIgnores& Instance();
-    bool             IsIgnored(const std::wstring& s);
-    void             Reload(const std::wstring& s = std::wstring());
+    bool                      IsIgnored(const std::wstring& s);
+    void                      Reload(const std::wstring& s = std::wstring());
+    /// returns the lowercased ignore patterns
+    std::vector<std::wstring> GetPatterns();
 
 private:
     CIgnores();
     ~CIgnores();
 
 private:
-    static CIgnores*          m_pInstance;
-    CReaderWriterLock         m_guard;
-    std::wstring              sIgnores;
-    std::vector<std::wstring> ignores;
+    static CIgnores*              m_pInstance;
+    CReaderWriterLock             m_guard;
+    std::wstring                  sIgnores;
+    std::vector<std::wstring>     ignores;
+    std::unique_ptr<CPathMatcher> m_matcher;
 };
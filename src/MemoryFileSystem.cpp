@@ -0,0 +1,478 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "MemoryFileSystem.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+
+namespace
+{
+constexpr uint64_t TicksPerSecond    = 10000000ULL;
+/// FAT stores the write time with 2 seconds accuracy
+constexpr uint64_t FatTimeAccuracy   = 2 * TicksPerSecond;
+/// 2024-01-01, the clock of a new file system
+constexpr uint64_t MemoryFsStartTime = 133485408000000000ULL;
+
+std::wstring Normalize(const std::wstring& path)
+{
+    auto end = path.find_last_not_of(PlatformPathSeparator);
+    return end == std::wstring::npos ? std::wstring() : path.substr(0, end + 1);
+}
+
+std::wstring GetParent(const std::wstring& path)
+{
+    auto pos = path.find_last_of(PlatformPathSeparator);
+    return (pos == std::wstring::npos) || (pos == 0) ? std::wstring() : path.substr(0, pos);
+}
+
+/// true if path is below folder, compared like the keys of the node map
+bool IsBelow(const std::wstring& path, const std::wstring& folder)
+{
+    if ((path.size() <= folder.size() + 1) || (path[folder.size()] != PlatformPathSeparator))
+        return false;
+    auto start = path.substr(0, folder.size());
+    return !SyncPathLess()(start, folder) && !SyncPathLess()(folder, start);
+}
+} // namespace
+
+CMemoryFileSystem::CMemoryFileSystem(uint32_t seed)
+    : m_random(seed)
+    , m_clock(MemoryFsStartTime)
+    , m_failureRate(0)
+    , m_latency(0)
+    , m_bytesPerSecond(0)
+    , m_fat(false)
+{
+}
+
+bool CMemoryFileSystem::Run(const std::wstring& path, const std::wstring& otherPath, const std::function<bool(std::vector<MemoryFsChange>& changes, uint64_t& bytes)>& op) const
+{
+    std::vector<MemoryFsChange> changes;
+    uint64_t                    bytes = 0;
+    bool                        ok    = false;
+    MemoryFsChangeCallback      callback;
+    uint64_t                    latency        = 0;
+    uint64_t                    bytesPerSecond = 0;
+    {
+        std::lock_guard lock(m_mutex);
+        ++m_stats.operations;
+        ApplyScripted(changes);
+        bool fail = m_failingPaths.contains(Normalize(path)) || (!otherPath.empty() && m_failingPaths.contains(Normalize(otherPath)));
+        if (!fail && (m_failureRate > 0))
+            fail = static_cast<double>(m_random() >> 11) / 9007199254740992.0 < m_failureRate;
+        if (fail)
+        {
+            ++m_stats.failures;
+            errno = EIO;
+        }
+        else
+            ok = op(changes, bytes);
+        callback       = m_callback;
+        latency        = m_latency;
+        bytesPerSecond = m_bytesPerSecond;
+    }
+    // the callback must not change the error of the operation
+    const int error = errno;
+    if (callback)
+    {
+        for (const auto& change : changes)
+            callback(change);
+    }
+    if (bytesPerSecond)
+        latency += bytes * 1000000 / bytesPerSecond;
+    if (latency)
+        std::this_thread::sleep_for(std::chrono::microseconds(latency));
+    errno = error;
+    return ok;
+}
+
+void CMemoryFileSystem::ApplyScripted(std::vector<MemoryFsChange>& changes) const
+{
+    // the script is sorted by atOperation
+    while (!m_script.empty() && (m_script.front().atOperation <= m_stats.operations))
+    {
+        auto change = std::move(m_script.front());
+        m_script.erase(m_script.begin());
+        auto path   = Normalize(change.path);
+        switch (change.type)
+        {
+            case MemoryFsChangeType::Added:
+            case MemoryFsChangeType::Modified:
+            {
+                // the parents are created silently, like an unzip the user runs
+                for (auto parent = GetParent(path); !parent.empty() && !m_nodes.contains(parent); parent = GetParent(parent))
+                    m_nodes[parent].directory = true;
+                auto& node     = m_nodes[path];
+                node.content   = change.content;
+                node.writeTime = StoredTime(change.writeTime ? change.writeTime : Tick());
+                break;
+            }
+            case MemoryFsChangeType::Removed:
+                m_nodes.erase(m_nodes.lower_bound(path + PlatformPathSeparator), FirstAfter(path));
+                m_nodes.erase(path);
+                break;
+            case MemoryFsChangeType::Renamed:
+                if (m_nodes.contains(Normalize(change.oldPath)))
+                    Move(Normalize(change.oldPath), path);
+                break;
+        }
+        change.scripted = true;
+        changes.push_back(std::move(change));
+    }
+}
+
+bool CMemoryFileSystem::ParentExists(const std::wstring& path) const
+{
+    auto parent = GetParent(path);
+    if (parent.empty())
+        return true;
+    auto it = m_nodes.find(parent);
+    return (it != m_nodes.end()) && it->second.directory;
+}
+
+bool CMemoryFileSystem::HasChildren(const std::wstring& path) const
+{
+    return m_nodes.lower_bound(path + PlatformPathSeparator) != FirstAfter(path);
+}
+
+CMemoryFileSystem::NodeMap::iterator CMemoryFileSystem::FirstAfter(const std::wstring& folder) const
+{
+    // the content of a folder is a contiguous range of the map, but
+    // names like "folder-2" can sort between the folder and its content
+    auto it = m_nodes.lower_bound(folder + PlatformPathSeparator);
+    while ((it != m_nodes.end()) && IsBelow(it->first, folder))
+        ++it;
+    return it;
+}
+
+void CMemoryFileSystem::Move(const std::wstring& src, const std::wstring& dst) const
+{
+    // a folder moves with its content
+    NodeMap moved;
+    auto    it = m_nodes.find(src);
+    moved[dst] = std::move(it->second);
+    m_nodes.erase(it);
+    for (auto child = m_nodes.lower_bound(src + PlatformPathSeparator); (child != m_nodes.end()) && IsBelow(child->first, src);)
+    {
+        moved[dst + child->first.substr(src.size())] = std::move(child->second);
+        child                                        = m_nodes.erase(child);
+    }
+    m_nodes.erase(dst);
+    m_nodes.merge(moved);
+}
+
+uint64_t CMemoryFileSystem::Tick() const
+{
+    m_clock += TicksPerSecond;
+    return m_clock;
+}
+
+uint64_t CMemoryFileSystem::StoredTime(uint64_t writeTime) const
+{
+    if (m_fat && (writeTime % FatTimeAccuracy))
+        writeTime = (writeTime / FatTimeAccuracy + 1) * FatTimeAccuracy;
+    return writeTime;
+}
+
+bool CMemoryFileSystem::Stat(const std::wstring& path, PlatformFileInfo& info) const
+{
+    return Run(path, std::wstring(), [&](std::vector<MemoryFsChange>&, uint64_t&) {
+        auto it = m_nodes.find(Normalize(path));
+        if (it == m_nodes.end())
+        {
+            errno = ENOENT;
+            return false;
+        }
+        info           = PlatformFileInfo();
+        info.size      = it->second.content.size();
+        info.writeTime = it->second.writeTime;
+        info.directory = it->second.directory;
+        return true;
+    });
+}
+
+bool CMemoryFileSystem::Enumerate(const std::wstring& path, const PlatformEnumCallback& callback, const PlatformEnumCallback& descend) const
+{
+    // the entries are collected first: the callback runs without the lock and may call back into the file system
+    std::vector<std::pair<std::wstring, PlatformFileInfo>> entries;
+    bool                                                   ok = Run(path, std::wstring(), [&](std::vector<MemoryFsChange>&, uint64_t&) {
+        auto folder = Normalize(path);
+        auto it     = m_nodes.find(folder);
+        if ((it == m_nodes.end()) || !it->second.directory)
+        {
+            errno = (it == m_nodes.end()) ? ENOENT : ENOTDIR;
+            return false;
+        }
+        auto end = FirstAfter(folder);
+        for (it = m_nodes.lower_bound(folder + PlatformPathSeparator); it != end; ++it)
+        {
+            PlatformFileInfo info;
+            info.size      = it->second.content.size();
+            info.writeTime = it->second.writeTime;
+            info.directory = it->second.directory;
+            entries.emplace_back(it->first.substr(folder.size() + 1), info);
+        }
+        m_stats.enumerated += entries.size();
+        return true;
+    });
+    // the folders descend skipped; folders come before their content, so
+    // the folders below a skipped one are skipped as their parent is checked
+    std::set<std::wstring, SyncPathLess> skipped;
+    for (const auto& [relPath, info] : entries)
+    {
+        if (!skipped.empty() && skipped.contains(GetParent(relPath)))
+        {
+            if (info.directory)
+                skipped.insert(relPath);
+            continue;
+        }
+        if (!callback(relPath, info))
+            break;
+        if (info.directory && descend && !descend(relPath, info))
+            skipped.insert(relPath);
+    }
+    return ok;
+}
+
+bool CMemoryFileSystem::MakeDirs(const std::wstring& path)
+{
+    return Run(path, std::wstring(), [&](std::vector<MemoryFsChange>& changes, uint64_t&) {
+        auto folder = Normalize(path);
+        // the missing parents, the topmost last
+        std::vector<std::wstring> missing;
+        for (auto parent = folder; !parent.empty(); parent = GetParent(parent))
+        {
+            auto it = m_nodes.find(parent);
+            if (it != m_nodes.end())
+            {
+                if (!it->second.directory)
+                {
+                    errno = ENOTDIR;
+                    return false;
+                }
+                break;
+            }
+            missing.push_back(parent);
+        }
+        for (auto it = missing.rbegin(); it != missing.rend(); ++it)
+        {
+            auto& node     = m_nodes[*it];
+            node.directory = true;
+            node.writeTime = StoredTime(Tick());
+            changes.push_back({.type = MemoryFsChangeType::Added, .path = *it});
+        }
+        return true;
+    });
+}
+
+bool CMemoryFileSystem::Remove(const std::wstring& path)
+{
+    return Run(path, std::wstring(), [&](std::vector<MemoryFsChange>& changes, uint64_t&) {
+        auto name = Normalize(path);
+        auto it   = m_nodes.find(name);
+        if (it == m_nodes.end())
+        {
+            errno = ENOENT;
+            return false;
+        }
+        if (it->second.directory && HasChildren(name))
+        {
+            errno = ENOTEMPTY;
+            return false;
+        }
+        m_nodes.erase(it);
+        changes.push_back({.type = MemoryFsChangeType::Removed, .path = name});
+        return true;
+    });
+}
+
+bool CMemoryFileSystem::Rename(const std::wstring& from, const std::wstring& to)
+{
+    return Run(from, to, [&](std::vector<MemoryFsChange>& changes, uint64_t&) {
+        auto src = Normalize(from);
+        auto dst = Normalize(to);
+        auto it  = m_nodes.find(src);
+        if ((it == m_nodes.end()) || !ParentExists(dst))
+        {
+            errno = ENOENT;
+            return false;
+        }
+        auto dstIt = m_nodes.find(dst);
+        if ((dstIt != m_nodes.end()) && (dstIt->second.directory || it->second.directory))
+        {
+            errno = EEXIST;
+            return false;
+        }
+        if (IsBelow(dst, src))
+        {
+            errno = EINVAL;
+            return false;
+        }
+        Move(src, dst);
+        changes.push_back({.type = MemoryFsChangeType::Renamed, .path = dst, .oldPath = src});
+        return true;
+    });
+}
+
+bool CMemoryFileSystem::Copy(const std::wstring& from, const std::wstring& to)
+{
+    return Run(from, to, [&](std::vector<MemoryFsChange>& changes, uint64_t& bytes) {
+        auto dst = Normalize(to);
+        auto it  = m_nodes.find(Normalize(from));
+        if ((it == m_nodes.end()) || it->second.directory || !ParentExists(dst))
+        {
+            errno = (it != m_nodes.end()) && it->second.directory ? EISDIR : ENOENT;
+            return false;
+        }
+        auto dstIt = m_nodes.find(dst);
+        if ((dstIt != m_nodes.end()) && dstIt->second.directory)
+        {
+            errno = EISDIR;
+            return false;
+        }
+        const bool existed = dstIt != m_nodes.end();
+        auto       source  = it->second;
+        m_nodes[dst]       = source;
+        bytes              = 2 * source.content.size();
+        m_stats.bytesRead += source.content.size();
+        m_stats.bytesWritten += source.content.size();
+        changes.push_back({.type = existed ? MemoryFsChangeType::Modified : MemoryFsChangeType::Added, .path = dst});
+        return true;
+    });
+}
+
+bool CMemoryFileSystem::SetWriteTime(const std::wstring& path, uint64_t writeTime)
+{
+    return Run(path, std::wstring(), [&](std::vector<MemoryFsChange>& changes, uint64_t&) {
+        auto name = Normalize(path);
+        auto it   = m_nodes.find(name);
+        if (it == m_nodes.end())
+        {
+            errno = ENOENT;
+            return false;
+        }
+        it->second.writeTime = StoredTime(writeTime);
+        changes.push_back({.type = MemoryFsChangeType::Modified, .path = name});
+        return true;
+    });
+}
+
+bool CMemoryFileSystem::ReadContent(const std::wstring& path, std::string& content) const
+{
+    return Run(path, std::wstring(), [&](std::vector<MemoryFsChange>&, uint64_t& bytes) {
+        auto it = m_nodes.find(Normalize(path));
+        if ((it == m_nodes.end()) || it->second.directory)
+        {
+            errno = (it == m_nodes.end()) ? ENOENT : EISDIR;
+            return false;
+        }
+        content = it->second.content;
+        bytes   = content.size();
+        m_stats.bytesRead += bytes;
+        return true;
+    });
+}
+
+bool CMemoryFileSystem::WriteContent(const std::wstring& path, const std::string& content)
+{
+    return Run(path, std::wstring(), [&](std::vector<MemoryFsChange>& changes, uint64_t& bytes) {
+        auto name = Normalize(path);
+        auto it   = m_nodes.find(name);
+        if ((it != m_nodes.end()) && it->second.directory)
+        {
+            errno = EISDIR;
+            return false;
+        }
+        if (!ParentExists(name))
+        {
+            errno = ENOENT;
+            return false;
+        }
+        const bool existed = it != m_nodes.end();
+        auto&      node    = m_nodes[name];
+        node.content       = content;
+        node.writeTime     = StoredTime(Tick());
+        bytes              = content.size();
+        m_stats.bytesWritten += bytes;
+        changes.push_back({.type = existed ? MemoryFsChangeType::Modified : MemoryFsChangeType::Added, .path = name});
+        return true;
+    });
+}
+
+PlatformError CMemoryFileSystem::LastError() const
+{
+    return CPlatform::FromErrno(errno);
+}
+
+void CMemoryFileSystem::SetLatency(uint64_t microseconds, uint64_t bytesPerSecond)
+{
+    std::lock_guard lock(m_mutex);
+    m_latency        = microseconds;
+    m_bytesPerSecond = bytesPerSecond;
+}
+
+void CMemoryFileSystem::SetFailureRate(double rate)
+{
+    std::lock_guard lock(m_mutex);
+    m_failureRate = std::clamp(rate, 0.0, 1.0);
+}
+
+void CMemoryFileSystem::SetFailingPath(const std::wstring& path, bool fail)
+{
+    std::lock_guard lock(m_mutex);
+    if (fail)
+        m_failingPaths.insert(Normalize(path));
+    else
+        m_failingPaths.erase(Normalize(path));
+}
+
+void CMemoryFileSystem::SetFatTimes(bool fat)
+{
+    std::lock_guard lock(m_mutex);
+    m_fat = fat;
+}
+
+void CMemoryFileSystem::SetClock(uint64_t writeTime)
+{
+    std::lock_guard lock(m_mutex);
+    m_clock = writeTime;
+}
+
+void CMemoryFileSystem::SetChangeCallback(const MemoryFsChangeCallback& callback)
+{
+    std::lock_guard lock(m_mutex);
+    m_callback = callback;
+}
+
+void CMemoryFileSystem::Script(const MemoryFsChange& change)
+{
+    std::lock_guard lock(m_mutex);
+    auto            pos = std::ranges::upper_bound(m_script, change.atOperation, {}, &MemoryFsChange::atOperation);
+    m_script.insert(pos, change);
+}
+
+MemoryFsStats CMemoryFileSystem::GetStats() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_stats;
+}
@@ -0,0 +1,146 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include "Platform.h"
+#include "SyncPlan.h"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+enum class MemoryFsChangeType
+{
+    Added,
+    Modified,
+    Removed,
+    Renamed,
+};
+
+/// a change of a CMemoryFileSystem: reported to the change callback, or scripted to happen at an operation
+struct MemoryFsChange
+{
+    MemoryFsChangeType type        = MemoryFsChangeType::Modified;
+    std::wstring       path        = {};
+    std::wstring       oldPath     = {}; ///< Renamed: the path before
+    std::string        content     = {}; ///< scripted Added and Modified: the new content of the file
+    uint64_t           writeTime   = 0;  ///< scripted Added and Modified: the new write time, 0 for the clock of the file system
+    uint64_t           atOperation = 0;  ///< scripted: applied right before the operation with this number, the first one is 1
+    bool               scripted    = false;
+};
+
+using MemoryFsChangeCallback = std::function<void(const MemoryFsChange& change)>;
+
+/// what a CMemoryFileSystem was asked to do
+struct MemoryFsStats
+{
+    uint64_t operations   = 0;
+    uint64_t enumerated   = 0; ///< entries passed to Enumerate() callbacks
+    uint64_t bytesRead    = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t failures     = 0; ///< injected failures
+};
+
+/**
+ * A file system that only lives in memory.
+ *
+ * Runs the sync core without touching a disk, so tests are deterministic
+ * and benchmarks measure the algorithms instead of the device. It
+ * behaves like the native backends: parents must exist, folders must be
+ * empty to be removed, Copy() keeps the write time. On top of that it can
+ * - delay every operation, to simulate a slow device
+ * - fail operations, at a rate or for given paths
+ * - store write times with the 2 seconds accuracy of FAT
+ * - apply scripted changes between operations, as if the user changed
+ *   files while a sync runs, and report every change like a watcher.
+ * Failures set errno. The object is thread safe; the callbacks are
+ * called without holding its lock.
+ */
+class CMemoryFileSystem : public CFileSystem
+{
+public:
+    explicit CMemoryFileSystem(uint32_t seed = 1);
+
+    bool          Stat(const std::wstring& path, PlatformFileInfo& info) const override;
+    bool          Enumerate(const std::wstring& path, const PlatformEnumCallback& callback, const PlatformEnumCallback& descend = nullptr) const override;
+    bool          MakeDirs(const std::wstring& path) override;
+    bool          Remove(const std::wstring& path) override;
+    bool          Rename(const std::wstring& from, const std::wstring& to) override;
+    bool          Copy(const std::wstring& from, const std::wstring& to) override;
+    bool          SetWriteTime(const std::wstring& path, uint64_t writeTime) override;
+    bool          ReadContent(const std::wstring& path, std::string& content) const override;
+    bool          WriteContent(const std::wstring& path, const std::string& content) override;
+    PlatformError LastError() const override;
+
+    /// every operation takes at least this long, plus the time to move its bytes if bytesPerSecond isn't 0
+    void          SetLatency(uint64_t microseconds, uint64_t bytesPerSecond);
+    /// the part of the operations that fail, between 0 and 1, picked with the seed of the constructor
+    void          SetFailureRate(double rate);
+    /// all operations on path fail
+    void          SetFailingPath(const std::wstring& path, bool fail);
+    /// write times are rounded up to 2 seconds, like FAT stores them
+    void          SetFatTimes(bool fat);
+    /// the write time of new and changed files; it advances by a second with every change
+    void          SetClock(uint64_t writeTime);
+    void          SetChangeCallback(const MemoryFsChangeCallback& callback);
+    /// adds a change that is applied right before operation change.atOperation
+    void          Script(const MemoryFsChange& change);
+    MemoryFsStats GetStats() const;
+
+private:
+    struct Node
+    {
+        bool        directory = false;
+        uint64_t    writeTime = 0;
+        std::string content;
+    };
+    using NodeMap = std::map<std::wstring, Node, SyncPathLess>;
+
+    /// counts the operation, applies the scripted changes that are due and injects the failures for path
+    /// and otherPath, then runs op with the lock held. The changes op adds are reported after the lock is released.
+    bool              Run(const std::wstring& path, const std::wstring& otherPath, const std::function<bool(std::vector<MemoryFsChange>& changes, uint64_t& bytes)>& op) const;
+    void              ApplyScripted(std::vector<MemoryFsChange>& changes) const;
+    bool              ParentExists(const std::wstring& path) const;
+    bool              HasChildren(const std::wstring& path) const;
+    /// the first node after the content of folder
+    NodeMap::iterator FirstAfter(const std::wstring& folder) const;
+    /// moves src and its content to dst, src must exist
+    void              Move(const std::wstring& src, const std::wstring& dst) const;
+    uint64_t          Tick() const;
+    uint64_t          StoredTime(uint64_t writeTime) const;
+
+    // scripted changes happen on any call, reading ones too
+    mutable std::mutex                   m_mutex;
+    mutable NodeMap                      m_nodes;
+    mutable MemoryFsStats                m_stats;
+    mutable std::mt19937_64              m_random;
+    mutable uint64_t                     m_clock;
+    mutable std::vector<MemoryFsChange>  m_script;
+    std::set<std::wstring, SyncPathLess> m_failingPaths;
+    MemoryFsChangeCallback               m_callback;
+    double                               m_failureRate;
+    uint64_t                             m_latency;
+    uint64_t                             m_bytesPerSecond;
+    bool                                 m_fat;
+};
@@ -0,0 +1,196 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "NameCipher.h"
+#include "Platform.h"
+#include "../base4k/base4k.h"
+#include "../lzma/C/Md5.h"
+
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+namespace
+{
+/// splits a path at both kinds of slashes, without empty elements
+std::vector<std::wstring> SplitPath(const std::wstring& path)
+{
+    std::vector<std::wstring> elements;
+    size_t                    start = 0;
+    while (start <= path.size())
+    {
+        auto end = path.find_first_of(L"\\/", start);
+        if (end == std::wstring::npos)
+            end = path.size();
+        if (end > start)
+            elements.push_back(path.substr(start, end - start));
+        start = end + 1;
+    }
+    return elements;
+}
+
+std::wstring JoinPath(const std::vector<std::wstring>& elements)
+{
+    std::wstring path;
+    for (const auto& element : elements)
+    {
+        if (!path.empty())
+            path += PlatformPathSeparator;
+        path += element;
+    }
+    return path;
+}
+
+int HexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+} // namespace
+
+CNameCipher::CNameCipher(const std::wstring& password)
+    : m_key{}
+{
+    auto utf16 = CPlatform::ToUtf16(password);
+    // the bytes of the UTF-16LE string, independent of the byte order of the host
+    std::vector<Byte> bytes;
+    bytes.reserve(utf16.size() * 2);
+    for (auto c : utf16)
+    {
+        bytes.push_back(static_cast<Byte>(c & 0xFF));
+        bytes.push_back(static_cast<Byte>(c >> 8));
+    }
+    CMd5 md5;
+    Md5_Init(&md5);
+    Md5_Update(&md5, bytes.data(), bytes.size());
+    Md5_Final(&md5, m_key);
+}
+
+void CNameCipher::Crypt(uint8_t* data, size_t size) const
+{
+    uint8_t s[256];
+    for (int i = 0; i < 256; ++i)
+        s[i] = static_cast<uint8_t>(i);
+    uint8_t j = 0;
+    for (int i = 0; i < 256; ++i)
+    {
+        j = static_cast<uint8_t>(j + s[i] + m_key[i % sizeof(m_key)]);
+        std::swap(s[i], s[j]);
+    }
+    uint8_t i = 0;
+    j         = 0;
+    for (size_t pos = 0; pos < size; ++pos)
+    {
+        i = static_cast<uint8_t>(i + 1);
+        j = static_cast<uint8_t>(j + s[i]);
+        std::swap(s[i], s[j]);
+        data[pos] ^= s[static_cast<uint8_t>(s[i] + s[j])];
+    }
+}
+
+std::wstring CNameCipher::EncryptName(const std::wstring& name, bool newEncryption) const
+{
+    std::string data = "*" + CPlatform::ToUtf8(name);
+    auto*       buf  = reinterpret_cast<uint8_t*>(data.data());
+    Crypt(buf, data.size());
+    if (!newEncryption)
+    {
+        static const wchar_t hexDigits[] = L"0123456789abcdef";
+        std::wstring         hex;
+        for (auto c : data)
+        {
+            hex += hexDigits[(static_cast<uint8_t>(c) >> 4) & 0x0F];
+            hex += hexDigits[static_cast<uint8_t>(c) & 0x0F];
+        }
+        return hex;
+    }
+    base4k::B4K_ENCODING_SETTINGS encodingSettings;
+    base4k::initialize(&encodingSettings, 2);
+    uint32_t  ccData   = static_cast<uint32_t>(data.size());
+    uint16_t* cEncoded = nullptr;
+    if (base4k::base4kEncode(&encodingSettings, buf, &ccData, &cEncoded) != base4k::B4K_SUCCESS)
+        return name;
+    std::u16string encoded(reinterpret_cast<const char16_t*>(cEncoded), ccData);
+    free(cEncoded);
+    return CPlatform::FromUtf16(encoded);
+}
+
+std::wstring CNameCipher::DecryptName(const std::wstring& name, bool newEncryption) const
+{
+    std::string data;
+    if (newEncryption)
+    {
+        auto     encoded  = CPlatform::ToUtf16(name);
+        uint32_t ccData   = B4K_AUTO;
+        uint8_t* cDecoded = nullptr;
+        if (base4k::base4KDecode(reinterpret_cast<uint16_t*>(encoded.data()), &ccData, &cDecoded) != base4k::B4K_SUCCESS)
+        {
+            free(cDecoded);
+            return {};
+        }
+        data.assign(reinterpret_cast<const char*>(cDecoded), ccData);
+        free(cDecoded);
+    }
+    else
+    {
+        auto hex = CPlatform::ToUtf8(name);
+        if (hex.empty() || (hex.size() % 2))
+            return {};
+        for (size_t pos = 0; pos < hex.size(); pos += 2)
+        {
+            int high = HexValue(hex[pos]);
+            int low  = HexValue(hex[pos + 1]);
+            if (high < 0 || low < 0)
+                return {};
+            data += static_cast<char>((high << 4) | low);
+        }
+    }
+    Crypt(reinterpret_cast<uint8_t*>(data.data()), data.size());
+    return CPlatform::FromUtf8(data);
+}
+
+std::wstring CNameCipher::EncryptPath(const std::wstring& relPath, bool newEncryption) const
+{
+    auto elements = SplitPath(relPath);
+    for (auto& element : elements)
+        element = EncryptName(element, newEncryption);
+    return JoinPath(elements);
+}
+
+std::wstring CNameCipher::DecryptPath(const std::wstring& encPath, bool newEncryption) const
+{
+    auto         dotPos    = encPath.find_last_of('.');
+    std::wstring extension = dotPos != std::wstring::npos ? encPath.substr(dotPos) : std::wstring();
+    auto         elements  = SplitPath(encPath.substr(0, dotPos));
+    for (size_t i = 0; i < elements.size(); ++i)
+    {
+        auto decrypted = DecryptName(elements[i], newEncryption);
+        if (!decrypted.empty() && (decrypted[0] == '*'))
+            elements[i] = decrypted.substr(1);
+        else if (i + 1 == elements.size())
+            elements[i] += extension;
+    }
+    auto decPath = JoinPath(elements);
+    return decPath.empty() ? encPath : decPath;
+}
@@ -0,0 +1,55 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include <cstdint>
+#include <string>
+
+/**
+ * Encrypts and decrypts file and folder names.
+ *
+ * Every element of a path is encrypted on its own with RC4, keyed with
+ * the MD5 hash of the UTF-16 password. That's the key CryptDeriveKey()
+ * of the default Windows provider creates, so names encrypted by older
+ * versions decrypt the same on every platform. The encrypted bytes are
+ * stored base4k encoded (new encryption) or as hex (old encryption).
+ * A '*' is prepended before encrypting, a decrypted name that doesn't
+ * start with it wasn't encrypted with this password.
+ */
+class CNameCipher
+{
+public:
+    explicit CNameCipher(const std::wstring& password);
+
+    /// encrypts every element of relPath, the elements are joined with PlatformPathSeparator
+    std::wstring EncryptPath(const std::wstring& relPath, bool newEncryption) const;
+    /// decrypts a path returned by EncryptPath() with the file extension appended, which is cut off.
+    /// Elements that don't decrypt are returned unchanged, the last one with its extension.
+    std::wstring DecryptPath(const std::wstring& encPath, bool newEncryption) const;
+
+private:
+    /// RC4 en- and decrypts in place, every call starts with a fresh key stream
+    void         Crypt(uint8_t* data, size_t size) const;
+    std::wstring EncryptName(const std::wstring& name, bool newEncryption) const;
+    /// returns the decrypted name including the leading '*', or an empty string if name isn't base4k or hex
+    std::wstring DecryptName(const std::wstring& name, bool newEncryption) const;
+
+    uint8_t      m_key[16];
+};
@@ -28,6 +28,7 @@
 #include "Ignores.h"
 #include "StringUtils.h"
 #include "CircularLog.h"
+#include "AsyncLog.h"
 #include "ResString.h"
 #include "OnOutOfScope.h"
 
@@ -41,6 +42,7 @@ COptionsDlg::COptionsDlg(HWND hParent, CFolderSync& folderSync)
     , m_bNewerVersionAvailable(false)
     , m_exitAfterSync(false)
     , m_listInit(false)
+    , m_saveErrorShown(false)
 {
 }
 
@@ -146,7 +148,7 @@ void COptionsDlg::DoPairEdit(int iItem)
     CPairAddDlg dlg(*this);
     dlg.m_origPath              = t.m_origPath;
     dlg.m_cryptPath             = t.m_cryptPath;
-    dlg.m_password              = t.m_password;
+    dlg.m_password              = t.password();
     dlg.m_cryptOnly             = t.cryptOnly();
     dlg.m_copyOnly              = t.copyOnly();
     dlg.m_noSync                = t.noSync();
@@ -190,7 +192,7 @@ void COptionsDlg::DoPairEdit(int iItem)
                 g_pairs.push_back(pd); // Edition resulted in new pd
             }
             InitPairList();
-            g_pairs.SavePairs();
+            SavePairs();
         }
     }
 }
@@ -213,6 +215,7 @@ LRESULT COptionsDlg::DoCommand(int id)
             break;
         case IDC_SHOWLOG:
         {
+            CAsyncLog::Instance().Flush();
             CCircularLog::Instance().Save();
             std::wstring     path = CCircularLog::Instance().GetSavePath();
             SHELLEXECUTEINFO shex = {0};
@@ -256,7 +259,7 @@ LRESULT COptionsDlg::DoCommand(int id)
                     {
                         g_pairs.push_back(pd);
                         InitPairList();
-                        g_pairs.SavePairs();
+                        SavePairs();
                     }
                     else
                     {
@@ -326,7 +329,7 @@ LRESULT COptionsDlg::DoCommand(int id)
                 }
             }
             InitPairList();
-            g_pairs.SavePairs();
+            SavePairs();
         }
         break;
         case IDC_ABOUT:
@@ -478,7 +481,7 @@ void COptionsDlg::DoListNotify(LPNMITEMACTIVATE lpNMItemActivate)
                 {
                     auto& t     = g_pairs[lv.lParam];
                     t.m_enabled = ListView_GetCheckState(hListControl, lpNMItemActivate->iItem);
-                    g_pairs.SavePairs();
+                    SavePairs();
                 }
             }
         }
@@ -503,6 +506,18 @@ int COptionsDlg::GetFailuresFor(const std::wstring& path) const
     return failures;
 }
 
+void COptionsDlg::SavePairs()
+{
+    // tell the user once, not for every check box that's clicked
+    if (!g_pairs.SavePairs() && !m_saveErrorShown)
+    {
+        m_saveErrorShown = true;
+        MessageBox(*this, g_pairs.IsReadOnly() ? L"The stored sync pairs could not be read. Changes to the pairs are not saved to keep them intact."
+                                               : L"The sync pairs could not be saved.",
+                   L"CryptSync", MB_OK | MB_ICONERROR);
+    }
+}
+
 void COptionsDlg::SaveSettings()
 {
     CRegStdString regStartWithWindows = CRegStdString(_T("Software\\Microsoft\\Windows\\CurrentVersion\\Run\\CryptSync"));
@@ -543,7 +558,7 @@ void COptionsDlg::SaveSettings()
         g_pairs[lv.lParam].m_enabled = ListView_GetCheckState(hListControl, iItem);
     }
 
-    g_pairs.SavePairs();
+    SavePairs();
 
     CIgnores::Instance().Reload();
 }
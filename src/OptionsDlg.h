@@ -45,6 +45,8 @@ protected:
     void             DoListNotify(LPNMITEMACTIVATE lpNMItemActivate);
 
     int              GetFailuresFor(const std::wstring& path) const;
+    /// saves g_pairs, tells the user if that fails
+    void             SavePairs();
     void             SaveSettings();
 
 private:
@@ -56,4 +58,5 @@ private:
     bool                           m_exitAfterSync;
     std::map<std::wstring, SyncOp> m_failures;
     std::atomic<bool>              m_listInit;
+    bool                           m_saveErrorShown;
 };
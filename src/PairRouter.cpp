@@ -0,0 +1,121 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+#include "stdafx.h"
+#include "PairRouter.h"
+
+#include <algorithm>
+
+CPairRouter::CPairRouter(const PairVector& pairs)
+    : m_pairs(pairs)
+{
+    m_nodes.emplace_back();
+    for (size_t i = 0; i < m_pairs.size(); ++i)
+    {
+        const auto& pair = m_pairs[i];
+        if (!pair.m_enabled)
+            continue;
+        if (!pair.m_origPath.empty())
+            AddRoot(pair.m_origPath, {i, PairSide::Orig});
+        if (!pair.m_cryptPath.empty())
+            AddRoot(pair.m_cryptPath, {i, PairSide::Crypt});
+    }
+}
+
+CPairRouter::~CPairRouter()
+{
+}
+
+void CPairRouter::AddRoot(const std::wstring& root, const PairRoute& route)
+{
+    size_t            node = 0;
+    size_t            pos  = SkipPathPrefix(root);
+    std::wstring_view element;
+    while (NextElement(root, pos, element))
+    {
+        auto& children = m_nodes[node].children;
+        auto  it       = std::lower_bound(children.begin(), children.end(), element, [](const Child& child, std::wstring_view e) {
+            return CompareElement(child.element, e) < 0;
+        });
+        if ((it != children.end()) && (CompareElement(it->element, element) == 0))
+        {
+            node = it->node;
+            continue;
+        }
+        std::wstring key(element);
+        std::transform(key.begin(), key.end(), key.begin(), ::towlower);
+        size_t newNode = m_nodes.size();
+        children.insert(it, {key, newNode});
+        // note: 'children' must not be used after this, it may get moved
+        m_nodes.emplace_back();
+        node = newNode;
+    }
+    if (node != 0)
+        m_nodes[node].routes.push_back(route);
+}
+
+size_t CPairRouter::FindChild(size_t node, std::wstring_view element) const
+{
+    const auto& children = m_nodes[node].children;
+    auto        it       = std::lower_bound(children.begin(), children.end(), element, [](const Child& child, std::wstring_view e) {
+        return CompareElement(child.element, e) < 0;
+    });
+    if ((it != children.end()) && (CompareElement(it->element, element) == 0))
+        return it->node;
+    return NoNode;
+}
+
+int CPairRouter::CompareElement(const std::wstring& key, std::wstring_view element)
+{
+    // key is already lowercased
+    size_t len = min(key.size(), element.size());
+    for (size_t i = 0; i < len; ++i)
+    {
+        wchar_t c = static_cast<wchar_t>(::towlower(element[i]));
+        if (key[i] != c)
+            return key[i] < c ? -1 : 1;
+    }
+    if (key.size() == element.size())
+        return 0;
+    return key.size() < element.size() ? -1 : 1;
+}
+
+size_t CPairRouter::SkipPathPrefix(std::wstring_view path)
+{
+    // \\?\C:\path and C:\path are the same path,
+    // as are \\?\UNC\server\share and \\server\share
+    if (path.starts_with(L"\\\\?\\UNC\\"))
+        return 8;
+    if (path.starts_with(L"\\\\?\\"))
+        return 4;
+    return 0;
+}
+
+bool CPairRouter::NextElement(std::wstring_view path, size_t& pos, std::wstring_view& element)
+{
+    while ((pos < path.size()) && ((path[pos] == '\\') || (path[pos] == '/')))
+        ++pos;
+    if (pos >= path.size())
+        return false;
+    size_t end = path.find_first_of(L"\\/", pos);
+    if (end == std::wstring_view::npos)
+        end = path.size();
+    element = path.substr(pos, end - pos);
+    pos     = end;
+    return true;
+}
@@ -0,0 +1,103 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+
+#include "Pairs.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class PairSide
+{
+    Orig,
+    Crypt,
+};
+
+struct PairRoute
+{
+    size_t   pairIndex; ///< index into CPairRouter::GetPairs()
+    PairSide side;
+};
+
+/**
+ * Finds the pairs a path belongs to.
+ *
+ * The orig and crypt folders of all enabled pairs are stored in a trie of
+ * path elements which are compared case insensitive. A lookup walks the
+ * elements of the path once and doesn't allocate any memory.
+ *
+ * A router is never modified after it's created: when the pairs change,
+ * a new router replaces the old one, so it can be used from several
+ * threads without locking.
+ */
+class CPairRouter
+{
+public:
+    explicit CPairRouter(const PairVector& pairs);
+    ~CPairRouter();
+
+    const PairVector& GetPairs() const { return m_pairs; }
+
+    /**
+     * Calls \c func with a \c PairRoute for every pair folder \c path is in.
+     * The folders themselves are not part of their pair, only the files
+     * and folders below them.
+     */
+    template <typename F>
+    void ForEachRoute(std::wstring_view path, F&& func) const
+    {
+        size_t            node = 0;
+        size_t            pos  = SkipPathPrefix(path);
+        std::wstring_view element;
+        while (NextElement(path, pos, element))
+        {
+            // there's more of the path left, so the path is inside the folders of this node
+            for (const auto& route : m_nodes[node].routes)
+                func(route);
+            node = FindChild(node, element);
+            if (node == NoNode)
+                return;
+        }
+    }
+
+private:
+    static constexpr size_t NoNode = static_cast<size_t>(-1);
+
+    struct Child
+    {
+        std::wstring element; ///< lowercased path element
+        size_t       node;
+    };
+    struct Node
+    {
+        std::vector<Child>     children; ///< sorted by element
+        std::vector<PairRoute> routes;
+    };
+
+    void          AddRoot(const std::wstring& root, const PairRoute& route);
+    size_t        FindChild(size_t node, std::wstring_view element) const;
+    static int    CompareElement(const std::wstring& key, std::wstring_view element);
+    static size_t SkipPathPrefix(std::wstring_view path);
+    static bool   NextElement(std::wstring_view path, size_t& pos, std::wstring_view& element);
+
+    PairVector        m_pairs;
+    std::vector<Node> m_nodes; ///< m_nodes[0] is the root
+};
@@ -21,8 +21,8 @@
 #include "Pairs.h"
 #include "Registry.h"
 #include "StringUtils.h"
+#include "CircularLog.h"
 #include <algorithm>
-#include <cassert>
 
 void PairData::UpdateVec(std::wstring& s, std::vector<std::wstring>& v)
 {
@@ -32,148 +32,597 @@ void PairData::UpdateVec(std::wstring& s, std::vector<std::wstring>& v)
 
 bool PairData::IsCryptOnly(const std::wstring& s) const
 {
-    return MatchInVec(m_cryptOnlyVec, s);
+    return (Classify(s) & PathMatchCryptOnly) != 0;
 }
 
 bool PairData::IsCopyOnly(const std::wstring& s) const
 {
-    return MatchInVec(m_copyOnlyVec, s);
+    return (Classify(s) & PathMatchCopyOnly) != 0;
 }
 
 bool PairData::IsIgnored(const std::wstring& s) const
 {
-    return MatchInVec(m_noSyncVec, s);
+    return (Classify(s) & PathMatchIgnored) != 0;
 }
 
-bool PairData::MatchInVec(const std::vector<std::wstring>& v, const std::wstring& s)
+unsigned PairData::Classify(const std::wstring& s) const
 {
-    bool bMatched = false;
-    if (v.empty())
-        return false;
-    std::wstring sCmp = s;
-    std::transform(sCmp.begin(), sCmp.end(), sCmp.begin(), ::towlower);
+    if (!m_matcher)
+        return PathMatchNone;
+    return m_matcher->Match(s);
+}
+
+void PairData::AddPatterns(CPathMatcher& matcher) const
+{
+    matcher.AddPatterns(m_noSyncVec, PathMatchIgnored, true);
+    matcher.AddPatterns(m_cryptOnlyVec, PathMatchCryptOnly, true);
+    matcher.AddPatterns(m_copyOnlyVec, PathMatchCopyOnly, true);
+}
+
+void PairData::UpdateMatcher()
+{
+    // a new matcher is created instead of modifying the existing one:
+    // copies of this pair may still use it
+    auto matcher = std::make_shared<CPathMatcher>();
+    AddPatterns(*matcher);
+    m_matcher = matcher;
+}
+
+const std::wstring& PairData::password() const
+{
+    static const std::wstring empty;
+    if (!m_password)
+        return empty;
+    return m_password->GetPlain();
+}
+
+std::shared_ptr<CPairPassword> CPairPassword::FromPlain(const std::wstring& password)
+{
+    auto pw        = std::make_shared<CPairPassword>();
+    pw->m_plain    = password;
+    pw->m_hasPlain = true;
+    return pw;
+}
+
+std::shared_ptr<CPairPassword> CPairPassword::FromProtected(const std::vector<BYTE>& data)
+{
+    auto pw            = std::make_shared<CPairPassword>();
+    pw->m_protected    = data;
+    pw->m_hasProtected = true;
+    return pw;
+}
+
+const std::wstring& CPairPassword::GetPlain()
+{
+    {
+        CAutoReadLock locker(m_guard);
+        if (m_hasPlain)
+            return m_plain;
+    }
+    CAutoWriteLock locker(m_guard);
+    if (!m_hasPlain)
+    {
+        m_plain    = Unprotect(m_protected);
+        m_hasPlain = true;
+    }
+    return m_plain;
+}
+
+const std::vector<BYTE>& CPairPassword::GetProtected()
+{
+    {
+        CAutoReadLock locker(m_guard);
+        if (m_hasProtected)
+            return m_protected;
+    }
+    CAutoWriteLock locker(m_guard);
+    if (!m_hasProtected)
+    {
+        m_protected    = Protect(m_plain);
+        m_hasProtected = true;
+    }
+    return m_protected;
+}
+
+std::vector<BYTE> CPairPassword::Protect(const std::wstring& password)
+{
+    DATA_BLOB         blobIn  = {0};
+    DATA_BLOB         blobOut = {0};
+    std::vector<BYTE> result;
+
+    blobIn.cbData = static_cast<DWORD>(password.size()) * sizeof(wchar_t);
+    blobIn.pbData = reinterpret_cast<BYTE*>(const_cast<wchar_t*>(password.c_str()));
+    if (CryptProtectData(&blobIn, L"CryptSyncRegPWs", nullptr, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &blobOut) == FALSE)
+        return result;
+    result.assign(blobOut.pbData, blobOut.pbData + blobOut.cbData);
+    LocalFree(blobOut.pbData);
+    return result;
+}
+
+std::wstring CPairPassword::Unprotect(const std::vector<BYTE>& data)
+{
+    if (data.empty())
+        return L"";
+    std::vector<BYTE> in = data;
+    DATA_BLOB         blobIn;
+    blobIn.cbData = static_cast<DWORD>(in.size());
+    blobIn.pbData = in.data();
+    LPWSTR    descr;
+    DATA_BLOB blobOut = {0};
+    if (CryptUnprotectData(&blobIn, &descr, nullptr, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &blobOut) == FALSE)
+        return L"";
+    SecureZeroMemory(blobIn.pbData, blobIn.cbData);
+
+    auto tempResult = std::make_unique<wchar_t[]>(blobOut.cbData + 1);
+    wcsncpy_s(tempResult.get(), blobOut.cbData + 1, reinterpret_cast<const wchar_t*>(blobOut.pbData), blobOut.cbData / sizeof(wchar_t));
+    SecureZeroMemory(blobOut.pbData, blobOut.cbData);
+    LocalFree(blobOut.pbData);
+    LocalFree(descr);
+
+    std::wstring result = tempResult.get();
+    SecureZeroMemory(tempResult.get(), (blobOut.cbData + 1) * sizeof(wchar_t));
+
+    return result;
+}
+
+namespace
+{
+/// subkey of the settings the pairs are stored in
+constexpr wchar_t PAIRS_SUBKEY[]      = L"SyncPairs";
+/// value of PAIRS_SUBKEY the index of the pairs is stored in
+constexpr wchar_t PAIRS_INDEX_VALUE[] = L"Index";
+/// "CSPI" as little endian DWORD
+constexpr DWORD   PAIRS_INDEX_MAGIC   = 0x49505343;
+
+enum PairFlags : DWORD
+{
+    PairFlagEnabled               = 0x0001,
+    PairFlagEncNames              = 0x0002,
+    PairFlagEncNamesNew           = 0x0004,
+    PairFlagUse7Z                 = 0x0008,
+    PairFlagUseGpg                = 0x0010,
+    PairFlagFat                   = 0x0020,
+    PairFlagSyncDeleted           = 0x0040,
+    PairFlagResetOriginalArchAttr = 0x0080,
+};
+
+void WriteDWORD(std::vector<BYTE>& blob, DWORD value)
+{
+    auto p = reinterpret_cast<const BYTE*>(&value);
+    blob.insert(blob.end(), p, p + sizeof(value));
+}
 
-    // first check if the whole path matches
-    for (auto it = v.cbegin(); it != v.cend(); ++it)
+void WriteBytes(std::vector<BYTE>& blob, const BYTE* data, size_t size)
+{
+    WriteDWORD(blob, static_cast<DWORD>(size));
+    blob.insert(blob.end(), data, data + size);
+}
+
+void WriteString(std::vector<BYTE>& blob, const std::wstring& s)
+{
+    WriteBytes(blob, reinterpret_cast<const BYTE*>(s.c_str()), s.size() * sizeof(wchar_t));
+}
+
+/// reads the fields of a blob, every read fails once the end is reached
+class CBlobReader
+{
+public:
+    CBlobReader(const BYTE* data, size_t size)
+        : m_data(data)
+        , m_size(size)
+        , m_pos(0)
     {
-        if (wcswildcmp(it->c_str(), sCmp.c_str()))
+    }
+
+    bool ReadDWORD(DWORD& value)
+    {
+        if (m_size - m_pos < sizeof(DWORD))
+            return false;
+        memcpy(&value, m_data + m_pos, sizeof(DWORD));
+        m_pos += sizeof(DWORD);
+        return true;
+    }
+
+    bool ReadBytes(const BYTE*& data, size_t& size)
+    {
+        DWORD len = 0;
+        if (!ReadDWORD(len) || (m_size - m_pos < len))
+            return false;
+        data = m_data + m_pos;
+        size = len;
+        m_pos += len;
+        return true;
+    }
+
+    bool ReadString(std::wstring& s)
+    {
+        const BYTE* data = nullptr;
+        size_t      size = 0;
+        if (!ReadBytes(data, size) || (size % sizeof(wchar_t)))
+            return false;
+        s.assign(reinterpret_cast<const wchar_t*>(data), size / sizeof(wchar_t));
+        return true;
+    }
+
+private:
+    const BYTE* m_data;
+    size_t      m_size;
+    size_t      m_pos;
+};
+} // namespace
+
+CPairs::CPairs(const std::wstring& regKey, bool readOnly)
+    : m_regKey(regKey)
+    , m_readOnly(readOnly)
+{
+    InitPairList();
+}
+
+CPairs::~CPairs()
+{
+}
+
+void CPairs::InitPairList()
+{
+    clear();
+    m_savedIndex.clear();
+    m_savedRecords.clear();
+
+    std::vector<BYTE>                  index;
+    std::map<DWORD, std::vector<BYTE>> records;
+    if (ReadStored(index, records))
+    {
+        std::vector<DWORD> ids;
+        DWORD              version = 0;
+        bool               loaded  = ParseIndex(index, ids, version);
+        for (size_t i = 0; loaded && (i < ids.size()); ++i)
+        {
+            PairData pd;
+            auto     record = records.find(ids[i]);
+            loaded          = (record != records.end()) && ParseRecord(record->second, pd);
+            pd.m_storeId    = ids[i];
+            if (loaded)
+                push_back(pd);
+        }
+        if (!loaded)
         {
-            return true;
+            // don't overwrite a configuration we don't understand,
+            // e.g. one written by a newer version
+            CCircularLog::Instance()(L"ERROR:   the stored sync pairs could not be read, changes to the pairs won't be saved");
+            clear();
+            m_readOnly = true;
+            return;
         }
+        if (version > PAIRS_BLOB_VERSION)
+            CCircularLog::Instance()(L"INFO:    the sync pairs were saved by a newer version, settings unknown to this version are dropped when they're saved");
+        m_savedIndex   = std::move(index);
+        m_savedRecords = std::move(records);
+        return;
     }
 
-    std::vector<std::wstring> pathelems;
-    stringtok(pathelems, sCmp, true, L"\\");
-    for (auto pe : pathelems)
+    // no configuration yet: import the pairs from the old registry layout once.
+    // The old values are left in place so that a downgrade still finds its pairs,
+    // they're not read anymore once the new configuration is written.
+    ImportRegistryPairs(m_regKey.c_str());
+    if (!empty() && !m_readOnly)
+    {
+        CCircularLog::Instance()(L"INFO:    importing %d sync pairs from the old registry settings", static_cast<int>(size()));
+        SavePairs();
+    }
+}
+
+bool CPairs::ReadStored(std::vector<BYTE>& index, std::map<DWORD, std::vector<BYTE>>& records) const
+{
+    const std::wstring keyPath = m_regKey + L"\\" + PAIRS_SUBKEY;
+    HKEY               hKey    = nullptr;
+    if (RegOpenKeyEx(HKEY_CURRENT_USER, keyPath.c_str(), 0, KEY_QUERY_VALUE, &hKey) != ERROR_SUCCESS)
+        return false;
+    DWORD size   = 0;
+    bool  exists = RegGetValue(hKey, nullptr, PAIRS_INDEX_VALUE, RRF_RT_REG_BINARY, nullptr, nullptr, &size) == ERROR_SUCCESS;
+    if (exists)
     {
-        for (auto it = v.cbegin(); it != v.cend(); ++it)
+        index.resize(size);
+        exists = RegGetValue(hKey, nullptr, PAIRS_INDEX_VALUE, RRF_RT_REG_BINARY, nullptr, index.data(), &size) == ERROR_SUCCESS;
+        index.resize(size);
+    }
+    std::vector<DWORD> ids;
+    DWORD              version = 0;
+    if (exists && ParseIndex(index, ids, version) && !ids.empty())
+    {
+        // all records with one call: loading takes the same time for any number of pairs
+        std::vector<std::wstring> names;
+        std::vector<VALENT>       values(ids.size());
+        for (auto id : ids)
+            names.push_back(GetRecordName(id));
+        for (size_t i = 0; i < ids.size(); ++i)
+            values[i].ve_valuename = names[i].data();
+        std::vector<BYTE> buffer;
+        DWORD             bufferSize = 0;
+        LONG              ret        = RegQueryMultipleValues(hKey, values.data(), static_cast<DWORD>(values.size()), nullptr, &bufferSize);
+        // the values might grow between the calls
+        for (int tries = 0; (ret == ERROR_MORE_DATA) && (tries < 3); ++tries)
+        {
+            buffer.resize(bufferSize);
+            ret = RegQueryMultipleValues(hKey, values.data(), static_cast<DWORD>(values.size()), reinterpret_cast<LPWSTR>(buffer.data()), &bufferSize);
+        }
+        if (ret == ERROR_SUCCESS)
         {
-            if (wcswildcmp(it->c_str(), pe.c_str()))
+            for (size_t i = 0; i < ids.size(); ++i)
             {
-                bMatched = true;
-                break;
+                if (values[i].ve_type != REG_BINARY)
+                    continue;
+                auto data = reinterpret_cast<const BYTE*>(values[i].ve_valueptr);
+                records.emplace(ids[i], std::vector<BYTE>(data, data + values[i].ve_valuelen));
             }
         }
-        if (bMatched)
-            break;
     }
-    return bMatched;
+    RegCloseKey(hKey);
+    return exists;
 }
 
-CPairs::CPairs()
+std::vector<BYTE> CPairs::CreateIndex(const std::vector<DWORD>& ids)
 {
-    InitPairList();
+    std::vector<BYTE> index;
+    WriteDWORD(index, PAIRS_INDEX_MAGIC);
+    WriteDWORD(index, PAIRS_BLOB_VERSION);
+    WriteDWORD(index, static_cast<DWORD>(ids.size()));
+    for (auto id : ids)
+        WriteDWORD(index, id);
+    return index;
 }
 
-CPairs::~CPairs()
+bool CPairs::ParseIndex(const std::vector<BYTE>& index, std::vector<DWORD>& ids, DWORD& version)
 {
+    CBlobReader reader(index.data(), index.size());
+    DWORD       magic = 0;
+    DWORD       count = 0;
+    if (!reader.ReadDWORD(magic) || (magic != PAIRS_INDEX_MAGIC))
+        return false;
+    // newer versions only append fields to the records and data after
+    // the ids, so their configuration can be read as far as it is known here
+    if (!reader.ReadDWORD(version) || (version < 1))
+        return false;
+    if (!reader.ReadDWORD(count))
+        return false;
+    ids.clear();
+    for (DWORD i = 0; i < count; ++i)
+    {
+        DWORD id = 0;
+        if (!reader.ReadDWORD(id) || (id == 0))
+            return false;
+        ids.push_back(id);
+    }
+    return true;
 }
 
-void CPairs::InitPairList()
+std::vector<BYTE> CPairs::CreateRecord(const PairData& pd)
+{
+    DWORD flags = 0;
+    flags |= pd.m_enabled ? PairFlagEnabled : 0;
+    flags |= pd.m_encNames ? PairFlagEncNames : 0;
+    flags |= pd.m_encNamesNew ? PairFlagEncNamesNew : 0;
+    flags |= pd.m_use7Z ? PairFlagUse7Z : 0;
+    flags |= pd.m_useGpg ? PairFlagUseGpg : 0;
+    flags |= pd.m_fat ? PairFlagFat : 0;
+    flags |= pd.m_syncDeleted ? PairFlagSyncDeleted : 0;
+    flags |= pd.m_ResetOriginalArchAttr ? PairFlagResetOriginalArchAttr : 0;
+
+    // passwords that were loaded or saved before are written as they are:
+    // only new or changed passwords need to be protected
+    static const std::vector<BYTE> noPassword;
+    const auto&                    pw = pd.m_password ? pd.m_password->GetProtected() : noPassword;
+
+    std::vector<BYTE> record;
+    WriteDWORD(record, flags);
+    WriteDWORD(record, static_cast<DWORD>(pd.m_syncDir));
+    WriteDWORD(record, static_cast<DWORD>(pd.m_compressSize));
+    WriteString(record, pd.m_origPath);
+    WriteString(record, pd.m_cryptPath);
+    WriteBytes(record, pw.data(), pw.size());
+    WriteString(record, pd.cryptOnly());
+    WriteString(record, pd.copyOnly());
+    WriteString(record, pd.noSync());
+    return record;
+}
+
+bool CPairs::ParseRecord(const std::vector<BYTE>& record, PairData& pd)
+{
+    // fields added later are appended to the record and ignored here
+    CBlobReader  reader(record.data(), record.size());
+    DWORD        flags        = 0;
+    DWORD        syncDir      = 0;
+    DWORD        compressSize = 0;
+    std::wstring cryptOnly;
+    std::wstring copyOnly;
+    std::wstring noSync;
+    const BYTE*  pwData = nullptr;
+    size_t       pwSize = 0;
+    if (!reader.ReadDWORD(flags) ||
+        !reader.ReadDWORD(syncDir) ||
+        !reader.ReadDWORD(compressSize) ||
+        !reader.ReadString(pd.m_origPath) ||
+        !reader.ReadString(pd.m_cryptPath) ||
+        !reader.ReadBytes(pwData, pwSize) ||
+        !reader.ReadString(cryptOnly) ||
+        !reader.ReadString(copyOnly) ||
+        !reader.ReadString(noSync))
+        return false;
+
+    pd.m_enabled               = (flags & PairFlagEnabled) != 0;
+    pd.m_encNames              = (flags & PairFlagEncNames) != 0;
+    pd.m_encNamesNew           = (flags & PairFlagEncNamesNew) != 0;
+    pd.m_use7Z                 = (flags & PairFlagUse7Z) != 0;
+    pd.m_useGpg                = (flags & PairFlagUseGpg) != 0;
+    pd.m_fat                   = (flags & PairFlagFat) != 0;
+    pd.m_syncDeleted           = (flags & PairFlagSyncDeleted) != 0;
+    pd.m_ResetOriginalArchAttr = (flags & PairFlagResetOriginalArchAttr) != 0;
+    pd.m_syncDir               = static_cast<SyncDir>(syncDir);
+    pd.m_compressSize          = static_cast<int>(compressSize);
+    // the password is unprotected when it's needed the first time
+    pd.m_password = CPairPassword::FromProtected(std::vector<BYTE>(pwData, pwData + pwSize));
+    pd.cryptOnly(cryptOnly);
+    pd.copyOnly(copyOnly);
+    pd.noSync(noSync);
+    return true;
+}
+
+std::wstring CPairs::GetRecordName(DWORD id)
+{
+    wchar_t name[32] = {};
+    swprintf_s(name, L"Pair%lu", id);
+    return name;
+}
+
+bool CPairs::SavePairs()
+{
+    if (m_readOnly)
+    {
+        CCircularLog::Instance()(L"ERROR:   the sync pairs are read only, they were not saved");
+        return false;
+    }
+    // a pair keeps the id of its record. New pairs and copies of a pair get a new one
+    DWORD nextId = m_savedRecords.empty() ? 1 : m_savedRecords.rbegin()->first + 1;
+    for (const auto& pd : *this)
+        nextId = std::max(nextId, pd.m_storeId + 1);
+    std::map<DWORD, std::vector<BYTE>> records;
+    std::vector<DWORD>                 ids;
+    for (auto& pd : *this)
+    {
+        if ((pd.m_storeId == 0) || records.contains(pd.m_storeId))
+            pd.m_storeId = nextId++;
+        ids.push_back(pd.m_storeId);
+        records[pd.m_storeId] = CreateRecord(pd);
+    }
+    auto index = CreateIndex(ids);
+
+    const std::wstring keyPath = m_regKey + L"\\" + PAIRS_SUBKEY;
+    HKEY               hKey    = nullptr;
+    bool               ok      = RegCreateKeyEx(HKEY_CURRENT_USER, keyPath.c_str(), 0, nullptr, REG_OPTION_NON_VOLATILE, KEY_SET_VALUE, nullptr, &hKey, nullptr) == ERROR_SUCCESS;
+    if (ok)
+    {
+        // only the changed records are written. The index is written after the
+        // records it lists, the records it doesn't list anymore are removed after
+        // it: whenever the saving stops, the stored configuration is complete
+        for (const auto& [id, record] : records)
+        {
+            auto saved = m_savedRecords.find(id);
+            if (ok && ((saved == m_savedRecords.end()) || (saved->second != record)))
+                ok = RegSetValueEx(hKey, GetRecordName(id).c_str(), 0, REG_BINARY, record.data(), static_cast<DWORD>(record.size())) == ERROR_SUCCESS;
+        }
+        if (ok && (index != m_savedIndex))
+            ok = RegSetValueEx(hKey, PAIRS_INDEX_VALUE, 0, REG_BINARY, index.data(), static_cast<DWORD>(index.size())) == ERROR_SUCCESS;
+        if (ok)
+        {
+            for (const auto& [id, record] : m_savedRecords)
+            {
+                if (!records.contains(id))
+                    RegDeleteValue(hKey, GetRecordName(id).c_str());
+            }
+            m_savedIndex   = std::move(index);
+            m_savedRecords = std::move(records);
+        }
+        RegCloseKey(hKey);
+    }
+    if (!ok)
+        CCircularLog::Instance()(L"ERROR:   failed to save the sync pairs");
+    return ok;
+}
+
+void CPairs::ImportRegistryPairs(const wchar_t* regKey)
 {
-    clear();
     int p = 0;
     for (;;)
     {
         PairData pd;
 
         WCHAR key[MAX_PATH];
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairOrig%d", p);
+        swprintf_s(key, L"%s\\SyncPairOrig%d", regKey, p);
         CRegStdString origPathReg(key);
         pd.m_origPath = origPathReg;
         if (pd.m_origPath.empty())
             break;
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCrypt%d", p);
+        swprintf_s(key, L"%s\\SyncPairCrypt%d", regKey, p);
         CRegStdString cryptPathReg(key);
         pd.m_cryptPath = cryptPathReg;
         if (pd.m_cryptPath.empty())
             break;
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairPass%d", p);
+        swprintf_s(key, L"%s\\SyncPairPass%d", regKey, p);
         CRegStdString passwordReg(key);
-        pd.m_password = passwordReg;
-        if (pd.m_password.empty())
+        std::wstring  password = passwordReg;
+        if (password.empty())
             break;
-        pd.m_password = Decrypt(pd.m_password);
+        // keep the password protected, just convert it from the hex string
+        DWORD dwLen = 0;
+        if (CryptStringToBinary(password.c_str(), static_cast<DWORD>(password.size()), CRYPT_STRING_HEX, nullptr, &dwLen, nullptr, nullptr))
+        {
+            std::vector<BYTE> protectedPw(dwLen);
+            if (CryptStringToBinary(password.c_str(), static_cast<DWORD>(password.size()), CRYPT_STRING_HEX, protectedPw.data(), &dwLen, nullptr, nullptr))
+            {
+                protectedPw.resize(dwLen);
+                pd.m_password = CPairPassword::FromProtected(protectedPw);
+            }
+        }
+        if (!pd.m_password)
+            pd.m_password = CPairPassword::FromPlain(L"");
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCryptOnly%d", p);
+        swprintf_s(key, L"%s\\SyncPairCryptOnly%d", regKey, p);
         CRegStdString cryptOnlyReg(key);
         pd.cryptOnly(cryptOnlyReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCopyOnly%d", p);
+        swprintf_s(key, L"%s\\SyncPairCopyOnly%d", regKey, p);
         CRegStdString copyOnlyReg(key);
         pd.copyOnly(copyOnlyReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairNoSync%d", p);
+        swprintf_s(key, L"%s\\SyncPairNoSync%d", regKey, p);
         CRegStdString noSyncReg(key);
         pd.noSync(noSyncReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEncnames%d", p);
+        swprintf_s(key, L"%s\\SyncPairEncnames%d", regKey, p);
         CRegStdDWORD encNamesReg(key, TRUE);
         pd.m_encNames = !!static_cast<DWORD>(encNamesReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEncnamesNew%d", p);
+        swprintf_s(key, L"%s\\SyncPairEncnamesNew%d", regKey, p);
         CRegStdDWORD encNamesNewReg(key, FALSE);
         pd.m_encNamesNew = !!static_cast<DWORD>(encNamesNewReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairOneWay%d", p);
+        swprintf_s(key, L"%s\\SyncPairOneWay%d", regKey, p);
         CRegStdDWORD oneWayReg(key, static_cast<DWORD>(-1));
         if (static_cast<DWORD>(oneWayReg) != static_cast<DWORD>(-1))
             pd.m_syncDir = (!!static_cast<DWORD>(oneWayReg) ? SrcToDst : BothWays);
         else
         {
-            swprintf_s(key, L"Software\\CryptSync\\SyncPairDir%d", p);
+            swprintf_s(key, L"%s\\SyncPairDir%d", regKey, p);
             CRegStdDWORD syncDirReg(key, BothWays);
             pd.m_syncDir = static_cast<SyncDir>(static_cast<DWORD>(syncDirReg));
         }
-        oneWayReg.removeValue();
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPair7zExt%d", p);
+        swprintf_s(key, L"%s\\SyncPair7zExt%d", regKey, p);
         CRegStdDWORD zExtReg(key, FALSE);
         pd.m_use7Z = !!static_cast<DWORD>(zExtReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\UseGPG%d", p);
+        swprintf_s(key, L"%s\\UseGPG%d", regKey, p);
         CRegStdDWORD zGpgReg(key, FALSE);
         pd.m_useGpg = !!static_cast<DWORD>(zGpgReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairFAT%d", p);
+        swprintf_s(key, L"%s\\SyncPairFAT%d", regKey, p);
         CRegStdDWORD fatReg(key, FALSE);
         pd.m_fat = !!static_cast<DWORD>(fatReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncDeleted%d", p);
+        swprintf_s(key, L"%s\\SyncDeleted%d", regKey, p);
         CRegStdDWORD syncDelReg(key, TRUE);
         pd.m_syncDeleted = !!static_cast<DWORD>(syncDelReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCompressSize%d", p);
+        swprintf_s(key, L"%s\\SyncPairCompressSize%d", regKey, p);
         CRegStdDWORD compressSizeReg(key, 100);
         pd.m_compressSize = static_cast<DWORD>(compressSizeReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\ResetOriginalArchiveAttribute%d", p);
+        swprintf_s(key, L"%s\\ResetOriginalArchiveAttribute%d", regKey, p);
         CRegStdDWORD resetOriginalArchiveAttrReg(key, FALSE);
         pd.m_ResetOriginalArchAttr = !!static_cast<DWORD>(resetOriginalArchiveAttrReg);
 
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEnabled%d", p);
+        swprintf_s(key, L"%s\\SyncPairEnabled%d", regKey, p);
         CRegStdDWORD enabledReg(key, TRUE);
         pd.m_enabled = !!static_cast<DWORD>(enabledReg);
 
@@ -183,161 +632,12 @@ void CPairs::InitPairList()
     }
 }
 
-void CPairs::SavePairs()
-{
-    int p = 0;
-    for (auto it = cbegin(); (it != cend()) && (p < 200); ++it)
-    {
-        WCHAR key[MAX_PATH];
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairOrig%d", p);
-        // ReSharper disable CppEntityAssignedButNoRead
-        CRegStdString origPathReg(key, L"", true);
-        origPathReg = it->m_origPath;
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCrypt%d", p);
-        CRegStdString cryptPathReg(key, L"", true);
-        cryptPathReg = it->m_cryptPath;
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairPass%d", p);
-        CRegStdString passwordReg(key, L"", true);
-        passwordReg = Encrypt(it->m_password);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCryptOnly%d", p);
-        CRegStdString cryptOnlyReg(key, L"", true);
-        cryptOnlyReg = it->cryptOnly();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCopyOnly%d", p);
-        CRegStdString copyOnlyReg(key, L"", true);
-        copyOnlyReg = it->copyOnly();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairNoSync%d", p);
-        CRegStdString noSyncReg(key, L"", true);
-        noSyncReg = it->noSync();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEncnames%d", p);
-        CRegStdDWORD encNamesReg(key, TRUE, true);
-        encNamesReg = static_cast<DWORD>(it->m_encNames);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEncnamesNew%d", p);
-        CRegStdDWORD encNamesNewReg(key, FALSE, true);
-        encNamesNewReg = static_cast<DWORD>(it->m_encNamesNew);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairDir%d", p);
-        CRegStdDWORD syncDirReg(key, BothWays, true);
-        syncDirReg = static_cast<DWORD>(it->m_syncDir);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPair7zExt%d", p);
-        CRegStdDWORD zExtReg(key, FALSE, true);
-        zExtReg = static_cast<DWORD>(it->m_use7Z);
-
-        swprintf_s(key, L"Software\\CryptSync\\UseGPG%d", p);
-        CRegStdDWORD zGpgReg(key, FALSE, true);
-        zGpgReg = static_cast<DWORD>(it->m_useGpg);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairFAT%d", p);
-        CRegStdDWORD fatReg(key, FALSE, true);
-        fatReg = static_cast<DWORD>(it->m_fat);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncDeleted%d", p);
-        CRegStdDWORD syncDelReg(key, TRUE, true);
-        syncDelReg = static_cast<DWORD>(it->m_syncDeleted);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCompressSize%d", p);
-        CRegStdDWORD compressSizeReg(key, 100, true);
-        compressSizeReg = static_cast<DWORD>(it->m_compressSize);
-
-        swprintf_s(key, L"Software\\CryptSync\\ResetOriginalArchiveAttribute%d", p);
-        CRegStdDWORD resetOriginalArchiveAttrReg(key, FALSE, true);
-        resetOriginalArchiveAttrReg = static_cast<DWORD>(it->m_ResetOriginalArchAttr);
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEnabled%d", p);
-        CRegStdDWORD enabledReg(key, TRUE, true);
-        enabledReg = static_cast<DWORD>(it->m_enabled);
-        // ReSharper restore CppEntityAssignedButNoRead
-
-        ++p;
-    }
-    // delete all possible remaining registry entries
-    while (p < 200)
-    {
-        WCHAR key[MAX_PATH];
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairOrig%d", p);
-        CRegStdString origPathReg(key);
-        origPathReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCrypt%d", p);
-        CRegStdString cryptPathReg(key);
-        cryptPathReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairPass%d", p);
-        CRegStdString passwordReg(key);
-        passwordReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCryptOnly%d", p);
-        CRegStdString cryptOnlyReg(key);
-        cryptOnlyReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCopyOnly%d", p);
-        CRegStdString copyOnlyReg(key);
-        copyOnlyReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairNoSync%d", p);
-        CRegStdString noSyncReg(key);
-        noSyncReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEncnames%d", p);
-        CRegStdDWORD encNamesReg(key);
-        encNamesReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEncnamesNew%d", p);
-        CRegStdDWORD encNamesNewReg(key);
-        encNamesNewReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairDir%d", p);
-        CRegStdDWORD syncDirReg(key);
-        syncDirReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairOneWay%d", p);
-        CRegStdDWORD oneWayReg(key);
-        oneWayReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPair7zExt%d", p);
-        CRegStdDWORD zExtReg(key);
-        zExtReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\UseGPG%d", p);
-        CRegStdDWORD zGpgReg(key);
-        zGpgReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncDeleted%d", p);
-        CRegStdDWORD syncDelReg(key);
-        syncDelReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairFAT%d", p);
-        CRegStdDWORD fatReg(key);
-        fatReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairCompressSize%d", p);
-        CRegStdDWORD compressSizeReg(key);
-        compressSizeReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\ResetOriginalArchiveAttribute%d", p);
-        CRegStdDWORD resetOriginalArchiveAttrReg(key);
-        resetOriginalArchiveAttrReg.removeValue();
-
-        swprintf_s(key, L"Software\\CryptSync\\SyncPairEnabled%d", p);
-        CRegStdDWORD enabledReg(key);
-        enabledReg.removeValue();
-        ++p;
-    }
-}
-
 PairData::PairData(bool enabled, const std::wstring& orig, const std::wstring& crypt, const std::wstring& password, const std::wstring& cryptOnly, const std::wstring& copyOnly, const std::wstring& noSync, int compressSize, bool encryptNames, bool encryptNamesNew, SyncDir syncDir, bool use7ZExt, bool useGpg, bool fat, bool syncDeleted, bool ResetOriginalArchAttr)
 {
     m_enabled   = enabled;
     m_origPath  = orig;
     m_cryptPath = crypt;
-    m_password  = password;
+    m_password  = CPairPassword::FromPlain(password);
     this->cryptOnly(cryptOnly);
     this->copyOnly(copyOnly);
     this->noSync(noSync);
@@ -375,76 +675,35 @@ bool CPairs::AddPair(bool enabled, const std::wstring& orig, const std::wstring&
     return (AddPair(pd));
 }
 
-std::wstring CPairs::Decrypt(const std::wstring& pw) const
+std::wstring CPairs::Decrypt(const std::wstring& pw)
 {
     DWORD dwLen = 0;
 
     if (CryptStringToBinary(pw.c_str(), static_cast<DWORD>(pw.size()), CRYPT_STRING_HEX, nullptr, &dwLen, nullptr, nullptr) == FALSE)
         return L"";
 
-    auto strIn = std::make_unique<BYTE[]>(dwLen + 1);
-    if (CryptStringToBinary(pw.c_str(), static_cast<DWORD>(pw.size()), CRYPT_STRING_HEX, strIn.get(), &dwLen, nullptr, nullptr) == FALSE)
-        return L"";
-
-    DATA_BLOB blobIn;
-    blobIn.cbData = dwLen;
-    blobIn.pbData = strIn.get();
-    LPWSTR    descr;
-    DATA_BLOB blobOut = {0};
-    if (CryptUnprotectData(&blobIn, &descr, nullptr, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &blobOut) == FALSE)
+    std::vector<BYTE> data(dwLen);
+    if (CryptStringToBinary(pw.c_str(), static_cast<DWORD>(pw.size()), CRYPT_STRING_HEX, data.data(), &dwLen, nullptr, nullptr) == FALSE)
         return L"";
-    SecureZeroMemory(blobIn.pbData, blobIn.cbData);
-
-    auto tempResult = std::make_unique<wchar_t[]>(blobOut.cbData + 1);
-    wcsncpy_s(tempResult.get(), blobOut.cbData + 1, reinterpret_cast<const wchar_t*>(blobOut.pbData), blobOut.cbData / sizeof(wchar_t));
-    SecureZeroMemory(blobOut.pbData, blobOut.cbData);
-    LocalFree(blobOut.pbData);
-    LocalFree(descr);
-
-    std::wstring result = tempResult.get();
+    data.resize(dwLen);
 
-    return result;
+    return CPairPassword::Unprotect(data);
 }
 
 std::wstring CPairs::Encrypt(const std::wstring& pw)
 {
-    DATA_BLOB    blobIn  = {0};
-    DATA_BLOB    blobOut = {0};
     std::wstring result;
-
-    blobIn.cbData = static_cast<DWORD>(pw.size()) * sizeof(wchar_t);
-    blobIn.pbData = reinterpret_cast<BYTE*>(const_cast<wchar_t*>(pw.c_str()));
-    if (CryptProtectData(&blobIn, L"CryptSyncRegPWs", nullptr, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &blobOut) == FALSE)
+    auto         data  = CPairPassword::Protect(pw);
+    DWORD        dwLen = 0;
+    if (data.empty())
         return result;
-    DWORD dwLen = 0;
-    if (CryptBinaryToString(blobOut.pbData, blobOut.cbData, CRYPT_STRING_HEX, nullptr, &dwLen) == FALSE)
+    if (CryptBinaryToString(data.data(), static_cast<DWORD>(data.size()), CRYPT_STRING_HEX, nullptr, &dwLen) == FALSE)
         return result;
     auto strOut = std::make_unique<wchar_t[]>(dwLen + 1);
-    if (CryptBinaryToString(blobOut.pbData, blobOut.cbData, CRYPT_STRING_HEX, strOut.get(), &dwLen) == FALSE)
+    if (CryptBinaryToString(data.data(), static_cast<DWORD>(data.size()), CRYPT_STRING_HEX, strOut.get(), &dwLen) == FALSE)
         return result;
-    LocalFree(blobOut.pbData);
 
     result = strOut.get();
 
     return result;
 }
-
-#if defined(_DEBUG)
-// Some test cases for these classes
-[[maybe_unused]] static class CPairsTests
-{
-public:
-    CPairsTests()
-    {
-        CPairs       p;
-        std::wstring pw = p.Encrypt(L"password");
-        pw              = p.Decrypt(pw);
-        assert(pw == L"password");
-
-        std::wstring pw2 = p.Encrypt(L"");
-        pw2              = p.Decrypt(pw2);
-        assert(pw2 == L"");
-    }
-
-} cPairsTestsobject;
-#endif
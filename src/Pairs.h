@@ -19,8 +19,19 @@
 
 #pragma once
 
+#include "PathMatcher.h"
+#include "ReaderWriterLock.h"
+
+#include <map>
 #include <vector>
 #include <string>
+#include <memory>
+
+/// the key below HKCU the settings of CryptSync are stored in
+constexpr wchar_t CRYPTSYNC_REGKEY[] = L"Software\\CryptSync";
+/// version of the pair configuration written by CPairs::SavePairs(),
+/// newer versions only append fields so older ones can still read it
+constexpr DWORD   PAIRS_BLOB_VERSION = 1;
 
 enum SyncDir
 {
@@ -29,6 +40,33 @@ enum SyncDir
     DstToSrc
 };
 
+/**
+ * The password of a pair.
+ * The password is kept DPAPI protected as it was loaded and is only
+ * unprotected when it's used the first time. Copies of a PairData share
+ * the same object, so that happens only once, and passwords that didn't
+ * change don't have to be protected again when the pairs are saved.
+ */
+class CPairPassword
+{
+public:
+    static std::shared_ptr<CPairPassword> FromPlain(const std::wstring& password);
+    static std::shared_ptr<CPairPassword> FromProtected(const std::vector<BYTE>& data);
+
+    const std::wstring&      GetPlain();
+    const std::vector<BYTE>& GetProtected();
+
+    static std::vector<BYTE> Protect(const std::wstring& password);
+    static std::wstring      Unprotect(const std::vector<BYTE>& data);
+
+private:
+    CReaderWriterLock m_guard;
+    std::wstring      m_plain;
+    std::vector<BYTE> m_protected;
+    bool              m_hasPlain     = false;
+    bool              m_hasProtected = false;
+};
+
 class PairData
 {
 public:
@@ -51,7 +89,6 @@ public:
     bool         m_ResetOriginalArchAttr;
     std::wstring m_origPath;
     std::wstring m_cryptPath;
-    std::wstring m_password;
     bool         m_encNames;
     bool         m_encNamesNew;
     SyncDir      m_syncDir;
@@ -60,11 +97,17 @@ public:
     bool         m_fat;
     int          m_compressSize;
     bool         m_syncDeleted;
+
+    /// returns the password, unprotecting it first if necessary
+    const std::wstring& password() const;
+    void                password(const std::wstring& pw) { m_password = CPairPassword::FromPlain(pw); }
+
     std::wstring noSync() const { return m_noSync; }
     void         noSync(const std::wstring& c)
     {
         m_noSync = c;
         UpdateVec(m_noSync, m_noSyncVec);
+        UpdateMatcher();
     }
     bool         IsIgnored(const std::wstring& s) const;
     std::wstring cryptOnly() const { return m_cryptOnly; }
@@ -72,6 +115,7 @@ public:
     {
         m_cryptOnly = c;
         UpdateVec(m_cryptOnly, m_cryptOnlyVec);
+        UpdateMatcher();
     }
     bool         IsCryptOnly(const std::wstring& s) const;
     std::wstring copyOnly() const { return m_copyOnly; }
@@ -79,8 +123,13 @@ public:
     {
         m_copyOnly = c;
         UpdateVec(m_copyOnly, m_copyOnlyVec);
+        UpdateMatcher();
     }
-    bool IsCopyOnly(const std::wstring& s) const;
+    bool     IsCopyOnly(const std::wstring& s) const;
+    /// returns the PathMatchClass bits of the noSync, cryptOnly and copyOnly patterns that match \c s
+    unsigned Classify(const std::wstring& s) const;
+    /// adds the noSync, cryptOnly and copyOnly patterns to \c matcher
+    void     AddPatterns(CPathMatcher& matcher) const;
 
     friend bool operator<(const PairData& mk1, const PairData& mk2)
     {
@@ -104,28 +153,44 @@ public:
 
 private:
     static void UpdateVec(std::wstring& s, std::vector<std::wstring>& v);
-    static bool MatchInVec(const std::vector<std::wstring>& v, const std::wstring& s);
-
-    std::wstring              m_cryptOnly;
-    std::vector<std::wstring> m_cryptOnlyVec;
-    std::wstring              m_copyOnly;
-    std::vector<std::wstring> m_copyOnlyVec;
-    std::wstring              m_noSync;
-    std::vector<std::wstring> m_noSyncVec;
+    void        UpdateMatcher();
+
+    std::wstring                        m_cryptOnly;
+    std::vector<std::wstring>           m_cryptOnlyVec;
+    std::wstring                        m_copyOnly;
+    std::vector<std::wstring>           m_copyOnlyVec;
+    std::wstring                        m_noSync;
+    std::vector<std::wstring>           m_noSyncVec;
+    std::shared_ptr<const CPathMatcher> m_matcher; ///< compiled patterns, shared between copies of the pair
+    std::shared_ptr<CPairPassword>      m_password;
+    DWORD                               m_storeId = 0; ///< the id the pair is stored with, 0 if it was never saved
+
+    friend class CPairs;
 };
 
 typedef std::vector<PairData> PairVector;
 
 /**
  * class to handle pairs of synced folders
+ *
+ * Every pair is stored in a binary registry value of its own, a versioned
+ * index value lists them in their order. All of them are read at once, and
+ * SavePairs() only writes the pairs that changed.
  */
 class CPairs : public PairVector
 {
 public:
-    CPairs();
+    /// loads the pairs stored below the HKCU key \c regKey. A read only instance
+    /// never writes to the registry, not even to import the old settings
+    explicit CPairs(const std::wstring& regKey = CRYPTSYNC_REGKEY, bool readOnly = false);
     ~CPairs();
 
-    void SavePairs();
+    /// writes the pairs that changed since they were loaded or saved. Returns
+    /// false if that failed, or if the pairs are read only
+    bool SavePairs();
+    /// the pairs are not saved: the instance was created read only, or the
+    /// stored configuration could not be read and must not be overwritten
+    bool IsReadOnly() const { return m_readOnly; }
     bool AddPair(bool                enabled,
                  const std::wstring& orig,
                  const std::wstring& crypt,
@@ -144,12 +209,29 @@ public:
                  bool                ResetOriginalArchAttr);
 
 protected:
-    void InitPairList();
+    void                     InitPairList();
+    /// reads the stored index and the records it lists. Returns false if there's no index,
+    /// a listed record that can't be read leaves \c records without it
+    bool                     ReadStored(std::vector<BYTE>& index, std::map<DWORD, std::vector<BYTE>>& records) const;
+    /// the index of the pairs: their ids in the order of the pairs
+    static std::vector<BYTE> CreateIndex(const std::vector<DWORD>& ids);
+    /// reads the ids of an index, fails if the index is damaged
+    static bool              ParseIndex(const std::vector<BYTE>& index, std::vector<DWORD>& ids, DWORD& version);
+    static std::vector<BYTE> CreateRecord(const PairData& pd);
+    /// reads a pair from its record, fails if the record is damaged
+    static bool              ParseRecord(const std::vector<BYTE>& record, PairData& pd);
+    /// the registry value the record of the pair \c id is stored in
+    static std::wstring      GetRecordName(DWORD id);
+    /// adds the pairs stored in the old registry layout below the HKCU key \c regKey
+    void                     ImportRegistryPairs(const wchar_t* regKey);
+    static std::wstring      Decrypt(const std::wstring& pw);
+    static std::wstring      Encrypt(const std::wstring& pw);
 
 private:
-    bool                AddPair(PairData& pd);
-    std::wstring        Decrypt(const std::wstring& pw) const;
-    static std::wstring Encrypt(const std::wstring& pw);
+    bool AddPair(PairData& pd);
 
-    friend class CPairsTests;
+    std::wstring                       m_regKey;
+    std::vector<BYTE>                  m_savedIndex;   ///< the index as it is stored
+    std::map<DWORD, std::vector<BYTE>> m_savedRecords; ///< the records as they are stored, by the id of their pair
+    bool                               m_readOnly;
 };
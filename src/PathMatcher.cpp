@@ -0,0 +1,228 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+#include "stdafx.h"
+#include "PathMatcher.h"
+
+#include <algorithm>
+
+CPathMatcher::CPathMatcher()
+    : m_allMask(0)
+    , m_hasFullPath(false)
+{
+}
+
+CPathMatcher::~CPathMatcher()
+{
+}
+
+void CPathMatcher::AddPatterns(const std::vector<std::wstring>& patterns, unsigned classMask, bool matchFullPath)
+{
+    Masks masks;
+    masks.element = classMask;
+    masks.path    = matchFullPath ? classMask : 0;
+    for (const auto& pattern : patterns)
+    {
+        if (pattern.empty())
+            continue;
+        std::wstring p = pattern;
+        std::transform(p.begin(), p.end(), p.begin(), ::towlower);
+        // "**" matches the same as "*"
+        p.erase(std::unique(p.begin(), p.end(), [](wchar_t a, wchar_t b) { return (a == '*') && (b == '*'); }), p.end());
+        AddPattern(p, masks);
+        m_allMask |= classMask;
+        m_hasFullPath = m_hasFullPath || matchFullPath;
+    }
+    CAutoWriteLock locker(m_cacheGuard);
+    m_dirCache.clear();
+}
+
+void CPathMatcher::AddPattern(const std::wstring& pattern, const Masks& masks)
+{
+    auto firstWild = pattern.find_first_of(L"*?");
+    if (firstWild == std::wstring::npos)
+    {
+        m_literals[pattern] |= masks;
+        return;
+    }
+    if (pattern == L"*")
+    {
+        m_anyMask |= masks;
+        return;
+    }
+    auto lastWild = pattern.find_last_of(L"*?");
+    if ((firstWild == 0) && (lastWild == 0) && (pattern[0] == '*'))
+    {
+        auto suffix = pattern.substr(1);
+        m_suffixes[suffix] |= masks;
+        if (std::ranges::find(m_suffixLengths, suffix.size()) == m_suffixLengths.end())
+            m_suffixLengths.push_back(suffix.size());
+        return;
+    }
+    if ((firstWild == pattern.size() - 1) && (pattern.back() == '*'))
+    {
+        auto prefix = pattern.substr(0, pattern.size() - 1);
+        m_prefixes[prefix] |= masks;
+        if (std::ranges::find(m_prefixLengths, prefix.size()) == m_prefixLengths.end())
+            m_prefixLengths.push_back(prefix.size());
+        return;
+    }
+
+    // all other patterns become part of the glob automaton:
+    // one state per pattern char, followed by the accepting state
+    m_globStarts.push_back(m_globStates.size());
+    for (auto c : pattern)
+        m_globStates.push_back({c, 0});
+    m_globStates.push_back({0, m_globMasks.size()});
+    m_globMasks.push_back(masks);
+}
+
+unsigned CPathMatcher::Match(const std::wstring& path) const
+{
+    if (m_allMask == 0)
+        return PathMatchNone;
+
+    std::wstring sCmp = path;
+    std::transform(sCmp.begin(), sCmp.end(), sCmp.begin(), ::towlower);
+
+    unsigned result = PathMatchNone;
+    if (m_hasFullPath)
+        result |= MatchString(sCmp).path;
+
+    auto pos = sCmp.find_last_of('\\');
+    if (pos == std::wstring::npos)
+        return result | MatchString(sCmp).element;
+
+    result |= GetDirMask(sCmp.substr(0, pos));
+    if ((result != m_allMask) && (pos + 1 < sCmp.size()))
+        result |= MatchString(sCmp.substr(pos + 1)).element;
+    return result;
+}
+
+bool CPathMatcher::WildcardMatch(const std::wstring& pattern, const std::wstring& s)
+{
+    CPathMatcher matcher;
+    matcher.AddPatterns({pattern}, PathMatchIgnored, false);
+    std::wstring sCmp = s;
+    std::transform(sCmp.begin(), sCmp.end(), sCmp.begin(), ::towlower);
+    return matcher.MatchString(sCmp).element != 0;
+}
+
+unsigned CPathMatcher::GetDirMask(const std::wstring& dir) const
+{
+    if (dir.empty())
+        return PathMatchNone;
+    {
+        CAutoReadLock locker(m_cacheGuard);
+        auto          it = m_dirCache.find(dir);
+        if (it != m_dirCache.end())
+            return it->second;
+    }
+
+    // a directory inherits the result of its parent directory
+    unsigned mask = PathMatchNone;
+    auto     pos  = dir.find_last_of('\\');
+    if (pos != std::wstring::npos)
+        mask = GetDirMask(dir.substr(0, pos));
+    auto name = (pos == std::wstring::npos) ? dir : dir.substr(pos + 1);
+    if (!name.empty() && (mask != m_allMask))
+        mask |= MatchString(name).element;
+
+    CAutoWriteLock locker(m_cacheGuard);
+    if (m_dirCache.size() >= PATHMATCHER_MAX_CACHED_DIRS)
+        m_dirCache.clear();
+    m_dirCache[dir] = mask;
+    return mask;
+}
+
+CPathMatcher::Masks CPathMatcher::MatchString(const std::wstring& s) const
+{
+    Masks masks = m_anyMask;
+    if (!m_literals.empty())
+    {
+        auto it = m_literals.find(s);
+        if (it != m_literals.end())
+            masks |= it->second;
+    }
+    for (auto len : m_suffixLengths)
+    {
+        if (len > s.size())
+            continue;
+        auto it = m_suffixes.find(s.substr(s.size() - len));
+        if (it != m_suffixes.end())
+            masks |= it->second;
+    }
+    for (auto len : m_prefixLengths)
+    {
+        if (len > s.size())
+            continue;
+        auto it = m_prefixes.find(s.substr(0, len));
+        if (it != m_prefixes.end())
+            masks |= it->second;
+    }
+    if (!m_globStarts.empty())
+        masks |= MatchGlobs(s);
+    return masks;
+}
+
+CPathMatcher::Masks CPathMatcher::MatchGlobs(const std::wstring& s) const
+{
+    // simulates the automaton of all glob patterns in parallel:
+    // the set of active states is advanced once per char of the string
+    std::vector<size_t> current;
+    std::vector<size_t> next;
+    std::vector<size_t> marks(m_globStates.size(), static_cast<size_t>(-1));
+
+    auto addState = [&](std::vector<size_t>& states, size_t state, size_t step) {
+        for (;;)
+        {
+            if (marks[state] == step)
+                return;
+            marks[state] = step;
+            states.push_back(state);
+            if (m_globStates[state].ch != '*')
+                return;
+            // a '*' can also match nothing
+            ++state;
+        }
+    };
+
+    for (auto start : m_globStarts)
+        addState(current, start, 0);
+    for (size_t i = 0; (i < s.size()) && !current.empty(); ++i)
+    {
+        next.clear();
+        for (auto state : current)
+        {
+            auto ch = m_globStates[state].ch;
+            if (ch == '*')
+                addState(next, state, i + 1);
+            else if ((ch != 0) && ((ch == '?') || (ch == s[i])))
+                addState(next, state + 1, i + 1);
+        }
+        std::swap(current, next);
+    }
+
+    Masks masks;
+    for (auto state : current)
+    {
+        if (m_globStates[state].ch == 0)
+            masks |= m_globMasks[m_globStates[state].maskIndex];
+    }
+    return masks;
+}
@@ -0,0 +1,114 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+
+#include "ReaderWriterLock.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/// classification bits returned by CPathMatcher::Match()
+enum PathMatchClass : unsigned
+{
+    PathMatchNone      = 0x00,
+    PathMatchIgnored   = 0x01,
+    PathMatchCryptOnly = 0x02,
+    PathMatchCopyOnly  = 0x04,
+};
+
+/// max number of directories whose results are cached
+constexpr size_t PATHMATCHER_MAX_CACHED_DIRS = 10000;
+
+/**
+ * Matches paths against several lists of wildcard patterns at once.
+ *
+ * Every pattern list is added with the classification bits it stands for;
+ * \c Match() returns the bits of all lists with a pattern that matches the
+ * path. A pattern matches if it matches one element of the path, or, for
+ * lists added with \c matchFullPath, the whole path. The matching is the
+ * same as \c wcswildcmp() on lowercased strings: '*' matches any number
+ * of chars, '?' exactly one.
+ *
+ * The patterns are compiled when they're added: plain names, "*suffix" and
+ * "prefix*" patterns are looked up in hash maps, all other patterns are
+ * evaluated together in one pass over the string.
+ * The results for directories are cached, so for files in the same
+ * directory only the file name needs to be matched.
+ */
+class CPathMatcher
+{
+public:
+    CPathMatcher();
+    ~CPathMatcher();
+
+    CPathMatcher(const CPathMatcher&)            = delete;
+    CPathMatcher& operator=(const CPathMatcher&) = delete;
+
+    /// adds the patterns of a list with the classification \c classMask
+    void        AddPatterns(const std::vector<std::wstring>& patterns, unsigned classMask, bool matchFullPath);
+
+    /// returns the classification bits for \c path
+    unsigned    Match(const std::wstring& path) const;
+
+    bool        IsEmpty() const { return m_allMask == 0; }
+
+    /// matches a single pattern, exactly like \c Match() does for one pattern and one path element
+    static bool WildcardMatch(const std::wstring& pattern, const std::wstring& s);
+
+private:
+    struct Masks
+    {
+        unsigned element = 0; ///< bits for a match of a path element
+        unsigned path    = 0; ///< bits for a match of the whole path
+
+        Masks& operator|=(const Masks& m)
+        {
+            element |= m.element;
+            path |= m.path;
+            return *this;
+        }
+    };
+    struct GlobState
+    {
+        wchar_t ch;        ///< the char to match, '?' for any char, '*' for any number of chars, 0 for the accepting state
+        size_t  maskIndex; ///< for the accepting state: index into m_globMasks
+    };
+
+    void     AddPattern(const std::wstring& pattern, const Masks& masks);
+    Masks    MatchString(const std::wstring& s) const;
+    Masks    MatchGlobs(const std::wstring& s) const;
+    unsigned GetDirMask(const std::wstring& dir) const;
+
+    std::unordered_map<std::wstring, Masks> m_literals;
+    std::unordered_map<std::wstring, Masks> m_prefixes;
+    std::unordered_map<std::wstring, Masks> m_suffixes;
+    std::vector<size_t>                     m_prefixLengths;
+    std::vector<size_t>                     m_suffixLengths;
+    Masks                                   m_anyMask; ///< patterns that match everything, e.g. "*"
+    std::vector<GlobState>                  m_globStates;
+    std::vector<size_t>                     m_globStarts;
+    std::vector<Masks>                      m_globMasks;
+    unsigned                                m_allMask;
+    bool                                    m_hasFullPath;
+
+    mutable CReaderWriterLock                          m_cacheGuard;
+    mutable std::unordered_map<std::wstring, unsigned> m_dirCache;
+};
@@ -20,9 +20,10 @@
 #include "PathWatcher.h"
 #include "DebugOutput.h"
 #include "PathUtils.h"
+#include "SyncTrace.h"
 
-#include <Dbt.h>
 #include <process.h>
+#include <memory>
 #ifdef _DEBUG
 #include <comdef.h>
 #endif
@@ -53,6 +54,10 @@ CPathWatcher::CPathWatcher()
         }
     }
 
+    // the completion port lives as long as the watcher: the watched directories
+    // are associated with it one by one as they're added.
+    m_hCompPort           = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+
     unsigned int threadId = 0;
     m_hThread             = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, 0, ThreadEntry, this, 0, &threadId));
 }
@@ -67,41 +72,124 @@ CPathWatcher::~CPathWatcher()
 void CPathWatcher::Stop()
 {
     InterlockedExchange(&m_bRunning, FALSE);
-    if (m_hCompPort)
-    {
-        PostQueuedCompletionStatus(m_hCompPort, 0, NULL, nullptr);
-        m_hCompPort.CloseHandle();
-    }
+    WakeWorker();
 
     if (m_hThread)
     {
-        // the background thread sleeps for 200ms,
-        // so lets wait for it to finish for 1000 ms.
+        // the background thread wakes up as soon as it gets
+        // the packet posted above, so lets wait for it to finish for 1000 ms.
 
         WaitForSingleObject(m_hThread, 1000);
         m_hThread.CloseHandle();
     }
 }
 
+void CPathWatcher::WakeWorker()
+{
+    if (m_hCompPort)
+        PostQueuedCompletionStatus(m_hCompPort, 0, NULL, nullptr);
+}
+
 bool CPathWatcher::RemovePath(const std::wstring& path)
 {
-    CAutoWriteLock locker(m_guard);
+    {
+        CAutoWriteLock locker(m_guard);
 
-    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": RemovePath for %s\n"), path.c_str());
-    bool bRet = (watchedPaths.erase(CPathUtils::AdjustForMaxPath(path)) != 0);
-    m_hCompPort.CloseHandle();
-    return bRet;
+        CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": RemovePath for %s\n"), path.c_str());
+        auto it = m_watchedPaths.find(CPathUtils::AdjustForMaxPath(path));
+        if (it == m_watchedPaths.end())
+            return false;
+        if (it->second.pInfo)
+        {
+            // the info object is deleted by the worker thread once the aborted read completes
+            it->second.pInfo->m_cancelled = true;
+            CancelIoEx(it->second.pInfo->m_hDir, &it->second.pInfo->m_overlapped);
+        }
+        m_watchedPaths.erase(it);
+    }
+    WakeWorker();
+    return true;
 }
 
 bool CPathWatcher::AddPath(const std::wstring& path)
 {
-    CAutoWriteLock locker(m_guard);
-    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": AddPath for %s\n"), path.c_str());
-    watchedPaths.insert(CPathUtils::AdjustForMaxPath(path));
-    m_hCompPort.CloseHandle();
+    {
+        CAutoWriteLock locker(m_guard);
+        CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": AddPath for %s\n"), path.c_str());
+        if (!m_watchedPaths.try_emplace(CPathUtils::AdjustForMaxPath(path)).second)
+            return false;
+    }
+    WakeWorker();
     return true;
 }
 
+void CPathWatcher::SetPaths(const std::set<std::wstring>& paths)
+{
+    std::set<std::wstring> newPaths;
+    for (const auto& path : paths)
+        newPaths.insert(CPathUtils::AdjustForMaxPath(path));
+
+    bool bChanged = false;
+    {
+        CAutoWriteLock locker(m_guard);
+        for (auto it = m_watchedPaths.begin(); it != m_watchedPaths.end();)
+        {
+            if (newPaths.contains(it->first))
+            {
+                ++it;
+                continue;
+            }
+            CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": RemovePath for %s\n"), it->first.c_str());
+            if (it->second.pInfo)
+            {
+                it->second.pInfo->m_cancelled = true;
+                CancelIoEx(it->second.pInfo->m_hDir, &it->second.pInfo->m_overlapped);
+            }
+            it       = m_watchedPaths.erase(it);
+            bChanged = true;
+        }
+        for (const auto& path : newPaths)
+        {
+            if (m_watchedPaths.try_emplace(path).second)
+            {
+                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": AddPath for %s\n"), path.c_str());
+                bChanged = true;
+            }
+        }
+    }
+    if (bChanged)
+        WakeWorker();
+}
+
+size_t CPathWatcher::GetNumberOfWatchedPaths()
+{
+    CAutoReadLock locker(m_guard);
+    size_t        count = 0;
+    for (const auto& [path, watched] : m_watchedPaths)
+    {
+        if (watched.health == WatchHealth::Active)
+            ++count;
+    }
+    return count;
+}
+
+std::vector<WatchStatus> CPathWatcher::GetWatchStatus()
+{
+    CAutoReadLock            locker(m_guard);
+    std::vector<WatchStatus> status;
+    auto                     now = GetTickCount64();
+    for (const auto& [path, watched] : m_watchedPaths)
+    {
+        WatchStatus ws;
+        ws.path       = path;
+        ws.health     = watched.health;
+        ws.lastError  = watched.lastError;
+        ws.retryDelay = (watched.health == WatchHealth::Unavailable) && (watched.nextRetry > now) ? watched.nextRetry - now : 0;
+        status.push_back(ws);
+    }
+    return status;
+}
+
 unsigned int CPathWatcher::ThreadEntry(void* pContext)
 {
     static_cast<CPathWatcher*>(pContext)->WorkerThread();
@@ -110,202 +198,241 @@ unsigned int CPathWatcher::ThreadEntry(void* pContext)
 
 void CPathWatcher::WorkerThread()
 {
-    DWORD          lasterr;
-    DWORD          numBytes;
-    CDirWatchInfo* pdi = nullptr;
-    LPOVERLAPPED   lpOverlapped;
+    DWORD        numBytes     = 0;
+    ULONG_PTR    key          = 0;
+    LPOVERLAPPED lpOverlapped = nullptr;
     while (m_bRunning)
     {
-        if (!watchedPaths.empty())
+        UpdateWatches();
+
+        BOOL bRet = GetQueuedCompletionStatus(m_hCompPort, &numBytes, &key, &lpOverlapped, GetWaitTimeout());
+        if (!m_bRunning)
+            return;
+        if (lpOverlapped == nullptr)
         {
-            if (!m_hCompPort || !GetQueuedCompletionStatus(m_hCompPort,
-                                                           &numBytes,
-                                                           reinterpret_cast<PULONG_PTR>(&pdi),
-                                                           &lpOverlapped,
-                                                           INFINITE))
+            // either a wake up packet (paths added/removed), or the timeout
+            // for retrying paths that could not be watched
+            if (!bRet && (GetLastError() != WAIT_TIMEOUT))
             {
-                // Error retrieving changes
-                // Clear the list of watched objects and recreate that list
-                if (!m_bRunning)
-                    return;
-
-                lasterr = GetLastError();
+                // the completion port itself failed: we don't want to have this
+                // thread running using 100% CPU if something goes completely wrong.
+                Sleep(200);
+            }
+            continue;
+        }
 
-                {
-                    CAutoWriteLock locker(m_guard);
-                    ClearInfoMap();
-                }
+        CDirWatchInfo* pdi     = reinterpret_cast<CDirWatchInfo*>(key);
+        DWORD          lasterr = bRet ? ERROR_SUCCESS : GetLastError();
+        if (!bRet)
+        {
+            CAutoWriteLock locker(m_guard);
+            if (!pdi->m_cancelled)
+            {
 #ifdef _DEBUG
-                if (m_hCompPort)
-                {
-                    _com_error comError(lasterr);
-                    LPCTSTR    comErrorText = comError.ErrorMessage();
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": GetQueuedCompletionStatus (%s) \n"), comErrorText);
-                }
+                _com_error comError(lasterr);
+                LPCTSTR    comErrorText = comError.ErrorMessage();
+                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": GetQueuedCompletionStatus (%s) for watched folder \"%s\"\n"), comErrorText, pdi->m_dirPath.c_str());
 #endif
-                if ((m_hCompPort) && (lasterr != ERROR_SUCCESS) && (lasterr != ERROR_INVALID_HANDLE))
-                {
-                    m_hCompPort.CloseHandle();
-                }
-                CAutoReadLock locker(m_guard);
-                for (auto p = watchedPaths.cbegin(); p != watchedPaths.cend(); ++p)
-                {
-                    CAutoFile hDir = CreateFile(p->c_str(),
-                                                FILE_LIST_DIRECTORY,
-                                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-                                                nullptr, // security attributes
-                                                OPEN_EXISTING,
-                                                FILE_FLAG_BACKUP_SEMANTICS | // required privileges: SE_BACKUP_NAME and SE_RESTORE_NAME.
-                                                    FILE_FLAG_OVERLAPPED,
-                                                nullptr);
-                    if (!hDir)
-                    {
-                        // this could happen if a watched folder has been removed/renamed
-                        m_hCompPort.CloseHandle();
-                        CAutoWriteLock lockerW(m_guard);
-                        watchedPaths.erase(p);
-                        break;
-                    }
-
-                    auto pDirInfo = std::make_unique<CDirWatchInfo>(std::move(hDir), p->c_str());
-                    m_hCompPort   = CreateIoCompletionPort(pDirInfo->m_hDir, m_hCompPort, reinterpret_cast<ULONG_PTR>(pDirInfo.get()), 0);
-                    if (m_hCompPort == NULL)
-                    {
-                        CAutoWriteLock lockerW(m_guard);
-                        ClearInfoMap();
-                        watchedPaths.erase(p);
-                        break;
-                    }
-                    SecureZeroMemory(pDirInfo->m_buffer, sizeof(pDirInfo->m_buffer));
-                    SecureZeroMemory(&pDirInfo->m_overlapped, sizeof(pDirInfo->m_overlapped));
-                    if (!ReadDirectoryChangesW(pDirInfo->m_hDir,
-                                               pDirInfo->m_buffer,
-                                               READ_DIR_CHANGE_BUFFER_SIZE,
-                                               TRUE,
-                                               FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
-                                               &numBytes, // not used
-                                               &pDirInfo->m_overlapped,
-                                               nullptr)) // no completion routine!
-                    {
-                        CAutoWriteLock lockerW(m_guard);
-                        ClearInfoMap();
-                        watchedPaths.erase(p);
-                        break;
-                    }
-                    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": watching path %s\n"), p->c_str());
-                    CAutoWriteLock lockerW(m_guard);
-                    m_watchInfoMap[pDirInfo->m_hDir] = pDirInfo.get();
-                    pDirInfo.release();
-                }
+                // only this path failed (removed, renamed, drive disconnected):
+                // all other watches keep running.
+                auto it = m_watchedPaths.find(pdi->m_dirName);
+                if ((it != m_watchedPaths.end()) && (it->second.pInfo == pdi))
+                    SetUnavailable(it->second, lasterr);
             }
-            else
+            m_watchInfos.erase(pdi);
+            delete pdi;
+            continue;
+        }
+
+        // NOTE: the longer this code takes to execute until ReadDirectoryChangesW
+        // is called again, the higher the chance that we miss some
+        // changes in the file system!
+        if (numBytes != 0)
+        {
+            CTraceSpan               span("WatcherDispatch", "watcher", pdi->m_dirPath);
+            PFILE_NOTIFY_INFORMATION pnotify = reinterpret_cast<PFILE_NOTIFY_INFORMATION>(pdi->m_buffer);
+            DWORD                    nOffset;
+            do
             {
-                if (!m_bRunning)
-                    return;
-                // NOTE: the longer this code takes to execute until ReadDirectoryChangesW
-                // is called again, the higher the chance that we miss some
-                // changes in the file system!
-                if (pdi)
+                size_t bufferSize = pdi->m_dirPath.size() + (pnotify->FileNameLength / sizeof(pnotify->FileName[0])) + 1;
+                auto   buf        = std::make_unique<wchar_t[]>(bufferSize);
+                nOffset           = pnotify->NextEntryOffset;
+                auto action       = pnotify->Action;
+
+                if (reinterpret_cast<ULONG_PTR>(pnotify) - reinterpret_cast<ULONG_PTR>(pdi->m_buffer) > READ_DIR_CHANGE_BUFFER_SIZE)
+                    break;
+
+                wcscpy_s(buf.get(), bufferSize, pdi->m_dirPath.c_str());
+
+                // pnotify->FileName is not null terminated, the second argument to wcsncat_s limits the number of characters
+                // concatenated and the last parameter forces truncation; STRUNCATE, the expected return value since buf is allocated
+                // accordingly, is a valid return value.
+                // errno_t err     = wcsncat_s(buf.get() + pdi->m_dirPath.size(), min(pnotify->FileNameLength / sizeof(pnotify->FileName[0]) + 1, bufferSize - pdi->m_dirPath.size()), pnotify->FileName, _TRUNCATE);
+                // Above code may do a one-wchar_t source buffer read overrun on m_buffer, we can either declare m_buffer as "READ_DIR_CHANGE_BUFFER_SIZE + sizeof(wchar_t)" bytes
+                // or use memmove_s() to prevent source buffer overrun
+
+                errno_t err         = wmemmove_s(buf.get() + pdi->m_dirPath.size(),
+                                                 min(pnotify->FileNameLength / sizeof(pnotify->FileName[0]), bufferSize - pdi->m_dirPath.size()),
+                                                 pnotify->FileName,
+                                                 pnotify->FileNameLength / sizeof(pnotify->FileName[0]));
+
+                buf[bufferSize - 1] = 0;
+                pnotify             = reinterpret_cast<PFILE_NOTIFY_INFORMATION>(reinterpret_cast<LPBYTE>(pnotify) + nOffset);
+                if (err != 0)
                 {
-                    if (numBytes != 0)
-                    {
-                        PFILE_NOTIFY_INFORMATION pnotify = reinterpret_cast<PFILE_NOTIFY_INFORMATION>(pdi->m_buffer);
-                        DWORD                    nOffset;
-                        do
-                        {
-                            size_t bufferSize = pdi->m_dirPath.size() + (pnotify->FileNameLength / sizeof(pnotify->FileName[0])) + 1;
-                            auto   buf        = std::make_unique<wchar_t[]>(bufferSize);
-                            nOffset           = pnotify->NextEntryOffset;
-                            auto action       = pnotify->Action;
-
-                            if (reinterpret_cast<ULONG_PTR>(pnotify) - reinterpret_cast<ULONG_PTR>(pdi->m_buffer) > READ_DIR_CHANGE_BUFFER_SIZE)
-                                break;
-
-                            wcscpy_s(buf.get(), bufferSize, pdi->m_dirPath.c_str());
-
-                            // pnotify->FileName is not null terminated, the second argument to wcsncat_s limits the number of characters
-                            // concatenated and the last parameter forces truncation; STRUNCATE, the expected return value since buf is allocated
-                            // accordingly, is a valid return value.
-                            // errno_t err     = wcsncat_s(buf.get() + pdi->m_dirPath.size(), min(pnotify->FileNameLength / sizeof(pnotify->FileName[0]) + 1, bufferSize - pdi->m_dirPath.size()), pnotify->FileName, _TRUNCATE);
-                            // Above code may do a one-wchar_t source buffer read overrun on m_buffer, we can either declare m_buffer as "READ_DIR_CHANGE_BUFFER_SIZE + sizeof(wchar_t)" bytes
-                            // or use memmove_s() to prevent source buffer overrun
-
-                            errno_t err         = wmemmove_s(buf.get() + pdi->m_dirPath.size(),
-                                                             min(pnotify->FileNameLength / sizeof(pnotify->FileName[0]), bufferSize - pdi->m_dirPath.size()),
-                                                             pnotify->FileName,
-                                                             pnotify->FileNameLength / sizeof(pnotify->FileName[0]));
-
-                            buf[bufferSize - 1] = 0;
-                            pnotify = reinterpret_cast<PFILE_NOTIFY_INFORMATION>(reinterpret_cast<LPBYTE>(pnotify) + nOffset);
-                            if (err != 0)
-                            {
-                                continue;
-                            }
-                            CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": change notification for %s (Action:%d)\n"), buf.get(), action);
-                            {
-                                CAutoWriteLock locker(m_guard);
-                                m_changedPaths.insert(std::wstring(buf.get()));
-                            }
-                        } while (nOffset);
-                    }
-                    else
-                    {
-#ifdef _DEBUG
-                        if (m_hCompPort)
-                        {
-                            lasterr = GetLastError();
-                            _com_error comError(lasterr);
-                            LPCTSTR    comErrorText = comError.ErrorMessage();
-                            CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": GetQueuedCompletionStatus returned zero numBytes (%s) for watched folder \"%s\"\n"), comErrorText, pdi->m_dirPath.c_str());
-                        }
-#endif
-                    }
-                    SecureZeroMemory(pdi->m_buffer, sizeof(pdi->m_buffer));
-                    SecureZeroMemory(&pdi->m_overlapped, sizeof(pdi->m_overlapped));
-                    if (!ReadDirectoryChangesW(pdi->m_hDir,
-                                               pdi->m_buffer,
-                                               READ_DIR_CHANGE_BUFFER_SIZE,
-                                               TRUE,
-                                               FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
-                                               /*
-                                                    Warning: including FILE_NOTIFY_CHANGE_ATTRIBUTES below would
-                                                             result in notifications when we change the "index"
-                                                             on target file or "archive" on source
-                                               */
-                                               &numBytes, // not used
-                                               &pdi->m_overlapped,
-                                               nullptr)) // no completion routine!
-                    {
-                        // Since the call to ReadDirectoryChangesW failed, just
-                        // wait a while. We don't want to have this thread
-                        // running using 100% CPU if something goes completely
-                        // wrong.
-                        Sleep(200);
-                    }
+                    continue;
                 }
-            }
-        } // if (watchedPaths.GetCount())
+                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": change notification for %s (Action:%d)\n"), buf.get(), action);
+                AddChangedPath(buf.get());
+            } while (nOffset);
+        }
         else
-            Sleep(200);
+        {
+#ifdef _DEBUG
+            CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": GetQueuedCompletionStatus returned zero numBytes for watched folder \"%s\"\n"), pdi->m_dirPath.c_str());
+#endif
+        }
+
+        CAutoWriteLock locker(m_guard);
+        if (pdi->m_cancelled)
+        {
+            // the path was removed while we processed the notifications
+            m_watchInfos.erase(pdi);
+            delete pdi;
+            continue;
+        }
+        if (!pdi->StartRead())
+        {
+            lasterr = GetLastError();
+            auto it = m_watchedPaths.find(pdi->m_dirName);
+            if ((it != m_watchedPaths.end()) && (it->second.pInfo == pdi))
+                SetUnavailable(it->second, lasterr);
+            m_watchInfos.erase(pdi);
+            delete pdi;
+        }
     } // while (m_bRunning)
 }
 
-void CPathWatcher::ClearInfoMap()
+void CPathWatcher::UpdateWatches()
 {
-    if (!m_watchInfoMap.empty())
+    std::vector<std::wstring> pathsToWatch;
     {
+        CAutoReadLock locker(m_guard);
+        auto          now = GetTickCount64();
+        for (const auto& [path, watched] : m_watchedPaths)
+        {
+            if (watched.pInfo)
+                continue;
+            if ((watched.health == WatchHealth::Unavailable) && (now < watched.nextRetry))
+                continue;
+            pathsToWatch.push_back(path);
+        }
+    }
+
+    // opening the directories is done without holding the lock: for paths
+    // on network drives that are not reachable, this can take a long time.
+    for (const auto& path : pathsToWatch)
+    {
+        DWORD     lasterr = ERROR_SUCCESS;
+        CAutoFile hDir    = CreateFile(path.c_str(),
+                                       FILE_LIST_DIRECTORY,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                       nullptr, // security attributes
+                                       OPEN_EXISTING,
+                                       FILE_FLAG_BACKUP_SEMANTICS | // required privileges: SE_BACKUP_NAME and SE_RESTORE_NAME.
+                                           FILE_FLAG_OVERLAPPED,
+                                       nullptr);
+        std::unique_ptr<CDirWatchInfo> pDirInfo;
+        if (!hDir)
+            lasterr = GetLastError();
+        else
+        {
+            pDirInfo = std::make_unique<CDirWatchInfo>(std::move(hDir), path);
+            if (CreateIoCompletionPort(pDirInfo->m_hDir, m_hCompPort, reinterpret_cast<ULONG_PTR>(pDirInfo.get()), 0) == NULL)
+            {
+                lasterr = GetLastError();
+                pDirInfo.reset();
+            }
+        }
+
         CAutoWriteLock locker(m_guard);
-        for (std::map<HANDLE, CDirWatchInfo*>::iterator I = m_watchInfoMap.begin(); I != m_watchInfoMap.end(); ++I)
+        auto           it = m_watchedPaths.find(path);
+        if ((it == m_watchedPaths.end()) || it->second.pInfo)
+            continue; // removed in the meantime
+        if (pDirInfo && !pDirInfo->StartRead())
+        {
+            lasterr = GetLastError();
+            pDirInfo.reset();
+        }
+        if (!pDirInfo)
         {
-            CPathWatcher::CDirWatchInfo* info = I->second;
-            delete info;
-            info = nullptr;
+            // this could happen if a watched folder has been removed/renamed,
+            // or if the drive isn't ready yet
+            CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": failed to watch path %s (error %d)\n"), path.c_str(), lasterr);
+            SetUnavailable(it->second, lasterr);
+            continue;
         }
+        CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": watching path %s\n"), path.c_str());
+        it->second.health     = WatchHealth::Active;
+        it->second.lastError  = ERROR_SUCCESS;
+        it->second.retryDelay = 0;
+        it->second.pInfo      = pDirInfo.get();
+        m_watchInfos.insert(pDirInfo.release());
+    }
+}
+
+void CPathWatcher::SetUnavailable(WatchedPath& watched, DWORD error)
+{
+    watched.health     = WatchHealth::Unavailable;
+    watched.lastError  = error;
+    watched.pInfo      = nullptr;
+    watched.retryDelay = GetNextRetryDelay(watched.retryDelay);
+    watched.nextRetry  = GetTickCount64() + watched.retryDelay;
+}
+
+ULONGLONG CPathWatcher::GetNextRetryDelay(ULONGLONG retryDelay)
+{
+    return retryDelay ? min(retryDelay * 2, static_cast<ULONGLONG>(WATCH_RETRY_MAX_DELAY)) : WATCH_RETRY_MIN_DELAY;
+}
+
+DWORD CPathWatcher::GetWaitTimeout()
+{
+    CAutoReadLock locker(m_guard);
+    auto          now     = GetTickCount64();
+    DWORD         timeout = INFINITE;
+    for (const auto& [path, watched] : m_watchedPaths)
+    {
+        if (watched.pInfo || (watched.health != WatchHealth::Unavailable))
+            continue;
+        DWORD wait = watched.nextRetry > now ? static_cast<DWORD>(watched.nextRetry - now) : 0;
+        timeout    = min(timeout, wait);
     }
-    m_watchInfoMap.clear();
+    return timeout;
+}
+
+void CPathWatcher::ClearInfoMap()
+{
+    for (auto* info : m_watchInfos)
+        delete info;
+    m_watchInfos.clear();
+    for (auto& [path, watched] : m_watchedPaths)
+        watched.pInfo = nullptr;
     m_hCompPort.CloseHandle();
 }
 
+void CPathWatcher::AddChangedPath(const std::wstring& path)
+{
+    std::function<bool(const std::wstring&)> eventFilter;
+    {
+        CAutoReadLock locker(m_guard);
+        eventFilter = m_eventFilter;
+    }
+    if (eventFilter && eventFilter(path))
+        return;
+    CAutoWriteLock locker(m_guard);
+    m_changedPaths.insert(path);
+}
+
 std::set<std::wstring> CPathWatcher::GetChangedPaths()
 {
     CAutoWriteLock         locker(m_guard);
@@ -317,6 +444,7 @@ std::set<std::wstring> CPathWatcher::GetChangedPaths()
 CPathWatcher::CDirWatchInfo::CDirWatchInfo(CAutoFile&& hDir, const std::wstring& directoryName)
     : m_hDir(std::move(hDir))
     , m_dirName(directoryName)
+    , m_cancelled(false)
 {
     reinterpret_cast<PFILE_NOTIFY_INFORMATION>(m_buffer)->NextEntryOffset = 0;
     SecureZeroMemory(&m_overlapped, sizeof(m_overlapped));
@@ -334,3 +462,23 @@ bool CPathWatcher::CDirWatchInfo::CloseDirectoryHandle()
 {
     return m_hDir.CloseHandle();
 }
+
+bool CPathWatcher::CDirWatchInfo::StartRead()
+{
+    DWORD numBytes = 0;
+    SecureZeroMemory(m_buffer, sizeof(m_buffer));
+    SecureZeroMemory(&m_overlapped, sizeof(m_overlapped));
+    return !!ReadDirectoryChangesW(m_hDir,
+                                   m_buffer,
+                                   READ_DIR_CHANGE_BUFFER_SIZE,
+                                   TRUE,
+                                   FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                   /*
+                                        Warning: including FILE_NOTIFY_CHANGE_ATTRIBUTES below would
+                                                 result in notifications when we change the "index"
+                                                 on target file or "archive" on source
+                                   */
+                                   &numBytes, // not used
+                                   &m_overlapped,
+                                   nullptr); // no completion routine!
+}
@@ -24,9 +24,28 @@
 #include <string>
 #include <set>
 #include <map>
+#include <vector>
+#include <functional>
 
 constexpr auto READ_DIR_CHANGE_BUFFER_SIZE = 4096;
 constexpr auto MAX_CHANGED_PATHS           = 4000;
+constexpr auto WATCH_RETRY_MIN_DELAY       = 2000;
+constexpr auto WATCH_RETRY_MAX_DELAY       = 5 * 60000;
+
+enum class WatchHealth
+{
+    Pending,     ///< added, but not yet watched
+    Active,      ///< ReadDirectoryChangesW is running for the path
+    Unavailable, ///< the path could not be watched, retried with exponential backoff
+};
+
+struct WatchStatus
+{
+    std::wstring path;
+    WatchHealth  health;
+    DWORD        lastError;
+    ULONGLONG    retryDelay; ///< ms until the next try to watch an unavailable path
+};
 
 /**
  * \ingroup Utils
@@ -36,8 +55,10 @@ constexpr auto MAX_CHANGED_PATHS           = 4000;
  * waits for file system change notifications.
  * To add folders to the list of watched folders, call \c AddPath().
  *
- * The folders are watched recursively. To prevent having too many folders watched,
- * children of already watched folders are automatically removed from watching.
+ * Every path is watched on its own: adding or removing a path, or one path
+ * becoming unavailable (e.g. a drive that's offline) does not affect the
+ * watches of the other paths, and no notifications for them are lost.
+ * Paths that can't be watched are retried with an exponential backoff.
  */
 class CPathWatcher
 {
@@ -47,63 +68,86 @@ public:
 
     /**
      * Adds a new path to be watched. The path \b must point to a directory.
-     * If the path is already watched because a parent of that path is already
-     * watched recursively, then the new path is just ignored and the method
-     * returns false.
+     * Returns false if the path is already watched.
      */
     bool AddPath(const std::wstring& path);
     /**
-     * Removes a path and all its children from the watched list.
+     * Removes a path from the watched list.
      */
     bool RemovePath(const std::wstring& path);
+    /**
+     * Sets the watched paths: paths not in \c paths are removed, new ones are
+     * added. Paths that are in both lists keep being watched without interruption.
+     */
+    void SetPaths(const std::set<std::wstring>& paths);
 
     /**
      * Removes all watched paths
      */
-    void ClearPaths()
-    {
-        CAutoWriteLock locker(m_guard);
-        watchedPaths.clear();
-        m_hCompPort.CloseHandle();
-    }
+    void ClearPaths() { SetPaths(std::set<std::wstring>()); }
 
     /**
-     * Returns the number of recursively watched paths.
+     * Returns the number of paths that are currently watched successfully.
      */
-    size_t GetNumberOfWatchedPaths() const { return watchedPaths.size(); }
+    size_t GetNumberOfWatchedPaths();
+
+    /**
+     * Returns the state of all paths that were added.
+     */
+    std::vector<WatchStatus> GetWatchStatus();
+
+    /**
+     * Adds a changed path like a change notification does: the event filter
+     * is called for it first. The watching thread calls this for every
+     * notification, changes found some other way can be added as well.
+     */
+    void AddChangedPath(const std::wstring& path);
 
     /**
      * Returns all changed paths since the last call to GetChangedPaths
      */
     std::set<std::wstring> GetChangedPaths();
 
+    /**
+     * Sets a filter that is called from the watching thread for every change
+     * notification as it arrives. If the filter returns true, the path is
+     * not added to the changed paths.
+     */
+    void SetEventFilter(const std::function<bool(const std::wstring&)>& filter)
+    {
+        CAutoWriteLock locker(m_guard);
+        m_eventFilter = filter;
+    }
+
     /**
      * Stops the watching thread.
      */
     void Stop();
 
+    /**
+     * Returns the delay before the next try to watch a path that could not
+     * be watched, \c retryDelay is the delay before the last try or 0.
+     */
+    static ULONGLONG GetNextRetryDelay(ULONGLONG retryDelay);
+
 private:
     static unsigned int __stdcall ThreadEntry(void* pContext);
     void WorkerThread();
 
+    void UpdateWatches();
+    DWORD GetWaitTimeout();
     void ClearInfoMap();
+    void WakeWorker();
 
 private:
-    CReaderWriterLock  m_guard;
-    CAutoGeneralHandle m_hThread;
-    CAutoGeneralHandle m_hCompPort;
-    volatile LONG      m_bRunning;
-
-    std::set<std::wstring> watchedPaths; ///< list of watched paths.
-
     /**
      * Helper class: provides information about watched directories.
      */
     class CDirWatchInfo
     {
     private:
-        CDirWatchInfo()                       = delete;
-        CDirWatchInfo(const CDirWatchInfo& i) = delete;
+        CDirWatchInfo()                                    = delete;
+        CDirWatchInfo(const CDirWatchInfo& i)              = delete;
         CDirWatchInfo& operator=(const CDirWatchInfo& rhs) = delete;
 
     public:
@@ -112,17 +156,36 @@ private:
 
     public:
         bool CloseDirectoryHandle();
+        bool StartRead();
 
         CAutoFile    m_hDir;                                ///< handle to the directory that we're watching
         std::wstring m_dirName;                             ///< the directory that we're watching
         __declspec(align(sizeof(DWORD)))                    ///< buffer must be DWORD-aligned as per doc
         CHAR         m_buffer[READ_DIR_CHANGE_BUFFER_SIZE]; ///< buffer for ReadDirectoryChangesW
         OVERLAPPED   m_overlapped;
-        std::wstring m_dirPath; ///< the directory name we're watching with a backslash at the end
+        std::wstring m_dirPath;   ///< the directory name we're watching with a backslash at the end
+        bool         m_cancelled; ///< the watch was removed, waiting for the aborted read to complete
     };
 
-    std::map<HANDLE, CDirWatchInfo*> m_watchInfoMap;
+    struct WatchedPath
+    {
+        WatchHealth    health     = WatchHealth::Pending;
+        DWORD          lastError  = 0;
+        ULONGLONG      retryDelay = 0;
+        ULONGLONG      nextRetry  = 0;
+        CDirWatchInfo* pInfo      = nullptr;
+    };
+
+    static void SetUnavailable(WatchedPath& watched, DWORD error);
+
+    CReaderWriterLock  m_guard;
+    CAutoGeneralHandle m_hThread;
+    CAutoGeneralHandle m_hCompPort;
+    volatile LONG      m_bRunning;
+
+    std::map<std::wstring, WatchedPath> m_watchedPaths; ///< list of watched paths.
+    std::set<CDirWatchInfo*>            m_watchInfos;   ///< all watches with a pending read, including cancelled ones
 
-    HDEVNOTIFY             m_hDev;
-    std::set<std::wstring> m_changedPaths;
+    std::set<std::wstring>                   m_changedPaths;
+    std::function<bool(const std::wstring&)> m_eventFilter;
 };
@@ -0,0 +1,184 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "Platform.h"
+
+#include <cerrno>
+
+namespace
+{
+void AppendUtf8(std::string& out, char32_t cp)
+{
+    if (cp < 0x80)
+        out += static_cast<char>(cp);
+    else if (cp < 0x800)
+    {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+void AppendWide(std::wstring& out, char32_t cp)
+{
+    if constexpr (sizeof(wchar_t) == 2)
+    {
+        if (cp >= 0x10000)
+        {
+            cp -= 0x10000;
+            out += static_cast<wchar_t>(0xD800 + (cp >> 10));
+            out += static_cast<wchar_t>(0xDC00 + (cp & 0x3FF));
+            return;
+        }
+    }
+    out += static_cast<wchar_t>(cp);
+}
+
+/// decodes the code point at pos of a wide string and moves pos past it
+char32_t NextCodePoint(const std::wstring& str, size_t& pos)
+{
+    char32_t cp = static_cast<char32_t>(str[pos++]);
+    if constexpr (sizeof(wchar_t) == 2)
+    {
+        if ((cp >= 0xD800) && (cp < 0xDC00) && (pos < str.size()) && (str[pos] >= 0xDC00) && (str[pos] < 0xE000))
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (static_cast<char32_t>(str[pos++]) - 0xDC00);
+    }
+    return cp;
+}
+} // namespace
+
+std::string CPlatform::ToUtf8(const std::wstring& str)
+{
+    std::string out;
+    out.reserve(str.size());
+    for (size_t pos = 0; pos < str.size();)
+        AppendUtf8(out, NextCodePoint(str, pos));
+    return out;
+}
+
+std::wstring CPlatform::FromUtf8(const std::string& str)
+{
+    std::wstring out;
+    out.reserve(str.size());
+    for (size_t pos = 0; pos < str.size();)
+    {
+        auto     lead   = static_cast<unsigned char>(str[pos++]);
+        char32_t cp     = lead;
+        int      follow = 0;
+        if (lead >= 0xF0 && lead < 0xF8)
+        {
+            cp     = lead & 0x07;
+            follow = 3;
+        }
+        else if (lead >= 0xE0)
+        {
+            cp     = lead & 0x0F;
+            follow = 2;
+        }
+        else if (lead >= 0xC0)
+        {
+            cp     = lead & 0x1F;
+            follow = 1;
+        }
+        else if (lead >= 0x80)
+        {
+            // a continuation byte without a lead byte
+            AppendWide(out, 0xFFFD);
+            continue;
+        }
+        for (; follow > 0; --follow)
+        {
+            if ((pos >= str.size()) || ((static_cast<unsigned char>(str[pos]) & 0xC0) != 0x80))
+            {
+                cp = 0xFFFD;
+                break;
+            }
+            cp = (cp << 6) | (static_cast<unsigned char>(str[pos++]) & 0x3F);
+        }
+        AppendWide(out, cp);
+    }
+    return out;
+}
+
+std::u16string CPlatform::ToUtf16(const std::wstring& str)
+{
+    if constexpr (sizeof(wchar_t) == 2)
+        return std::u16string(str.begin(), str.end());
+    std::u16string out;
+    out.reserve(str.size());
+    for (size_t pos = 0; pos < str.size();)
+    {
+        char32_t cp = NextCodePoint(str, pos);
+        if (cp >= 0x10000)
+        {
+            cp -= 0x10000;
+            out += static_cast<char16_t>(0xD800 + (cp >> 10));
+            out += static_cast<char16_t>(0xDC00 + (cp & 0x3FF));
+        }
+        else
+            out += static_cast<char16_t>(cp);
+    }
+    return out;
+}
+
+std::wstring CPlatform::FromUtf16(const std::u16string& str)
+{
+    if constexpr (sizeof(wchar_t) == 2)
+        return std::wstring(str.begin(), str.end());
+    std::wstring out;
+    out.reserve(str.size());
+    for (size_t pos = 0; pos < str.size(); ++pos)
+    {
+        char32_t cp = str[pos];
+        if ((cp >= 0xD800) && (cp < 0xDC00) && (pos + 1 < str.size()) && (str[pos + 1] >= 0xDC00) && (str[pos + 1] < 0xE000))
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (str[++pos] - 0xDC00);
+        AppendWide(out, cp);
+    }
+    return out;
+}
+
+PlatformError CPlatform::FromErrno(int error)
+{
+    switch (error)
+    {
+        case 0:
+            return PlatformError::None;
+        case ENOENT:
+            return PlatformError::NotFound;
+        case ENOTDIR:
+            return PlatformError::PathNotFound;
+        case EACCES:
+        case EPERM:
+            return PlatformError::AccessDenied;
+        default:
+            return PlatformError::Other;
+    }
+}
@@ -0,0 +1,135 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * The platform abstraction of the sync core.
+ *
+ * The core (name cipher, planner and the tests and benchmarks that run
+ * on every platform) does not call the OS directly but goes through
+ * the file system, crypto and process functions declared here. There is
+ * one backend per platform: PlatformWin32.cpp and PlatformPosix.cpp, the
+ * build picks the one for the target. CMemoryFileSystem is a file system
+ * in memory for the tests and benchmarks.
+ * CFolderSync enumerates, stats, copies, moves and deletes through a
+ * CFileSystem too, but it stays in the Windows build, like C7Zip and the
+ * tests in Tests/test.cpp: the encryption (7-Zip and gpg), the progress
+ * UI and the settings are Win32 only. EncryptFile() and DecryptFile()
+ * work on the files directly, so the encryption needs the native file
+ * system.
+ * Paths are wide strings in the native form of the platform, with
+ * PlatformPathSeparator between the elements.
+ */
+
+#ifdef _WIN32
+constexpr wchar_t PlatformPathSeparator = '\\';
+#else
+constexpr wchar_t PlatformPathSeparator = '/';
+#endif
+
+/// the metadata of a file or folder
+struct PlatformFileInfo
+{
+    uint64_t size       = 0;
+    uint64_t writeTime  = 0; ///< last write time in 100ns ticks since 1601-01-01 UTC, the FILETIME scale on every platform
+    uint64_t createTime = 0; ///< creation time in the same ticks, 0 if the file system doesn't store it
+    uint64_t accessTime = 0; ///< last access time in the same ticks, 0 if the file system doesn't store it
+    uint32_t attributes = 0; ///< the FILE_ATTRIBUTE_* flags on Windows, 0 elsewhere
+    bool     directory  = false;
+    bool     readOnly   = false;
+    bool     hidden     = false;
+};
+
+/// what went wrong in the last failed CFileSystem call
+enum class PlatformError
+{
+    None,
+    NotFound,     ///< the file or folder doesn't exist
+    PathNotFound, ///< a parent folder of the path doesn't exist
+    AccessDenied,
+    Other,
+};
+
+/// called for every entry found by CFileSystem::Enumerate(), return false to stop the enumeration
+using PlatformEnumCallback = std::function<bool(const std::wstring& relPath, const PlatformFileInfo& info)>;
+
+/**
+ * The file system the sync core works on.
+ *
+ * All functions return false on failure, the OS error is left in
+ * errno or GetLastError() for the caller to log. LastError() tells
+ * the errors apart that callers handle, the same way on every backend.
+ */
+class CFileSystem
+{
+public:
+    virtual ~CFileSystem() = default;
+
+    /// the backend for the real file system of the platform
+    static CFileSystem&   Native();
+
+    virtual bool          Stat(const std::wstring& path, PlatformFileInfo& info) const = 0;
+    /// calls callback for every file and folder below path, with the path relative to it; folders come before their content.
+    /// If descend is set, it's called for every folder after callback and the content of the folder is skipped if it returns false.
+    virtual bool          Enumerate(const std::wstring& path, const PlatformEnumCallback& callback, const PlatformEnumCallback& descend = nullptr) const = 0;
+    /// creates the folder and all its missing parents
+    virtual bool          MakeDirs(const std::wstring& path) = 0;
+    /// deletes a file or an empty folder, read-only files too
+    virtual bool          Remove(const std::wstring& path) = 0;
+    /// moves a file, replacing the target if it exists
+    virtual bool          Rename(const std::wstring& from, const std::wstring& to) = 0;
+    /// copies the content and the last write time of a file, replacing the target if it exists
+    virtual bool          Copy(const std::wstring& from, const std::wstring& to) = 0;
+    virtual bool          SetWriteTime(const std::wstring& path, uint64_t writeTime) = 0;
+    virtual bool          ReadContent(const std::wstring& path, std::string& content) const = 0;
+    /// creates or overwrites the file with content
+    virtual bool          WriteContent(const std::wstring& path, const std::string& content) = 0;
+    /// the error of the last failed call on this thread
+    virtual PlatformError LastError() const = 0;
+};
+
+/// the non file system services of the platform
+class CPlatform
+{
+public:
+    /// fills buffer with cryptographically secure random bytes
+    static bool           RandomBytes(void* buffer, size_t size);
+    /// runs application with the arguments in folder cwd and waits for it, returns the exit code or -1 if it could not be started
+    static int            RunProcess(const std::wstring& application, const std::vector<std::wstring>& arguments, const std::wstring& cwd);
+    /// the value of an environment variable, empty if it is not set
+    static std::wstring   GetEnvironment(const std::wstring& name);
+    /// the most physical memory the process used so far, in bytes
+    static uint64_t       PeakMemory();
+    /// a file time in 100ns ticks since 1601-01-01 UTC as local time, in the "dd.mm.yyyy - hh:mm:ss:mmm" form of the log
+    static std::wstring   FormatFileTime(uint64_t fileTime);
+    /// the PlatformError of an errno value
+    static PlatformError  FromErrno(int error);
+
+    static std::string    ToUtf8(const std::wstring& str);
+    static std::wstring   FromUtf8(const std::string& str);
+    /// UTF-16 no matter how wide wchar_t is on the platform
+    static std::u16string ToUtf16(const std::wstring& str);
+    static std::wstring   FromUtf16(const std::u16string& str);
+};
@@ -0,0 +1,356 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "Platform.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cwchar>
+#include <iterator>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+/// seconds between 1601-01-01 and the unix epoch
+constexpr uint64_t UnixEpochOffset = 11644473600ULL;
+constexpr uint64_t TicksPerSecond  = 10000000ULL;
+
+uint64_t ToFileTime(const timespec& ts)
+{
+    return (static_cast<uint64_t>(ts.tv_sec) + UnixEpochOffset) * TicksPerSecond + static_cast<uint64_t>(ts.tv_nsec) / 100;
+}
+
+timespec FromFileTime(uint64_t ft)
+{
+    timespec ts{};
+    ts.tv_sec  = static_cast<time_t>(ft / TicksPerSecond - UnixEpochOffset);
+    ts.tv_nsec = static_cast<long>((ft % TicksPerSecond) * 100);
+    return ts;
+}
+
+void FillInfo(const std::string& name, const struct stat& st, PlatformFileInfo& info)
+{
+    info.size       = S_ISDIR(st.st_mode) ? 0 : static_cast<uint64_t>(st.st_size);
+    info.writeTime  = ToFileTime(st.st_mtim);
+    info.accessTime = ToFileTime(st.st_atim);
+    info.directory  = S_ISDIR(st.st_mode);
+    info.readOnly   = (st.st_mode & S_IWUSR) == 0;
+    auto slashPos   = name.find_last_of('/');
+    info.hidden     = name[slashPos == std::string::npos ? 0 : slashPos + 1] == '.';
+}
+
+bool WriteAll(int fd, const char* data, size_t size)
+{
+    while (size)
+    {
+        auto written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+class CPosixFileSystem : public CFileSystem
+{
+public:
+    bool Stat(const std::wstring& path, PlatformFileInfo& info) const override
+    {
+        auto        name = CPlatform::ToUtf8(path);
+        struct stat st{};
+        if (stat(name.c_str(), &st) != 0)
+            return false;
+        FillInfo(name, st, info);
+        return true;
+    }
+
+    bool Enumerate(const std::wstring& path, const PlatformEnumCallback& callback, const PlatformEnumCallback& descend = nullptr) const override
+    {
+        return EnumerateDir(CPlatform::ToUtf8(path), std::wstring(), callback, descend);
+    }
+
+    bool MakeDirs(const std::wstring& path) override
+    {
+        auto name = CPlatform::ToUtf8(path);
+        for (size_t pos = name.find('/', 1); ; pos = name.find('/', pos + 1))
+        {
+            auto part = name.substr(0, pos);
+            if ((mkdir(part.c_str(), 0777) != 0) && (errno != EEXIST))
+                return false;
+            if (pos == std::string::npos)
+                break;
+        }
+        struct stat st{};
+        return (stat(name.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+    }
+
+    bool Remove(const std::wstring& path) override
+    {
+        auto        name = CPlatform::ToUtf8(path);
+        struct stat st{};
+        if (lstat(name.c_str(), &st) != 0)
+            return false;
+        if (S_ISDIR(st.st_mode))
+            return rmdir(name.c_str()) == 0;
+        return unlink(name.c_str()) == 0;
+    }
+
+    bool Rename(const std::wstring& from, const std::wstring& to) override
+    {
+        if (rename(CPlatform::ToUtf8(from).c_str(), CPlatform::ToUtf8(to).c_str()) == 0)
+            return true;
+        // different file systems: copy and delete like MoveFileEx with MOVEFILE_COPY_ALLOWED does
+        if (errno != EXDEV)
+            return false;
+        return Copy(from, to) && Remove(from);
+    }
+
+    bool Copy(const std::wstring& from, const std::wstring& to) override
+    {
+        auto        src = CPlatform::ToUtf8(from);
+        auto        dst = CPlatform::ToUtf8(to);
+        struct stat st{};
+        int         in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0)
+            return false;
+        if (fstat(in, &st) != 0)
+        {
+            close(in);
+            return false;
+        }
+        int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+        if (out < 0)
+        {
+            close(in);
+            return false;
+        }
+        bool ok = true;
+        char buffer[64 * 1024];
+        for (;;)
+        {
+            auto bytesRead = read(in, buffer, sizeof(buffer));
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead <= 0)
+            {
+                ok = bytesRead == 0;
+                break;
+            }
+            if (!WriteAll(out, buffer, static_cast<size_t>(bytesRead)))
+            {
+                ok = false;
+                break;
+            }
+        }
+        const timespec times[2] = {st.st_atim, st.st_mtim};
+        ok                      = ok && (futimens(out, times) == 0);
+        ok                      = (close(out) == 0) && ok;
+        close(in);
+        return ok;
+    }
+
+    bool SetWriteTime(const std::wstring& path, uint64_t writeTime) override
+    {
+        const timespec times[2] = {{0, UTIME_OMIT}, FromFileTime(writeTime)};
+        return utimensat(AT_FDCWD, CPlatform::ToUtf8(path).c_str(), times, 0) == 0;
+    }
+
+    bool ReadContent(const std::wstring& path, std::string& content) const override
+    {
+        int fd = open(CPlatform::ToUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        content.clear();
+        char buffer[64 * 1024];
+        bool ok = true;
+        for (;;)
+        {
+            auto bytesRead = read(fd, buffer, sizeof(buffer));
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead <= 0)
+            {
+                ok = bytesRead == 0;
+                break;
+            }
+            content.append(buffer, static_cast<size_t>(bytesRead));
+        }
+        close(fd);
+        return ok;
+    }
+
+    bool WriteContent(const std::wstring& path, const std::string& content) override
+    {
+        int fd = open(CPlatform::ToUtf8(path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0)
+            return false;
+        bool ok = WriteAll(fd, content.data(), content.size());
+        return (close(fd) == 0) && ok;
+    }
+
+    PlatformError LastError() const override
+    {
+        return CPlatform::FromErrno(errno);
+    }
+
+private:
+    bool EnumerateDir(const std::string& dir, const std::wstring& relDir, const PlatformEnumCallback& callback, const PlatformEnumCallback& descend) const
+    {
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr)
+            return false;
+        bool ok = true;
+        while (ok)
+        {
+            errno         = 0;
+            dirent* entry = readdir(d);
+            if (entry == nullptr)
+            {
+                ok = errno == 0;
+                break;
+            }
+            std::string name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+            std::string      fullPath = dir + "/" + name;
+            struct stat      st{};
+            PlatformFileInfo info;
+            if (stat(fullPath.c_str(), &st) != 0)
+                continue; // vanished or a dangling link
+            FillInfo(name, st, info);
+            auto relPath = relDir.empty() ? CPlatform::FromUtf8(name) : relDir + PlatformPathSeparator + CPlatform::FromUtf8(name);
+            if (!callback(relPath, info))
+            {
+                closedir(d);
+                return true;
+            }
+            if (info.directory && (!descend || descend(relPath, info)))
+                ok = EnumerateDir(fullPath, relPath, callback, descend);
+        }
+        closedir(d);
+        return ok;
+    }
+};
+} // namespace
+
+CFileSystem& CFileSystem::Native()
+{
+    static CPosixFileSystem fs;
+    return fs;
+}
+
+bool CPlatform::RandomBytes(void* buffer, size_t size)
+{
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    auto* data = static_cast<char*>(buffer);
+    while (size)
+    {
+        auto bytesRead = read(fd, data, size);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        data += bytesRead;
+        size -= static_cast<size_t>(bytesRead);
+    }
+    close(fd);
+    return true;
+}
+
+int CPlatform::RunProcess(const std::wstring& application, const std::vector<std::wstring>& arguments, const std::wstring& cwd)
+{
+    std::vector<std::string> args;
+    args.push_back(ToUtf8(application));
+    for (const auto& arg : arguments)
+        args.push_back(ToUtf8(arg));
+    std::vector<char*> argv;
+    for (auto& arg : args)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+    auto dir = ToUtf8(cwd);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        if (!dir.empty() && chdir(dir.c_str()) != 0)
+            _exit(127);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (!WIFEXITED(status))
+        return -1;
+    // 127 is what the child exits with if the application could not be started
+    return WEXITSTATUS(status) == 127 ? -1 : WEXITSTATUS(status);
+}
+
+std::wstring CPlatform::GetEnvironment(const std::wstring& name)
+{
+    const char* value = getenv(ToUtf8(name).c_str());
+    return value ? FromUtf8(value) : std::wstring();
+}
+
+uint64_t CPlatform::PeakMemory()
+{
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    // kilobytes on Linux and the BSDs
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+std::wstring CPlatform::FormatFileTime(uint64_t fileTime)
+{
+    time_t  seconds = static_cast<time_t>(fileTime / TicksPerSecond) - static_cast<time_t>(UnixEpochOffset);
+    tm      local{};
+    wchar_t buffer[64] = {};
+    localtime_r(&seconds, &local);
+    swprintf(buffer, std::size(buffer), L"%02d.%02d.%02d - %02d:%02d:%02d:%03d",
+             local.tm_mday, local.tm_mon + 1, local.tm_year + 1900,
+             local.tm_hour, local.tm_min, local.tm_sec, static_cast<int>((fileTime % TicksPerSecond) / 10000));
+    return buffer;
+}
@@ -0,0 +1,293 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "Platform.h"
+
+#include <Windows.h>
+#include <wincrypt.h>
+#include <Psapi.h>
+
+namespace
+{
+/// prefixes paths too long for the normal Win32 API, like CPathUtils::AdjustForMaxPath() does
+std::wstring LongPath(const std::wstring& path)
+{
+    if ((path.size() < 248) || path.starts_with(L"\\\\?\\"))
+        return path;
+    if (path.starts_with(L"\\\\"))
+        return L"\\\\?\\UNC" + path.substr(1);
+    return L"\\\\?\\" + path;
+}
+
+uint64_t ToFileTime(const FILETIME& ft)
+{
+    return (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+
+void FillInfo(DWORD attributes, const FILETIME& createTime, const FILETIME& accessTime, const FILETIME& writeTime, DWORD sizeHigh, DWORD sizeLow, PlatformFileInfo& info)
+{
+    info.directory  = (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    info.size       = info.directory ? 0 : ((static_cast<uint64_t>(sizeHigh) << 32) | sizeLow);
+    info.writeTime  = ToFileTime(writeTime);
+    info.createTime = ToFileTime(createTime);
+    info.accessTime = ToFileTime(accessTime);
+    info.attributes = attributes;
+    info.readOnly   = (attributes & FILE_ATTRIBUTE_READONLY) != 0;
+    info.hidden     = (attributes & FILE_ATTRIBUTE_HIDDEN) != 0;
+}
+
+/// quotes an argument the way CommandLineToArgvW splits it again
+std::wstring QuoteArgument(const std::wstring& arg)
+{
+    if (!arg.empty() && (arg.find_first_of(L" \t\"") == std::wstring::npos))
+        return arg;
+    std::wstring quoted      = L"\"";
+    size_t       backslashes = 0;
+    for (auto c : arg)
+    {
+        if (c == '\\')
+        {
+            ++backslashes;
+            continue;
+        }
+        quoted.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+        backslashes = 0;
+        quoted += c;
+    }
+    quoted.append(backslashes * 2, '\\');
+    quoted += '"';
+    return quoted;
+}
+
+class CWin32FileSystem : public CFileSystem
+{
+public:
+    bool Stat(const std::wstring& path, PlatformFileInfo& info) const override
+    {
+        WIN32_FILE_ATTRIBUTE_DATA data{};
+        if (!GetFileAttributesEx(LongPath(path).c_str(), GetFileExInfoStandard, &data))
+            return false;
+        FillInfo(data.dwFileAttributes, data.ftCreationTime, data.ftLastAccessTime, data.ftLastWriteTime, data.nFileSizeHigh, data.nFileSizeLow, info);
+        return true;
+    }
+
+    bool Enumerate(const std::wstring& path, const PlatformEnumCallback& callback, const PlatformEnumCallback& descend = nullptr) const override
+    {
+        bool stopped = false;
+        return EnumerateDir(path, std::wstring(), callback, descend, stopped);
+    }
+
+    bool MakeDirs(const std::wstring& path) override
+    {
+        auto longPath = LongPath(path);
+        if (CreateDirectory(longPath.c_str(), nullptr) || (GetLastError() == ERROR_ALREADY_EXISTS))
+            return true;
+        if (GetLastError() != ERROR_PATH_NOT_FOUND)
+            return false;
+        auto slashPos = path.find_last_of(L"\\/");
+        if ((slashPos == std::wstring::npos) || (slashPos == 0) || !MakeDirs(path.substr(0, slashPos)))
+            return false;
+        return CreateDirectory(longPath.c_str(), nullptr) || (GetLastError() == ERROR_ALREADY_EXISTS);
+    }
+
+    bool Remove(const std::wstring& path) override
+    {
+        auto  longPath   = LongPath(path);
+        DWORD attributes = GetFileAttributes(longPath.c_str());
+        if (attributes == INVALID_FILE_ATTRIBUTES)
+            return false;
+        if (attributes & FILE_ATTRIBUTE_READONLY)
+            SetFileAttributes(longPath.c_str(), attributes & ~FILE_ATTRIBUTE_READONLY);
+        if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+            return RemoveDirectory(longPath.c_str()) != FALSE;
+        return DeleteFile(longPath.c_str()) != FALSE;
+    }
+
+    bool Rename(const std::wstring& from, const std::wstring& to) override
+    {
+        return MoveFileEx(LongPath(from).c_str(), LongPath(to).c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED) != FALSE;
+    }
+
+    bool Copy(const std::wstring& from, const std::wstring& to) override
+    {
+        return CopyFile(LongPath(from).c_str(), LongPath(to).c_str(), FALSE) != FALSE;
+    }
+
+    bool SetWriteTime(const std::wstring& path, uint64_t writeTime) override
+    {
+        HANDLE hFile = CreateFile(LongPath(path).c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+        FILETIME ft{};
+        ft.dwLowDateTime  = static_cast<DWORD>(writeTime);
+        ft.dwHighDateTime = static_cast<DWORD>(writeTime >> 32);
+        BOOL ret          = SetFileTime(hFile, nullptr, nullptr, &ft);
+        CloseHandle(hFile);
+        return ret != FALSE;
+    }
+
+    bool ReadContent(const std::wstring& path, std::string& content) const override
+    {
+        HANDLE hFile = CreateFile(LongPath(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+        content.clear();
+        char  buffer[64 * 1024];
+        DWORD bytesRead = 0;
+        BOOL  ret       = FALSE;
+        while ((ret = ReadFile(hFile, buffer, sizeof(buffer), &bytesRead, nullptr)) != FALSE && bytesRead)
+            content.append(buffer, bytesRead);
+        CloseHandle(hFile);
+        return ret != FALSE;
+    }
+
+    bool WriteContent(const std::wstring& path, const std::string& content) override
+    {
+        HANDLE hFile = CreateFile(LongPath(path).c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+        bool   ok     = true;
+        size_t offset = 0;
+        while (ok && (offset < content.size()))
+        {
+            DWORD toWrite = static_cast<DWORD>(content.size() - offset > 0x40000000 ? 0x40000000 : content.size() - offset);
+            DWORD written = 0;
+            ok            = WriteFile(hFile, content.data() + offset, toWrite, &written, nullptr) != FALSE;
+            offset += written;
+        }
+        ok = (CloseHandle(hFile) != FALSE) && ok;
+        return ok;
+    }
+
+    PlatformError LastError() const override
+    {
+        switch (GetLastError())
+        {
+            case ERROR_SUCCESS:
+                return PlatformError::None;
+            case ERROR_FILE_NOT_FOUND:
+                return PlatformError::NotFound;
+            case ERROR_PATH_NOT_FOUND:
+                return PlatformError::PathNotFound;
+            case ERROR_ACCESS_DENIED:
+                return PlatformError::AccessDenied;
+            default:
+                return PlatformError::Other;
+        }
+    }
+
+private:
+    bool EnumerateDir(const std::wstring& dir, const std::wstring& relDir, const PlatformEnumCallback& callback, const PlatformEnumCallback& descend, bool& stopped) const
+    {
+        WIN32_FIND_DATA findData{};
+        HANDLE          hFind = FindFirstFileEx(LongPath(dir + L"\\*").c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+        if (hFind == INVALID_HANDLE_VALUE)
+            return GetLastError() == ERROR_FILE_NOT_FOUND;
+        bool ok = true;
+        do
+        {
+            std::wstring name = findData.cFileName;
+            if (name == L"." || name == L"..")
+                continue;
+            PlatformFileInfo info;
+            FillInfo(findData.dwFileAttributes, findData.ftCreationTime, findData.ftLastAccessTime, findData.ftLastWriteTime, findData.nFileSizeHigh, findData.nFileSizeLow, info);
+            auto relPath = relDir.empty() ? name : relDir + PlatformPathSeparator + name;
+            if (!callback(relPath, info))
+            {
+                stopped = true;
+                break;
+            }
+            // don't follow junctions and symlinked folders, they can form cycles
+            if (info.directory && ((findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0) && (!descend || descend(relPath, info)))
+                ok = EnumerateDir(dir + L"\\" + name, relPath, callback, descend, stopped);
+        } while (ok && !stopped && FindNextFile(hFind, &findData));
+        if (ok && !stopped && (GetLastError() != ERROR_NO_MORE_FILES))
+            ok = false;
+        FindClose(hFind);
+        return ok;
+    }
+};
+} // namespace
+
+CFileSystem& CFileSystem::Native()
+{
+    static CWin32FileSystem fs;
+    return fs;
+}
+
+bool CPlatform::RandomBytes(void* buffer, size_t size)
+{
+    HCRYPTPROV hProv = NULL;
+    if (!CryptAcquireContext(&hProv, nullptr, nullptr, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+        return false;
+    BOOL ret = CryptGenRandom(hProv, static_cast<DWORD>(size), static_cast<BYTE*>(buffer));
+    CryptReleaseContext(hProv, 0);
+    return ret != FALSE;
+}
+
+int CPlatform::RunProcess(const std::wstring& application, const std::vector<std::wstring>& arguments, const std::wstring& cwd)
+{
+    std::wstring cmdline = QuoteArgument(application);
+    for (const auto& arg : arguments)
+        cmdline += L" " + QuoteArgument(arg);
+
+    STARTUPINFO         si = {sizeof(STARTUPINFO)};
+    PROCESS_INFORMATION pi = {nullptr};
+    if (!CreateProcess(nullptr, cmdline.data(), nullptr, nullptr, FALSE, CREATE_NO_WINDOW | CREATE_UNICODE_ENVIRONMENT, nullptr, cwd.empty() ? nullptr : cwd.c_str(), &si, &pi))
+        return -1;
+    CloseHandle(pi.hThread);
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD exitCode = static_cast<DWORD>(-1);
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+    CloseHandle(pi.hProcess);
+    return static_cast<int>(exitCode);
+}
+
+std::wstring CPlatform::GetEnvironment(const std::wstring& name)
+{
+    DWORD size = GetEnvironmentVariable(name.c_str(), nullptr, 0);
+    if (size == 0)
+        return {};
+    std::wstring value(size, '\0');
+    size = GetEnvironmentVariable(name.c_str(), value.data(), size);
+    value.resize(size);
+    return value;
+}
+
+uint64_t CPlatform::PeakMemory()
+{
+    PROCESS_MEMORY_COUNTERS counters = {sizeof(counters)};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+}
+
+std::wstring CPlatform::FormatFileTime(uint64_t fileTime)
+{
+    FILETIME   ft      = {static_cast<DWORD>(fileTime), static_cast<DWORD>(fileTime >> 32)};
+    SYSTEMTIME stUtc   = {};
+    SYSTEMTIME stLocal = {};
+    FileTimeToSystemTime(&ft, &stUtc);
+    SystemTimeToTzSpecificLocalTime(nullptr, &stUtc, &stLocal);
+    wchar_t buffer[64] = {};
+    swprintf_s(buffer, L"%02d.%02d.%02d - %02d:%02d:%02d:%03d",
+               stLocal.wDay, stLocal.wMonth, stLocal.wYear,
+               stLocal.wHour, stLocal.wMinute, stLocal.wSecond, stLocal.wMilliseconds);
+    return buffer;
+}
@@ -0,0 +1,221 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+#include "stdafx.h"
+#include "SelfWriteTable.h"
+#include "DebugOutput.h"
+
+#include <algorithm>
+
+CSelfWriteTable::CSelfWriteTable(const CFileSystem& fs)
+    : m_fs(fs)
+    , m_generation(0)
+    , m_lastPrune(0)
+    , m_deleteEntries(0)
+    , m_suppressed(0)
+    , m_leaked(0)
+{
+}
+
+CSelfWriteTable::~CSelfWriteTable()
+{
+}
+
+std::wstring CSelfWriteTable::NormalizePath(const std::wstring& path)
+{
+    std::wstring normalized;
+    if (path.starts_with(L"\\\\?\\UNC\\"))
+        normalized = L"\\" + path.substr(7);
+    else if (path.starts_with(L"\\\\?\\"))
+        normalized = path.substr(4);
+    else
+        normalized = path;
+    std::ranges::replace(normalized, '/', '\\');
+    while ((normalized.size() > 3) && (normalized.back() == '\\'))
+        normalized.pop_back();
+    std::ranges::transform(normalized, normalized.begin(), ::towlower);
+    return normalized;
+}
+
+ULONGLONG CSelfWriteTable::BeginWrite(const std::wstring& path)
+{
+    auto           key = NormalizePath(path);
+    auto           now = GetTickCount64();
+    CAutoWriteLock locker(m_guard);
+    PruneExpired(now);
+    auto& entry = m_entries[key];
+    if (entry.type == EntryType::Deleted)
+        --m_deleteEntries;
+    entry.type       = EntryType::Pending;
+    entry.generation = ++m_generation;
+    entry.deadline   = now + SELFWRITE_PENDING_TTL;
+    return entry.generation;
+}
+
+void CSelfWriteTable::CommitWrite(const std::wstring& path, ULONGLONG generation)
+{
+    auto             key = NormalizePath(path);
+    PlatformFileInfo info;
+    bool             bStat = m_fs.Stat(path, info);
+    CAutoWriteLock   locker(m_guard);
+    auto             it = m_entries.find(key);
+    if ((it == m_entries.end()) || (it->second.generation != generation))
+        return; // a newer write for the same path owns the entry now
+    if (!bStat)
+    {
+        m_entries.erase(it);
+        return;
+    }
+    it->second.type      = EntryType::Written;
+    it->second.writeTime = info.writeTime;
+    it->second.size      = info.size;
+    it->second.deadline  = GetTickCount64() + SELFWRITE_TTL;
+}
+
+void CSelfWriteTable::CancelWrite(const std::wstring& path, ULONGLONG generation)
+{
+    auto           key = NormalizePath(path);
+    CAutoWriteLock locker(m_guard);
+    auto           it = m_entries.find(key);
+    if ((it != m_entries.end()) && (it->second.generation == generation))
+        m_entries.erase(it);
+}
+
+void CSelfWriteTable::ExpectDelete(const std::wstring& path)
+{
+    auto           key = NormalizePath(path);
+    auto           now = GetTickCount64();
+    CAutoWriteLock locker(m_guard);
+    PruneExpired(now);
+    auto& entry = m_entries[key];
+    if (entry.type != EntryType::Deleted)
+        ++m_deleteEntries;
+    entry.type       = EntryType::Deleted;
+    entry.generation = ++m_generation;
+    entry.deadline   = now + SELFWRITE_TTL;
+}
+
+bool CSelfWriteTable::IsSelfEvent(const std::wstring& path)
+{
+    std::wstring foundKey;
+    Entry        entry;
+    {
+        CAutoReadLock locker(m_guard);
+        if (m_entries.empty())
+            return false;
+        foundKey = NormalizePath(path);
+        auto it  = m_entries.find(foundKey);
+        if ((it == m_entries.end()) && (m_deleteEntries > 0))
+        {
+            // notifications for the content of a directory CryptSync removed
+            std::wstring parent = foundKey;
+            for (auto pos = parent.find_last_of('\\'); (pos != std::wstring::npos) && (pos > 0); pos = parent.find_last_of('\\'))
+            {
+                parent.resize(pos);
+                auto parentIt = m_entries.find(parent);
+                if ((parentIt != m_entries.end()) && (parentIt->second.type == EntryType::Deleted))
+                {
+                    it       = parentIt;
+                    foundKey = parent;
+                    break;
+                }
+            }
+        }
+        if (it == m_entries.end())
+            return false;
+        entry = it->second;
+    }
+
+    // the file system is checked without holding the lock
+    bool             isSelf = true;
+    PlatformFileInfo info;
+    switch (entry.type)
+    {
+        case EntryType::Pending:
+            break;
+        case EntryType::Written:
+            if (m_fs.Stat(path, info))
+                isSelf = (info.writeTime == entry.writeTime) && (info.size == entry.size);
+            else
+                isSelf = false;
+            break;
+        case EntryType::Deleted:
+            if (!m_fs.Stat(path, info))
+            {
+                auto lastError = m_fs.LastError();
+                isSelf         = (lastError == PlatformError::NotFound) || (lastError == PlatformError::PathNotFound);
+            }
+            else
+                isSelf = false;
+            break;
+    }
+
+    CAutoWriteLock locker(m_guard);
+    if (!isSelf)
+    {
+        // the path was changed by someone else after CryptSync touched it:
+        // that's a real change, and the entry is of no use anymore.
+        auto it = m_entries.find(foundKey);
+        if ((it != m_entries.end()) && (it->second.generation == entry.generation))
+        {
+            if (it->second.type == EntryType::Deleted)
+                --m_deleteEntries;
+            m_entries.erase(it);
+        }
+        return false;
+    }
+    if (GetTickCount64() > entry.deadline)
+    {
+        ++m_leaked;
+        CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": late notification for own change of %s\n"), path.c_str());
+        return false;
+    }
+    ++m_suppressed;
+    CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": remove notification for file %s\n"), path.c_str());
+    return true;
+}
+
+SelfWriteStats CSelfWriteTable::GetStats()
+{
+    CAutoReadLock  locker(m_guard);
+    SelfWriteStats stats;
+    stats.suppressed = m_suppressed;
+    stats.leaked     = m_leaked;
+    stats.entries    = m_entries.size();
+    return stats;
+}
+
+void CSelfWriteTable::PruneExpired(ULONGLONG now)
+{
+    if (now - m_lastPrune < SELFWRITE_TTL)
+        return;
+    m_lastPrune = now;
+    // expired entries are kept for another SELFWRITE_TTL so that late
+    // notifications can still be recognized and counted as leaked
+    for (auto it = m_entries.begin(); it != m_entries.end();)
+    {
+        if (now > it->second.deadline + SELFWRITE_TTL)
+        {
+            if (it->second.type == EntryType::Deleted)
+                --m_deleteEntries;
+            it = m_entries.erase(it);
+        }
+        else
+            ++it;
+    }
+}
@@ -0,0 +1,102 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+
+#include "ReaderWriterLock.h"
+#include "Platform.h"
+
+#include <string>
+#include <unordered_map>
+
+/// time a committed write or a delete is expected to still produce change notifications
+constexpr ULONGLONG SELFWRITE_TTL         = 30000;
+/// time a write that was started but not yet committed is kept
+constexpr ULONGLONG SELFWRITE_PENDING_TTL = 10 * 60000;
+
+struct SelfWriteStats
+{
+    ULONGLONG suppressed = 0; ///< notifications dropped because CryptSync caused them
+    ULONGLONG leaked     = 0; ///< notifications caused by CryptSync that arrived after their entry expired
+    size_t    entries    = 0; ///< number of entries currently in the table
+};
+
+/**
+ * Keeps track of the files CryptSync itself writes or deletes, so that the
+ * change notifications those operations trigger can be dropped as they arrive
+ * instead of syncing the files back.
+ *
+ * Paths are normalized (case, \\?\ prefix, slashes) before they're used as keys.
+ * Every write is tagged with a generation: \c BeginWrite() returns it, and
+ * \c CommitWrite() / \c CancelWrite() only act on the entry if no newer write
+ * for the same path has started in between.
+ * A committed entry records the last-write-time and size of the file CryptSync
+ * produced: a notification only gets suppressed if the file still has exactly
+ * those values, so a real modification right after a sync is never lost.
+ */
+class CSelfWriteTable
+{
+public:
+    /// the files are checked on \c fs when their notifications arrive
+    explicit CSelfWriteTable(const CFileSystem& fs = CFileSystem::Native());
+    ~CSelfWriteTable();
+
+    /// marks \c path as being written by CryptSync. Returns the generation of the write.
+    ULONGLONG      BeginWrite(const std::wstring& path);
+    /// records the current state of \c path as the expected result of the write \c generation
+    void           CommitWrite(const std::wstring& path, ULONGLONG generation);
+    /// removes the entry of a failed write
+    void           CancelWrite(const std::wstring& path, ULONGLONG generation);
+    /// marks \c path (and if it's a directory, everything below it) as deleted by CryptSync
+    void           ExpectDelete(const std::wstring& path);
+
+    /// returns true if the change notification for \c path was caused by CryptSync itself
+    bool           IsSelfEvent(const std::wstring& path);
+
+    SelfWriteStats GetStats();
+
+    static std::wstring NormalizePath(const std::wstring& path);
+
+private:
+    enum class EntryType
+    {
+        Pending,
+        Written,
+        Deleted,
+    };
+    struct Entry
+    {
+        EntryType type       = EntryType::Pending;
+        ULONGLONG generation = 0;
+        ULONGLONG deadline   = 0;
+        ULONGLONG writeTime  = 0;
+        ULONGLONG size       = 0;
+    };
+
+    void PruneExpired(ULONGLONG now);
+
+    const CFileSystem&                      m_fs;
+    CReaderWriterLock                       m_guard;
+    std::unordered_map<std::wstring, Entry> m_entries;
+    ULONGLONG                               m_generation;
+    ULONGLONG                               m_lastPrune;
+    size_t                                  m_deleteEntries;
+    ULONGLONG                               m_suppressed;
+    ULONGLONG                               m_leaked;
+};
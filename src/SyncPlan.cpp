@@ -0,0 +1,330 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "SyncPlan.h"
+
+#include <algorithm>
+#include <cwchar>
+#include <set>
+
+namespace
+{
+/// FAT stores the write time with 2 seconds accuracy
+constexpr uint64_t FAT_TIME_ACCURACY  = 20000000ULL;
+/// times closer than this are equal on FAT, twice the accuracy
+constexpr uint64_t FAT_TIME_TOLERANCE = 40000000ULL;
+
+uint64_t RoundUpToFat(uint64_t t)
+{
+    if (t % FAT_TIME_ACCURACY)
+        t = (t + FAT_TIME_ACCURACY) / FAT_TIME_ACCURACY * FAT_TIME_ACCURACY;
+    return t;
+}
+
+std::wstring GetFolder(const std::wstring& path)
+{
+    auto slashPos = path.find_last_of(L"\\/");
+    return slashPos == std::wstring::npos ? std::wstring() : path.substr(0, slashPos);
+}
+} // namespace
+
+bool SyncPathLess::operator()(const std::wstring& a, const std::wstring& b) const
+{
+#ifdef _WIN32
+    return _wcsicmp(a.c_str(), b.c_str()) < 0;
+#else
+    return a < b;
+#endif
+}
+
+bool SyncAction::IsTransfer() const
+{
+    switch (type)
+    {
+        case SyncActionType::Encrypt:
+        case SyncActionType::Decrypt:
+        case SyncActionType::CopyToCrypt:
+        case SyncActionType::CopyToOrig:
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::wstring SyncAction::GetTargetPath() const
+{
+    switch (type)
+    {
+        case SyncActionType::Encrypt:
+        case SyncActionType::CopyToCrypt:
+        case SyncActionType::DeleteCrypt:
+            return cryptRelPath;
+        default:
+            return origRelPath;
+    }
+}
+
+const wchar_t* SyncAction::GetName() const
+{
+    switch (type)
+    {
+        case SyncActionType::Encrypt:
+            return L"encrypt";
+        case SyncActionType::Decrypt:
+            return L"decrypt";
+        case SyncActionType::CopyToCrypt:
+            return L"copy";
+        case SyncActionType::CopyToOrig:
+            return L"copy back";
+        case SyncActionType::DeleteOrig:
+            return L"delete orig";
+        case SyncActionType::DeleteCrypt:
+            return L"delete crypt";
+        case SyncActionType::ResetArchiveAttribute:
+            return L"reset attr";
+        case SyncActionType::KeepDeleted:
+            return L"keep";
+    }
+    return L"";
+}
+
+SyncPolicy SyncPolicy::FromSettings(uint32_t order, uint32_t threads, uint32_t batchSize)
+{
+    SyncPolicy policy;
+    if (order <= static_cast<uint32_t>(SyncOrder::ByFolder))
+        policy.order = static_cast<SyncOrder>(order);
+    policy.threads   = std::clamp<uint32_t>(threads, 1, 64);
+    policy.batchSize = std::clamp<uint32_t>(batchSize, 1, 1024);
+    return policy;
+}
+
+int CSyncPlan::CompareTimes(uint64_t t1, uint64_t t2, bool fat)
+{
+    if (fat)
+    {
+        t1 = RoundUpToFat(t1);
+        t2 = RoundUpToFat(t2);
+        if ((t1 > t2 ? t1 - t2 : t2 - t1) < FAT_TIME_TOLERANCE)
+            return 0;
+    }
+    if (t1 == t2)
+        return 0;
+    return t1 < t2 ? -1 : 1;
+}
+
+CSyncPlan::CSyncPlan(const SyncPlanFileList& origFiles, const SyncPlanFileList& cryptFiles, const SyncPlanSettings& settings)
+    : m_settings(settings)
+{
+    const bool srcToDstOnly = settings.toCrypt && !settings.toOrig;
+
+    for (const auto& [relPath, origFile] : origFiles)
+    {
+        if (origFile.ignored)
+            continue;
+        auto cryptIt = cryptFiles.find(relPath);
+        if (cryptIt == cryptFiles.end())
+        {
+            // file does not exist in the encrypted folder
+            if (settings.toCrypt)
+            {
+                if (origFile.copyOnly)
+                    Add(SyncActionType::CopyToCrypt, relPath, relPath, relPath, origFile, false);
+                else
+                    Add(SyncActionType::Encrypt, relPath, relPath, settings.encryptPath(relPath), origFile, false);
+            }
+            else
+                Add(settings.syncDeleted ? SyncActionType::DeleteOrig : SyncActionType::KeepDeleted, relPath, origFile.fileRelPath, std::wstring(), origFile, false);
+            continue;
+        }
+
+        int cmp = CompareTimes(origFile.writeTime, cryptIt->second.writeTime, settings.fat);
+        if (cmp < 0)
+        {
+            // original file is older than the encrypted file
+            if (settings.toOrig)
+            {
+                if (origFile.copyOnly)
+                    Add(SyncActionType::CopyToOrig, relPath, relPath, relPath, cryptIt->second, true);
+                else
+                    Add(SyncActionType::Decrypt, relPath, relPath, settings.encryptPath(relPath), cryptIt->second, true);
+            }
+        }
+        else if (cmp > 0)
+        {
+            // encrypted file is older than the original file
+            if (settings.toCrypt)
+            {
+                if (origFile.copyOnly)
+                    Add(SyncActionType::CopyToCrypt, relPath, relPath, relPath, origFile, true);
+                else
+                    Add(SyncActionType::Encrypt, relPath, relPath, settings.encryptPath(relPath), origFile, true);
+            }
+        }
+        else if (settings.toCrypt && settings.resetArchiveAttribute)
+        {
+            // files are identical, but the archive attribute might still be set
+            Add(SyncActionType::ResetArchiveAttribute, relPath, relPath, std::wstring(), origFile, true);
+        }
+    }
+
+    // the files that only exist in the encrypted folder
+    for (const auto& [relPath, cryptFile] : cryptFiles)
+    {
+        if (cryptFile.ignored || (origFiles.find(relPath) != origFiles.end()))
+            continue;
+        if (srcToDstOnly && !origFiles.empty())
+            Add(settings.syncDeleted ? SyncActionType::DeleteCrypt : SyncActionType::KeepDeleted, relPath, std::wstring(), cryptFile.fileRelPath, cryptFile, false);
+        else if (cryptFile.copyOnly && (origFiles.empty() || settings.toOrig))
+            Add(SyncActionType::CopyToOrig, relPath, relPath, relPath, cryptFile, false);
+        else if (settings.toOrig)
+        {
+            Add(SyncActionType::Decrypt, relPath, relPath, cryptFile.fileRelPath, cryptFile, false);
+            m_actions.back().moveOnFailure = !cryptFile.filenameEncrypted;
+        }
+    }
+}
+
+void CSyncPlan::Add(SyncActionType type, const std::wstring& relPath, const std::wstring& origRelPath, const std::wstring& cryptRelPath, const SyncPlanFile& source, bool targetExists)
+{
+    SyncAction action;
+    action.type         = type;
+    action.relPath      = relPath;
+    action.origRelPath  = origRelPath;
+    action.cryptRelPath = cryptRelPath;
+    action.targetExists = targetExists;
+    action.noCompress   = source.cryptOnly;
+    if (action.IsTransfer())
+        action.size = source.size;
+
+    const bool compressed = !source.cryptOnly && (source.size <= static_cast<uint64_t>(m_settings.compressSize) * 1024 * 1024);
+    switch (type)
+    {
+        case SyncActionType::Encrypt:
+            action.cpuCost = source.size / (m_settings.useGpg ? SYNCPLAN_GPG_RATE : (compressed ? SYNCPLAN_COMPRESS_RATE : SYNCPLAN_AES_RATE));
+            break;
+        case SyncActionType::Decrypt:
+            action.cpuCost = source.size / (m_settings.useGpg ? SYNCPLAN_GPG_RATE : (compressed ? SYNCPLAN_DECOMPRESS_RATE : SYNCPLAN_AES_RATE));
+            break;
+        default:
+            break;
+    }
+    m_actions.push_back(std::move(action));
+}
+
+void CSyncPlan::Apply(const SyncPolicy& policy)
+{
+    // two plain paths can map to the same target, e.g. names that differ
+    // only in case on a case sensitive source: only the first one is synced
+    std::set<std::wstring, SyncPathLess> targets;
+    std::erase_if(m_actions, [&](const SyncAction& action) {
+        if (!action.IsTransfer())
+            return false;
+        auto key = (action.type == SyncActionType::Encrypt || action.type == SyncActionType::CopyToCrypt ? L"c:" : L"o:") + action.GetTargetPath();
+        return !targets.insert(key).second;
+    });
+
+    switch (policy.order)
+    {
+        case SyncOrder::Planned:
+            break;
+        case SyncOrder::SmallestFirst:
+            std::ranges::stable_sort(m_actions, [](const SyncAction& a, const SyncAction& b) { return a.size < b.size; });
+            break;
+        case SyncOrder::LargestFirst:
+            std::ranges::stable_sort(m_actions, [](const SyncAction& a, const SyncAction& b) { return a.size > b.size; });
+            break;
+        case SyncOrder::ByFolder:
+            std::ranges::stable_sort(m_actions, [](const SyncAction& a, const SyncAction& b) {
+                if (a.IsTransfer() != b.IsTransfer())
+                    return b.IsTransfer();
+                return SyncPathLess()(GetFolder(a.GetTargetPath()), GetFolder(b.GetTargetPath()));
+            });
+            break;
+    }
+}
+
+std::vector<SyncBatch> CSyncPlan::GetBatches(const SyncPolicy& policy) const
+{
+    std::vector<SyncBatch> batches;
+    std::wstring           batchFolder;
+    for (size_t i = 0; i < m_actions.size(); ++i)
+    {
+        const auto& action = m_actions[i];
+        if (action.IsTransfer() && !batches.empty())
+        {
+            auto&       last     = batches.back();
+            const auto& previous = m_actions[last.first];
+            auto        folder   = GetFolder(action.GetTargetPath());
+            if (previous.IsTransfer() && (previous.type == action.type) && (last.count < policy.batchSize) && (folder == batchFolder))
+            {
+                ++last.count;
+                continue;
+            }
+        }
+        batches.push_back({i, 1});
+        batchFolder = GetFolder(action.GetTargetPath());
+    }
+    return batches;
+}
+
+SyncPlanTotals CSyncPlan::GetTotals() const
+{
+    SyncPlanTotals totals;
+    for (const auto& action : m_actions)
+    {
+        ++totals.actions;
+        if (action.IsTransfer())
+            ++totals.transfers;
+        totals.bytes += action.size;
+        totals.cpuCost += action.cpuCost;
+    }
+    return totals;
+}
+
+std::wstring CSyncPlan::Format() const
+{
+    std::wstring text;
+    wchar_t      buf[128] = {};
+    for (const auto& action : m_actions)
+    {
+        std::swprintf(buf, std::size(buf), L"%-12ls %12llu bytes %8llu ms  ", action.GetName(), static_cast<unsigned long long>(action.size), static_cast<unsigned long long>(action.cpuCost));
+        text += buf;
+        switch (action.type)
+        {
+            case SyncActionType::Encrypt:
+            case SyncActionType::CopyToCrypt:
+                text += action.origRelPath + L" -> " + action.cryptRelPath;
+                break;
+            case SyncActionType::Decrypt:
+            case SyncActionType::CopyToOrig:
+                text += action.cryptRelPath + L" -> " + action.origRelPath;
+                break;
+            default:
+                text += action.GetTargetPath().empty() ? action.relPath : action.GetTargetPath();
+                break;
+        }
+        text += L"\n";
+    }
+    auto totals = GetTotals();
+    std::swprintf(buf, std::size(buf), L"%llu actions, %llu transfers, %llu bytes, %llu ms cpu\n",
+                  static_cast<unsigned long long>(totals.actions), static_cast<unsigned long long>(totals.transfers),
+                  static_cast<unsigned long long>(totals.bytes), static_cast<unsigned long long>(totals.cpuCost));
+    text += buf;
+    return text;
+}
@@ -0,0 +1,178 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/// single core throughput the cost estimates of a plan are based on, in bytes per ms
+constexpr uint64_t SYNCPLAN_COMPRESS_RATE   = 3 * 1024;   ///< LZMA2 at level 9
+constexpr uint64_t SYNCPLAN_DECOMPRESS_RATE = 60 * 1024;  ///< LZMA2
+constexpr uint64_t SYNCPLAN_AES_RATE        = 800 * 1024; ///< AES-256 with hardware support
+constexpr uint64_t SYNCPLAN_GPG_RATE        = 25 * 1024;  ///< gpg with its default zlib compression
+
+/// orders the paths like the file system of the platform compares them
+struct SyncPathLess
+{
+    bool operator()(const std::wstring& a, const std::wstring& b) const;
+};
+
+/// a file found in one of the folders of a pair
+struct SyncPlanFile
+{
+    std::wstring fileRelPath;               ///< the real path relative to the folder, possibly encrypted
+    uint64_t     size              = 0;
+    uint64_t     writeTime         = 0;     ///< in 100ns ticks since 1601, like FILETIME
+    bool         filenameEncrypted = false;
+    bool         ignored           = false; ///< PathMatchIgnored
+    bool         cryptOnly         = false; ///< PathMatchCryptOnly: encrypted without compression
+    bool         copyOnly          = false; ///< PathMatchCopyOnly: copied, not encrypted
+};
+
+/// the files of a folder, the key is the plain (decrypted) path relative to the folder
+using SyncPlanFileList = std::map<std::wstring, SyncPlanFile, SyncPathLess>;
+
+/// the settings of a pair the planner needs
+struct SyncPlanSettings
+{
+    bool                                            toCrypt               = true; ///< original files are synced to the encrypted folder
+    bool                                            toOrig                = true; ///< encrypted files are synced to the original folder
+    bool                                            syncDeleted           = true;
+    bool                                            fat                   = false; ///< compare the times with 2 seconds accuracy
+    bool                                            resetArchiveAttribute = false;
+    bool                                            useGpg                = false;
+    int                                             compressSize          = 100; ///< MB, bigger files are stored without compression
+    /// returns the encrypted path for a plain path relative to the folder
+    std::function<std::wstring(const std::wstring&)> encryptPath;
+};
+
+/**
+ * what a planned action does to a file.
+ *
+ * The planner only compares the two folders path by path, it doesn't track
+ * renames: a file moved or renamed in one folder is planned as a delete of the
+ * old counterpart and a new encrypt, decrypt or copy of the whole file. There's
+ * also no action that only touches the file times, a file whose times differ is
+ * transferred again. The decrypt fallback that moves the file instead is a flag
+ * of the decrypt action, not an action of its own.
+ */
+enum class SyncActionType
+{
+    Encrypt,
+    Decrypt,
+    CopyToCrypt,
+    CopyToOrig,
+    DeleteOrig,
+    DeleteCrypt,
+    ResetArchiveAttribute,
+    KeepDeleted, ///< the counterpart was deleted, but deletions aren't synced
+};
+
+/// one operation of a plan
+struct SyncAction
+{
+    SyncActionType type;
+    std::wstring   relPath;              ///< the plain path, the key of the file lists
+    std::wstring   origRelPath;          ///< the path in the original folder
+    std::wstring   cryptRelPath;         ///< the path in the encrypted folder
+    uint64_t       size          = 0;    ///< bytes the action reads
+    uint64_t       cpuCost       = 0;    ///< estimated cpu time in ms
+    bool           targetExists  = false;
+    bool           noCompress    = false;
+    bool           moveOnFailure = false; ///< the file is moved if it can't be decrypted: its name isn't encrypted, so it's likely not encrypted at all
+
+    /// true for actions that transfer file content, i.e. the ones that can run in parallel
+    bool           IsTransfer() const;
+    /// the path of the file the action writes or deletes, relative to the folder it's in
+    std::wstring   GetTargetPath() const;
+    const wchar_t* GetName() const;
+};
+
+enum class SyncOrder
+{
+    Planned,       ///< the order of the file lists
+    SmallestFirst, ///< most files done early
+    LargestFirst,  ///< the long transfers don't end up alone at the end
+    ByFolder,      ///< all actions for one target folder together
+};
+
+/// how a plan is executed
+struct SyncPolicy
+{
+    SyncOrder order     = SyncOrder::Planned;
+    unsigned  threads   = 1; ///< transfers that run at the same time
+    size_t    batchSize = 1; ///< number of consecutive transfers into the same folder a thread takes at once
+
+    /// the policy of the SyncOrder, SyncThreads and SyncBatchSize settings, clamped to sane values
+    static SyncPolicy FromSettings(uint32_t order, uint32_t threads, uint32_t batchSize);
+};
+
+struct SyncPlanTotals
+{
+    size_t   actions   = 0;
+    size_t   transfers = 0;
+    uint64_t bytes     = 0;
+    uint64_t cpuCost   = 0; ///< ms
+};
+
+/// a range of actions a thread executes in one go
+struct SyncBatch
+{
+    size_t first = 0;
+    size_t count = 0;
+};
+
+/**
+ * The operations that sync the two folders of a pair.
+ *
+ * The plan is created from the file lists of both folders, it decides
+ * what has to be done but doesn't do anything itself: the caller
+ * executes the actions, or just prints them for a dry run.
+ * Every action has an estimate of the bytes it reads and the cpu time it
+ * takes, based on the SYNCPLAN_*_RATE constants.
+ */
+class CSyncPlan
+{
+public:
+    CSyncPlan(const SyncPlanFileList& origFiles, const SyncPlanFileList& cryptFiles, const SyncPlanSettings& settings);
+
+    /// removes duplicate targets and orders the actions as the policy says
+    void                           Apply(const SyncPolicy& policy);
+    /// splits the actions in the batches the policy asks for: transfers are
+    /// grouped by target folder, all other actions are batches of their own
+    std::vector<SyncBatch>         GetBatches(const SyncPolicy& policy) const;
+
+    const std::vector<SyncAction>& GetActions() const { return m_actions; }
+    SyncPlanTotals                 GetTotals() const;
+    /// one line per action and a line with the totals
+    std::wstring                   Format() const;
+
+    /// returns -1, 0 or 1, with the FAT tolerance of 4 seconds if fat is set
+    static int                     CompareTimes(uint64_t t1, uint64_t t2, bool fat);
+
+private:
+    void                           Add(SyncActionType type, const std::wstring& relPath, const std::wstring& origRelPath, const std::wstring& cryptRelPath, const SyncPlanFile& source, bool targetExists);
+
+    SyncPlanSettings               m_settings;
+    std::vector<SyncAction>        m_actions;
+};
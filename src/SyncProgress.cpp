@@ -0,0 +1,154 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "SyncProgress.h"
+
+#include <cwchar>
+#include <iterator>
+
+namespace
+{
+std::wstring FormatBytes(uint64_t bytes)
+{
+    const wchar_t* units[] = {L"bytes", L"KB", L"MB", L"GB", L"TB"};
+    double         value   = static_cast<double>(bytes);
+    size_t         unit    = 0;
+    while ((value >= 1024.0) && (unit + 1 < std::size(units)))
+    {
+        value /= 1024.0;
+        ++unit;
+    }
+    wchar_t buf[64] = {};
+    if (unit == 0)
+        std::swprintf(buf, std::size(buf), L"%llu %ls", static_cast<unsigned long long>(bytes), units[unit]);
+    else
+        std::swprintf(buf, std::size(buf), L"%.1f %ls", value, units[unit]);
+    return buf;
+}
+
+std::wstring FormatDuration(uint64_t seconds)
+{
+    wchar_t buf[64] = {};
+    if (seconds < 60)
+        std::swprintf(buf, std::size(buf), L"%llu seconds", static_cast<unsigned long long>(seconds));
+    else if (seconds < 2 * 60 * 60)
+        std::swprintf(buf, std::size(buf), L"%llu minutes", static_cast<unsigned long long>((seconds + 30) / 60));
+    else
+        std::swprintf(buf, std::size(buf), L"%llu hours", static_cast<unsigned long long>((seconds + 30 * 60) / (60 * 60)));
+    return buf;
+}
+} // namespace
+
+std::wstring SyncProgressSnapshot::Format() const
+{
+    wchar_t buf[64] = {};
+    std::swprintf(buf, std::size(buf), L"%llu of %llu files", static_cast<unsigned long long>(filesDone), static_cast<unsigned long long>(filesTotal));
+    std::wstring text = buf;
+    if (bytesTotal)
+        text += L", " + FormatBytes(bytesDone) + L" of " + FormatBytes(bytesTotal);
+    if (secondsLeft)
+        text += L", about " + FormatDuration(secondsLeft) + L" left";
+    return text;
+}
+
+CSyncProgress::CFile::CFile(CSyncProgress& progress, const std::wstring& path, uint64_t size)
+    : m_progress(progress)
+    , m_size(size)
+    , m_reported(0)
+{
+    m_progress.m_path = &path;
+}
+
+CSyncProgress::CFile::~CFile()
+{
+    if (m_size > m_reported)
+        m_progress.m_bytesDone.fetch_add(m_size - m_reported, std::memory_order_relaxed);
+    m_progress.m_filesDone.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CSyncProgress::CFile::SetPosition(uint64_t position)
+{
+    // the encoders report the position in their own stream, which can be bigger than the file
+    if (position > m_size)
+        position = m_size;
+    if (position <= m_reported)
+        return;
+    m_progress.m_bytesDone.fetch_add(position - m_reported, std::memory_order_relaxed);
+    m_reported = position;
+}
+
+CSyncProgress::CSyncProgress()
+{
+    Reset();
+}
+
+void CSyncProgress::Reset()
+{
+    m_filesDone   = 0;
+    m_filesTotal  = 0;
+    m_bytesDone   = 0;
+    m_bytesTotal  = 0;
+    m_path        = nullptr;
+    m_nextPublish = 0;
+    m_rateStart   = 0;
+    m_rateBytes   = 0;
+}
+
+void CSyncProgress::AddTotal(uint64_t files, uint64_t bytes)
+{
+    m_filesTotal.fetch_add(files, std::memory_order_relaxed);
+    m_bytesTotal.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void CSyncProgress::StartTransfers(uint64_t now)
+{
+    m_rateBytes = m_bytesDone.load();
+    m_rateStart = now;
+}
+
+bool CSyncProgress::ShouldPublish(uint64_t now)
+{
+    uint64_t next = m_nextPublish.load(std::memory_order_relaxed);
+    if (now < next)
+        return false;
+    // only one of the threads that see the interval expire publishes
+    return m_nextPublish.compare_exchange_strong(next, now + SYNCPROGRESS_INTERVAL_MS, std::memory_order_relaxed);
+}
+
+SyncProgressSnapshot CSyncProgress::Snapshot(uint64_t now) const
+{
+    SyncProgressSnapshot snapshot;
+    snapshot.filesDone  = m_filesDone.load(std::memory_order_relaxed);
+    snapshot.filesTotal = m_filesTotal.load(std::memory_order_relaxed);
+    snapshot.bytesDone  = m_bytesDone.load(std::memory_order_relaxed);
+    snapshot.bytesTotal = m_bytesTotal.load(std::memory_order_relaxed);
+    if (const std::wstring* path = m_path.load())
+        snapshot.path = *path;
+
+    uint64_t rateStart = m_rateStart;
+    uint64_t rateBytes = m_rateBytes;
+    if (rateStart && (now >= rateStart + SYNCPROGRESS_RATE_MS) && (snapshot.bytesDone > rateBytes))
+    {
+        snapshot.bytesPerSecond = (snapshot.bytesDone - rateBytes) * 1000 / (now - rateStart);
+        if (snapshot.bytesPerSecond && (snapshot.bytesTotal > snapshot.bytesDone))
+            snapshot.secondsLeft = (snapshot.bytesTotal - snapshot.bytesDone + snapshot.bytesPerSecond - 1) / snapshot.bytesPerSecond;
+    }
+    return snapshot;
+}
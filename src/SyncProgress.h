@@ -0,0 +1,105 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/// milliseconds between two updates of the progress dialog and the tray icon
+constexpr uint64_t SYNCPROGRESS_INTERVAL_MS = 100;
+/// the transfer rate for the time left is measured after this many milliseconds
+constexpr uint64_t SYNCPROGRESS_RATE_MS     = 2000;
+
+/// the progress of a sync at one point in time
+struct SyncProgressSnapshot
+{
+    uint64_t     filesDone      = 0; ///< executed actions, deletes count as files too
+    uint64_t     filesTotal     = 0;
+    uint64_t     bytesDone      = 0;
+    uint64_t     bytesTotal     = 0;
+    uint64_t     bytesPerSecond = 0; ///< 0 while it is not known yet
+    uint64_t     secondsLeft    = 0; ///< 0 while it is not known
+    std::wstring path;               ///< the file started last
+
+    /// the done and the total value for a progress bar: bytes if there are any, files otherwise
+    uint64_t     GetDone() const { return bytesTotal ? bytesDone : filesDone; }
+    uint64_t     GetTotal() const { return bytesTotal ? bytesTotal : filesTotal; }
+    /// e.g. "12 of 340 files, 1.2 MB of 4.0 GB, about 3 minutes left"
+    std::wstring Format() const;
+};
+
+/**
+ * The progress of a sync.
+ *
+ * The threads that sync update the counters without locks, one thread
+ * publishes them: it calls ShouldPublish() as often as it likes and
+ * only updates the UI with a Snapshot() when that returns true, at most
+ * once every SYNCPROGRESS_INTERVAL_MS. The times are in ms of a
+ * monotonic clock like GetTickCount64().
+ */
+class CSyncProgress
+{
+public:
+    CSyncProgress();
+
+    CSyncProgress(const CSyncProgress&)            = delete;
+    CSyncProgress& operator=(const CSyncProgress&) = delete;
+
+    /// counts a file as done when it goes out of scope, with all of its
+    /// bytes no matter how many SetPosition() reported
+    class CFile
+    {
+    public:
+        /// path must stay valid until the next ClearPath() or Reset()
+        CFile(CSyncProgress& progress, const std::wstring& path, uint64_t size);
+        ~CFile();
+
+        CFile(const CFile&)            = delete;
+        CFile& operator=(const CFile&) = delete;
+
+        /// the bytes of the file done so far, e.g. from the callback of an encoder
+        void SetPosition(uint64_t position);
+
+    private:
+        CSyncProgress& m_progress;
+        uint64_t       m_size;
+        uint64_t       m_reported;
+    };
+
+    void                 Reset();
+    void                 AddTotal(uint64_t files, uint64_t bytes);
+    /// the transfer rate is measured from here on
+    void                 StartTransfers(uint64_t now);
+    void                 ClearPath() { m_path = nullptr; }
+    /// true at most once per interval, then the caller publishes a Snapshot()
+    bool                 ShouldPublish(uint64_t now);
+    SyncProgressSnapshot Snapshot(uint64_t now) const;
+
+private:
+    std::atomic<uint64_t>            m_filesDone;
+    std::atomic<uint64_t>            m_filesTotal;
+    std::atomic<uint64_t>            m_bytesDone;
+    std::atomic<uint64_t>            m_bytesTotal;
+    std::atomic<const std::wstring*> m_path;
+    std::atomic<uint64_t>            m_nextPublish;
+    std::atomic<uint64_t>            m_rateStart; ///< when the measuring of the transfer rate started
+    std::atomic<uint64_t>            m_rateBytes; ///< the bytes done at that time
+};
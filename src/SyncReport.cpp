@@ -0,0 +1,232 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "SyncReport.h"
+#include "Platform.h"
+
+#include <cstdio>
+#include <iterator>
+
+namespace
+{
+/// the keys of the operations in the report, in the order of SyncActionType
+const char* const actionKeys[SYNCSTATS_ACTIONS] = {
+    "encrypt",
+    "decrypt",
+    "copyToCrypt",
+    "copyToOrig",
+    "deleteOrig",
+    "deleteCrypt",
+    "resetArchiveAttribute",
+    "keepDeleted",
+};
+
+/// the timer that measures the work of an action, Count if there's none
+SyncTimer GetActionTimer(SyncActionType type)
+{
+    switch (type)
+    {
+        case SyncActionType::Encrypt:
+            return SyncTimer::Encrypt;
+        case SyncActionType::Decrypt:
+            return SyncTimer::Decrypt;
+        case SyncActionType::CopyToCrypt:
+        case SyncActionType::CopyToOrig:
+            return SyncTimer::Copy;
+        default:
+            return SyncTimer::Count;
+    }
+}
+
+void AppendNumber(std::string& json, const char* key, uint64_t value)
+{
+    char buf[64] = {};
+    std::snprintf(buf, std::size(buf), "\"%s\":%llu", key, static_cast<unsigned long long>(value));
+    json += buf;
+}
+
+void AppendDouble(std::string& json, const char* key, double value)
+{
+    char buf[64] = {};
+    std::snprintf(buf, std::size(buf), "\"%s\":%.3f", key, value);
+    json += buf;
+}
+
+double ToMs(uint64_t microseconds)
+{
+    return static_cast<double>(microseconds) / 1000.0;
+}
+
+/// bytes per second, zero if no time was measured
+double GetThroughput(uint64_t bytes, uint64_t microseconds)
+{
+    return microseconds ? static_cast<double>(bytes) * 1000000.0 / static_cast<double>(microseconds) : 0.0;
+}
+
+void AppendStats(std::string& json, const SyncStats& stats)
+{
+    json += "\"phases\":{";
+    AppendDouble(json, "enumOrig", ToMs(stats.GetMicroseconds(SyncTimer::EnumOrig)));
+    json += ',';
+    AppendDouble(json, "enumCrypt", ToMs(stats.GetMicroseconds(SyncTimer::EnumCrypt)));
+    json += ',';
+    AppendDouble(json, "nameEncrypt", ToMs(stats.GetMicroseconds(SyncTimer::NameEncrypt)));
+    json += ',';
+    AppendDouble(json, "nameDecrypt", ToMs(stats.GetMicroseconds(SyncTimer::NameDecrypt)));
+    json += ',';
+    AppendDouble(json, "plan", ToMs(stats.GetMicroseconds(SyncTimer::Plan)));
+    json += ',';
+    AppendDouble(json, "encrypt", ToMs(stats.GetMicroseconds(SyncTimer::Encrypt)));
+    json += ',';
+    AppendDouble(json, "decrypt", ToMs(stats.GetMicroseconds(SyncTimer::Decrypt)));
+    json += ',';
+    AppendDouble(json, "copy", ToMs(stats.GetMicroseconds(SyncTimer::Copy)));
+    json += "},\"files\":{";
+    AppendNumber(json, "orig", stats.Get(SyncCounter::OrigFiles));
+    json += ',';
+    AppendNumber(json, "crypt", stats.Get(SyncCounter::CryptFiles));
+    json += ',';
+    AppendNumber(json, "ignored", stats.Get(SyncCounter::Ignored));
+    json += ',';
+    AppendNumber(json, "namesEncrypted", stats.Get(SyncCounter::NameEncrypts));
+    json += ',';
+    AppendNumber(json, "namesDecrypted", stats.Get(SyncCounter::NameDecrypts));
+    json += "},\"operations\":{";
+    for (size_t i = 0; i < SYNCSTATS_ACTIONS; ++i)
+    {
+        const auto     type    = static_cast<SyncActionType>(i);
+        const uint64_t read    = stats.GetActionBytesRead(type);
+        const uint64_t written = stats.GetActionBytesWritten(type);
+        const auto     timer   = GetActionTimer(type);
+        if (i)
+            json += ',';
+        json += '"';
+        json += actionKeys[i];
+        json += "\":{";
+        AppendNumber(json, "count", stats.GetActions(type));
+        if (timer != SyncTimer::Count)
+        {
+            json += ',';
+            AppendNumber(json, "bytesRead", read);
+            json += ',';
+            AppendNumber(json, "bytesWritten", written);
+            // the written bytes per read byte: below 1 if encrypting compressed the files
+            json += ',';
+            AppendDouble(json, "ratio", read ? static_cast<double>(written) / static_cast<double>(read) : 0.0);
+            json += ',';
+            AppendDouble(json, "bytesPerSecond", GetThroughput(read, stats.GetMicroseconds(timer)));
+        }
+        json += '}';
+    }
+    json += "},";
+    AppendNumber(json, "bytesRead", stats.Get(SyncCounter::BytesRead));
+    json += ',';
+    AppendNumber(json, "bytesWritten", stats.Get(SyncCounter::BytesWritten));
+    json += ',';
+    AppendDouble(json, "bytesPerSecond", GetThroughput(stats.Get(SyncCounter::BytesRead) + stats.Get(SyncCounter::BytesWritten), stats.GetMicroseconds(SyncTimer::Total)));
+    json += ',';
+    AppendNumber(json, "retries", stats.Get(SyncCounter::Retries));
+    json += ',';
+    AppendNumber(json, "failures", stats.Get(SyncCounter::Failures));
+}
+} // namespace
+
+void AppendJsonString(std::string& json, const std::string& str)
+{
+    json += '"';
+    for (char c : str)
+    {
+        switch (c)
+        {
+            case '"':
+                json += "\\\"";
+                break;
+            case '\\':
+                json += "\\\\";
+                break;
+            case '\n':
+                json += "\\n";
+                break;
+            case '\r':
+                json += "\\r";
+                break;
+            case '\t':
+                json += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char buf[8] = {};
+                    std::snprintf(buf, std::size(buf), "\\u%04x", static_cast<unsigned>(c));
+                    json += buf;
+                }
+                else
+                    json += c;
+                break;
+        }
+    }
+    json += '"';
+}
+
+std::string SyncReport::ToJson() const
+{
+    SyncStats total;
+    for (const auto& [orig, stats] : pairs)
+        total += stats;
+
+    std::string json = "{";
+    AppendNumber(json, "version", SYNCREPORT_VERSION);
+    json += ",\"exitCode\":";
+    json += std::to_string(exitCode);
+    json += ",\"cancelled\":";
+    json += (exitCode & 1) ? "true" : "false"; // ErrorCancelled
+    json += ",\"dryRun\":";
+    json += dryRun ? "true" : "false";
+    json += ',';
+    AppendDouble(json, "durationMs", ToMs(microseconds));
+    json += ",\n\"total\":{";
+    AppendDouble(json, "durationMs", ToMs(total.GetMicroseconds(SyncTimer::Total)));
+    json += ',';
+    AppendStats(json, total);
+    json += "},\n\"pairs\":[";
+    bool first = true;
+    for (const auto& [orig, stats] : pairs)
+    {
+        json += first ? "\n{\"orig\":" : ",\n{\"orig\":";
+        first = false;
+        AppendJsonString(json, CPlatform::ToUtf8(orig));
+        json += ',';
+        AppendDouble(json, "durationMs", ToMs(stats.GetMicroseconds(SyncTimer::Total)));
+        json += ',';
+        AppendStats(json, stats);
+        json += '}';
+    }
+    json += "],\n\"failures\":[";
+    first = true;
+    for (const auto& failure : failures)
+    {
+        json += first ? "\n{\"path\":" : ",\n{\"path\":";
+        first = false;
+        AppendJsonString(json, CPlatform::ToUtf8(failure.path));
+        json += failure.encrypt ? ",\"operation\":\"encrypt\"}" : ",\"operation\":\"decrypt\"}";
+    }
+    json += "]}\n";
+    return json;
+}
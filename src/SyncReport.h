@@ -0,0 +1,60 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include "SyncStats.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// version of the document SyncReport::ToJson() writes
+constexpr int SYNCREPORT_VERSION = 1;
+
+/// a file that failed to sync
+struct SyncReportFailure
+{
+    std::wstring path;
+    bool         encrypt = true; ///< false if decrypting the file failed
+};
+
+/**
+ * The machine readable report of a /syncall or /src /dst run, written with /report.
+ *
+ * For every pair and for the whole run it has the durations of the phases, the
+ * file and byte counts of every operation with its compression ratio and
+ * throughput, the bytes read and written and the retries. Then comes the list of
+ * the files that failed to sync. The durations are in milliseconds, the sizes in
+ * bytes and the exit code is the %ERRORLEVEL% bitmask.
+ */
+struct SyncReport
+{
+    int                            exitCode     = 0;
+    bool                           dryRun       = false;
+    uint64_t                       microseconds = 0; ///< the duration of the whole run
+    SyncStatsMap                   pairs;
+    std::vector<SyncReportFailure> failures;
+
+    /// the report as UTF-8 JSON
+    std::string                    ToJson() const;
+};
+
+/// appends str as a quoted and escaped JSON string, str is UTF-8
+void AppendJsonString(std::string& json, const std::string& str);
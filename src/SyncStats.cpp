@@ -0,0 +1,147 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "SyncStats.h"
+
+#include <cwchar>
+
+namespace
+{
+double ToMs(uint64_t microseconds)
+{
+    return static_cast<double>(microseconds) / 1000.0;
+}
+} // namespace
+
+SyncStats& SyncStats::operator+=(const SyncStats& other)
+{
+    for (size_t i = 0; i < SYNCSTATS_COUNTERS; ++i)
+        counters[i] += other.counters[i];
+    for (size_t i = 0; i < SYNCSTATS_TIMERS; ++i)
+        timers[i] += other.timers[i];
+    for (size_t i = 0; i < SYNCSTATS_ACTIONS; ++i)
+    {
+        actions[i] += other.actions[i];
+        actionBytesRead[i] += other.actionBytesRead[i];
+        actionBytesWritten[i] += other.actionBytesWritten[i];
+    }
+    return *this;
+}
+
+std::vector<std::wstring> SyncStats::Format() const
+{
+    std::vector<std::wstring> lines;
+    wchar_t                   buf[512] = {};
+    std::swprintf(buf, std::size(buf), L"enumerated %llu orig files in %.1f ms, %llu crypt files in %.1f ms, %llu ignored",
+                  static_cast<unsigned long long>(Get(SyncCounter::OrigFiles)), ToMs(GetMicroseconds(SyncTimer::EnumOrig)),
+                  static_cast<unsigned long long>(Get(SyncCounter::CryptFiles)), ToMs(GetMicroseconds(SyncTimer::EnumCrypt)),
+                  static_cast<unsigned long long>(Get(SyncCounter::Ignored)));
+    lines.push_back(buf);
+    std::swprintf(buf, std::size(buf), L"names: %llu encrypted in %.1f ms, %llu decrypted in %.1f ms; planned in %.1f ms",
+                  static_cast<unsigned long long>(Get(SyncCounter::NameEncrypts)), ToMs(GetMicroseconds(SyncTimer::NameEncrypt)),
+                  static_cast<unsigned long long>(Get(SyncCounter::NameDecrypts)), ToMs(GetMicroseconds(SyncTimer::NameDecrypt)),
+                  ToMs(GetMicroseconds(SyncTimer::Plan)));
+    lines.push_back(buf);
+    std::wstring actionLine = L"actions:";
+    for (size_t i = 0; i < SYNCSTATS_ACTIONS; ++i)
+    {
+        SyncAction action;
+        action.type = static_cast<SyncActionType>(i);
+        std::swprintf(buf, std::size(buf), L"%ls %ls %llu", i ? L"," : L"", action.GetName(), static_cast<unsigned long long>(actions[i]));
+        actionLine += buf;
+    }
+    lines.push_back(actionLine);
+    std::swprintf(buf, std::size(buf), L"encrypt %.1f ms, decrypt %.1f ms, copy %.1f ms, read %llu bytes, written %llu bytes, retries %llu, failures %llu, total %.1f ms",
+                  ToMs(GetMicroseconds(SyncTimer::Encrypt)), ToMs(GetMicroseconds(SyncTimer::Decrypt)), ToMs(GetMicroseconds(SyncTimer::Copy)),
+                  static_cast<unsigned long long>(Get(SyncCounter::BytesRead)), static_cast<unsigned long long>(Get(SyncCounter::BytesWritten)),
+                  static_cast<unsigned long long>(Get(SyncCounter::Retries)), static_cast<unsigned long long>(Get(SyncCounter::Failures)),
+                  ToMs(GetMicroseconds(SyncTimer::Total)));
+    lines.push_back(buf);
+    return lines;
+}
+
+CSyncStats::CSyncStats()
+{
+    Reset();
+}
+
+CSyncStats::CTimer::CTimer(CSyncStats& stats, SyncTimer timer)
+    : m_stats(stats)
+    , m_timer(timer)
+    , m_start(std::chrono::steady_clock::now())
+{
+}
+
+CSyncStats::CTimer::~CTimer()
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start);
+    m_stats.AddTime(m_timer, static_cast<uint64_t>(elapsed.count()));
+}
+
+void CSyncStats::Add(SyncCounter counter, uint64_t value)
+{
+    m_counters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+}
+
+void CSyncStats::AddTime(SyncTimer timer, uint64_t microseconds)
+{
+    m_timers[static_cast<size_t>(timer)].fetch_add(microseconds, std::memory_order_relaxed);
+}
+
+void CSyncStats::AddAction(SyncActionType type)
+{
+    m_actions[static_cast<size_t>(type)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void CSyncStats::AddActionBytes(SyncActionType type, uint64_t read, uint64_t written)
+{
+    m_actionBytesRead[static_cast<size_t>(type)].fetch_add(read, std::memory_order_relaxed);
+    m_actionBytesWritten[static_cast<size_t>(type)].fetch_add(written, std::memory_order_relaxed);
+}
+
+SyncStats CSyncStats::Snapshot() const
+{
+    SyncStats stats;
+    for (size_t i = 0; i < SYNCSTATS_COUNTERS; ++i)
+        stats.counters[i] = m_counters[i].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < SYNCSTATS_TIMERS; ++i)
+        stats.timers[i] = m_timers[i].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < SYNCSTATS_ACTIONS; ++i)
+    {
+        stats.actions[i]            = m_actions[i].load(std::memory_order_relaxed);
+        stats.actionBytesRead[i]    = m_actionBytesRead[i].load(std::memory_order_relaxed);
+        stats.actionBytesWritten[i] = m_actionBytesWritten[i].load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+void CSyncStats::Reset()
+{
+    for (auto& counter : m_counters)
+        counter = 0;
+    for (auto& timer : m_timers)
+        timer = 0;
+    for (auto& action : m_actions)
+        action = 0;
+    for (auto& bytes : m_actionBytesRead)
+        bytes = 0;
+    for (auto& bytes : m_actionBytesWritten)
+        bytes = 0;
+}
@@ -0,0 +1,139 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include "SyncPlan.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/// the counters of a sync
+enum class SyncCounter
+{
+    OrigFiles,    ///< files enumerated in the original folder
+    CryptFiles,   ///< files enumerated in the encrypted folder
+    Ignored,      ///< files and folders skipped because they match an ignore pattern
+    NameEncrypts, ///< file names encrypted
+    NameDecrypts, ///< file names decrypted
+    BytesRead,
+    BytesWritten,
+    Retries,      ///< waits before an operation was tried again
+    Failures,     ///< actions that failed
+    Count
+};
+
+/// the timers of a sync, the time is in microseconds. The enumeration includes the name decryption
+enum class SyncTimer
+{
+    EnumOrig,
+    EnumCrypt,
+    NameEncrypt,
+    NameDecrypt,
+    Plan,
+    Encrypt, ///< compressing and encrypting, or running gpg
+    Decrypt,
+    Copy,    ///< the copy only files
+    Total,
+    Count
+};
+
+constexpr size_t SYNCSTATS_COUNTERS = static_cast<size_t>(SyncCounter::Count);
+constexpr size_t SYNCSTATS_TIMERS   = static_cast<size_t>(SyncTimer::Count);
+constexpr size_t SYNCSTATS_ACTIONS  = static_cast<size_t>(SyncActionType::KeepDeleted) + 1;
+
+/// the counters of one pair at one point in time
+struct SyncStats
+{
+    uint64_t counters[SYNCSTATS_COUNTERS]          = {};
+    uint64_t timers[SYNCSTATS_TIMERS]              = {}; ///< microseconds
+    uint64_t actions[SYNCSTATS_ACTIONS]            = {}; ///< executed actions by SyncActionType
+    uint64_t actionBytesRead[SYNCSTATS_ACTIONS]    = {}; ///< size of the sources of the actions that succeeded
+    uint64_t actionBytesWritten[SYNCSTATS_ACTIONS] = {}; ///< size of the targets of the actions that succeeded
+
+    uint64_t                  Get(SyncCounter counter) const { return counters[static_cast<size_t>(counter)]; }
+    uint64_t                  GetMicroseconds(SyncTimer timer) const { return timers[static_cast<size_t>(timer)]; }
+    uint64_t                  GetActions(SyncActionType type) const { return actions[static_cast<size_t>(type)]; }
+    uint64_t                  GetActionBytesRead(SyncActionType type) const { return actionBytesRead[static_cast<size_t>(type)]; }
+    uint64_t                  GetActionBytesWritten(SyncActionType type) const { return actionBytesWritten[static_cast<size_t>(type)]; }
+    SyncStats&                operator+=(const SyncStats& other);
+    /// a few lines for the log
+    std::vector<std::wstring> Format() const;
+};
+
+/// the stats of the pairs of a sync pass, the key is the orig path of the pair
+using SyncStatsMap = std::map<std::wstring, SyncStats>;
+
+/**
+ * The live counters of a sync.
+ *
+ * All threads of a sync can add to them at the same time, Snapshot()
+ * returns their values at that point.
+ */
+class CSyncStats
+{
+public:
+    CSyncStats();
+
+    CSyncStats(const CSyncStats&)            = delete;
+    CSyncStats& operator=(const CSyncStats&) = delete;
+
+    /// adds the time from its construction to its destruction to a timer
+    class CTimer
+    {
+    public:
+        CTimer(CSyncStats& stats, SyncTimer timer);
+        ~CTimer();
+
+        CTimer(const CTimer&)            = delete;
+        CTimer& operator=(const CTimer&) = delete;
+
+    private:
+        CSyncStats&                           m_stats;
+        SyncTimer                             m_timer;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    void      Add(SyncCounter counter, uint64_t value = 1);
+    void      AddTime(SyncTimer timer, uint64_t microseconds);
+    void      AddAction(SyncActionType type);
+    /// the source and target size of an action that succeeded
+    void      AddActionBytes(SyncActionType type, uint64_t read, uint64_t written);
+    SyncStats Snapshot() const;
+    void      Reset();
+
+    /// calls func and adds the time it took to timer, returns what func returns
+    template <typename Func>
+    auto Time(SyncTimer timer, Func&& func)
+    {
+        CTimer scope(*this, timer);
+        return func();
+    }
+
+private:
+    std::atomic<uint64_t> m_counters[SYNCSTATS_COUNTERS];
+    std::atomic<uint64_t> m_timers[SYNCSTATS_TIMERS];
+    std::atomic<uint64_t> m_actions[SYNCSTATS_ACTIONS];
+    std::atomic<uint64_t> m_actionBytesRead[SYNCSTATS_ACTIONS];
+    std::atomic<uint64_t> m_actionBytesWritten[SYNCSTATS_ACTIONS];
+};
@@ -0,0 +1,125 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "SyncTrace.h"
+#include "SyncReport.h"
+#include "Platform.h"
+
+#include <cstdio>
+#include <iterator>
+
+std::atomic<bool> CSyncTrace::s_enabled{false};
+
+namespace
+{
+/// small numbers for the threads, in the order they first add a span
+uint32_t GetTraceThreadId()
+{
+    static std::atomic<uint32_t> nextId{1};
+    thread_local uint32_t        id = nextId++;
+    return id;
+}
+} // namespace
+
+CSyncTrace::CSyncTrace()
+    : m_start(std::chrono::steady_clock::now())
+    , m_maxEvents(SYNCTRACE_MAX_EVENTS)
+    , m_dropped(0)
+{
+}
+
+CSyncTrace& CSyncTrace::Instance()
+{
+    static CSyncTrace instance;
+    return instance;
+}
+
+bool CSyncTrace::Start(const std::wstring& path, size_t maxEvents)
+{
+    std::lock_guard lock(m_mutex);
+    if (s_enabled)
+        return false;
+    m_path      = path;
+    m_maxEvents = maxEvents;
+    m_start     = std::chrono::steady_clock::now();
+    m_dropped   = 0;
+    m_events.clear();
+    s_enabled = true;
+    return true;
+}
+
+bool CSyncTrace::Stop()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        if (!s_enabled)
+            return false;
+        s_enabled = false;
+    }
+    // spans that are still open are not added anymore
+    return CFileSystem::Native().WriteContent(m_path, ToJson());
+}
+
+uint64_t CSyncTrace::Now() const
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count());
+}
+
+void CSyncTrace::Add(const char* name, const char* category, uint64_t start, uint64_t end, const std::wstring& detail)
+{
+    uint32_t        thread = GetTraceThreadId();
+    std::lock_guard lock(m_mutex);
+    if (!s_enabled)
+        return;
+    if (m_events.size() >= m_maxEvents)
+    {
+        ++m_dropped;
+        return;
+    }
+    m_events.push_back({name, category, start, end > start ? end - start : 0, thread, detail});
+}
+
+std::string CSyncTrace::ToJson() const
+{
+    std::lock_guard lock(m_mutex);
+    std::string     json     = "{\"traceEvents\":[\n";
+    char            buf[128] = {};
+    for (size_t i = 0; i < m_events.size(); ++i)
+    {
+        const auto& event = m_events[i];
+        json += "{\"name\":";
+        AppendJsonString(json, event.name);
+        json += ",\"cat\":";
+        AppendJsonString(json, event.category);
+        std::snprintf(buf, std::size(buf), ",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%u",
+                      static_cast<unsigned long long>(event.start), static_cast<unsigned long long>(event.duration), event.thread);
+        json += buf;
+        if (!event.detail.empty())
+        {
+            json += ",\"args\":{\"detail\":";
+            AppendJsonString(json, CPlatform::ToUtf8(event.detail));
+            json += '}';
+        }
+        json += (i + 1 < m_events.size()) ? "},\n" : "}\n";
+    }
+    std::snprintf(buf, std::size(buf), "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%llu}}\n", static_cast<unsigned long long>(m_dropped.load()));
+    json += buf;
+    return json;
+}
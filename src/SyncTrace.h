@@ -0,0 +1,114 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// the most spans a trace keeps, the ones after that are counted but dropped
+constexpr size_t SYNCTRACE_MAX_EVENTS = 1000000;
+
+/**
+ * Records what the sync spends its time on, for offline profiling.
+ *
+ * The spans of all threads are collected while tracing is on and
+ * written as Chrome trace event JSON, which chrome://tracing and the
+ * Perfetto UI open. When tracing is off a CTraceSpan only reads one
+ * flag.
+ */
+class CSyncTrace
+{
+public:
+    CSyncTrace();
+
+    CSyncTrace(const CSyncTrace&)            = delete;
+    CSyncTrace& operator=(const CSyncTrace&) = delete;
+
+    static CSyncTrace& Instance();
+    static bool        IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    /// starts recording, the trace is written to path when it stops
+    bool               Start(const std::wstring& path, size_t maxEvents = SYNCTRACE_MAX_EVENTS);
+    /// stops recording and writes the trace, returns false if it could not be written
+    bool               Stop();
+    /// microseconds since the start of the trace
+    uint64_t           Now() const;
+    /// adds a span, name and category must be string literals
+    void               Add(const char* name, const char* category, uint64_t start, uint64_t end, const std::wstring& detail);
+    /// the recorded spans as Chrome trace event JSON
+    std::string        ToJson() const;
+    size_t             GetDropped() const { return m_dropped; }
+
+private:
+    struct Event
+    {
+        const char*  name;
+        const char*  category;
+        uint64_t     start;
+        uint64_t     duration;
+        uint32_t     thread;
+        std::wstring detail;
+    };
+
+    static std::atomic<bool>              s_enabled;
+    std::chrono::steady_clock::time_point m_start;
+    std::wstring                          m_path;
+    size_t                                m_maxEvents;
+    mutable std::mutex                    m_mutex;
+    std::vector<Event>                    m_events;
+    std::atomic<size_t>                   m_dropped;
+};
+
+/// records the time from its construction to its destruction if tracing is on
+class CTraceSpan
+{
+public:
+    CTraceSpan(const char* name, const char* category)
+        : m_name(CSyncTrace::IsEnabled() ? name : nullptr)
+        , m_category(category)
+        , m_start(m_name ? CSyncTrace::Instance().Now() : 0)
+    {
+    }
+    /// detail is shown with the span, e.g. the path it works on
+    CTraceSpan(const char* name, const char* category, const std::wstring& detail)
+        : CTraceSpan(name, category)
+    {
+        if (m_name)
+            m_detail = detail;
+    }
+    ~CTraceSpan()
+    {
+        if (m_name)
+            CSyncTrace::Instance().Add(m_name, m_category, m_start, CSyncTrace::Instance().Now(), m_detail);
+    }
+
+    CTraceSpan(const CTraceSpan&)            = delete;
+    CTraceSpan& operator=(const CTraceSpan&) = delete;
+
+private:
+    const char*  m_name;
+    const char*  m_category;
+    uint64_t     m_start;
+    std::wstring m_detail;
+};
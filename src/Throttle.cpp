@@ -0,0 +1,251 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+#include "stdafx.h"
+#include "Throttle.h"
+#include "Registry.h"
+
+#include <algorithm>
+
+namespace
+{
+thread_local CThrottle::CScope* currentScope = nullptr;
+} // namespace
+
+CTokenBucket::CTokenBucket()
+    : m_rate(0.0)
+    , m_tokens(0.0)
+    , m_last(0)
+{
+}
+
+void CTokenBucket::SetRate(ULONGLONG perSecond, ULONGLONG now)
+{
+    m_rate   = static_cast<double>(perSecond) / 1000.0;
+    m_tokens = static_cast<double>(perSecond);
+    m_last   = now;
+}
+
+ULONGLONG CTokenBucket::Take(ULONGLONG amount, ULONGLONG now)
+{
+    if ((m_rate <= 0.0) || (amount == 0))
+        return 0;
+    double burst = m_rate * 1000.0;
+    if (now > m_last)
+        m_tokens = std::min(burst, m_tokens + m_rate * static_cast<double>(now - m_last));
+    m_last   = now;
+    // the debt is limited, so that operations which didn't wait for
+    // their tokens don't block the next ones for too long
+    m_tokens = std::max(m_tokens - static_cast<double>(amount), -std::max(burst, static_cast<double>(amount)));
+    if (m_tokens >= 0.0)
+        return 0;
+    return static_cast<ULONGLONG>(-m_tokens / m_rate) + 1;
+}
+
+CThrottle::CScope::CScope(CThrottle& throttle, const std::wstring& key, bool canWait)
+    : m_throttle(throttle)
+    , m_key(key)
+    , m_canWait(canWait)
+    , m_cpuTime(GetThreadCpuTime())
+    , m_outer(currentScope)
+{
+    currentScope = this;
+}
+
+CThrottle::CScope::~CScope()
+{
+    currentScope = m_outer;
+}
+
+CThrottle::CThrottle()
+    : m_interactive(false)
+    , m_cancelled(false)
+{
+}
+
+CThrottle::~CThrottle()
+{
+}
+
+void CThrottle::SetLimits(const ThrottleLimits& limits)
+{
+    CAutoWriteLock locker(m_guard);
+    auto           now = GetTickCount64();
+    m_limits           = limits;
+    for (auto& [key, volume] : m_volumes)
+    {
+        volume.read.SetRate(m_limits.readBytesPerSec, now);
+        volume.write.SetRate(m_limits.writeBytesPerSec, now);
+        volume.ops.SetRate(m_limits.opsPerSec, now);
+    }
+    // the cpu time is measured in ms
+    m_cpu.SetRate(m_limits.cpuPercent * 10ULL, now);
+}
+
+void CThrottle::ReadSettings()
+{
+    SetLimits(GetConfiguredLimits());
+}
+
+ThrottleLimits CThrottle::GetConfiguredLimits()
+{
+    ThrottleLimits limits;
+    limits.readBytesPerSec  = static_cast<ULONGLONG>(static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\ThrottleReadKBps", 0))) * 1024;
+    limits.writeBytesPerSec = static_cast<ULONGLONG>(static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\ThrottleWriteKBps", 0))) * 1024;
+    limits.opsPerSec        = static_cast<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\ThrottleIops", 0));
+    limits.cpuPercent       = std::min<DWORD>(CRegStdDWORD(L"Software\\CryptSync\\ThrottleCpuPercent", 0), 100);
+    limits.idleSeconds      = CRegStdDWORD(L"Software\\CryptSync\\ThrottleIdleSeconds", THROTTLE_DEFAULT_IDLE_SECONDS);
+    if (limits.cpuPercent == 100)
+        limits.cpuPercent = 0;
+    return limits;
+}
+
+void CThrottle::Read(const std::wstring& path, ULONGLONG bytes)
+{
+    Consume(path, bytes, 0);
+}
+
+void CThrottle::Write(const std::wstring& path, ULONGLONG bytes)
+{
+    Consume(path, 0, bytes);
+}
+
+void CThrottle::Operation(const std::wstring& path)
+{
+    Consume(path, 0, 0);
+}
+
+bool CThrottle::IsRelaxed() const
+{
+    if (m_interactive)
+        return true;
+    DWORD idleSeconds = 0;
+    {
+        CAutoReadLock locker(m_guard);
+        idleSeconds = m_limits.idleSeconds;
+    }
+    if (idleSeconds == 0)
+        return false;
+    LASTINPUTINFO lii = {sizeof(LASTINPUTINFO)};
+    if (!GetLastInputInfo(&lii))
+        return false;
+    // GetLastInputInfo() uses the 32-bit tick count
+    return (GetTickCount() - lii.dwTime) >= idleSeconds * 1000ULL;
+}
+
+ThrottleStatsMap CThrottle::GetStats()
+{
+    CAutoReadLock locker(m_guard);
+    return m_stats;
+}
+
+std::wstring CThrottle::GetVolumeKey(const std::wstring& path)
+{
+    std::wstring key;
+    if (path.starts_with(L"\\\\?\\UNC\\"))
+        key = L"\\" + path.substr(7);
+    else if (path.starts_with(L"\\\\?\\"))
+        key = path.substr(4);
+    else
+        key = path;
+    std::ranges::replace(key, '/', '\\');
+    if (key.starts_with(L"\\\\"))
+    {
+        // \\server\share
+        auto pos = key.find('\\', 2);
+        if (pos != std::wstring::npos)
+            pos = key.find('\\', pos + 1);
+        if (pos != std::wstring::npos)
+            key.resize(pos);
+    }
+    else if ((key.size() >= 2) && (key[1] == ':'))
+        key.resize(2);
+    std::ranges::transform(key, key.begin(), ::towlower);
+    return key;
+}
+
+void CThrottle::Consume(const std::wstring& path, ULONGLONG readBytes, ULONGLONG writtenBytes)
+{
+    CScope* scope = currentScope;
+    if (scope && (&scope->m_throttle != this))
+        scope = nullptr;
+
+    ULONGLONG waitMs = 0;
+    {
+        CAutoWriteLock locker(m_guard);
+        auto           now = GetTickCount64();
+        if ((m_limits.readBytesPerSec != 0) || (m_limits.writeBytesPerSec != 0) || (m_limits.opsPerSec != 0))
+        {
+            auto& volume = GetVolume(path, now);
+            waitMs       = std::max({volume.read.Take(readBytes, now),
+                                     volume.write.Take(writtenBytes, now),
+                                     volume.ops.Take(1, now)});
+        }
+        if (scope)
+        {
+            if (m_limits.cpuPercent != 0)
+            {
+                auto cpuTime     = GetThreadCpuTime();
+                waitMs           = std::max(waitMs, m_cpu.Take(cpuTime - scope->m_cpuTime, now));
+                scope->m_cpuTime = cpuTime;
+            }
+            auto& stats = m_stats[scope->m_key];
+            stats.bytesRead += readBytes;
+            stats.bytesWritten += writtenBytes;
+            ++stats.operations;
+        }
+    }
+    if ((waitMs == 0) || (scope == nullptr) || !scope->m_canWait || IsRelaxed())
+        return;
+
+    auto start = GetTickCount64();
+    for (ULONGLONG waited = 0; waited < waitMs; waited = GetTickCount64() - start)
+    {
+        if (m_cancelled || IsRelaxed())
+            break;
+        Sleep(static_cast<DWORD>(std::min(THROTTLE_WAIT_SLICE, waitMs - waited)));
+    }
+    CAutoWriteLock locker(m_guard);
+    auto&          stats = m_stats[scope->m_key];
+    ++stats.delays;
+    stats.delayedMs += GetTickCount64() - start;
+}
+
+CThrottle::VolumeBuckets& CThrottle::GetVolume(const std::wstring& path, ULONGLONG now)
+{
+    auto key = GetVolumeKey(path);
+    auto it  = m_volumes.find(key);
+    if (it != m_volumes.end())
+        return it->second;
+    auto& volume = m_volumes[key];
+    volume.read.SetRate(m_limits.readBytesPerSec, now);
+    volume.write.SetRate(m_limits.writeBytesPerSec, now);
+    volume.ops.SetRate(m_limits.opsPerSec, now);
+    return volume;
+}
+
+ULONGLONG CThrottle::GetThreadCpuTime()
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return 0;
+    ULONGLONG kernel = (static_cast<ULONGLONG>(kernelTime.dwHighDateTime) << 32) | kernelTime.dwLowDateTime;
+    ULONGLONG user   = (static_cast<ULONGLONG>(userTime.dwHighDateTime) << 32) | userTime.dwLowDateTime;
+    // FILETIME is in 100ns units
+    return (kernel + user) / 10000;
+}
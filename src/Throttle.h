@@ -0,0 +1,159 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#pragma once
+
+#include "ReaderWriterLock.h"
+
+#include <atomic>
+#include <map>
+#include <string>
+
+/// seconds without user input after which the limits are not enforced anymore
+constexpr DWORD     THROTTLE_DEFAULT_IDLE_SECONDS = 300;
+/// longest a throttled operation sleeps before it checks the limits again
+constexpr ULONGLONG THROTTLE_WAIT_SLICE           = 100;
+
+/// the limits of the throttle, 0 means unlimited
+struct ThrottleLimits
+{
+    ULONGLONG readBytesPerSec  = 0; ///< per volume
+    ULONGLONG writeBytesPerSec = 0; ///< per volume
+    ULONGLONG opsPerSec        = 0; ///< per volume, every read, write and enumerated directory is one operation
+    DWORD     cpuPercent       = 0; ///< of one core, for all threads that sync together
+    /// 0 to never relax the limits when the user is idle
+    DWORD     idleSeconds      = THROTTLE_DEFAULT_IDLE_SECONDS;
+};
+
+struct ThrottleStats
+{
+    ULONGLONG bytesRead    = 0;
+    ULONGLONG bytesWritten = 0;
+    ULONGLONG operations   = 0;
+    ULONGLONG delays       = 0; ///< number of operations that had to wait
+    ULONGLONG delayedMs    = 0; ///< time spent waiting for the limits
+};
+
+using ThrottleStatsMap = std::map<std::wstring, ThrottleStats>;
+
+/// a token bucket which allows a burst of one second
+class CTokenBucket
+{
+public:
+    CTokenBucket();
+
+    /// sets the tokens per second, 0 for unlimited
+    void      SetRate(ULONGLONG perSecond, ULONGLONG now);
+
+    /// takes \c amount tokens. The bucket can go into debt, the returned
+    /// value is the time in ms until the debt is paid.
+    ULONGLONG Take(ULONGLONG amount, ULONGLONG now);
+
+private:
+    double    m_rate; ///< tokens per ms
+    double    m_tokens;
+    ULONGLONG m_last;
+};
+
+/**
+ * Limits the bandwidth, the I/O operations and the CPU time of background syncs.
+ *
+ * All reads and writes of a sync go through \c Read(), \c Write() and
+ * \c Operation(): every volume has its own token buckets, and a thread
+ * that uses up the budget of a volume sleeps until there are tokens again.
+ * Volumes are identified by their drive letter or their UNC share.
+ *
+ * The limits only apply to threads inside a \c CScope that allows waiting,
+ * and not at all while an interactive sync runs or the user is idle.
+ * Operations outside of a scope still use up tokens, but never wait.
+ * The stats are collected per scope key, i.e. per pair.
+ */
+class CThrottle
+{
+public:
+    CThrottle();
+    ~CThrottle();
+
+    CThrottle(const CThrottle&)            = delete;
+    CThrottle& operator=(const CThrottle&) = delete;
+
+    /// accounts the operations of the current thread to \c key until it is destroyed
+    class CScope
+    {
+    public:
+        CScope(CThrottle& throttle, const std::wstring& key, bool canWait);
+        ~CScope();
+
+        CScope(const CScope&)            = delete;
+        CScope& operator=(const CScope&) = delete;
+
+    private:
+        friend class CThrottle;
+
+        CThrottle&   m_throttle;
+        std::wstring m_key;
+        bool         m_canWait;
+        ULONGLONG    m_cpuTime; ///< cpu time of the thread in ms when it was last checked
+        CScope*      m_outer;
+    };
+
+    void                  SetLimits(const ThrottleLimits& limits);
+    /// reads the limits from the registry
+    void                  ReadSettings();
+    static ThrottleLimits GetConfiguredLimits();
+
+    /// while an interactive sync runs, the limits are not enforced
+    void                  SetInteractive(bool interactive) { m_interactive = interactive; }
+    /// makes all waiting threads return right away, until \c Resume() is called
+    void                  Cancel() { m_cancelled = true; }
+    void                  Resume() { m_cancelled = false; }
+
+    void                  Read(const std::wstring& path, ULONGLONG bytes);
+    void                  Write(const std::wstring& path, ULONGLONG bytes);
+    /// an I/O operation without data, e.g. enumerating a directory
+    void                  Operation(const std::wstring& path);
+
+    /// returns true if the limits currently are not enforced
+    bool                  IsRelaxed() const;
+
+    ThrottleStatsMap      GetStats();
+
+    /// returns the drive ("c:") or the UNC share ("\\server\share") of \c path, lowercased
+    static std::wstring   GetVolumeKey(const std::wstring& path);
+
+private:
+    struct VolumeBuckets
+    {
+        CTokenBucket read;
+        CTokenBucket write;
+        CTokenBucket ops;
+    };
+
+    void             Consume(const std::wstring& path, ULONGLONG readBytes, ULONGLONG writtenBytes);
+    VolumeBuckets&   GetVolume(const std::wstring& path, ULONGLONG now);
+    static ULONGLONG GetThreadCpuTime();
+
+    mutable CReaderWriterLock             m_guard;
+    ThrottleLimits                        m_limits;
+    std::map<std::wstring, VolumeBuckets> m_volumes;
+    CTokenBucket                          m_cpu; ///< cpu time in ms
+    ThrottleStatsMap                      m_stats;
+    std::atomic<bool>                     m_interactive;
+    std::atomic<bool>                     m_cancelled;
+};
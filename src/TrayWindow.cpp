@@ -74,6 +74,9 @@ DWORD CTrayWindow::GetDllVersion(LPCTSTR lpszDllName)
 
 CTrayWindow::~CTrayWindow()
 {
+    // the watcher thread calls into m_folderSyncer through the event filter,
+    // so it has to be stopped before the members get destroyed.
+    m_watcher.Stop();
     if (m_iconNormal)
         DestroyIcon(m_iconNormal);
     if (m_iconError)
@@ -124,6 +127,24 @@ bool CTrayWindow::RegisterAndCreateWindow()
     return false;
 }
 
+void CTrayWindow::UpdateWatchedPaths()
+{
+    // paths that can't be watched right now (e.g., the drive isn't ready yet)
+    // are retried by the watcher itself, and paths that don't change keep
+    // their watch running.
+    std::set<std::wstring> paths;
+    for (const auto& pair : g_pairs)
+    {
+        if (!pair.m_enabled)
+            continue;
+        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == SrcToDst))
+            paths.insert(pair.m_origPath);
+        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == DstToSrc))
+            paths.insert(pair.m_cryptPath);
+    }
+    m_watcher.SetPaths(paths);
+}
+
 void CTrayWindow::ShowTrayIcon()
 {
     if (m_iconNormal)
@@ -184,16 +205,9 @@ LRESULT CALLBACK CTrayWindow::WinMsgHandler(HWND hwnd, UINT uMsg, WPARAM wParam,
         case WM_CREATE:
         {
             m_hwnd = hwnd;
-            m_watcher.ClearPaths();
-            for (const auto& pair : g_pairs)
-            {
-                if (!pair.m_enabled)
-                    continue;
-                if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == SrcToDst))
-                    m_watcher.AddPath(pair.m_origPath);
-                if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == DstToSrc))
-                    m_watcher.AddPath(pair.m_cryptPath);
-            }
+            // drop the notifications for changes we made ourselves right when they arrive
+            m_watcher.SetEventFilter([this](const std::wstring& path) { return m_folderSyncer.IsSelfWrite(path); });
+            UpdateWatchedPaths();
             SetTimer(*this, TIMER_DETECTCHANGES, TIMER_DETECTCHANGESINTERVAL, nullptr);
             if (g_timer_fullScanInterval > 0)
                 SetTimer(*this, TIMER_FULLSCAN, g_timer_fullScanInterval, nullptr);
@@ -304,52 +318,11 @@ LRESULT CALLBACK CTrayWindow::WinMsgHandler(HWND hwnd, UINT uMsg, WPARAM wParam,
                             }
                         }
                     }
+                    m_folderSyncer.FlushDeletes();
+                    // notifications caused by our own writes are already filtered
+                    // out by the watcher, see the event filter set in WM_CREATE
                     auto newPaths = m_watcher.GetChangedPaths();
                     m_lastChangedPaths.insert(newPaths.begin(), newPaths.end());
-                    auto ignores  = m_folderSyncer.GetNotifyIgnores();
-                    if (!m_lastChangedPaths.empty() && !ignores.empty())
-                    {
-                        for (const auto& ign : ignores)
-                        {
-                            auto foundIt = m_lastChangedPaths.find(ign);
-                            if (foundIt != m_lastChangedPaths.end())
-                            {
-                                CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": remove notification for file %s\n"), foundIt->c_str());
-                                m_lastChangedPaths.erase(foundIt);
-                            }
-                        }
-                    }
-
-                    // if the number of watched paths is not what we expect,
-                    // reinitialize the paths: the watching may have failed
-                    // because the drive wasn't ready yet when CS started,
-                    // or even due to an access violation (virus scanners, ...)
-                    size_t watchPathCount = 0;
-                    for (const auto& pair : g_pairs)
-                    {
-                        if (!pair.m_enabled)
-                            continue;
-                        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == DstToSrc))
-                            ++watchPathCount;
-                        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == SrcToDst))
-                            ++watchPathCount;
-                    }
-
-                    if (m_watcher.GetNumberOfWatchedPaths() != watchPathCount)
-                    {
-                        m_watcher.ClearPaths();
-                        for (const auto& pair : g_pairs)
-                        {
-                            if (!pair.m_enabled)
-                                continue;
-                            std::wstring origPath  = pair.m_origPath;
-                            std::wstring cryptPath = pair.m_cryptPath;
-                            if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == SrcToDst))
-                                m_watcher.AddPath(origPath);
-                            if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == DstToSrc))
-                                m_watcher.AddPath(cryptPath);
-                        }
-                    }
 
                     m_niData.hIcon = m_folderSyncer.GetFailureCount() > 0 ? m_iconError : m_iconNormal;
                     Shell_NotifyIcon(NIM_MODIFY, &m_niData);
@@ -384,36 +357,13 @@ LRESULT CALLBACK CTrayWindow::WinMsgHandler(HWND hwnd, UINT uMsg, WPARAM wParam,
                                     }
                                 }
                             }
+                            m_folderSyncer.FlushDeletes();
                             auto newPaths = m_watcher.GetChangedPaths();
                             m_lastChangedPaths.insert(newPaths.begin(), newPaths.end());
-                            auto ignores       = m_folderSyncer.GetNotifyIgnores();
-                            if (!m_lastChangedPaths.empty() && !ignores.empty())
-                            {
-                                for (const auto& ign : ignores)
-                                {
-                                    auto foundIt = m_lastChangedPaths.find(ign);
-                                    if (foundIt != m_lastChangedPaths.end())
-                                    {
-                                        CTraceToOutputDebugString::Instance()(_T(__FUNCTION__) _T(": remove notification for file %s\n"), foundIt->c_str());
-                                        m_lastChangedPaths.erase(foundIt);
-                                    }
-                                }
-                            }
                         }
                         // now start the full scan
                         m_folderSyncer.SyncFolders(g_pairs);
-                        m_watcher.ClearPaths();
-                        for (const auto& pair : g_pairs)
-                        {
-                            if (!pair.m_enabled)
-                                continue;
-                            std::wstring origPath  = pair.m_origPath;
-                            std::wstring cryptPath = pair.m_cryptPath;
-                            if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == SrcToDst))
-                                m_watcher.AddPath(origPath);
-                            if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == DstToSrc))
-                                m_watcher.AddPath(cryptPath);
-                        }
+                        UpdateWatchedPaths();
                     }
                     if (g_timer_fullScanInterval > 0)
                         SetTimer(*this, TIMER_FULLSCAN, g_timer_fullScanInterval, nullptr);
@@ -479,21 +429,7 @@ LRESULT CTrayWindow::DoCommand(int id)
                     m_folderSyncer.SyncFolders(g_pairs);
                 else
                     m_folderSyncer.SetPairs(g_pairs);
-                m_watcher.ClearPaths();
-                for (const auto& pair : g_pairs)
-                {
-                    if (pair.m_enabled)
-                    {
-                        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == SrcToDst))
-                        {
-                            m_watcher.AddPath(pair.m_origPath);
-                        }
-                        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == DstToSrc))
-                        {
-                            m_watcher.AddPath(pair.m_cryptPath);
-                        }
-                    }
-                }
+                UpdateWatchedPaths();
                 SetTimer(*this, TIMER_DETECTCHANGES, TIMER_DETECTCHANGESINTERVAL, nullptr);
                 if (g_timer_fullScanInterval > 0)
                     SetTimer(*this, TIMER_FULLSCAN, g_timer_fullScanInterval, nullptr);
@@ -64,6 +64,7 @@ protected:
     LRESULT DoCommand(int id);
 
     void         ShowTrayIcon();
+    void         UpdateWatchedPaths();
     static DWORD GetDllVersion(LPCTSTR lpszDllName);
 
     static unsigned int __stdcall UpdateCheckThreadEntry(void* pContext);
@@ -0,0 +1,309 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#include "stdafx.h"
+#include "WatchDaemon.h"
+#include "Ignores.h"
+#include "AsyncLog.h"
+#include "Registry.h"
+
+CWatchDaemon::CWatchDaemon(const std::wstring& regKey)
+    : m_regKey(regKey)
+    , m_pairs(regKey, true)
+    , m_configKey(nullptr)
+    , m_fullScanInterval(0)
+    , m_statsInterval(WATCHDAEMON_DEFAULT_STATS_SEC)
+    , m_drainTimeout(WATCHDAEMON_DEFAULT_DRAIN_SEC)
+    , m_console(false)
+    , m_shutdown(false)
+    , m_filesSynced(0)
+    , m_fullScans(0)
+    , m_reloads(0)
+{
+    // only the daemon of the real configuration can be signaled by /watch:stop and /watch:reload
+    const bool named = (m_regKey == CRYPTSYNC_REGKEY);
+    m_stopEvent      = CreateEvent(nullptr, TRUE, FALSE, named ? GetStopEventName().c_str() : nullptr);
+    m_reloadEvent    = CreateEvent(nullptr, FALSE, FALSE, named ? GetReloadEventName().c_str() : nullptr);
+    m_configEvent    = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    m_stoppedEvent   = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    // a stop request left over from an earlier run must not stop this one right away
+    if (m_stopEvent)
+        ResetEvent(m_stopEvent);
+}
+
+CWatchDaemon::~CWatchDaemon()
+{
+    // the watcher thread calls into m_folderSyncer through the event filter
+    m_watcher.Stop();
+    if (m_configKey)
+        RegCloseKey(m_configKey);
+}
+
+std::wstring CWatchDaemon::GetStopEventName()
+{
+    return L"Local\\CryptSyncWatchStop";
+}
+
+std::wstring CWatchDaemon::GetReloadEventName()
+{
+    return L"Local\\CryptSyncWatchReload";
+}
+
+void CWatchDaemon::Stop(bool shutdown)
+{
+    if (shutdown)
+        m_shutdown = true;
+    SetEvent(m_stopEvent);
+}
+
+void CWatchDaemon::Reload()
+{
+    SetEvent(m_reloadEvent);
+}
+
+bool CWatchDaemon::WaitForStopped(DWORD timeoutMs) const
+{
+    return WaitForSingleObject(m_stoppedEvent, timeoutMs) == WAIT_OBJECT_0;
+}
+
+int CWatchDaemon::Run()
+{
+    if (!m_stopEvent || !m_reloadEvent || !m_configEvent || !m_stoppedEvent)
+    {
+        CAsyncLog::Instance().Error(L"watch mode: could not create the events, error %lu", GetLastError());
+        return ErrorAccess;
+    }
+    CAsyncLog::Instance().Info(L"watch mode started");
+    LoadConfig();
+    // drop the notifications for changes we made ourselves right when they arrive
+    m_watcher.SetEventFilter([this](const std::wstring& path) { return m_folderSyncer.IsSelfWrite(path); });
+    UpdateWatchedPaths();
+    if (!WatchConfig())
+        CAsyncLog::Instance().Warning(L"watch mode: configuration changes are not detected, use /watch:reload");
+    // the first scan picks up what changed while CryptSync wasn't running
+    StartFullScan();
+
+    ULONGLONG lastSync  = GetTickCount64();
+    ULONGLONG lastScan  = lastSync;
+    ULONGLONG lastStats = lastSync;
+    ULONGLONG reloadAt  = 0; // when the pending reload is due, zero if there is none
+    HANDLE    handles[] = {m_stopEvent, m_reloadEvent, m_configEvent};
+    for (;;)
+    {
+        ULONGLONG now = GetTickCount64();
+        ULONGLONG due = lastSync + WATCHDAEMON_INTERVAL_MS;
+        if (reloadAt && (reloadAt < due))
+            due = reloadAt;
+        DWORD waitResult = WaitForMultipleObjects(_countof(handles), handles, FALSE, due > now ? static_cast<DWORD>(due - now) : 0);
+        if (waitResult == WAIT_OBJECT_0)
+            break;
+        if (waitResult == WAIT_FAILED)
+        {
+            CAsyncLog::Instance().Error(L"watch mode: waiting failed, error %lu", GetLastError());
+            break;
+        }
+        now = GetTickCount64();
+        if (waitResult == WAIT_OBJECT_0 + 1)
+            reloadAt = now;
+        else if (waitResult == WAIT_OBJECT_0 + 2)
+        {
+            // the notification fires only once: arm it again right away so no change gets lost
+            WatchConfig();
+            reloadAt = now + WATCHDAEMON_RELOAD_DELAY_MS;
+        }
+
+        if (reloadAt && (now >= reloadAt))
+        {
+            if (m_folderSyncer.IsRunning())
+            {
+                // the running scan keeps the old pairs, reload once it's done
+                reloadAt = now + WATCHDAEMON_RELOAD_DELAY_MS;
+            }
+            else
+            {
+                reloadAt = 0;
+                ++m_reloads;
+                LoadConfig();
+                UpdateWatchedPaths();
+                StartFullScan();
+                lastScan = now;
+            }
+        }
+        if (now - lastSync >= WATCHDAEMON_INTERVAL_MS)
+        {
+            SyncChangedPaths();
+            lastSync = now;
+        }
+        if ((m_fullScanInterval > 0) && (now - lastScan >= m_fullScanInterval) && !m_folderSyncer.IsRunning())
+        {
+            // first handle the notifications
+            SyncChangedPaths();
+            StartFullScan();
+            UpdateWatchedPaths();
+            lastScan = now;
+        }
+        if ((m_statsInterval > 0) && (now - lastStats >= m_statsInterval * 1000ULL))
+        {
+            LogStats();
+            lastStats = now;
+        }
+    }
+
+    Drain();
+    const int ret = m_folderSyncer.GetFailureCount() ? ErrorCrypt : ErrorNone;
+    CAsyncLog::Instance().Info(L"watch mode stopped");
+    SetEvent(m_stoppedEvent);
+    return ret;
+}
+
+void CWatchDaemon::LoadConfig()
+{
+    // read-only: saving would write to the key we watch and trigger the next reload
+    m_pairs = CPairs(m_regKey, true);
+    CIgnores::Instance().Reload();
+    m_fullScanInterval = CRegStdDWORD(m_regKey + L"\\FullScanInterval", 60000 * 30);
+    m_statsInterval    = CRegStdDWORD(m_regKey + L"\\WatchStatsInterval", WATCHDAEMON_DEFAULT_STATS_SEC);
+    m_drainTimeout     = CRegStdDWORD(m_regKey + L"\\WatchDrainTimeout", WATCHDAEMON_DEFAULT_DRAIN_SEC);
+    m_folderSyncer.SetPairs(m_pairs);
+    size_t enabled = 0;
+    for (const auto& pair : m_pairs)
+    {
+        if (pair.m_enabled)
+            ++enabled;
+    }
+    CAsyncLog::Instance().Info(L"watch mode: %Iu of %Iu pairs enabled, full scan every %lu ms", enabled, m_pairs.size(), m_fullScanInterval);
+}
+
+bool CWatchDaemon::WatchConfig()
+{
+    if (!m_configKey)
+    {
+        if (RegCreateKeyEx(HKEY_CURRENT_USER, m_regKey.c_str(), 0, nullptr, REG_OPTION_NON_VOLATILE, KEY_NOTIFY, nullptr, &m_configKey, nullptr) != ERROR_SUCCESS)
+        {
+            m_configKey = nullptr;
+            return false;
+        }
+    }
+    return RegNotifyChangeKeyValue(m_configKey, TRUE, REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC, m_configEvent, TRUE) == ERROR_SUCCESS;
+}
+
+void CWatchDaemon::UpdateWatchedPaths()
+{
+    std::set<std::wstring> paths;
+    for (const auto& pair : m_pairs)
+    {
+        if (!pair.m_enabled)
+            continue;
+        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == SrcToDst))
+            paths.insert(pair.m_origPath);
+        if ((pair.m_syncDir == BothWays) || (pair.m_syncDir == DstToSrc))
+            paths.insert(pair.m_cryptPath);
+    }
+    m_watcher.SetPaths(paths);
+}
+
+void CWatchDaemon::SyncChangedPaths(ULONGLONG deadline)
+{
+    for (auto changedPath = m_changedPaths.begin(); changedPath != m_changedPaths.end();)
+    {
+        if (deadline && (GetTickCount64() >= deadline))
+            break;
+        if (CIgnores::Instance().IsIgnored(*changedPath))
+        {
+            changedPath = m_changedPaths.erase(changedPath);
+            continue;
+        }
+        if (m_folderSyncer.SyncFile(*changedPath))
+        {
+            ++m_filesSynced;
+            changedPath = m_changedPaths.erase(changedPath);
+        }
+        else
+            ++changedPath;
+    }
+    m_folderSyncer.FlushDeletes();
+    // the paths are synced on the next call, when the writes that caused the notifications are done
+    auto newPaths = m_watcher.GetChangedPaths();
+    m_changedPaths.insert(newPaths.begin(), newPaths.end());
+}
+
+void CWatchDaemon::StartFullScan()
+{
+    // always runs: the full scan interval only turns off the periodic rescans
+    ++m_fullScans;
+    m_folderSyncer.SyncFolders(m_pairs);
+}
+
+void CWatchDaemon::Drain()
+{
+    const bool shutdown = m_shutdown;
+    CAsyncLog::Instance().Info(L"watch mode stopping%s, %Iu changed paths pending", shutdown ? L" for the shutdown" : L"", m_changedPaths.size());
+    ULONGLONG syncDeadline = 0;
+    if (shutdown)
+    {
+        // the process is terminated in a few seconds: a scan can't finish
+        // anyway, the first scan of the next start does its work
+        if (m_folderSyncer.IsRunning())
+            m_folderSyncer.Stop();
+        syncDeadline = GetTickCount64() + WATCHDAEMON_SHUTDOWN_DRAIN_MS;
+    }
+    else
+    {
+        // let a running scan finish, but not forever
+        const ULONGLONG deadline = GetTickCount64() + m_drainTimeout * 1000ULL;
+        while (m_folderSyncer.IsRunning() && (GetTickCount64() < deadline))
+            Sleep(100);
+        if (m_folderSyncer.IsRunning())
+        {
+            CAsyncLog::Instance().Warning(L"watch mode: the full scan did not finish within %lu seconds, stopping it", m_drainTimeout);
+            m_folderSyncer.Stop();
+        }
+    }
+    // no new notifications from here on: sync everything that changed up to now
+    m_watcher.Stop();
+    auto newPaths = m_watcher.GetChangedPaths();
+    m_changedPaths.insert(newPaths.begin(), newPaths.end());
+    SyncChangedPaths(syncDeadline);
+    if (!m_changedPaths.empty())
+        CAsyncLog::Instance().Warning(L"watch mode: %Iu changed paths could not be synced, the next full scan picks them up", m_changedPaths.size());
+    LogStats();
+}
+
+void CWatchDaemon::LogStats()
+{
+    ULONGLONG bytesRead    = 0;
+    ULONGLONG bytesWritten = 0;
+    for (const auto& [pair, stats] : m_folderSyncer.GetThrottleStats())
+    {
+        bytesRead += stats.bytesRead;
+        bytesWritten += stats.bytesWritten;
+    }
+    wchar_t line[300] = {};
+    swprintf_s(line, L"watch stats: %Iu paths watched, %Iu changes pending, %I64u files synced, %I64u full scans, %I64u reloads, %Iu failures, %I64u KB read, %I64u KB written",
+               m_watcher.GetNumberOfWatchedPaths(), m_changedPaths.size(), m_filesSynced, m_fullScans, m_reloads,
+               m_folderSyncer.GetFailureCount(), bytesRead / 1024, bytesWritten / 1024);
+    CAsyncLog::Instance().Info(L"%s", line);
+    if (m_console)
+    {
+        DWORD written = 0;
+        WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), line, static_cast<DWORD>(wcslen(line)), &written, nullptr);
+        WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), L"\n", 1, &written, nullptr);
+    }
+}
@@ -0,0 +1,117 @@
+// CryptSync - A folder sync tool with encryption
+
+// Copyright (C) 2024 - Stefan Kueng
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+
+#pragma once
+
+#include "PathWatcher.h"
+#include "FolderSync.h"
+#include "Pairs.h"
+#include "SmartHandle.h"
+
+#include <atomic>
+#include <string>
+#include <set>
+
+/// how often the changed paths are synced, same as the tray window does
+constexpr DWORD WATCHDAEMON_INTERVAL_MS       = 10000;
+/// config changes come in bursts (the options dialog writes several values), wait that long before reloading
+constexpr DWORD WATCHDAEMON_RELOAD_DELAY_MS   = 1000;
+constexpr DWORD WATCHDAEMON_DEFAULT_STATS_SEC = 300;
+constexpr DWORD WATCHDAEMON_DEFAULT_DRAIN_SEC = 60;
+/// Windows terminates the process about five seconds after a close, logoff or
+/// shutdown event: the drain must be done well before that
+constexpr DWORD WATCHDAEMON_SHUTDOWN_DRAIN_MS = 3000;
+/// how long the console control handler waits for the daemon on those events
+constexpr DWORD WATCHDAEMON_SHUTDOWN_WAIT_MS  = 4000;
+
+/**
+ * Runs the sync without any window or message loop, for build servers and
+ * service managers.
+ *
+ * Watches the folders of the enabled pairs, syncs the changed files and scans
+ * all pairs every FullScanInterval, like the tray window does with its timers.
+ * The pairs, ignore patterns and intervals are reloaded when they change in the
+ * registry or when the reload event is set. A stats line is logged every
+ * WatchStatsInterval seconds.
+ *
+ * On stop, a running full scan gets WatchDrainTimeout seconds to finish, then
+ * the pending changes are synced and the queued deletes flushed before Run()
+ * returns. When the system shuts down, the scan is stopped right away and the
+ * pending changes get WATCHDAEMON_SHUTDOWN_DRAIN_MS, the rest is picked up by
+ * the first scan of the next start.
+ *
+ * The daemon only reads its configuration, it never writes the pairs back.
+ * Another process can stop or reload a running daemon by setting the named
+ * events GetStopEventName() and GetReloadEventName(). A daemon that reads
+ * another key than CRYPTSYNC_REGKEY (the tests) uses unnamed events.
+ */
+class CWatchDaemon
+{
+public:
+    explicit CWatchDaemon(const std::wstring& regKey = CRYPTSYNC_REGKEY);
+    ~CWatchDaemon();
+
+    /// runs until Stop() is called or the stop event is set.
+    /// Returns ErrorNone, or ErrorCrypt if files failed to sync
+    int                 Run();
+    /// can be called from any thread, e.g. a console control handler.
+    /// With \c shutdown the drain is cut down to WATCHDAEMON_SHUTDOWN_DRAIN_MS
+    void                Stop(bool shutdown = false);
+    /// reloads the configuration, can be called from any thread
+    void                Reload();
+    /// waits until Run() has drained and returned
+    bool                WaitForStopped(DWORD timeoutMs) const;
+    /// writes the stats lines to the console too
+    void                SetConsoleOutput(bool b) { m_console = b; }
+
+    static std::wstring GetStopEventName();
+    static std::wstring GetReloadEventName();
+
+private:
+    void                LoadConfig();
+    /// (re)arms the change notification on the CryptSync registry key
+    bool                WatchConfig();
+    void                UpdateWatchedPaths();
+    /// syncs the paths that changed since the last call, the ones that can't be synced yet are kept.
+    /// Stops syncing at the \c deadline tick if it's not zero, the queued deletes are flushed anyway
+    void                SyncChangedPaths(ULONGLONG deadline = 0);
+    void                StartFullScan();
+    void                Drain();
+    void                LogStats();
+
+    std::wstring           m_regKey;
+    CPairs                 m_pairs;
+    CPathWatcher           m_watcher;
+    CFolderSync            m_folderSyncer;
+    std::set<std::wstring> m_changedPaths;
+    CAutoGeneralHandle     m_stopEvent;
+    CAutoGeneralHandle     m_reloadEvent;
+    CAutoGeneralHandle     m_configEvent;
+    CAutoGeneralHandle     m_stoppedEvent;
+    HKEY                   m_configKey;
+    DWORD                  m_fullScanInterval;
+    DWORD                  m_statsInterval;
+    DWORD                  m_drainTimeout;
+    bool                   m_console;
+    std::atomic<bool>      m_shutdown;
+    ULONGLONG              m_filesSynced; ///< changed files synced since the start
+    ULONGLONG              m_fullScans;
+    ULONGLONG              m_reloads;
+};